@@ -104,7 +104,8 @@ void qemu_aio_flush(void)
     int ret;
 
     do {
-        ret = 0;
+        /* Requests held back by I/O throttling must be waited for, too */
+        ret = bdrv_io_limits_flush_all();
 
 	/*
 	 * If there are pending emulated aio start them now so flush
@@ -113,7 +114,9 @@ void qemu_aio_flush(void)
         qemu_aio_wait();
 
         QLIST_FOREACH(node, &aio_handlers, node) {
-            ret |= node->io_flush(node->opaque);
+            if (node->io_flush) {
+                ret |= node->io_flush(node->opaque);
+            }
         }
     } while (qemu_bh_poll() || ret > 0);
 }
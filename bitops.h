@@ -0,0 +1,125 @@
+/*
+ * Bit operations on arrays of unsigned long
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#ifndef BITOPS_H
+#define BITOPS_H
+
+#include "host-utils.h"
+
+#define BITS_PER_LONG           (sizeof(unsigned long) * 8)
+#define BITS_TO_LONGS(nr)       (((nr) + BITS_PER_LONG - 1) / BITS_PER_LONG)
+#define BIT_WORD(nr)            ((nr) / BITS_PER_LONG)
+#define BIT_MASK(nr)            (1UL << ((nr) % BITS_PER_LONG))
+
+static inline int ctzl(unsigned long val)
+{
+#if HOST_LONG_BITS == 64
+    return ctz64(val);
+#else
+    return ctz32(val);
+#endif
+}
+
+static inline int ctpopl(unsigned long val)
+{
+#if HOST_LONG_BITS == 64
+    return ctpop64(val);
+#else
+    return ctpop32(val);
+#endif
+}
+
+static inline void set_bit(unsigned long nr, unsigned long *addr)
+{
+    addr[BIT_WORD(nr)] |= BIT_MASK(nr);
+}
+
+static inline void clear_bit(unsigned long nr, unsigned long *addr)
+{
+    addr[BIT_WORD(nr)] &= ~BIT_MASK(nr);
+}
+
+static inline int test_bit(unsigned long nr, const unsigned long *addr)
+{
+    return (addr[BIT_WORD(nr)] & BIT_MASK(nr)) != 0;
+}
+
+/*
+ * Returns the index of the first set bit in [offset, size), or size if there
+ * is none. Whole words are skipped at a time.
+ */
+static inline unsigned long find_next_bit(const unsigned long *addr,
+                                          unsigned long size,
+                                          unsigned long offset)
+{
+    const unsigned long *p = addr + BIT_WORD(offset);
+    unsigned long result = offset - (offset % BITS_PER_LONG);
+    unsigned long tmp;
+
+    if (offset >= size) {
+        return size;
+    }
+
+    /* first, partial word */
+    tmp = *p++ & (~0UL << (offset % BITS_PER_LONG));
+    while (!tmp) {
+        result += BITS_PER_LONG;
+        if (result >= size) {
+            return size;
+        }
+        tmp = *p++;
+    }
+
+    result += ctzl(tmp);
+    return result < size ? result : size;
+}
+
+/*
+ * Sets (or clears) the bits [start, start + nr) and returns how many of them
+ * changed their value.
+ */
+static inline unsigned long bitmap_update_range(unsigned long *addr,
+                                                unsigned long start,
+                                                unsigned long nr, int set)
+{
+    unsigned long *p = addr + BIT_WORD(start);
+    unsigned long end = start + nr;
+    unsigned long mask, changed = 0;
+
+    while (start < end) {
+        mask = ~0UL << (start % BITS_PER_LONG);
+        if (BIT_WORD(start) == BIT_WORD(end - 1)) {
+            mask &= ~0UL >> (BITS_PER_LONG - 1 - ((end - 1) % BITS_PER_LONG));
+        }
+        if (set) {
+            changed += ctpopl(~*p & mask);
+            *p |= mask;
+        } else {
+            changed += ctpopl(*p & mask);
+            *p &= ~mask;
+        }
+        p++;
+        start = (start | (BITS_PER_LONG - 1)) + 1;
+    }
+    return changed;
+}
+
+#endif
@@ -19,6 +19,8 @@
 #include "monitor.h"
 #include "block-migration.h"
 #include "migration.h"
+#include "qemu-aio.h"
+#include "bitops.h"
 #include <assert.h>
 
 #define BLOCK_SIZE (BDRV_SECTORS_PER_DIRTY_CHUNK << BDRV_SECTOR_BITS)
@@ -26,6 +28,9 @@
 #define BLK_MIG_FLAG_DEVICE_BLOCK       0x01
 #define BLK_MIG_FLAG_EOS                0x02
 #define BLK_MIG_FLAG_PROGRESS           0x04
+#define BLK_MIG_FLAG_ZERO_BLOCK         0x08 /* since version 2 */
+
+#define BLK_MIG_VERSION                 2
 
 #define MAX_IS_ALLOCATED_SEARCH 65536
 
@@ -48,6 +53,8 @@ typedef struct BlkMigDevState {
     int64_t completed_sectors;
     int64_t total_sectors;
     int64_t dirty;
+    /* chunks being read */
+    unsigned long *aio_bitmap;
     QSIMPLEQ_ENTRY(BlkMigDevState) entry;
 } BlkMigDevState;
 
@@ -55,6 +62,7 @@ typedef struct BlkMigBlock {
     uint8_t *buf;
     BlkMigDevState *bmds;
     int64_t sector;
+    int nr_sectors;
     struct iovec iov;
     QEMUIOVector qiov;
     BlockDriverAIOCB *aiocb;
@@ -76,23 +84,58 @@ typedef struct BlkMigState {
     int bulk_completed;
     long double total_time;
     int reads;
+    int64_t zero_blocks;
 } BlkMigState;
 
 static BlkMigState block_mig_state;
 
-static void blk_send(QEMUFile *f, BlkMigBlock * blk)
+static void blk_send_header(QEMUFile *f, BlkMigDevState *bmds, int64_t sector,
+                            int flags)
 {
     int len;
 
     /* sector number and flags */
-    qemu_put_be64(f, (blk->sector << BDRV_SECTOR_BITS)
-                     | BLK_MIG_FLAG_DEVICE_BLOCK);
+    qemu_put_be64(f, (sector << BDRV_SECTOR_BITS) | flags);
 
     /* device name */
-    len = strlen(blk->bmds->bs->device_name);
+    len = strlen(bmds->bs->device_name);
     qemu_put_byte(f, len);
-    qemu_put_buffer(f, (uint8_t *)blk->bmds->bs->device_name, len);
+    qemu_put_buffer(f, (uint8_t *)bmds->bs->device_name, len);
+}
+
+/* A chunk that reads as zeroes is sent without its data */
+static void blk_send_zero(QEMUFile *f, BlkMigDevState *bmds, int64_t sector)
+{
+    blk_send_header(f, bmds, sector, BLK_MIG_FLAG_ZERO_BLOCK);
+    block_mig_state.zero_blocks++;
+}
 
+static int buffer_is_zero(const uint8_t *buf, size_t len)
+{
+    const unsigned long *p = (const unsigned long *)buf;
+    size_t i;
+
+    for (i = 0; i < len / sizeof(*p); i++) {
+        if (p[i]) {
+            return 0;
+        }
+    }
+    for (i = i * sizeof(*p); i < len; i++) {
+        if (buf[i]) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static void blk_send(QEMUFile *f, BlkMigBlock * blk)
+{
+    if (buffer_is_zero(blk->buf, blk->nr_sectors * BDRV_SECTOR_SIZE)) {
+        blk_send_zero(f, blk->bmds, blk->sector);
+        return;
+    }
+
+    blk_send_header(f, blk->bmds, blk->sector, BLK_MIG_FLAG_DEVICE_BLOCK);
     qemu_put_buffer(f, blk->buf, BLOCK_SIZE);
 }
 
@@ -145,6 +188,8 @@ static void blk_mig_read_cb(void *opaque, int ret)
     BlkMigBlock *blk = opaque;
 
     blk->ret = ret;
+    clear_bit(blk->sector / BDRV_SECTORS_PER_DIRTY_CHUNK,
+              blk->bmds->aio_bitmap);
 
     blk->time = qemu_get_clock_ns(rt_clock) - blk->time;
 
@@ -157,13 +202,58 @@ static void blk_mig_read_cb(void *opaque, int ret)
     assert(block_mig_state.submitted >= 0);
 }
 
+/* Starts reading nr_sectors at sector; the chunk is sent by flush_blks() */
+static int blk_mig_submit_read(BlkMigDevState *bmds, int64_t sector,
+                               int nr_sectors)
+{
+    BlkMigBlock *blk;
+
+    blk = qemu_malloc(sizeof(BlkMigBlock));
+    blk->buf = qemu_malloc(BLOCK_SIZE);
+    blk->bmds = bmds;
+    blk->sector = sector;
+    blk->nr_sectors = nr_sectors;
+
+    blk->iov.iov_base = blk->buf;
+    blk->iov.iov_len = nr_sectors * BDRV_SECTOR_SIZE;
+    qemu_iovec_init_external(&blk->qiov, &blk->iov, 1);
+
+    blk->time = qemu_get_clock_ns(rt_clock);
+
+    set_bit(sector / BDRV_SECTORS_PER_DIRTY_CHUNK, bmds->aio_bitmap);
+    blk->aiocb = bdrv_aio_readv(bmds->bs, sector, &blk->qiov,
+                                nr_sectors, blk_mig_read_cb, blk);
+    if (!blk->aiocb) {
+        clear_bit(sector / BDRV_SECTORS_PER_DIRTY_CHUNK, bmds->aio_bitmap);
+        qemu_free(blk->buf);
+        qemu_free(blk);
+        return -EIO;
+    }
+    block_mig_state.submitted++;
+
+    return 0;
+}
+
+/* Returns 1 if the chunk at sector is unallocated and reads as zeroes */
+static int blk_mig_chunk_is_zero(BlkMigDevState *bmds, int64_t sector,
+                                 int nr_sectors)
+{
+    int n;
+
+    /* without a backing file, unallocated sectors read as zeroes */
+    if (bmds->shared_base || bmds->bs->backing_hd) {
+        return 0;
+    }
+    return !bdrv_is_allocated(bmds->bs, sector, nr_sectors, &n) &&
+           n >= nr_sectors;
+}
+
 static int mig_save_device_bulk(Monitor *mon, QEMUFile *f,
                                 BlkMigDevState *bmds)
 {
     int64_t total_sectors = bmds->total_sectors;
     int64_t cur_sector = bmds->cur_sector;
     BlockDriverState *bs = bmds->bs;
-    BlkMigBlock *blk;
     int nr_sectors;
 
     if (bmds->shared_base) {
@@ -190,35 +280,18 @@ static int mig_save_device_bulk(Monitor *mon, QEMUFile *f,
         nr_sectors = total_sectors - cur_sector;
     }
 
-    blk = qemu_malloc(sizeof(BlkMigBlock));
-    blk->buf = qemu_malloc(BLOCK_SIZE);
-    blk->bmds = bmds;
-    blk->sector = cur_sector;
-
-    blk->iov.iov_base = blk->buf;
-    blk->iov.iov_len = nr_sectors * BDRV_SECTOR_SIZE;
-    qemu_iovec_init_external(&blk->qiov, &blk->iov, 1);
-
-    blk->time = qemu_get_clock_ns(rt_clock);
-
-    blk->aiocb = bdrv_aio_readv(bs, cur_sector, &blk->qiov,
-                                nr_sectors, blk_mig_read_cb, blk);
-    if (!blk->aiocb) {
-        goto error;
+    if (blk_mig_chunk_is_zero(bmds, cur_sector, nr_sectors)) {
+        blk_send_zero(f, bmds, cur_sector);
+    } else if (blk_mig_submit_read(bmds, cur_sector, nr_sectors) < 0) {
+        monitor_printf(mon, "Error reading sector %" PRId64 "\n", cur_sector);
+        qemu_file_set_error(f);
+        return 0;
     }
-    block_mig_state.submitted++;
 
     bdrv_reset_dirty(bs, cur_sector, nr_sectors);
     bmds->cur_sector = cur_sector + nr_sectors;
 
     return (bmds->cur_sector >= total_sectors);
-
-error:
-    monitor_printf(mon, "Error reading sector %" PRId64 "\n", cur_sector);
-    qemu_file_set_error(f);
-    qemu_free(blk->buf);
-    qemu_free(blk);
-    return 0;
 }
 
 static void set_dirty_tracking(int enable)
@@ -244,6 +317,7 @@ static void init_blk_migration(Monitor *mon, QEMUFile *f)
     block_mig_state.bulk_completed = 0;
     block_mig_state.total_time = 0;
     block_mig_state.reads = 0;
+    block_mig_state.zero_blocks = 0;
 
     for (bs = bdrv_first; bs != NULL; bs = bs->next) {
         if (bs->type == BDRV_TYPE_HD) {
@@ -258,6 +332,9 @@ static void init_blk_migration(Monitor *mon, QEMUFile *f)
             bmds->total_sectors = sectors;
             bmds->completed_sectors = 0;
             bmds->shared_base = block_mig_state.shared_base;
+            bmds->aio_bitmap = qemu_mallocz(
+                BITS_TO_LONGS(sectors / BDRV_SECTORS_PER_DIRTY_CHUNK + 1) *
+                sizeof(unsigned long));
 
             block_mig_state.total_sector_sum += sectors;
 
@@ -317,49 +394,33 @@ static void blk_mig_reset_dirty_cursor(void)
     }
 }
 
+/*
+ * A dirty chunk that is still being read is left for a later pass: reads
+ * may complete in any order, and an older copy must not be sent last.
+ */
 static int mig_save_device_dirty(Monitor *mon, QEMUFile *f,
-                                 BlkMigDevState *bmds, int is_async)
+                                 BlkMigDevState *bmds)
 {
-    BlkMigBlock *blk;
     int64_t total_sectors = bmds->total_sectors;
     int64_t sector;
     int nr_sectors;
 
     for (sector = bmds->cur_dirty; sector < bmds->total_sectors;) {
-        if (bdrv_get_dirty(bmds->bs, sector)) {
+        if (bdrv_get_dirty(bmds->bs, sector) &&
+            !test_bit(sector / BDRV_SECTORS_PER_DIRTY_CHUNK,
+                      bmds->aio_bitmap)) {
 
             if (total_sectors - sector < BDRV_SECTORS_PER_DIRTY_CHUNK) {
                 nr_sectors = total_sectors - sector;
             } else {
                 nr_sectors = BDRV_SECTORS_PER_DIRTY_CHUNK;
             }
-            blk = qemu_malloc(sizeof(BlkMigBlock));
-            blk->buf = qemu_malloc(BLOCK_SIZE);
-            blk->bmds = bmds;
-            blk->sector = sector;
-
-            if (is_async) {
-                blk->iov.iov_base = blk->buf;
-                blk->iov.iov_len = nr_sectors * BDRV_SECTOR_SIZE;
-                qemu_iovec_init_external(&blk->qiov, &blk->iov, 1);
-
-		blk->time = qemu_get_clock_ns(rt_clock);
-
-                blk->aiocb = bdrv_aio_readv(bmds->bs, sector, &blk->qiov,
-                                            nr_sectors, blk_mig_read_cb, blk);
-                if (!blk->aiocb) {
-                    goto error;
-                }
-                block_mig_state.submitted++;
-            } else {
-                if (bdrv_read(bmds->bs, sector, blk->buf,
-                              nr_sectors) < 0) {
-                    goto error;
-                }
-                blk_send(f, blk);
 
-                qemu_free(blk->buf);
-                qemu_free(blk);
+            if (blk_mig_submit_read(bmds, sector, nr_sectors) < 0) {
+                monitor_printf(mon, "Error reading sector %" PRId64 "\n",
+                               sector);
+                qemu_file_set_error(f);
+                return 0;
             }
 
             bdrv_reset_dirty(bmds->bs, sector, nr_sectors);
@@ -370,22 +431,15 @@ static int mig_save_device_dirty(Monitor *mon, QEMUFile *f,
     }
 
     return (bmds->cur_dirty >= bmds->total_sectors);
-
-error:
-    monitor_printf(mon, "Error reading sector %" PRId64 "\n", sector);
-    qemu_file_set_error(f);
-    qemu_free(blk->buf);
-    qemu_free(blk);
-    return 0;
 }
 
-static int blk_mig_save_dirty_block(Monitor *mon, QEMUFile *f, int is_async)
+static int blk_mig_save_dirty_block(Monitor *mon, QEMUFile *f)
 {
     BlkMigDevState *bmds;
     int ret = 0;
 
     QSIMPLEQ_FOREACH(bmds, &block_mig_state.bmds_list, entry) {
-        if (mig_save_device_dirty(mon, f, bmds, is_async) == 0) {
+        if (mig_save_device_dirty(mon, f, bmds) == 0) {
             ret = 1;
             break;
         }
@@ -394,7 +448,8 @@ static int blk_mig_save_dirty_block(Monitor *mon, QEMUFile *f, int is_async)
     return ret;
 }
 
-static void flush_blks(QEMUFile* f)
+/* Sends the chunks that have been read, within the rate limit if limited */
+static void flush_blks(QEMUFile* f, int limited)
 {
     BlkMigBlock *blk;
 
@@ -403,7 +458,7 @@ static void flush_blks(QEMUFile* f)
             block_mig_state.transferred);
 
     while ((blk = QSIMPLEQ_FIRST(&block_mig_state.blk_list)) != NULL) {
-        if (qemu_file_rate_limit(f)) {
+        if (limited && qemu_file_rate_limit(f)) {
             break;
         }
         if (blk->ret < 0) {
@@ -469,8 +524,12 @@ static void blk_mig_cleanup(Monitor *mon)
     BlkMigDevState *bmds;
     BlkMigBlock *blk;
 
+    /* the reads still in flight refer to the devices */
+    qemu_aio_flush();
+
     while ((bmds = QSIMPLEQ_FIRST(&block_mig_state.bmds_list)) != NULL) {
         QSIMPLEQ_REMOVE_HEAD(&block_mig_state.bmds_list, entry);
+        qemu_free(bmds->aio_bitmap);
         qemu_free(bmds);
     }
 
@@ -508,7 +567,7 @@ static int block_save_live(Monitor *mon, QEMUFile *f, int stage, void *opaque)
         set_dirty_tracking(1);
     }
 
-    flush_blks(f);
+    flush_blks(f, stage != 3);
 
     if (qemu_file_has_error(f)) {
         blk_mig_cleanup(mon);
@@ -518,10 +577,13 @@ static int block_save_live(Monitor *mon, QEMUFile *f, int stage, void *opaque)
     blk_mig_reset_dirty_cursor();
 
     if (stage == 2) {
-        /* control the rate of transfer */
+        /* control the rate of transfer: the chunks being read and not sent
+           yet count against the limit, which is shared with RAM */
         while ((block_mig_state.submitted +
                 block_mig_state.read_done) * BLOCK_SIZE <
-               qemu_file_get_rate_limit(f)) {
+               qemu_file_get_rate_limit(f) &&
+               block_mig_state.submitted < migrate_block_inflight() &&
+               !qemu_file_rate_limit(f) && !qemu_file_has_error(f)) {
             if (block_mig_state.bulk_completed == 0) {
                 /* first finish the bulk phase */
                 if (blk_mig_save_bulked_block(mon, f) == 0) {
@@ -529,14 +591,14 @@ static int block_save_live(Monitor *mon, QEMUFile *f, int stage, void *opaque)
                     block_mig_state.bulk_completed = 1;
                 }
             } else {
-                if (blk_mig_save_dirty_block(mon, f, 1) == 0) {
+                if (blk_mig_save_dirty_block(mon, f) == 0) {
                     /* no more dirty blocks */
                     break;
                 }
             }
         }
 
-        flush_blks(f);
+        flush_blks(f, 1);
 
         if (qemu_file_has_error(f)) {
             blk_mig_cleanup(mon);
@@ -549,7 +611,18 @@ static int block_save_live(Monitor *mon, QEMUFile *f, int stage, void *opaque)
            all async read completed */
         assert(block_mig_state.submitted == 0);
 
-        while (blk_mig_save_dirty_block(mon, f, 0) != 0);
+        while (blk_mig_save_dirty_block(mon, f) != 0 &&
+               !qemu_file_has_error(f)) {
+            while (block_mig_state.submitted >= migrate_block_inflight()) {
+                qemu_aio_wait();
+            }
+            flush_blks(f, 0);
+        }
+        while (block_mig_state.submitted > 0) {
+            qemu_aio_wait();
+        }
+        flush_blks(f, 0);
+        DPRINTF("%" PRId64 " zero chunks\n", block_mig_state.zero_blocks);
         blk_mig_cleanup(mon);
 
         /* report completion */
@@ -601,6 +674,39 @@ static int block_load(QEMUFile *f, void *opaque, int version_id)
             bdrv_write(bs, addr, buf, BDRV_SECTORS_PER_DIRTY_CHUNK);
 
             qemu_free(buf);
+        } else if (flags & BLK_MIG_FLAG_ZERO_BLOCK) {
+            int64_t total_sectors;
+            int nr_sectors, ret;
+
+            if (version_id < 2) {
+                fprintf(stderr, "Unknown flags\n");
+                return -EINVAL;
+            }
+
+            len = qemu_get_byte(f);
+            qemu_get_buffer(f, (uint8_t *)device_name, len);
+            device_name[len] = '\0';
+
+            bs = bdrv_find(device_name);
+            if (!bs) {
+                fprintf(stderr, "Error unknown block device %s\n",
+                        device_name);
+                return -EINVAL;
+            }
+
+            total_sectors = bdrv_getlength(bs) >> BDRV_SECTOR_BITS;
+            nr_sectors = BDRV_SECTORS_PER_DIRTY_CHUNK;
+            if (total_sectors - addr < nr_sectors) {
+                nr_sectors = total_sectors - addr;
+            }
+            if (nr_sectors > 0) {
+                ret = bdrv_write_zeroes(bs, addr, nr_sectors);
+                if (ret < 0) {
+                    fprintf(stderr, "Error zeroing sector %" PRId64
+                            " of %s\n", addr, device_name);
+                    return ret;
+                }
+            }
         } else if (flags & BLK_MIG_FLAG_PROGRESS) {
             if (!banner_printed) {
                 printf("Receiving block device images\n");
@@ -635,6 +741,7 @@ void blk_mig_init(void)
     QSIMPLEQ_INIT(&block_mig_state.bmds_list);
     QSIMPLEQ_INIT(&block_mig_state.blk_list);
 
-    register_savevm_live("block", 0, 1, block_set_params, block_save_live,
-                         NULL, block_load, &block_mig_state);
+    register_savevm_live("block", 0, BLK_MIG_VERSION, block_set_params,
+                         block_save_live, NULL, block_load,
+                         &block_mig_state);
 }
@@ -25,6 +25,7 @@
 #include "qemu-common.h"
 #include "monitor.h"
 #include "block_int.h"
+#include "qemu-timer.h"
 #include "module.h"
 #include "qemu-objects.h"
 
@@ -54,6 +55,20 @@ static int bdrv_read_em(BlockDriverState *bs, int64_t sector_num,
                         uint8_t *buf, int nb_sectors);
 static int bdrv_write_em(BlockDriverState *bs, int64_t sector_num,
                          const uint8_t *buf, int nb_sectors);
+static BlockDriverAIOCB *bdrv_aio_throttled(BlockDriverState *bs,
+        int64_t sector_num, QEMUIOVector *qiov, int nb_sectors,
+        BlockDriverCompletionFunc *cb, void *opaque, int is_write);
+static int bdrv_io_limits_dispatch(BlockDriverState *bs, int force);
+static int bdrv_cor_needed(BlockDriverState *bs, int64_t sector_num,
+                           int nb_sectors);
+static BlockDriverAIOCB *bdrv_aio_cor(BlockDriverState *bs,
+        int64_t sector_num, QEMUIOVector *qiov, int nb_sectors,
+        BlockDriverCompletionFunc *cb, void *opaque);
+static BlockDriverAIOCB *bdrv_aio_writev_tracked(BlockDriverState *bs,
+        int64_t sector_num, QEMUIOVector *qiov, int nb_sectors,
+        BlockDriverCompletionFunc *cb, void *opaque);
+static void bdrv_tracked_write_sync(BlockDriverState *bs, int64_t sector_num,
+                                    int nb_sectors);
 
 BlockDriverState *bdrv_first;
 
@@ -152,6 +167,8 @@ BlockDriverState *bdrv_new(const char *device_name)
 
     bs = qemu_mallocz(sizeof(BlockDriverState));
     pstrcpy(bs->device_name, sizeof(bs->device_name), device_name);
+    QTAILQ_INIT(&bs->throttled_reqs);
+    QTAILQ_INIT(&bs->tracked_reqs);
     if (device_name[0] != '\0') {
         /* insert at the end */
         pbs = &bdrv_first;
@@ -527,6 +544,11 @@ unlink_and_fail:
 void bdrv_close(BlockDriverState *bs)
 {
     if (bs->drv) {
+        bdrv_stream_cancel(bs);
+
+        /* don't leave throttled requests behind */
+        bdrv_io_limits_dispatch(bs, 1);
+
         if (bs->backing_hd)
             bdrv_delete(bs->backing_hd);
         bs->drv->bdrv_close(bs);
@@ -557,21 +579,32 @@ void bdrv_delete(BlockDriverState *bs)
         *pbs = bs->next;
 
     bdrv_close(bs);
+    if (bs->io_limits_timer) {
+        qemu_del_timer(bs->io_limits_timer);
+        qemu_free_timer(bs->io_limits_timer);
+    }
     qemu_free(bs);
 }
 
 /*
- * Run consistency checks on an image
+ * Run consistency checks on an image, optionally repairing the problems
+ * given in fix (BDRV_FIX_*)
  *
- * Returns the number of errors or -errno when an internal error occurs
+ * The problems found are counted in res. Returns -errno when an internal
+ * error occurs.
  */
-int bdrv_check(BlockDriverState *bs)
+int bdrv_check(BlockDriverState *bs, BdrvCheckResult *res, int fix)
 {
+    memset(res, 0, sizeof(*res));
+
     if (bs->drv->bdrv_check == NULL) {
         return -ENOTSUP;
     }
+    if (fix && bs->read_only) {
+        return -EACCES;
+    }
 
-    return bs->drv->bdrv_check(bs);
+    return bs->drv->bdrv_check(bs, res, fix);
 }
 
 /* commit COW file into the raw image */
@@ -787,9 +820,90 @@ int bdrv_write(BlockDriverState *bs, int64_t sector_num,
         set_dirty_bitmap(bs, sector_num, nb_sectors, 1);
     }
 
+    if (bs->copy_on_read || !QTAILQ_EMPTY(&bs->tracked_reqs)) {
+        bdrv_tracked_write_sync(bs, sector_num, nb_sectors);
+    }
+
     return drv->bdrv_write(bs, sector_num, buf, nb_sectors);
 }
 
+#define WRITE_ZEROES_CHUNK_SECTORS 256
+
+/*
+ * Make the given sectors read back as zeros. Drivers that can do so without
+ * writing out a zeroed buffer (e.g. by deallocating clusters) implement
+ * bdrv_write_zeroes; if they don't, or return -ENOTSUP, the zeros are
+ * written explicitly.
+ *
+ * Return values are the same as for bdrv_write.
+ */
+int bdrv_write_zeroes(BlockDriverState *bs, int64_t sector_num,
+                      int nb_sectors)
+{
+    BlockDriver *drv = bs->drv;
+    uint8_t *buf;
+    int n, ret;
+
+    if (!bs->drv)
+        return -ENOMEDIUM;
+    if (bs->read_only)
+        return -EACCES;
+    if (bdrv_check_request(bs, sector_num, nb_sectors))
+        return -EIO;
+
+    if (drv->bdrv_write_zeroes) {
+        if (bs->dirty_bitmap) {
+            set_dirty_bitmap(bs, sector_num, nb_sectors, 1);
+        }
+        ret = drv->bdrv_write_zeroes(bs, sector_num, nb_sectors);
+        if (ret != -ENOTSUP)
+            return ret;
+    }
+
+    buf = qemu_blockalign(bs, WRITE_ZEROES_CHUNK_SECTORS * BDRV_SECTOR_SIZE);
+    memset(buf, 0, WRITE_ZEROES_CHUNK_SECTORS * BDRV_SECTOR_SIZE);
+    ret = 0;
+    while (nb_sectors > 0) {
+        n = MIN(nb_sectors, WRITE_ZEROES_CHUNK_SECTORS);
+        ret = bdrv_write(bs, sector_num, buf, n);
+        if (ret < 0)
+            break;
+        sector_num += n;
+        nb_sectors -= n;
+    }
+    qemu_vfree(buf);
+
+    return ret;
+}
+
+/*
+ * Tell the driver that the given sectors are not in use any more, so that
+ * their space can be reclaimed. Their content is undefined afterwards.
+ *
+ * This is only a hint: drivers that cannot discard data keep it, and 0 is
+ * returned. Other return values are the same as for bdrv_write.
+ */
+int bdrv_discard(BlockDriverState *bs, int64_t sector_num, int nb_sectors)
+{
+    BlockDriver *drv = bs->drv;
+
+    if (!bs->drv)
+        return -ENOMEDIUM;
+    if (bs->read_only)
+        return -EACCES;
+    if (bdrv_check_request(bs, sector_num, nb_sectors))
+        return -EIO;
+
+    if (!drv->bdrv_discard)
+        return 0;
+
+    if (bs->dirty_bitmap) {
+        set_dirty_bitmap(bs, sector_num, nb_sectors, 1);
+    }
+
+    return drv->bdrv_discard(bs, sector_num, nb_sectors);
+}
+
 int bdrv_pread(BlockDriverState *bs, int64_t offset,
                void *buf, int count1)
 {
@@ -1386,8 +1500,13 @@ void bdrv_info(Monitor *mon, QObject **ret_data)
 
 static void bdrv_stats_iter(QObject *data, void *opaque)
 {
+    static const char *const hist_names[] = {
+        "rd_latency_histogram", "wr_latency_histogram",
+        "flush_latency_histogram",
+    };
     QDict *qdict;
     Monitor *mon = opaque;
+    int i;
 
     qdict = qobject_to_qdict(data);
     monitor_printf(mon, "%s:", qdict_get_str(qdict, "device"));
@@ -1397,11 +1516,41 @@ static void bdrv_stats_iter(QObject *data, void *opaque)
                         " wr_bytes=%" PRId64
                         " rd_operations=%" PRId64
                         " wr_operations=%" PRId64
+                        " flush_operations=%" PRId64
+                        " wr_merged=%" PRId64
+                        " in_flight=%" PRId64
+                        " max_in_flight=%" PRId64
+                        " throttled_operations=%" PRId64
+                        " throttled_time_ms=%" PRId64
                         "\n",
                         qdict_get_int(qdict, "rd_bytes"),
                         qdict_get_int(qdict, "wr_bytes"),
                         qdict_get_int(qdict, "rd_operations"),
-                        qdict_get_int(qdict, "wr_operations"));
+                        qdict_get_int(qdict, "wr_operations"),
+                        qdict_get_int(qdict, "flush_operations"),
+                        qdict_get_int(qdict, "wr_merged"),
+                        qdict_get_int(qdict, "in_flight"),
+                        qdict_get_int(qdict, "max_in_flight"),
+                        qdict_get_int(qdict, "throttled_operations"),
+                        qdict_get_int(qdict, "throttled_time_ms"));
+
+    /* only the non-empty buckets, as "lower bound in us:count" */
+    for (i = 0; i < ARRAY_SIZE(hist_names); i++) {
+        QList *hist = qdict_get_qlist(qdict, hist_names[i]);
+        int64_t bucket = 0;
+        const QListEntry *entry;
+
+        monitor_printf(mon, "    %s:", hist_names[i]);
+        QLIST_FOREACH_ENTRY(hist, entry) {
+            int64_t count = qint_get_int(qobject_to_qint(entry->value));
+            if (count) {
+                monitor_printf(mon, " %" PRId64 ":%" PRId64,
+                               (int64_t)1 << bucket, count);
+            }
+            bucket++;
+        }
+        monitor_printf(mon, "\n");
+    }
 }
 
 void bdrv_stats_print(Monitor *mon, const QObject *data)
@@ -1409,6 +1558,18 @@ void bdrv_stats_print(Monitor *mon, const QObject *data)
     qlist_iter(qobject_to_qlist(data), bdrv_stats_iter, mon);
 }
 
+static QObject *bdrv_latency_histogram(const uint64_t *hist)
+{
+    QList *list = qlist_new();
+    int i;
+
+    for (i = 0; i < BDRV_LATENCY_BUCKETS; i++) {
+        qlist_append(list, qint_from_int(hist[i]));
+    }
+
+    return QOBJECT(list);
+}
+
 /**
  * bdrv_info_stats(): show block device statistics
  *
@@ -1423,19 +1584,47 @@ void bdrv_stats_print(Monitor *mon, const QObject *data)
  *     - "wr_bytes": bytes written
  *     - "rd_operations": read operations
  *     - "wr_operations": write operations
- * 
+ *     - "flush_operations": flush operations
+ *     - "wr_merged": write requests merged into others
+ *     - "in_flight": requests currently submitted to the driver
+ *     - "max_in_flight": highest value of "in_flight" seen so far
+ *     - "throttled_operations": operations delayed by I/O throttling
+ *     - "throttled_time_ms": total time operations were delayed, in ms
+ *     - "rd_latency_histogram", "wr_latency_histogram",
+ *       "flush_latency_histogram": QLists of completed operations by
+ *       latency, element i counting those that took 2^i to 2^(i+1)-1 us
+ *       (the first one also counts 0 us, the last one everything longer)
+ *
  * Example:
  *
  * [ { "device": "ide0-hd0",
  *               "stats": { "rd_bytes": 512,
  *                          "wr_bytes": 0,
  *                          "rd_operations": 1,
- *                          "wr_operations": 0 } },
+ *                          "wr_operations": 0,
+ *                          "flush_operations": 0,
+ *                          "wr_merged": 0,
+ *                          "in_flight": 0,
+ *                          "max_in_flight": 1,
+ *                          "throttled_operations": 0,
+ *                          "throttled_time_ms": 0,
+ *                          "rd_latency_histogram": [ 0, 0, 0, 0, 0, 1, ... ],
+ *                          "wr_latency_histogram": [ 0, 0, 0, 0, 0, 0, ... ],
+ *                          "flush_latency_histogram": [ 0, 0, 0, ... ] } },
  *   { "device": "ide1-cd0",
  *               "stats": { "rd_bytes": 0,
  *                          "wr_bytes": 0,
  *                          "rd_operations": 0,
- *                          "wr_operations": 0 } } ]
+ *                          "wr_operations": 0,
+ *                          "flush_operations": 0,
+ *                          "wr_merged": 0,
+ *                          "in_flight": 0,
+ *                          "max_in_flight": 0,
+ *                          "throttled_operations": 0,
+ *                          "throttled_time_ms": 0,
+ *                          "rd_latency_histogram": [ 0, 0, 0, ... ],
+ *                          "wr_latency_histogram": [ 0, 0, 0, ... ],
+ *                          "flush_latency_histogram": [ 0, 0, 0, ... ] } } ]
  */
 void bdrv_info_stats(Monitor *mon, QObject **ret_data)
 {
@@ -1450,11 +1639,29 @@ void bdrv_info_stats(Monitor *mon, QObject **ret_data)
                                  "'rd_bytes': %" PRId64 ","
                                  "'wr_bytes': %" PRId64 ","
                                  "'rd_operations': %" PRId64 ","
-                                 "'wr_operations': %" PRId64
+                                 "'wr_operations': %" PRId64 ","
+                                 "'flush_operations': %" PRId64 ","
+                                 "'wr_merged': %" PRId64 ","
+                                 "'in_flight': %d,"
+                                 "'max_in_flight': %d,"
+                                 "'throttled_operations': %" PRId64 ","
+                                 "'throttled_time_ms': %" PRId64 ","
+                                 "'rd_latency_histogram': %p,"
+                                 "'wr_latency_histogram': %p,"
+                                 "'flush_latency_histogram': %p"
                                  "} }",
                                  bs->device_name,
                                  bs->rd_bytes, bs->wr_bytes,
-                                 bs->rd_ops, bs->wr_ops);
+                                 bs->rd_ops, bs->wr_ops,
+                                 bs->flush_ops, bs->wr_merged,
+                                 bs->in_flight, bs->max_in_flight,
+                                 bs->throttled_ops, bs->throttled_time,
+                                 bdrv_latency_histogram(
+                                     bs->latency_hist[BDRV_ACCT_READ]),
+                                 bdrv_latency_histogram(
+                                     bs->latency_hist[BDRV_ACCT_WRITE]),
+                                 bdrv_latency_histogram(
+                                     bs->latency_hist[BDRV_ACCT_FLUSH]));
         qlist_append_obj(devices, obj);
     }
 
@@ -1655,28 +1862,172 @@ char *bdrv_snapshot_dump(char *buf, int buf_size, QEMUSnapshotInfo *sn)
 /**************************************************************/
 /* async I/Os */
 
+/*
+ * Requests to named devices are wrapped so that their latency and the
+ * number of requests in flight can be accounted for on completion.
+ */
+typedef struct BlockAcctAIOCB {
+    BlockDriverAIOCB common;
+    BlockDriverAIOCB *aiocb;
+    int type;
+    int64_t start;
+    int done; /* completed before the driver returned its AIOCB */
+} BlockAcctAIOCB;
+
+static void bdrv_aio_cancel_acct(BlockDriverAIOCB *blockacb)
+{
+    BlockAcctAIOCB *acb = (BlockAcctAIOCB *)blockacb;
+
+    bdrv_aio_cancel(acb->aiocb);
+    acb->common.bs->in_flight--;
+    qemu_aio_release(acb);
+}
+
+static AIOPool bdrv_acct_aio_pool = {
+    .aiocb_size         = sizeof(BlockAcctAIOCB),
+    .cancel             = bdrv_aio_cancel_acct,
+};
+
+static void bdrv_acct_cb(void *opaque, int ret)
+{
+    BlockAcctAIOCB *acb = opaque;
+    BlockDriverState *bs = acb->common.bs;
+    int64_t latency;
+    int bucket = 0;
+
+    latency = (qemu_get_clock_ns(rt_clock) - acb->start) / 1000;
+    while (latency >= 2 && bucket < BDRV_LATENCY_BUCKETS - 1) {
+        latency >>= 1;
+        bucket++;
+    }
+    bs->latency_hist[acb->type][bucket]++;
+    bs->in_flight--;
+
+    acb->common.cb(acb->common.opaque, ret);
+    if (acb->aiocb) {
+        qemu_aio_release(acb);
+    } else {
+        /* bdrv_acct_submitted() still uses acb, it releases it */
+        acb->done = 1;
+    }
+}
+
+static BlockAcctAIOCB *bdrv_acct_start(BlockDriverState *bs, int type,
+                                       BlockDriverCompletionFunc *cb,
+                                       void *opaque)
+{
+    BlockAcctAIOCB *acb;
+
+    acb = qemu_aio_get(&bdrv_acct_aio_pool, bs, cb, opaque);
+    acb->type = type;
+    acb->start = qemu_get_clock_ns(rt_clock);
+    acb->aiocb = NULL;
+    acb->done = 0;
+
+    if (++bs->in_flight > bs->max_in_flight) {
+        bs->max_in_flight = bs->in_flight;
+    }
+
+    return acb;
+}
+
+/*
+ * Returns the AIOCB to hand out for the request, NULL if it failed. If the
+ * driver completed the request before returning, acb is released and the
+ * driver's AIOCB is passed on as is.
+ */
+static BlockDriverAIOCB *bdrv_acct_submitted(BlockAcctAIOCB *acb,
+                                             BlockDriverAIOCB *aiocb)
+{
+    if (aiocb == NULL) {
+        acb->common.bs->in_flight--;
+        qemu_aio_release(acb);
+        return NULL;
+    }
+    if (acb->done) {
+        qemu_aio_release(acb);
+        return aiocb;
+    }
+    acb->aiocb = aiocb;
+    return &acb->common;
+}
+
+/* Submit a request to the driver, bypassing I/O throttling */
+static BlockDriverAIOCB *bdrv_aio_submit(BlockDriverState *bs,
+                                         int64_t sector_num,
+                                         QEMUIOVector *qiov, int nb_sectors,
+                                         BlockDriverCompletionFunc *cb,
+                                         void *opaque, int is_write)
+{
+    BlockDriver *drv = bs->drv;
+    BlockDriverAIOCB *ret;
+    BlockAcctAIOCB *acct = NULL;
+
+    if (bs->device_name[0] != '\0') {
+        acct = bdrv_acct_start(bs, is_write ? BDRV_ACCT_WRITE : BDRV_ACCT_READ,
+                               cb, opaque);
+        cb = bdrv_acct_cb;
+        opaque = acct;
+    }
+
+    if (is_write) {
+        ret = drv->bdrv_aio_writev(bs, sector_num, qiov, nb_sectors,
+                                   cb, opaque);
+    } else {
+        ret = drv->bdrv_aio_readv(bs, sector_num, qiov, nb_sectors,
+                                  cb, opaque);
+    }
+
+    if (acct) {
+        ret = bdrv_acct_submitted(acct, ret);
+    }
+
+    if (ret) {
+	/* Update stats even though technically transfer has not happened. */
+        if (is_write) {
+            bs->wr_bytes += (unsigned) nb_sectors * BDRV_SECTOR_SIZE;
+            bs->wr_ops ++;
+        } else {
+            bs->rd_bytes += (unsigned) nb_sectors * BDRV_SECTOR_SIZE;
+            bs->rd_ops ++;
+        }
+    }
+
+    return ret;
+}
+
+/* Submit a request to the driver, subject to I/O throttling */
+static BlockDriverAIOCB *bdrv_aio_dispatch(BlockDriverState *bs,
+                                           int64_t sector_num,
+                                           QEMUIOVector *qiov, int nb_sectors,
+                                           BlockDriverCompletionFunc *cb,
+                                           void *opaque, int is_write)
+{
+    if (bs->io_limits_enabled) {
+        return bdrv_aio_throttled(bs, sector_num, qiov, nb_sectors,
+                                  cb, opaque, is_write);
+    }
+
+    return bdrv_aio_submit(bs, sector_num, qiov, nb_sectors, cb, opaque,
+                           is_write);
+}
+
 BlockDriverAIOCB *bdrv_aio_readv(BlockDriverState *bs, int64_t sector_num,
                                  QEMUIOVector *qiov, int nb_sectors,
                                  BlockDriverCompletionFunc *cb, void *opaque)
 {
     BlockDriver *drv = bs->drv;
-    BlockDriverAIOCB *ret;
 
     if (!drv)
         return NULL;
     if (bdrv_check_request(bs, sector_num, nb_sectors))
         return NULL;
 
-    ret = drv->bdrv_aio_readv(bs, sector_num, qiov, nb_sectors,
-                              cb, opaque);
-
-    if (ret) {
-	/* Update stats even though technically transfer has not happened. */
-	bs->rd_bytes += (unsigned) nb_sectors * BDRV_SECTOR_SIZE;
-	bs->rd_ops ++;
+    if (bdrv_cor_needed(bs, sector_num, nb_sectors)) {
+        return bdrv_aio_cor(bs, sector_num, qiov, nb_sectors, cb, opaque);
     }
 
-    return ret;
+    return bdrv_aio_dispatch(bs, sector_num, qiov, nb_sectors, cb, opaque, 0);
 }
 
 BlockDriverAIOCB *bdrv_aio_writev(BlockDriverState *bs, int64_t sector_num,
@@ -1684,7 +2035,6 @@ BlockDriverAIOCB *bdrv_aio_writev(BlockDriverState *bs, int64_t sector_num,
                                   BlockDriverCompletionFunc *cb, void *opaque)
 {
     BlockDriver *drv = bs->drv;
-    BlockDriverAIOCB *ret;
 
     if (!drv)
         return NULL;
@@ -1697,16 +2047,12 @@ BlockDriverAIOCB *bdrv_aio_writev(BlockDriverState *bs, int64_t sector_num,
         set_dirty_bitmap(bs, sector_num, nb_sectors, 1);
     }
 
-    ret = drv->bdrv_aio_writev(bs, sector_num, qiov, nb_sectors,
-                               cb, opaque);
-
-    if (ret) {
-	/* Update stats even though technically transfer has not happened. */
-	bs->wr_bytes += (unsigned) nb_sectors * BDRV_SECTOR_SIZE;
-	bs->wr_ops ++;
+    if (bs->copy_on_read || !QTAILQ_EMPTY(&bs->tracked_reqs)) {
+        return bdrv_aio_writev_tracked(bs, sector_num, qiov, nb_sectors,
+                                       cb, opaque);
     }
 
-    return ret;
+    return bdrv_aio_dispatch(bs, sector_num, qiov, nb_sectors, cb, opaque, 1);
 }
 
 
@@ -1867,6 +2213,7 @@ int bdrv_aio_multiwrite(BlockDriverState *bs, BlockRequest *reqs, int num_reqs)
 
     // Check for mergable requests
     num_reqs = multiwrite_merge(bs, reqs, num_reqs, mcb);
+    bs->wr_merged += mcb->num_callbacks - num_reqs;
 
     // Run the aio requests
     for (i = 0; i < num_reqs; i++) {
@@ -1900,10 +2247,20 @@ BlockDriverAIOCB *bdrv_aio_flush(BlockDriverState *bs,
         BlockDriverCompletionFunc *cb, void *opaque)
 {
     BlockDriver *drv = bs->drv;
+    BlockAcctAIOCB *acct;
+    BlockDriverAIOCB *ret;
 
     if (!drv)
         return NULL;
-    return drv->bdrv_aio_flush(bs, cb, opaque);
+    if (bs->device_name[0] == '\0')
+        return drv->bdrv_aio_flush(bs, cb, opaque);
+
+    acct = bdrv_acct_start(bs, BDRV_ACCT_FLUSH, cb, opaque);
+    ret = bdrv_acct_submitted(acct, drv->bdrv_aio_flush(bs, bdrv_acct_cb, acct));
+    if (ret) {
+        bs->flush_ops++;
+    }
+    return ret;
 }
 
 void bdrv_aio_cancel(BlockDriverAIOCB *acb)
@@ -1911,6 +2268,930 @@ void bdrv_aio_cancel(BlockDriverAIOCB *acb)
     acb->pool->cancel(acb);
 }
 
+/*
+ * Between bdrv_io_plug() and the matching bdrv_io_unplug() the driver may
+ * hold back submitted requests so that it can pass them to the host in a
+ * single batch. Calls may be nested; the batch is submitted on the last
+ * unplug.
+ */
+void bdrv_io_plug(BlockDriverState *bs)
+{
+    BlockDriver *drv = bs->drv;
+
+    if (drv && drv->bdrv_io_plug) {
+        drv->bdrv_io_plug(bs);
+    }
+}
+
+void bdrv_io_unplug(BlockDriverState *bs)
+{
+    BlockDriver *drv = bs->drv;
+
+    if (drv && drv->bdrv_io_unplug) {
+        drv->bdrv_io_unplug(bs);
+    }
+}
+
+
+/**************************************************************/
+/* I/O throttling */
+
+/*
+ * Every limit is a token bucket that is refilled at the configured rate
+ * and holds at most a burst worth of tokens. A request may start as long
+ * as none of the buckets it is charged to is in debt; it then takes its
+ * tokens, possibly driving the buckets into debt. Requests that may not
+ * start are queued in order and submitted from a timer once the debt has
+ * been paid back.
+ */
+
+typedef struct BlockThrottleAIOCB {
+    BlockDriverAIOCB common;
+    int64_t sector_num;
+    QEMUIOVector *qiov;
+    int nb_sectors;
+    int is_write;
+    int64_t queued_time;
+    BlockDriverAIOCB *aiocb; /* set once submitted to the driver */
+    QTAILQ_ENTRY(BlockThrottleAIOCB) entry;
+} BlockThrottleAIOCB;
+
+static void bdrv_aio_cancel_throttled(BlockDriverAIOCB *blockacb)
+{
+    BlockThrottleAIOCB *acb = (BlockThrottleAIOCB *)blockacb;
+
+    if (acb->aiocb) {
+        bdrv_aio_cancel(acb->aiocb);
+    } else {
+        QTAILQ_REMOVE(&acb->common.bs->throttled_reqs, acb, entry);
+    }
+    qemu_aio_release(acb);
+}
+
+static AIOPool bdrv_throttle_aio_pool = {
+    .aiocb_size         = sizeof(BlockThrottleAIOCB),
+    .cancel             = bdrv_aio_cancel_throttled,
+};
+
+static double bdrv_io_limits_burst(int64_t rate, int64_t max)
+{
+    return max ? max : rate / 10.0;
+}
+
+static void bdrv_io_limits_refill(BlockDriverState *bs, int64_t now)
+{
+    BlockIOLimit *l = &bs->io_limits;
+    double elapsed = (now - bs->io_tokens_time) / 1000.0;
+    int i;
+
+    for (i = 0; i < BLOCK_IO_LIMIT_MAX; i++) {
+        if (l->bps[i]) {
+            bs->io_tokens_bps[i] = MIN(bs->io_tokens_bps[i] +
+                                       l->bps[i] * elapsed,
+                                       bdrv_io_limits_burst(l->bps[i],
+                                                            l->bps_max));
+        }
+        if (l->iops[i]) {
+            bs->io_tokens_iops[i] = MIN(bs->io_tokens_iops[i] +
+                                        l->iops[i] * elapsed,
+                                        bdrv_io_limits_burst(l->iops[i],
+                                                             l->iops_max));
+        }
+    }
+    bs->io_tokens_time = now;
+}
+
+/* Returns the time in ms until a request may start, 0 if it may start now */
+static int64_t bdrv_io_limits_wait(BlockDriverState *bs, int is_write)
+{
+    BlockIOLimit *l = &bs->io_limits;
+    int64_t wait = 0;
+    double debt;
+    int i, idx[2] = { is_write, BLOCK_IO_LIMIT_TOTAL };
+
+    bdrv_io_limits_refill(bs, qemu_get_clock(rt_clock));
+
+    for (i = 0; i < 2; i++) {
+        if (l->bps[idx[i]] && bs->io_tokens_bps[idx[i]] < 0) {
+            debt = -bs->io_tokens_bps[idx[i]] * 1000 / l->bps[idx[i]];
+            wait = MAX(wait, (int64_t)debt + 1);
+        }
+        if (l->iops[idx[i]] && bs->io_tokens_iops[idx[i]] < 0) {
+            debt = -bs->io_tokens_iops[idx[i]] * 1000 / l->iops[idx[i]];
+            wait = MAX(wait, (int64_t)debt + 1);
+        }
+    }
+
+    return wait;
+}
+
+static void bdrv_io_limits_account(BlockDriverState *bs, int is_write,
+                                   int nb_sectors)
+{
+    int i, idx[2] = { is_write, BLOCK_IO_LIMIT_TOTAL };
+
+    for (i = 0; i < 2; i++) {
+        bs->io_tokens_bps[idx[i]] -= (double)nb_sectors * BDRV_SECTOR_SIZE;
+        bs->io_tokens_iops[idx[i]] -= 1;
+    }
+}
+
+static void bdrv_io_limits_cb(void *opaque, int ret)
+{
+    BlockThrottleAIOCB *acb = opaque;
+
+    acb->common.cb(acb->common.opaque, ret);
+    qemu_aio_release(acb);
+}
+
+/*
+ * Submit queued requests as far as the limits allow (or all of them if
+ * force is set) and rearm the timer for the rest.
+ *
+ * Returns 1 if any request was submitted, 0 otherwise.
+ */
+static int bdrv_io_limits_dispatch(BlockDriverState *bs, int force)
+{
+    BlockThrottleAIOCB *acb;
+    int64_t now, wait;
+    int progress = 0;
+
+    while ((acb = QTAILQ_FIRST(&bs->throttled_reqs)) != NULL) {
+        now = qemu_get_clock(rt_clock);
+        if (!force) {
+            wait = bdrv_io_limits_wait(bs, acb->is_write);
+            if (wait) {
+                qemu_mod_timer(bs->io_limits_timer, now + wait);
+                break;
+            }
+        }
+
+        QTAILQ_REMOVE(&bs->throttled_reqs, acb, entry);
+        bdrv_io_limits_account(bs, acb->is_write, acb->nb_sectors);
+        bs->throttled_ops++;
+        bs->throttled_time += now - acb->queued_time;
+        progress = 1;
+
+        acb->aiocb = bdrv_aio_submit(bs, acb->sector_num, acb->qiov,
+                                     acb->nb_sectors, bdrv_io_limits_cb, acb,
+                                     acb->is_write);
+        if (acb->aiocb == NULL) {
+            acb->common.cb(acb->common.opaque, -EIO);
+            qemu_aio_release(acb);
+        }
+    }
+
+    return progress;
+}
+
+static void bdrv_io_limits_timer_cb(void *opaque)
+{
+    bdrv_io_limits_dispatch(opaque, 0);
+}
+
+static BlockDriverAIOCB *bdrv_aio_throttled(BlockDriverState *bs,
+        int64_t sector_num, QEMUIOVector *qiov, int nb_sectors,
+        BlockDriverCompletionFunc *cb, void *opaque, int is_write)
+{
+    BlockThrottleAIOCB *acb;
+    int64_t wait = 0;
+
+    /*
+     * Synchronous emulation waits for the request with qemu_aio_wait(),
+     * which doesn't run timers, so those requests are only accounted for.
+     */
+    if (get_async_context_id() != 0 ||
+        (QTAILQ_EMPTY(&bs->throttled_reqs) &&
+         !(wait = bdrv_io_limits_wait(bs, is_write)))) {
+        bdrv_io_limits_account(bs, is_write, nb_sectors);
+        return bdrv_aio_submit(bs, sector_num, qiov, nb_sectors, cb, opaque,
+                               is_write);
+    }
+
+    acb = qemu_aio_get(&bdrv_throttle_aio_pool, bs, cb, opaque);
+    acb->sector_num = sector_num;
+    acb->qiov = qiov;
+    acb->nb_sectors = nb_sectors;
+    acb->is_write = is_write;
+    acb->queued_time = qemu_get_clock(rt_clock);
+    acb->aiocb = NULL;
+    QTAILQ_INSERT_TAIL(&bs->throttled_reqs, acb, entry);
+
+    if (!bs->io_limits_timer) {
+        bs->io_limits_timer = qemu_new_timer(rt_clock,
+                                             bdrv_io_limits_timer_cb, bs);
+    }
+    /*
+     * Only arm the timer here: submitting from the dispatcher could complete
+     * and release acb before it is returned to the caller.
+     */
+    if (QTAILQ_FIRST(&bs->throttled_reqs) == acb) {
+        qemu_mod_timer(bs->io_limits_timer, qemu_get_clock(rt_clock) + wait);
+    }
+
+    return &acb->common;
+}
+
+/*
+ * Set the I/O throttling limits of a device. Requests that are already
+ * queued are submitted according to the new limits.
+ */
+void bdrv_set_io_limits(BlockDriverState *bs, const BlockIOLimit *io_limits)
+{
+    BlockIOLimit *l = &bs->io_limits;
+    int i;
+
+    *l = *io_limits;
+    bs->io_limits_enabled = 0;
+    for (i = 0; i < BLOCK_IO_LIMIT_MAX; i++) {
+        if (l->bps[i] || l->iops[i]) {
+            bs->io_limits_enabled = 1;
+        }
+        bs->io_tokens_bps[i] = bdrv_io_limits_burst(l->bps[i], l->bps_max);
+        bs->io_tokens_iops[i] = bdrv_io_limits_burst(l->iops[i], l->iops_max);
+    }
+    bs->io_tokens_time = qemu_get_clock(rt_clock);
+
+    if (bs->io_limits_timer) {
+        qemu_del_timer(bs->io_limits_timer);
+    }
+    bdrv_io_limits_dispatch(bs, !bs->io_limits_enabled);
+}
+
+/*
+ * Submit all throttled requests regardless of the limits, so that waiting
+ * for in-flight AIO covers them, too.
+ *
+ * Returns 1 if any request was submitted, 0 otherwise.
+ */
+int bdrv_io_limits_flush_all(void)
+{
+    BlockDriverState *bs;
+    int progress = 0;
+
+    for (bs = bdrv_first; bs != NULL; bs = bs->next) {
+        progress |= bdrv_io_limits_dispatch(bs, 1);
+    }
+
+    return progress;
+}
+
+
+/**************************************************************/
+/* copy-on-read and image streaming */
+
+/*
+ * With copy-on-read, reads of sectors that are not allocated in an image
+ * with a backing file write the data they fetched back into the image, so
+ * that later reads don't need to go down the backing chain any more. Image
+ * streaming uses the same mechanism to copy everything the image still
+ * takes from its backing file in the background.
+ *
+ * The write-back must never overwrite data written by the guest, so while
+ * copy-on-read is in use, guest writes are tracked along with the
+ * copy-on-read requests:
+ *  - a copy-on-read request doesn't write back if it overlaps any tracked
+ *    request when it starts, or a guest write starts while it is reading;
+ *  - a guest write that overlaps a write-back waits until the write-back
+ *    has completed.
+ */
+
+enum {
+    BDRV_TRACKED_COR_READ,      /* copy-on-read, reading */
+    BDRV_TRACKED_COR_WRITE,     /* copy-on-read, writing back */
+    BDRV_TRACKED_WRITE,         /* guest write */
+    BDRV_TRACKED_WRITE_QUEUED,  /* guest write waiting for a write-back */
+};
+
+typedef struct BdrvTrackedRequest {
+    int64_t sector_num;
+    int nb_sectors;
+    int state;
+    int skip_write_back;
+    QTAILQ_ENTRY(BdrvTrackedRequest) entry;
+} BdrvTrackedRequest;
+
+static int bdrv_tracked_overlaps(BdrvTrackedRequest *req, int64_t sector_num,
+                                 int nb_sectors)
+{
+    return sector_num < req->sector_num + req->nb_sectors &&
+           req->sector_num < sector_num + nb_sectors;
+}
+
+/*
+ * Returns 1 if a guest write to the given sectors must wait for a
+ * write-back. Otherwise, copy-on-read requests still reading these sectors
+ * are told not to write back and 0 is returned.
+ */
+static int bdrv_tracked_write_begin(BlockDriverState *bs, int64_t sector_num,
+                                    int nb_sectors)
+{
+    BdrvTrackedRequest *req;
+
+    QTAILQ_FOREACH(req, &bs->tracked_reqs, entry) {
+        if (req->state == BDRV_TRACKED_COR_WRITE &&
+            bdrv_tracked_overlaps(req, sector_num, nb_sectors)) {
+            return 1;
+        }
+    }
+
+    QTAILQ_FOREACH(req, &bs->tracked_reqs, entry) {
+        if (req->state == BDRV_TRACKED_COR_READ &&
+            bdrv_tracked_overlaps(req, sector_num, nb_sectors)) {
+            req->skip_write_back = 1;
+        }
+    }
+
+    return 0;
+}
+
+/* Synchronous writes wait for overlapping write-backs in place */
+static void bdrv_tracked_write_sync(BlockDriverState *bs, int64_t sector_num,
+                                    int nb_sectors)
+{
+    while (bdrv_tracked_write_begin(bs, sector_num, nb_sectors)) {
+        qemu_aio_wait();
+    }
+}
+
+typedef struct BlockTrackedAIOCB {
+    BlockDriverAIOCB common;
+    BdrvTrackedRequest req;
+    QEMUIOVector *qiov;
+    BlockDriverAIOCB *aiocb; /* set once submitted */
+} BlockTrackedAIOCB;
+
+static void bdrv_aio_cancel_tracked(BlockDriverAIOCB *blockacb)
+{
+    BlockTrackedAIOCB *acb = (BlockTrackedAIOCB *)blockacb;
+
+    if (acb->aiocb) {
+        bdrv_aio_cancel(acb->aiocb);
+    }
+    QTAILQ_REMOVE(&acb->common.bs->tracked_reqs, &acb->req, entry);
+    qemu_aio_release(acb);
+}
+
+static AIOPool bdrv_tracked_aio_pool = {
+    .aiocb_size         = sizeof(BlockTrackedAIOCB),
+    .cancel             = bdrv_aio_cancel_tracked,
+};
+
+static void bdrv_tracked_write_cb(void *opaque, int ret)
+{
+    BlockTrackedAIOCB *acb = opaque;
+
+    QTAILQ_REMOVE(&acb->common.bs->tracked_reqs, &acb->req, entry);
+    acb->common.cb(acb->common.opaque, ret);
+    qemu_aio_release(acb);
+}
+
+static int bdrv_tracked_write_submit(BlockTrackedAIOCB *acb)
+{
+    acb->req.state = BDRV_TRACKED_WRITE;
+    acb->aiocb = bdrv_aio_dispatch(acb->common.bs, acb->req.sector_num,
+                                   acb->qiov, acb->req.nb_sectors,
+                                   bdrv_tracked_write_cb, acb, 1);
+
+    return acb->aiocb ? 0 : -EIO;
+}
+
+static BlockDriverAIOCB *bdrv_aio_writev_tracked(BlockDriverState *bs,
+        int64_t sector_num, QEMUIOVector *qiov, int nb_sectors,
+        BlockDriverCompletionFunc *cb, void *opaque)
+{
+    BlockTrackedAIOCB *acb;
+
+    acb = qemu_aio_get(&bdrv_tracked_aio_pool, bs, cb, opaque);
+    acb->req.sector_num = sector_num;
+    acb->req.nb_sectors = nb_sectors;
+    acb->req.skip_write_back = 0;
+    acb->qiov = qiov;
+    acb->aiocb = NULL;
+
+    if (bdrv_tracked_write_begin(bs, sector_num, nb_sectors)) {
+        acb->req.state = BDRV_TRACKED_WRITE_QUEUED;
+        QTAILQ_INSERT_TAIL(&bs->tracked_reqs, &acb->req, entry);
+        return &acb->common;
+    }
+
+    QTAILQ_INSERT_TAIL(&bs->tracked_reqs, &acb->req, entry);
+    if (bdrv_tracked_write_submit(acb) < 0) {
+        QTAILQ_REMOVE(&bs->tracked_reqs, &acb->req, entry);
+        qemu_aio_release(acb);
+        return NULL;
+    }
+
+    return &acb->common;
+}
+
+/* Submit the queued guest writes that don't need to wait any more */
+static void bdrv_tracked_kick(BlockDriverState *bs)
+{
+    BdrvTrackedRequest *req, *next;
+    BlockTrackedAIOCB *acb;
+
+    QTAILQ_FOREACH_SAFE(req, &bs->tracked_reqs, entry, next) {
+        if (req->state != BDRV_TRACKED_WRITE_QUEUED ||
+            bdrv_tracked_write_begin(bs, req->sector_num, req->nb_sectors)) {
+            continue;
+        }
+
+        acb = container_of(req, BlockTrackedAIOCB, req);
+        if (bdrv_tracked_write_submit(acb) < 0) {
+            QTAILQ_REMOVE(&bs->tracked_reqs, req, entry);
+            acb->common.cb(acb->common.opaque, -EIO);
+            qemu_aio_release(acb);
+        }
+    }
+}
+
+/*
+ * A copy-on-read request reads into a bounce buffer and writes back from
+ * there. Guest reads complete as soon as the data has been read, streaming
+ * requests only once it has been written back; they fail with -EAGAIN if
+ * the write-back had to be skipped.
+ */
+typedef struct BlockCORAIOCB {
+    BlockDriverAIOCB common;
+    BdrvTrackedRequest req;
+    QEMUIOVector *qiov; /* NULL for streaming */
+    uint8_t *bounce;
+    struct iovec iov;
+    QEMUIOVector bounce_qiov;
+    BlockDriverAIOCB *aiocb;
+    int completed;
+    int cancelled;
+} BlockCORAIOCB;
+
+static void bdrv_aio_cancel_cor(BlockDriverAIOCB *blockacb)
+{
+    BlockCORAIOCB *acb = (BlockCORAIOCB *)blockacb;
+
+    if (acb->req.state == BDRV_TRACKED_COR_READ) {
+        bdrv_aio_cancel(acb->aiocb);
+        QTAILQ_REMOVE(&acb->common.bs->tracked_reqs, &acb->req, entry);
+        qemu_vfree(acb->bounce);
+    } else {
+        /* A write-back that has been submitted can't be taken back */
+        acb->cancelled = 1;
+        while (acb->aiocb) {
+            qemu_aio_wait();
+        }
+    }
+    qemu_aio_release(acb);
+}
+
+static AIOPool bdrv_cor_aio_pool = {
+    .aiocb_size         = sizeof(BlockCORAIOCB),
+    .cancel             = bdrv_aio_cancel_cor,
+};
+
+static void bdrv_cor_finish(BlockCORAIOCB *acb, int ret)
+{
+    BlockDriverState *bs = acb->common.bs;
+
+    QTAILQ_REMOVE(&bs->tracked_reqs, &acb->req, entry);
+    qemu_vfree(acb->bounce);
+    if (acb->req.state == BDRV_TRACKED_COR_WRITE) {
+        bdrv_tracked_kick(bs);
+    }
+
+    if (acb->cancelled) {
+        /* bdrv_aio_cancel_cor() releases it */
+        return;
+    }
+    if (!acb->completed) {
+        acb->common.cb(acb->common.opaque, ret);
+    }
+    qemu_aio_release(acb);
+}
+
+static void bdrv_cor_write_cb(void *opaque, int ret)
+{
+    BlockCORAIOCB *acb = opaque;
+
+    acb->aiocb = NULL;
+    bdrv_cor_finish(acb, ret);
+}
+
+static void bdrv_cor_read_cb(void *opaque, int ret)
+{
+    BlockCORAIOCB *acb = opaque;
+    BlockDriverState *bs = acb->common.bs;
+    int64_t sector_num, end, first = -1, last = -1;
+    int n;
+
+    acb->aiocb = NULL;
+    if (acb->qiov) {
+        if (ret == 0) {
+            qemu_iovec_from_buffer(acb->qiov, acb->bounce, acb->qiov->size);
+        }
+        acb->completed = 1;
+        acb->common.cb(acb->common.opaque, ret);
+    }
+    if (ret < 0) {
+        bdrv_cor_finish(acb, ret);
+        return;
+    }
+
+    /* Write back the range that is still unallocated */
+    if (!acb->req.skip_write_back) {
+        end = acb->req.sector_num + acb->req.nb_sectors;
+        for (sector_num = acb->req.sector_num; sector_num < end;
+             sector_num += n) {
+            if (!bdrv_is_allocated(bs, sector_num, end - sector_num, &n)) {
+                if (first < 0) {
+                    first = sector_num;
+                }
+                last = sector_num + n;
+            }
+            if (n <= 0) {
+                break;
+            }
+        }
+    }
+
+    if (first < 0) {
+        bdrv_cor_finish(acb, acb->req.skip_write_back ? -EAGAIN : 0);
+        return;
+    }
+
+    acb->req.state = BDRV_TRACKED_COR_WRITE;
+    acb->iov.iov_base = acb->bounce +
+                        (first - acb->req.sector_num) * BDRV_SECTOR_SIZE;
+    acb->iov.iov_len = (last - first) * BDRV_SECTOR_SIZE;
+    qemu_iovec_init_external(&acb->bounce_qiov, &acb->iov, 1);
+    acb->aiocb = bdrv_aio_submit(bs, first, &acb->bounce_qiov, last - first,
+                                 bdrv_cor_write_cb, acb, 1);
+    if (acb->aiocb == NULL) {
+        bdrv_cor_finish(acb, -EIO);
+    }
+}
+
+static BlockDriverAIOCB *bdrv_aio_cor(BlockDriverState *bs,
+        int64_t sector_num, QEMUIOVector *qiov, int nb_sectors,
+        BlockDriverCompletionFunc *cb, void *opaque)
+{
+    BlockCORAIOCB *acb;
+    BdrvTrackedRequest *req;
+
+    acb = qemu_aio_get(&bdrv_cor_aio_pool, bs, cb, opaque);
+    acb->req.sector_num = sector_num;
+    acb->req.nb_sectors = nb_sectors;
+    acb->req.state = BDRV_TRACKED_COR_READ;
+    acb->req.skip_write_back = 0;
+    QTAILQ_FOREACH(req, &bs->tracked_reqs, entry) {
+        if (bdrv_tracked_overlaps(req, sector_num, nb_sectors)) {
+            acb->req.skip_write_back = 1;
+        }
+    }
+
+    acb->qiov = qiov;
+    acb->bounce = qemu_blockalign(bs, nb_sectors * BDRV_SECTOR_SIZE);
+    acb->iov.iov_base = acb->bounce;
+    acb->iov.iov_len = nb_sectors * BDRV_SECTOR_SIZE;
+    qemu_iovec_init_external(&acb->bounce_qiov, &acb->iov, 1);
+    acb->completed = 0;
+    acb->cancelled = 0;
+    QTAILQ_INSERT_TAIL(&bs->tracked_reqs, &acb->req, entry);
+
+    /* Streaming has its own rate limit and isn't throttled */
+    if (qiov) {
+        acb->aiocb = bdrv_aio_dispatch(bs, sector_num, &acb->bounce_qiov,
+                                       nb_sectors, bdrv_cor_read_cb, acb, 0);
+    } else {
+        acb->aiocb = bdrv_aio_submit(bs, sector_num, &acb->bounce_qiov,
+                                     nb_sectors, bdrv_cor_read_cb, acb, 0);
+    }
+    if (acb->aiocb == NULL) {
+        QTAILQ_REMOVE(&bs->tracked_reqs, &acb->req, entry);
+        qemu_vfree(acb->bounce);
+        qemu_aio_release(acb);
+        return NULL;
+    }
+
+    return &acb->common;
+}
+
+/* Returns 1 if a read of the given sectors should copy them into the image */
+static int bdrv_cor_needed(BlockDriverState *bs, int64_t sector_num,
+                           int nb_sectors)
+{
+    int n;
+
+    if (!bs->copy_on_read || !bs->backing_hd || bs->read_only) {
+        return 0;
+    }
+
+    while (nb_sectors > 0) {
+        if (!bdrv_is_allocated(bs, sector_num, nb_sectors, &n)) {
+            return 1;
+        }
+        if (n <= 0) {
+            break;
+        }
+        sector_num += n;
+        nb_sectors -= n;
+    }
+
+    return 0;
+}
+
+/*
+ * Enable copy-on-read for an image. Calls nest: copy-on-read stays enabled
+ * until bdrv_disable_copy_on_read() has been called as often.
+ */
+void bdrv_enable_copy_on_read(BlockDriverState *bs)
+{
+    bs->copy_on_read++;
+}
+
+void bdrv_disable_copy_on_read(BlockDriverState *bs)
+{
+    assert(bs->copy_on_read > 0);
+    bs->copy_on_read--;
+}
+
+#define STREAM_CHUNK_SECTORS    1024    /* 512 KB per request */
+#define STREAM_SCAN_CHUNKS      64      /* chunks looked at per iteration */
+#define STREAM_RETRY_MS         10
+
+/*
+ * An image streaming job copies one unallocated range at a time with a
+ * copy-on-read request, paced by a timer so that the average rate stays
+ * below the speed limit. Once every sector is allocated, the backing file
+ * is dropped.
+ */
+typedef struct BlockStreamJob {
+    BlockDriverState *bs;
+    int64_t sector_num; /* everything before has been copied */
+    int64_t end;
+    int nb_sectors;     /* size of the request in flight */
+    int64_t speed;      /* bytes per second, 0 is unlimited */
+    int64_t next_ns;    /* earliest start of the next request */
+    QEMUTimer *timer;
+    BlockDriverAIOCB *aiocb;
+} BlockStreamJob;
+
+static void bdrv_stream_end(BlockStreamJob *job)
+{
+    job->bs->stream_job = NULL;
+    bdrv_disable_copy_on_read(job->bs);
+    qemu_del_timer(job->timer);
+    qemu_free_timer(job->timer);
+    qemu_free(job);
+}
+
+static void bdrv_stream_complete(BlockStreamJob *job, int ret)
+{
+    BlockDriverState *bs = job->bs;
+    QObject *data;
+
+    if (ret == 0) {
+        /*
+         * Requests in flight may still be reading from the backing file.
+         * bs->in_flight misses throttled requests and those of unnamed
+         * devices, so wait for all AIO, submitting throttled requests, too.
+         */
+        qemu_aio_flush();
+        ret = bdrv_change_backing_file(bs, NULL, NULL);
+        if (ret == 0) {
+            bdrv_delete(bs->backing_hd);
+            bs->backing_hd = NULL;
+            bs->backing_file[0] = '\0';
+            bs->backing_format[0] = '\0';
+        }
+    }
+
+    data = qobject_from_jsonf("{ 'device': %s, 'len': %" PRId64 ", "
+                              "'offset': %" PRId64 ", 'speed': %" PRId64 " }",
+                              bs->device_name,
+                              job->end * BDRV_SECTOR_SIZE,
+                              job->sector_num * BDRV_SECTOR_SIZE,
+                              job->speed);
+    if (ret < 0) {
+        qdict_put(qobject_to_qdict(data), "error",
+                  qstring_from_str(strerror(-ret)));
+    }
+    monitor_protocol_event(QEVENT_BLOCK_STREAM_COMPLETED, data);
+    qobject_decref(data);
+
+    bdrv_stream_end(job);
+}
+
+static void bdrv_stream_cb(void *opaque, int ret)
+{
+    BlockStreamJob *job = opaque;
+    int64_t now = qemu_get_clock(rt_clock);
+
+    job->aiocb = NULL;
+    if (ret == -EAGAIN) {
+        /* a guest write got in the way, look at these sectors again */
+        qemu_mod_timer(job->timer, now + STREAM_RETRY_MS);
+        return;
+    }
+    if (ret < 0) {
+        bdrv_stream_complete(job, ret);
+        return;
+    }
+
+    job->sector_num += job->nb_sectors;
+    qemu_mod_timer(job->timer, now);
+}
+
+static void bdrv_stream_run(void *opaque)
+{
+    BlockStreamJob *job = opaque;
+    BlockDriverState *bs = job->bs;
+    int64_t now;
+    int i, n = 0;
+
+    /* Skip what is allocated already, but don't hog the main loop */
+    for (i = 0; i < STREAM_SCAN_CHUNKS; i++) {
+        if (job->sector_num >= job->end) {
+            bdrv_stream_complete(job, 0);
+            return;
+        }
+        n = MIN(job->end - job->sector_num, STREAM_CHUNK_SECTORS);
+        if (!bdrv_is_allocated(bs, job->sector_num, n, &n)) {
+            break;
+        }
+        job->sector_num += n;
+    }
+    if (i == STREAM_SCAN_CHUNKS) {
+        qemu_mod_timer(job->timer, qemu_get_clock(rt_clock));
+        return;
+    }
+
+    if (job->speed) {
+        now = qemu_get_clock_ns(rt_clock);
+        if (now < job->next_ns) {
+            qemu_mod_timer(job->timer,
+                           (job->next_ns + 999999) / 1000000);
+            return;
+        }
+        job->next_ns = MAX(job->next_ns, now) +
+                       (int64_t)n * BDRV_SECTOR_SIZE * 1000000000LL /
+                       job->speed;
+    }
+
+    job->nb_sectors = n;
+    job->aiocb = bdrv_aio_cor(bs, job->sector_num, NULL, n,
+                              bdrv_stream_cb, job);
+    if (job->aiocb == NULL) {
+        bdrv_stream_complete(job, -EIO);
+    }
+}
+
+/*
+ * Start copying the data an image takes from its backing file into the
+ * image, with at most speed bytes per second (0 for no limit). Reads are
+ * copy-on-read while the job runs. When it is done, the image doesn't
+ * depend on its backing file any more and the backing file is dropped.
+ */
+int bdrv_stream_start(BlockDriverState *bs, int64_t speed)
+{
+    BlockDriver *drv = bs->drv;
+    BlockStreamJob *job;
+
+    if (!drv) {
+        return -ENOMEDIUM;
+    }
+    if (bs->stream_job) {
+        return -EBUSY;
+    }
+    if (bs->read_only) {
+        return -EACCES;
+    }
+    if (!bs->backing_hd || !drv->bdrv_is_allocated ||
+        !drv->bdrv_change_backing_file) {
+        return -ENOTSUP;
+    }
+    if (speed < 0) {
+        return -EINVAL;
+    }
+
+    job = qemu_mallocz(sizeof(*job));
+    job->bs = bs;
+    job->end = bs->total_sectors;
+    job->speed = speed;
+    job->timer = qemu_new_timer(rt_clock, bdrv_stream_run, job);
+    bs->stream_job = job;
+    bdrv_enable_copy_on_read(bs);
+
+    qemu_mod_timer(job->timer, qemu_get_clock(rt_clock));
+
+    return 0;
+}
+
+int bdrv_stream_set_speed(BlockDriverState *bs, int64_t speed)
+{
+    BlockStreamJob *job = bs->stream_job;
+
+    if (!job) {
+        return -ENOENT;
+    }
+    if (speed < 0) {
+        return -EINVAL;
+    }
+
+    job->speed = speed;
+    job->next_ns = 0;
+    if (!job->aiocb) {
+        qemu_mod_timer(job->timer, qemu_get_clock(rt_clock));
+    }
+
+    return 0;
+}
+
+/* Stop a streaming job, the image keeps its backing file */
+int bdrv_stream_cancel(BlockDriverState *bs)
+{
+    BlockStreamJob *job = bs->stream_job;
+
+    if (!job) {
+        return -ENOENT;
+    }
+
+    if (job->aiocb) {
+        bdrv_aio_cancel(job->aiocb);
+    }
+    bdrv_stream_end(job);
+
+    return 0;
+}
+
+static void bdrv_block_jobs_iter(QObject *data, void *opaque)
+{
+    QDict *qdict = qobject_to_qdict(data);
+    Monitor *mon = opaque;
+
+    monitor_printf(mon, "Streaming device %s: Completed %" PRId64
+                        " of %" PRId64 " bytes, speed limit %" PRId64
+                        " bytes/s\n",
+                   qdict_get_str(qdict, "device"),
+                   qdict_get_int(qdict, "offset"),
+                   qdict_get_int(qdict, "len"),
+                   qdict_get_int(qdict, "speed"));
+}
+
+void bdrv_block_jobs_print(Monitor *mon, const QObject *data)
+{
+    QList *list = qobject_to_qlist(data);
+
+    if (qlist_empty(list)) {
+        monitor_printf(mon, "No active jobs\n");
+        return;
+    }
+
+    qlist_iter(list, bdrv_block_jobs_iter, mon);
+}
+
+/**
+ * bdrv_info_block_jobs(): show the running block jobs
+ *
+ * Each job is represented by a QDict, the returned QObject is a QList of
+ * all jobs.
+ *
+ * The QDict contains the following:
+ *
+ * - "type": job type, currently always "stream"
+ * - "device": device name
+ * - "len": number of bytes to copy
+ * - "offset": number of bytes up to which the image has been copied
+ * - "speed": speed limit in bytes per second, 0 if unlimited
+ *
+ * Example:
+ *
+ * [ { "type": "stream", "device": "virtio0", "len": 10737418240,
+ *     "offset": 134217728, "speed": 0 } ]
+ */
+void bdrv_info_block_jobs(Monitor *mon, QObject **ret_data)
+{
+    QList *list = qlist_new();
+    BlockDriverState *bs;
+    BlockStreamJob *job;
+    QObject *obj;
+
+    for (bs = bdrv_first; bs != NULL; bs = bs->next) {
+        job = bs->stream_job;
+        if (!job) {
+            continue;
+        }
+        obj = qobject_from_jsonf("{ 'type': 'stream', 'device': %s, "
+                                 "'len': %" PRId64 ", 'offset': %" PRId64 ", "
+                                 "'speed': %" PRId64 " }",
+                                 bs->device_name,
+                                 job->end * BDRV_SECTOR_SIZE,
+                                 job->sector_num * BDRV_SECTOR_SIZE,
+                                 job->speed);
+        qlist_append_obj(list, obj);
+    }
+
+    *ret_data = QOBJECT(list);
+}
+
 
 /**************************************************************/
 /* async block device emulation */
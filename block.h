@@ -16,6 +16,16 @@ typedef struct BlockDriverInfo {
     int64_t vm_state_offset;
 } BlockDriverInfo;
 
+typedef struct BdrvCheckResult {
+    int corruptions;    /* errors that may lose or corrupt data */
+    int leaks;          /* clusters that are allocated but unused */
+    int leaks_fixed;    /* leaks that were repaired */
+    int check_errors;   /* the check itself failed, e.g. on I/O errors */
+} BdrvCheckResult;
+
+/* bdrv_check fix flags */
+#define BDRV_FIX_LEAKS  0x0001
+
 typedef struct QEMUSnapshotInfo {
     char id_str[128]; /* unique snapshot id */
     /* the following fields are informative. They are not needed for
@@ -37,6 +47,8 @@ typedef struct QEMUSnapshotInfo {
 #define BDRV_O_CACHE_WB    0x0040 /* use write-back caching */
 #define BDRV_O_NATIVE_AIO  0x0080 /* use native AIO instead of the thread pool */
 #define BDRV_O_NO_BACKING  0x0100 /* don't open the backing file */
+#define BDRV_O_MMAP        0x0200 /* read read-only image files through
+                                     a shared mapping */
 
 #define BDRV_O_CACHE_MASK  (BDRV_O_NOCACHE | BDRV_O_CACHE_WB)
 
@@ -48,12 +60,34 @@ typedef enum {
     BDRV_ACTION_REPORT, BDRV_ACTION_IGNORE, BDRV_ACTION_STOP
 } BlockMonEventAction;
 
+enum {
+    BLOCK_IO_LIMIT_READ,
+    BLOCK_IO_LIMIT_WRITE,
+    BLOCK_IO_LIMIT_TOTAL,
+    BLOCK_IO_LIMIT_MAX,
+};
+
+/* I/O throttling limits, 0 means unlimited */
+typedef struct BlockIOLimit {
+    int64_t bps[BLOCK_IO_LIMIT_MAX];  /* bytes per second */
+    int64_t iops[BLOCK_IO_LIMIT_MAX]; /* operations per second */
+    int64_t bps_max;  /* burst size in bytes, 0 for 1/10 s worth of bps */
+    int64_t iops_max; /* burst size in operations, 0 for 1/10 s worth */
+} BlockIOLimit;
+
 void bdrv_mon_event(const BlockDriverState *bdrv,
                     BlockMonEventAction action, int is_read);
 void bdrv_info_print(Monitor *mon, const QObject *data);
 void bdrv_info(Monitor *mon, QObject **ret_data);
 void bdrv_stats_print(Monitor *mon, const QObject *data);
 void bdrv_info_stats(Monitor *mon, QObject **ret_data);
+void bdrv_block_jobs_print(Monitor *mon, const QObject *data);
+void bdrv_info_block_jobs(Monitor *mon, QObject **ret_data);
+
+/* posix-aio-compat.c */
+int paio_set_threads(int min, int max, int idle);
+void paio_info_print(Monitor *mon, const QObject *data);
+void paio_info(Monitor *mon, QObject **ret_data);
 
 void bdrv_init(void);
 void bdrv_init_with_whitelist(void);
@@ -72,11 +106,14 @@ int bdrv_open(BlockDriverState *bs, const char *filename, int flags);
 int bdrv_open2(BlockDriverState *bs, const char *filename, int flags,
                BlockDriver *drv);
 void bdrv_close(BlockDriverState *bs);
-int bdrv_check(BlockDriverState *bs);
+int bdrv_check(BlockDriverState *bs, BdrvCheckResult *res, int fix);
 int bdrv_read(BlockDriverState *bs, int64_t sector_num,
               uint8_t *buf, int nb_sectors);
 int bdrv_write(BlockDriverState *bs, int64_t sector_num,
                const uint8_t *buf, int nb_sectors);
+int bdrv_write_zeroes(BlockDriverState *bs, int64_t sector_num,
+                      int nb_sectors);
+int bdrv_discard(BlockDriverState *bs, int64_t sector_num, int nb_sectors);
 int bdrv_pread(BlockDriverState *bs, int64_t offset,
                void *buf, int count);
 int bdrv_pwrite(BlockDriverState *bs, int64_t offset,
@@ -104,6 +141,8 @@ BlockDriverAIOCB *bdrv_aio_writev(BlockDriverState *bs, int64_t sector_num,
 BlockDriverAIOCB *bdrv_aio_flush(BlockDriverState *bs,
 				 BlockDriverCompletionFunc *cb, void *opaque);
 void bdrv_aio_cancel(BlockDriverAIOCB *acb);
+void bdrv_io_plug(BlockDriverState *bs);
+void bdrv_io_unplug(BlockDriverState *bs);
 
 typedef struct BlockRequest {
     /* Fields to be filled by multiwrite caller */
@@ -145,6 +184,13 @@ int bdrv_is_allocated(BlockDriverState *bs, int64_t sector_num, int nb_sectors,
 void bdrv_set_geometry_hint(BlockDriverState *bs,
                             int cyls, int heads, int secs);
 void bdrv_set_type_hint(BlockDriverState *bs, int type);
+void bdrv_set_io_limits(BlockDriverState *bs, const BlockIOLimit *io_limits);
+int bdrv_io_limits_flush_all(void);
+void bdrv_enable_copy_on_read(BlockDriverState *bs);
+void bdrv_disable_copy_on_read(BlockDriverState *bs);
+int bdrv_stream_start(BlockDriverState *bs, int64_t speed);
+int bdrv_stream_set_speed(BlockDriverState *bs, int64_t speed);
+int bdrv_stream_cancel(BlockDriverState *bs);
 void bdrv_set_translation_hint(BlockDriverState *bs, int translation);
 void bdrv_get_geometry_hint(BlockDriverState *bs,
                             int *pcyls, int *pheads, int *psecs);
@@ -35,32 +35,54 @@
 #endif
 
 #define CURL_NUM_STATES 8
-#define CURL_NUM_ACB    8
 #define SECTOR_SIZE     512
-#define READ_AHEAD_SIZE (256 * 1024)
+#define READ_AHEAD_SIZE (1024 * 1024)
+#define CACHE_SIZE      (16 * 1024 * 1024)
 
-#define FIND_RET_NONE   0
-#define FIND_RET_OK     1
-#define FIND_RET_WAIT   2
+/*
+ * Data is fetched and cached in blocks of CURL_BLOCK_SIZE bytes. Runs of
+ * missing blocks are fetched with range requests of up to
+ * CURL_FETCH_BLOCKS blocks, several of them in parallel.
+ */
+#define CURL_BLOCK_BITS     16
+#define CURL_BLOCK_SIZE     (1 << CURL_BLOCK_BITS)
+#define CURL_FETCH_BLOCKS   16
+#define CURL_HASH_SIZE      256
+
+/* Transfers that read-ahead leaves free for guest requests */
+#define CURL_RESERVED_STATES    2
 
 struct BDRVCURLState;
 
+typedef struct CURLBlock {
+    size_t offset;
+    size_t len;
+    int valid;
+    char *buf;
+    QLIST_ENTRY(CURLBlock) hash_entry;
+    QTAILQ_ENTRY(CURLBlock) lru_entry;  /* valid blocks */
+    QTAILQ_ENTRY(CURLBlock) done_entry; /* just fetched */
+} CURLBlock;
+
 typedef struct CURLAIOCB {
     BlockDriverAIOCB common;
     QEMUIOVector *qiov;
     size_t start;
     size_t end;
+    size_t remaining;       /* bytes not copied yet */
+    unsigned long *copied;  /* blocks copied, relative to start */
+    int ret;
+    QLIST_ENTRY(CURLAIOCB) entry;
 } CURLAIOCB;
 
 typedef struct CURLState
 {
     struct BDRVCURLState *s;
-    CURLAIOCB *acb[CURL_NUM_ACB];
     CURL *curl;
-    char *orig_buf;
-    size_t buf_start;
+    CURLBlock *blocks[CURL_FETCH_BLOCKS];
+    int nb_blocks;
+    int cur_block;
     size_t buf_off;
-    size_t buf_len;
     char range[128];
     char errmsg[CURL_ERROR_SIZE];
     char in_use;
@@ -72,25 +94,45 @@ typedef struct BDRVCURLState {
     CURLState states[CURL_NUM_STATES];
     char *url;
     size_t readahead_size;
+    size_t cache_size;
+    size_t nb_blocks;
+    QLIST_HEAD(, CURLBlock) hash[CURL_HASH_SIZE];
+    QTAILQ_HEAD(, CURLBlock) lru;
+    QTAILQ_HEAD(, CURLBlock) done_blocks;
+    QLIST_HEAD(, CURLAIOCB) acbs;
+    QEMUBH *bh;
+    int started;
+    size_t seq_end;         /* end of the previous read */
+    size_t ra_window;       /* current read-ahead */
+    size_t ra_end;          /* end of the last read-ahead issued */
 } BDRVCURLState;
 
 static void curl_clean_state(CURLState *s);
 static void curl_multi_do(void *arg);
 
+static int curl_aio_flush(void *opaque)
+{
+    BDRVCURLState *s = opaque;
+
+    return !QLIST_EMPTY(&s->acbs);
+}
+
 static int curl_sock_cb(CURL *curl, curl_socket_t fd, int action,
                         void *s, void *sp)
 {
     DPRINTF("CURL (AIO): Sock action %d on fd %d\n", action, fd);
     switch (action) {
         case CURL_POLL_IN:
-            qemu_aio_set_fd_handler(fd, curl_multi_do, NULL, NULL, NULL, s);
+            qemu_aio_set_fd_handler(fd, curl_multi_do, NULL, curl_aio_flush,
+                                    NULL, s);
             break;
         case CURL_POLL_OUT:
-            qemu_aio_set_fd_handler(fd, NULL, curl_multi_do, NULL, NULL, s);
+            qemu_aio_set_fd_handler(fd, NULL, curl_multi_do, curl_aio_flush,
+                                    NULL, s);
             break;
         case CURL_POLL_INOUT:
-            qemu_aio_set_fd_handler(fd, curl_multi_do,
-                                    curl_multi_do, NULL, NULL, s);
+            qemu_aio_set_fd_handler(fd, curl_multi_do, curl_multi_do,
+                                    curl_aio_flush, NULL, s);
             break;
         case CURL_POLL_REMOVE:
             qemu_aio_set_fd_handler(fd, NULL, NULL, NULL, NULL, NULL);
@@ -112,154 +154,188 @@ static size_t curl_size_cb(void *ptr, size_t size, size_t nmemb, void *opaque)
     return realsize;
 }
 
+/*
+ * Fetched blocks are only queued here, they are handed out to the waiting
+ * requests from curl_multi_do() once libcurl has returned.
+ */
 static size_t curl_read_cb(void *ptr, size_t size, size_t nmemb, void *opaque)
 {
     CURLState *s = ((CURLState*)opaque);
     size_t realsize = size * nmemb;
-    int i;
+    size_t done = 0, n;
+    CURLBlock *block;
 
     DPRINTF("CURL: Just reading %lld bytes\n", (unsigned long long)realsize);
 
-    if (!s || !s->orig_buf)
-        goto read_end;
-
-    memcpy(s->orig_buf + s->buf_off, ptr, realsize);
-    s->buf_off += realsize;
-
-    for(i=0; i<CURL_NUM_ACB; i++) {
-        CURLAIOCB *acb = s->acb[i];
-
-        if (!acb)
-            continue;
-
-        if ((s->buf_off >= acb->end)) {
-            qemu_iovec_from_buffer(acb->qiov, s->orig_buf + acb->start,
-                                   acb->end - acb->start);
-            acb->common.cb(acb->common.opaque, 0);
-            qemu_aio_release(acb);
-            s->acb[i] = NULL;
+    while (done < realsize) {
+        if (s->cur_block >= s->nb_blocks) {
+            /* More data than requested, the server ignored the range */
+            return 0;
+        }
+        block = s->blocks[s->cur_block];
+        n = MIN(block->len - s->buf_off, realsize - done);
+        memcpy(block->buf + s->buf_off, (char *)ptr + done, n);
+        s->buf_off += n;
+        done += n;
+
+        if (s->buf_off == block->len) {
+            s->blocks[s->cur_block++] = NULL;
+            s->buf_off = 0;
+            QTAILQ_INSERT_TAIL(&s->s->done_blocks, block, done_entry);
         }
     }
 
-read_end:
     return realsize;
 }
 
-static int curl_find_buf(BDRVCURLState *s, size_t start, size_t len,
-                         CURLAIOCB *acb)
+#define CURL_BITS_PER_LONG  (sizeof(unsigned long) * 8)
+
+static int curl_test_copied(CURLAIOCB *acb, size_t idx)
 {
-    int i;
-    size_t end = start + len;
+    return (acb->copied[idx / CURL_BITS_PER_LONG] >>
+            (idx % CURL_BITS_PER_LONG)) & 1;
+}
 
-    for (i=0; i<CURL_NUM_STATES; i++) {
-        CURLState *state = &s->states[i];
-        size_t buf_end = (state->buf_start + state->buf_off);
-        size_t buf_fend = (state->buf_start + state->buf_len);
+static void curl_set_copied(CURLAIOCB *acb, size_t idx)
+{
+    acb->copied[idx / CURL_BITS_PER_LONG] |= 1UL << (idx % CURL_BITS_PER_LONG);
+}
 
-        if (!state->orig_buf)
-            continue;
-        if (!state->buf_off)
-            continue;
+/* Copy len bytes into the request's buffer at offset, or zero them */
+static void curl_copy_to_qiov(QEMUIOVector *qiov, size_t offset,
+                              const char *buf, size_t len)
+{
+    size_t n;
+    int i;
 
-        // Does the existing buffer cover our section?
-        if ((start >= state->buf_start) &&
-            (start <= buf_end) &&
-            (end >= state->buf_start) &&
-            (end <= buf_end))
-        {
-            char *buf = state->orig_buf + (start - state->buf_start);
+    for (i = 0; i < qiov->niov && len > 0; i++) {
+        if (offset >= qiov->iov[i].iov_len) {
+            offset -= qiov->iov[i].iov_len;
+            continue;
+        }
+        n = MIN(qiov->iov[i].iov_len - offset, len);
+        if (buf) {
+            memcpy((char *)qiov->iov[i].iov_base + offset, buf, n);
+            buf += n;
+        } else {
+            memset((char *)qiov->iov[i].iov_base + offset, 0, n);
+        }
+        len -= n;
+        offset = 0;
+    }
+}
 
-            qemu_iovec_from_buffer(acb->qiov, buf, len);
-            acb->common.cb(acb->common.opaque, 0);
+static CURLBlock *curl_find_block(BDRVCURLState *s, size_t offset)
+{
+    CURLBlock *block;
 
-            return FIND_RET_OK;
+    QLIST_FOREACH(block, &s->hash[(offset >> CURL_BLOCK_BITS) % CURL_HASH_SIZE],
+                  hash_entry) {
+        if (block->offset == offset) {
+            return block;
         }
+    }
 
-        // Wait for unfinished chunks
-        if ((start >= state->buf_start) &&
-            (start <= buf_fend) &&
-            (end >= state->buf_start) &&
-            (end <= buf_fend))
-        {
-            int j;
-
-            acb->start = start - state->buf_start;
-            acb->end = acb->start + len;
-
-            for (j=0; j<CURL_NUM_ACB; j++) {
-                if (!state->acb[j]) {
-                    state->acb[j] = acb;
-                    return FIND_RET_WAIT;
-                }
-            }
-        }
+    return NULL;
+}
+
+static void curl_free_block(BDRVCURLState *s, CURLBlock *block)
+{
+    QLIST_REMOVE(block, hash_entry);
+    if (block->valid) {
+        QTAILQ_REMOVE(&s->lru, block, lru_entry);
+    }
+    qemu_free(block->buf);
+    qemu_free(block);
+    s->nb_blocks--;
+}
+
+/*
+ * Set up a block for fetching. Once the cache is full, the least recently
+ * used block is recycled; only if all blocks are being fetched does the
+ * cache grow beyond its size for a while.
+ */
+static CURLBlock *curl_alloc_block(BDRVCURLState *s, size_t offset)
+{
+    CURLBlock *block = QTAILQ_FIRST(&s->lru);
+
+    if (block && s->nb_blocks >= s->cache_size >> CURL_BLOCK_BITS) {
+        QLIST_REMOVE(block, hash_entry);
+        QTAILQ_REMOVE(&s->lru, block, lru_entry);
+    } else {
+        block = qemu_mallocz(sizeof(*block));
+        block->buf = qemu_malloc(CURL_BLOCK_SIZE);
+        s->nb_blocks++;
     }
 
-    return FIND_RET_NONE;
+    block->offset = offset;
+    block->len = MIN(CURL_BLOCK_SIZE, s->len - offset);
+    block->valid = 0;
+    QLIST_INSERT_HEAD(&s->hash[(offset >> CURL_BLOCK_BITS) % CURL_HASH_SIZE],
+                      block, hash_entry);
+
+    return block;
 }
 
-static void curl_multi_do(void *arg)
+/* Copy the part of a valid block that a request needs */
+static void curl_copy_block(CURLAIOCB *acb, CURLBlock *block, int ret)
 {
-    BDRVCURLState *s = (BDRVCURLState *)arg;
-    int running;
-    int r;
-    int msgs_in_queue;
+    size_t first = acb->start & ~(size_t)(CURL_BLOCK_SIZE - 1);
+    size_t idx = (block->offset - first) >> CURL_BLOCK_BITS;
+    size_t start, end;
 
-    if (!s->multi)
+    if (block->offset >= acb->end || block->offset + block->len <= acb->start ||
+        curl_test_copied(acb, idx)) {
         return;
+    }
 
-    do {
-        r = curl_multi_socket_all(s->multi, &running);
-    } while(r == CURLM_CALL_MULTI_PERFORM);
+    start = MAX(acb->start, block->offset);
+    end = MIN(acb->end, block->offset + block->len);
+    if (ret == 0) {
+        curl_copy_to_qiov(acb->qiov, start - acb->start,
+                          block->buf + (start - block->offset), end - start);
+    } else {
+        acb->ret = ret;
+    }
+    curl_set_copied(acb, idx);
+    acb->remaining -= end - start;
+}
 
-    /* Try to find done transfers, so we can free the easy
-     * handle again. */
-    do {
-        CURLMsg *msg;
-        msg = curl_multi_info_read(s->multi, &msgs_in_queue);
+/* A block has been fetched, or fetching it failed */
+static void curl_block_done(BDRVCURLState *s, CURLBlock *block, int ret)
+{
+    CURLAIOCB *acb;
 
-        if (!msg)
-            break;
-        if (msg->msg == CURLMSG_NONE)
-            break;
+    QLIST_FOREACH(acb, &s->acbs, entry) {
+        curl_copy_block(acb, block, ret);
+    }
 
-        switch (msg->msg) {
-            case CURLMSG_DONE:
-            {
-                CURLState *state = NULL;
-                curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char**)&state);
-                curl_clean_state(state);
-                break;
-            }
-            default:
-                msgs_in_queue = 0;
-                break;
-        }
-    } while(msgs_in_queue);
+    if (ret < 0) {
+        curl_free_block(s, block);
+        return;
+    }
+
+    block->valid = 1;
+    QTAILQ_INSERT_TAIL(&s->lru, block, lru_entry);
+    while (s->nb_blocks > s->cache_size >> CURL_BLOCK_BITS &&
+           (block = QTAILQ_FIRST(&s->lru)) != NULL) {
+        curl_free_block(s, block);
+    }
 }
 
 static CURLState *curl_init_state(BDRVCURLState *s)
 {
     CURLState *state = NULL;
-    int i, j;
-
-    do {
-        for (i=0; i<CURL_NUM_STATES; i++) {
-            for (j=0; j<CURL_NUM_ACB; j++)
-                if (s->states[i].acb[j])
-                    continue;
-            if (s->states[i].in_use)
-                continue;
+    int i;
 
+    for (i = 0; i < CURL_NUM_STATES; i++) {
+        if (!s->states[i].in_use) {
             state = &s->states[i];
-            state->in_use = 1;
             break;
         }
-        if (!state) {
-            usleep(100);
-            curl_multi_do(s);
-        }
-    } while(!state);
+    }
+    if (!state)
+        return NULL;
 
     if (state->curl)
         goto has_curl;
@@ -283,6 +359,7 @@ static CURLState *curl_init_state(BDRVCURLState *s)
 
 has_curl:
 
+    state->in_use = 1;
     state->s = s;
 
     return state;
@@ -295,48 +372,224 @@ static void curl_clean_state(CURLState *s)
     s->in_use = 0;
 }
 
+static int curl_free_states(BDRVCURLState *s)
+{
+    int i, n = 0;
+
+    for (i = 0; i < CURL_NUM_STATES; i++) {
+        if (!s->states[i].in_use) {
+            n++;
+        }
+    }
+
+    return n;
+}
+
+/* Start a range request for nb_blocks blocks starting at offset */
+static int curl_fetch(BDRVCURLState *s, size_t offset, int nb_blocks)
+{
+    CURLState *state;
+    int i;
+
+    state = curl_init_state(s);
+    if (!state)
+        return -EBUSY;
+
+    for (i = 0; i < nb_blocks; i++) {
+        state->blocks[i] = curl_alloc_block(s, offset +
+                                            (size_t)i * CURL_BLOCK_SIZE);
+    }
+    state->nb_blocks = nb_blocks;
+    state->cur_block = 0;
+    state->buf_off = 0;
+
+    snprintf(state->range, 127, "%lld-%lld", (long long)offset,
+             (long long)(state->blocks[nb_blocks - 1]->offset +
+                         state->blocks[nb_blocks - 1]->len - 1));
+    DPRINTF("CURL (AIO): Fetching %s\n", state->range);
+    curl_easy_setopt(state->curl, CURLOPT_RANGE, state->range);
+
+    curl_multi_add_handle(s->multi, state->curl);
+    s->started = 1;
+
+    return 0;
+}
+
+/*
+ * Fetch the blocks in [start, end) that are neither cached nor being
+ * fetched, and that acb (if given) still needs, as long as more than
+ * reserved transfers are free.
+ */
+static void curl_fetch_missing(BDRVCURLState *s, size_t start, size_t end,
+                               CURLAIOCB *acb, int reserved)
+{
+    size_t first = start & ~(size_t)(CURL_BLOCK_SIZE - 1);
+    size_t offset, run_start = 0;
+    int run = 0, missing;
+
+    end = MIN(end, s->len);
+    for (offset = first; ; offset += CURL_BLOCK_SIZE) {
+        missing = offset < end && !curl_find_block(s, offset) &&
+                  (!acb || !curl_test_copied(acb, (offset - first) >>
+                                                  CURL_BLOCK_BITS));
+        if (missing && run < CURL_FETCH_BLOCKS) {
+            if (!run++) {
+                run_start = offset;
+            }
+            continue;
+        }
+
+        if (run) {
+            if (curl_free_states(s) <= reserved ||
+                curl_fetch(s, run_start, run) < 0) {
+                return;
+            }
+            run = 0;
+        }
+        if (missing) {
+            run_start = offset;
+            run = 1;
+        } else if (offset >= end) {
+            return;
+        }
+    }
+}
+
+static void curl_multi_do(void *arg)
+{
+    BDRVCURLState *s = (BDRVCURLState *)arg;
+    CURLAIOCB *acb, *next;
+    CURLBlock *block;
+    int running;
+    int r;
+    int msgs_in_queue;
+    int i;
+
+    if (!s->multi)
+        return;
+
+    do {
+        s->started = 0;
+
+        do {
+            r = curl_multi_socket_all(s->multi, &running);
+        } while(r == CURLM_CALL_MULTI_PERFORM);
+
+        while ((block = QTAILQ_FIRST(&s->done_blocks)) != NULL) {
+            QTAILQ_REMOVE(&s->done_blocks, block, done_entry);
+            curl_block_done(s, block, 0);
+        }
+
+        /* Try to find done transfers, so we can free the easy
+         * handle again. Blocks they didn't deliver have failed. */
+        do {
+            CURLMsg *msg;
+            msg = curl_multi_info_read(s->multi, &msgs_in_queue);
+
+            if (!msg)
+                break;
+            if (msg->msg == CURLMSG_NONE)
+                break;
+
+            switch (msg->msg) {
+                case CURLMSG_DONE:
+                {
+                    CURLState *state = NULL;
+                    curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char**)&state);
+                    if (msg->data.result != CURLE_OK) {
+                        DPRINTF("CURL: %s failed: %s\n", state->range,
+                                state->errmsg);
+                    }
+                    for (i = state->cur_block; i < state->nb_blocks; i++) {
+                        if (state->blocks[i]) {
+                            curl_block_done(s, state->blocks[i], -EIO);
+                            state->blocks[i] = NULL;
+                        }
+                    }
+                    curl_clean_state(state);
+                    break;
+                }
+                default:
+                    msgs_in_queue = 0;
+                    break;
+            }
+        } while(msgs_in_queue);
+
+        /* Transfers may have become free for blocks still missing */
+        QLIST_FOREACH(acb, &s->acbs, entry) {
+            if (acb->remaining) {
+                curl_fetch_missing(s, acb->start, acb->end, acb, 0);
+            }
+        }
+    } while (s->started);
+
+    QLIST_FOREACH_SAFE(acb, &s->acbs, entry, next) {
+        if (!acb->remaining) {
+            QLIST_REMOVE(acb, entry);
+            qemu_free(acb->copied);
+            acb->common.cb(acb->common.opaque, acb->ret);
+            qemu_aio_release(acb);
+        }
+    }
+}
+
+/* Parse trailing ":readahead=<bytes>:" and ":cache=<bytes>:" options */
+static void curl_parse_options(BDRVCURLState *s, char *file)
+{
+    char *end, *opt, *val;
+    unsigned long long n;
+    int parsed = 0;
+
+    /* Options are appended as :name=value: and may share their colons */
+    for (;;) {
+        end = file + strlen(file) - 1;
+        if (end <= file || *end != ':') {
+            break;
+        }
+        for (opt = end - 1; opt > file && *opt != ':'; opt--) {
+            /* find the start of the option */
+        }
+        val = strchr(opt, '=');
+        if (opt == file || !val || val > end) {
+            break;
+        }
+        if (val + 1 == end || !qemu_isdigit(val[1])) {
+            break;
+        }
+        n = strtoull(val + 1, NULL, 10);
+
+        if (!strncmp(opt, ":readahead=", val + 1 - opt)) {
+            s->readahead_size = n;
+        } else if (!strncmp(opt, ":cache=", val + 1 - opt)) {
+            s->cache_size = n;
+        } else {
+            break;
+        }
+        opt[1] = '\0';
+        parsed = 1;
+    }
+
+    if (parsed) {
+        file[strlen(file) - 1] = '\0';
+    }
+}
+
 static int curl_open(BlockDriverState *bs, const char *filename, int flags)
 {
     BDRVCURLState *s = bs->opaque;
     CURLState *state = NULL;
     double d;
-
-    #define RA_OPTSTR ":readahead="
     char *file;
-    char *ra;
-    const char *ra_val;
-    int parse_state = 0;
+    int i;
 
     static int inited = 0;
 
     file = qemu_strdup(filename);
     s->readahead_size = READ_AHEAD_SIZE;
+    s->cache_size = CACHE_SIZE;
 
-    /* Parse a trailing ":readahead=#:" param, if present. */
-    ra = file + strlen(file) - 1;
-    while (ra >= file) {
-        if (parse_state == 0) {
-            if (*ra == ':')
-                parse_state++;
-            else
-                break;
-        } else if (parse_state == 1) {
-            if (*ra > '9' || *ra < '0') {
-                char *opt_start = ra - strlen(RA_OPTSTR) + 1;
-                if (opt_start > file &&
-                    strncmp(opt_start, RA_OPTSTR, strlen(RA_OPTSTR)) == 0) {
-                    ra_val = ra + 1;
-                    ra -= strlen(RA_OPTSTR) - 1;
-                    *ra = '\0';
-                    s->readahead_size = atoi(ra_val);
-                    break;
-                } else {
-                    break;
-                }
-            }
-        }
-        ra--;
-    }
+    /* Parse trailing ":readahead=#:" and ":cache=#:" params, if present. */
+    curl_parse_options(s, file);
 
     if ((s->readahead_size & 0x1ff) != 0) {
         fprintf(stderr, "HTTP_READAHEAD_SIZE %zd is not a multiple of 512\n",
@@ -374,6 +627,14 @@ static int curl_open(BlockDriverState *bs, const char *filename, int flags)
     curl_easy_cleanup(state->curl);
     state->curl = NULL;
 
+    for (i = 0; i < CURL_HASH_SIZE; i++) {
+        QLIST_INIT(&s->hash[i]);
+    }
+    QTAILQ_INIT(&s->lru);
+    QTAILQ_INIT(&s->done_blocks);
+    QLIST_INIT(&s->acbs);
+    s->bh = qemu_bh_new(curl_multi_do, s);
+
     // Now we know the file exists and its size, so let's
     // initialize the multi interface!
 
@@ -395,7 +656,12 @@ out_noclean:
 
 static void curl_aio_cancel(BlockDriverAIOCB *blockacb)
 {
-    // Do we have to implement canceling? Seems to work without...
+    CURLAIOCB *acb = (CURLAIOCB *)blockacb;
+
+    /* Blocks being fetched for the request still end up in the cache */
+    QLIST_REMOVE(acb, entry);
+    qemu_free(acb->copied);
+    qemu_aio_release(acb);
 }
 
 static AIOPool curl_aio_pool = {
@@ -409,53 +675,82 @@ static BlockDriverAIOCB *curl_aio_readv(BlockDriverState *bs,
 {
     BDRVCURLState *s = bs->opaque;
     CURLAIOCB *acb;
+    CURLBlock *block;
     size_t start = sector_num * SECTOR_SIZE;
-    size_t end;
-    CURLState *state;
+    size_t end = start + nb_sectors * SECTOR_SIZE;
+    size_t first, offset, nb_blocks, ra, ra_start;
 
     acb = qemu_aio_get(&curl_aio_pool, bs, cb, opaque);
     if (!acb)
         return NULL;
 
     acb->qiov = qiov;
-
-    // In case we have the requested data already (e.g. read-ahead),
-    // we can just call the callback and be done.
-
-    switch (curl_find_buf(s, start, nb_sectors * SECTOR_SIZE, acb)) {
-        case FIND_RET_OK:
-            qemu_aio_release(acb);
-            // fall through
-        case FIND_RET_WAIT:
-            return &acb->common;
-        default:
-            break;
+    acb->start = start;
+    acb->end = end;
+    acb->remaining = end - start;
+    acb->ret = 0;
+
+    first = start & ~(size_t)(CURL_BLOCK_SIZE - 1);
+    nb_blocks = (end - first + CURL_BLOCK_SIZE - 1) >> CURL_BLOCK_BITS;
+    acb->copied = qemu_mallocz((nb_blocks + CURL_BITS_PER_LONG - 1) /
+                               CURL_BITS_PER_LONG * sizeof(unsigned long));
+
+    // The last sector may extend beyond the end of the file
+    if (end > s->len) {
+        offset = MAX(start, s->len);
+        curl_copy_to_qiov(qiov, offset - start, NULL, end - offset);
+        acb->remaining -= end - offset;
     }
 
-    // No cache found, so let's start a new request
-
-    state = curl_init_state(s);
-    if (!state)
-        return NULL;
-
-    acb->start = 0;
-    acb->end = (nb_sectors * SECTOR_SIZE);
+    // Copy what is cached already, the rest is copied as it comes in
+    for (offset = first; offset < MIN(end, s->len);
+         offset += CURL_BLOCK_SIZE) {
+        block = curl_find_block(s, offset);
+        if (block && block->valid) {
+            curl_copy_block(acb, block, 0);
+            QTAILQ_REMOVE(&s->lru, block, lru_entry);
+            QTAILQ_INSERT_TAIL(&s->lru, block, lru_entry);
+        }
+    }
+    QLIST_INSERT_HEAD(&s->acbs, acb, entry);
+
+    // Grow the read-ahead while the guest keeps reading sequentially, but
+    // not so far that it would push out what it fetched before use. A new
+    // read-ahead is only issued once half of the previous one is consumed,
+    // so that it goes out in a few large requests rather than block by block.
+    if (start == s->seq_end) {
+        s->ra_window = MIN(MAX(s->ra_window * 2, CURL_BLOCK_SIZE),
+                           MIN(s->readahead_size, s->cache_size / 2));
+    } else {
+        s->ra_window = 0;
+        s->ra_end = 0;
+    }
+    s->seq_end = end;
+    ra_start = MAX(end, s->ra_end);
+    if (s->ra_window && end + s->ra_window / 2 < s->ra_end) {
+        ra_start = end;
+        ra = 0;
+    } else {
+        ra = s->ra_window;
+        s->ra_end = ra_start + ra;
+    }
 
-    state->buf_off = 0;
-    if (state->orig_buf)
-        qemu_free(state->orig_buf);
-    state->buf_start = start;
-    state->buf_len = acb->end + s->readahead_size;
-    end = MIN(start + state->buf_len, s->len) - 1;
-    state->orig_buf = qemu_malloc(state->buf_len);
-    state->acb[0] = acb;
-
-    snprintf(state->range, 127, "%lld-%lld", (long long)start, (long long)end);
-    DPRINTF("CURL (AIO): Reading %d at %lld (%s)\n", (nb_sectors * SECTOR_SIZE), start, state->range);
-    curl_easy_setopt(state->curl, CURLOPT_RANGE, state->range);
+    // The read-ahead goes into the same range request as the missing part
+    // of this read whenever possible
+    if (acb->remaining && ra && ra_start == end) {
+        curl_fetch_missing(s, start, end + ra, NULL, 0);
+    } else {
+        if (acb->remaining) {
+            curl_fetch_missing(s, start, end, acb, 0);
+        }
+        if (ra) {
+            curl_fetch_missing(s, ra_start, ra_start + ra, NULL,
+                               CURL_RESERVED_STATES);
+        }
+    }
 
-    curl_multi_add_handle(s->multi, state->curl);
-    curl_multi_do(s);
+    // Completion and starting the transfers happen outside of the caller
+    qemu_bh_schedule(s->bh);
 
     return &acb->common;
 }
@@ -463,6 +758,7 @@ static BlockDriverAIOCB *curl_aio_readv(BlockDriverState *bs,
 static void curl_close(BlockDriverState *bs)
 {
     BDRVCURLState *s = bs->opaque;
+    CURLBlock *block;
     int i;
 
     DPRINTF("CURL: Close\n");
@@ -473,11 +769,14 @@ static void curl_close(BlockDriverState *bs)
             curl_easy_cleanup(s->states[i].curl);
             s->states[i].curl = NULL;
         }
-        if (s->states[i].orig_buf) {
-            qemu_free(s->states[i].orig_buf);
-            s->states[i].orig_buf = NULL;
+    }
+    for (i = 0; i < CURL_HASH_SIZE; i++) {
+        while ((block = QLIST_FIRST(&s->hash[i])) != NULL) {
+            curl_free_block(s, block);
         }
     }
+    if (s->bh)
+        qemu_bh_delete(s->bh);
     if (s->multi)
         curl_multi_cleanup(s->multi);
     if (s->url)
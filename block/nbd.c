@@ -27,18 +27,68 @@
  */
 
 #include "qemu-common.h"
+#include "qemu-aio.h"
+#include "qemu_socket.h"
 #include "nbd.h"
 #include "module.h"
 
 #include <sys/types.h>
 #include <unistd.h>
 
+/*
+ * Requests are sent without waiting for the replies to earlier ones and
+ * the replies are matched to them by handle, so that many requests can be
+ * in flight on the socket.  Guest requests larger than what the server
+ * accepts are split into several NBD requests.
+ */
+#define NBD_MAX_SECTORS (NBD_BUFFER_SIZE / 512)
+
+typedef struct NBDAIOCB {
+    BlockDriverAIOCB common;
+    QEMUIOVector *qiov;
+    int ret;
+    int parts;              /* NBD requests not answered yet */
+    int cancelled;
+    uint64_t flush_seq;     /* flush: wait for requests older than this */
+    int async_context_id;
+    QLIST_ENTRY(NBDAIOCB) node;
+} NBDAIOCB;
+
+typedef struct NBDRequest {
+    NBDAIOCB *acb;
+    struct nbd_request request;
+    size_t qiov_offset;     /* position of the data in acb->qiov */
+    uint64_t seq;
+    QTAILQ_ENTRY(NBDRequest) node;
+} NBDRequest;
+
 typedef struct BDRVNBDState {
     int sock;
     off_t size;
     size_t blocksize;
+
+    int broken;             /* the connection failed, -errno */
+    int in_flight;
+    uint64_t next_seq;
+
+    /* requests waiting to be sent; the first one may be partially sent */
+    QTAILQ_HEAD(, NBDRequest) send_queue;
+    uint8_t send_buf[NBD_REQUEST_SIZE];
+    size_t send_done;
+
+    /* requests waiting for their reply, oldest first */
+    QTAILQ_HEAD(, NBDRequest) reply_queue;
+    uint8_t recv_buf[NBD_REPLY_SIZE];
+    size_t recv_done;
+    NBDRequest *recv_req;   /* read whose data is being received */
+
+    QLIST_HEAD(, NBDAIOCB) flush_reqs;
+    QLIST_HEAD(, NBDAIOCB) completed_reqs;
+    QEMUBH *bh;
 } BDRVNBDState;
 
+static void nbd_update_fd_handler(BDRVNBDState *s);
+
 static int nbd_open(BlockDriverState *bs, const char* filename, int flags)
 {
     BDRVNBDState *s = bs->opaque;
@@ -90,67 +140,455 @@ static int nbd_open(BlockDriverState *bs, const char* filename, int flags)
     s->size = size;
     s->blocksize = blocksize;
 
+    QTAILQ_INIT(&s->send_queue);
+    QTAILQ_INIT(&s->reply_queue);
+    QLIST_INIT(&s->flush_reqs);
+    QLIST_INIT(&s->completed_reqs);
+
+    socket_set_nonblock(sock);
+    nbd_update_fd_handler(s);
+
     return 0;
 }
 
-static int nbd_read(BlockDriverState *bs, int64_t sector_num,
-                    uint8_t *buf, int nb_sectors)
+/*
+ * Transfers up to len bytes over the non-blocking socket.  Returns the
+ * number of bytes transferred, 0 if the socket would block, or -errno.
+ */
+static ssize_t nbd_sock_io(int sock, void *buf, size_t len, bool do_read)
 {
-    BDRVNBDState *s = bs->opaque;
-    struct nbd_request request;
+    ssize_t ret;
+    int err;
+
+    do {
+        if (do_read) {
+            ret = recv(sock, buf, len, 0);
+        } else {
+            ret = send(sock, buf, len, 0);
+        }
+        err = (ret == -1) ? socket_error() : 0;
+    } while (err == EINTR);
+
+    if (ret == -1) {
+        return (err == EAGAIN || err == EWOULDBLOCK) ? 0 : -err;
+    }
+    if (ret == 0 && len > 0) {
+        /* the server closed the connection */
+        return -EPIPE;
+    }
+    return ret;
+}
+
+/* Like nbd_sock_io(), but for the data at offset bytes into qiov */
+static ssize_t nbd_qiov_io(int sock, QEMUIOVector *qiov, size_t offset,
+                           size_t len, bool do_read)
+{
+    size_t done = 0;
+    int i;
+
+    for (i = 0; i < qiov->niov && done < len; i++) {
+        struct iovec *iov = &qiov->iov[i];
+        size_t n;
+        ssize_t ret;
+
+        if (offset >= iov->iov_len) {
+            offset -= iov->iov_len;
+            continue;
+        }
+
+        n = MIN(iov->iov_len - offset, len - done);
+        ret = nbd_sock_io(sock, (uint8_t *)iov->iov_base + offset, n, do_read);
+        if (ret < 0) {
+            return ret;
+        }
+        done += ret;
+        if (ret < n) {
+            break;
+        }
+        offset = 0;
+    }
+
+    return done;
+}
+
+/*
+ * Calls the completion callback, or queues the request if the callback
+ * can't be called in the current AsyncContext.
+ */
+static void nbd_aio_complete(BDRVNBDState *s, NBDAIOCB *acb)
+{
+    if (acb->async_context_id != get_async_context_id()) {
+        QLIST_INSERT_HEAD(&s->completed_reqs, acb, node);
+        return;
+    }
+
+    acb->common.cb(acb->common.opaque, acb->ret);
+    qemu_aio_release(acb);
+}
+
+static int nbd_process_queue(void *opaque)
+{
+    BDRVNBDState *s = opaque;
+    NBDAIOCB *acb, *next;
+    int res = 0;
+
+    QLIST_FOREACH_SAFE(acb, &s->completed_reqs, node, next) {
+        if (acb->async_context_id == get_async_context_id()) {
+            QLIST_REMOVE(acb, node);
+            nbd_aio_complete(s, acb);
+            res = 1;
+        }
+    }
+
+    return res;
+}
+
+/* Completes the flushes for which all older requests have been answered */
+static void nbd_check_flushes(BDRVNBDState *s)
+{
+    NBDAIOCB *acb, *next;
+    uint64_t oldest = s->next_seq;
+
+    if (!QTAILQ_EMPTY(&s->reply_queue)) {
+        oldest = QTAILQ_FIRST(&s->reply_queue)->seq;
+    } else if (!QTAILQ_EMPTY(&s->send_queue)) {
+        oldest = QTAILQ_FIRST(&s->send_queue)->seq;
+    }
+
+    QLIST_FOREACH_SAFE(acb, &s->flush_reqs, node, next) {
+        if (acb->flush_seq <= oldest) {
+            QLIST_REMOVE(acb, node);
+            nbd_aio_complete(s, acb);
+        }
+    }
+}
+
+static void nbd_bh_cb(void *opaque)
+{
+    nbd_check_flushes(opaque);
+}
+
+static void nbd_request_done(BDRVNBDState *s, NBDRequest *req, int ret)
+{
+    NBDAIOCB *acb = req->acb;
+
+    s->in_flight--;
+    qemu_free(req);
+
+    if (ret < 0 && acb->ret == 0) {
+        acb->ret = ret;
+    }
+
+    /* nbd_aio_cancel() waits for the last part and releases the ACB */
+    if (--acb->parts == 0 && !acb->cancelled) {
+        nbd_aio_complete(s, acb);
+    }
+}
+
+/* The connection is unusable, fail everything that is outstanding */
+static void nbd_fail_all(BDRVNBDState *s, int ret)
+{
+    NBDRequest *req;
+
+    s->broken = ret;
+    s->recv_req = NULL;
+    qemu_aio_set_fd_handler(s->sock, NULL, NULL, NULL, NULL, NULL);
+
+    while ((req = QTAILQ_FIRST(&s->send_queue)) != NULL) {
+        QTAILQ_REMOVE(&s->send_queue, req, node);
+        nbd_request_done(s, req, ret);
+    }
+    while ((req = QTAILQ_FIRST(&s->reply_queue)) != NULL) {
+        QTAILQ_REMOVE(&s->reply_queue, req, node);
+        nbd_request_done(s, req, ret);
+    }
+
+    nbd_check_flushes(s);
+}
+
+static void nbd_send_pending(void *opaque)
+{
+    BDRVNBDState *s = opaque;
+    NBDRequest *req;
+    ssize_t ret;
+
+    while ((req = QTAILQ_FIRST(&s->send_queue)) != NULL) {
+        size_t total = NBD_REQUEST_SIZE;
+
+        if (req->request.type == NBD_CMD_WRITE) {
+            total += req->request.len;
+        }
+
+        if (s->send_done < NBD_REQUEST_SIZE) {
+            if (s->send_done == 0) {
+                nbd_encode_request(s->send_buf, &req->request);
+            }
+            ret = nbd_sock_io(s->sock, s->send_buf + s->send_done,
+                              NBD_REQUEST_SIZE - s->send_done, false);
+            if (ret < 0) {
+                goto fail;
+            }
+            s->send_done += ret;
+            if (s->send_done < NBD_REQUEST_SIZE) {
+                break;
+            }
+        }
+
+        if (s->send_done < total) {
+            ret = nbd_qiov_io(s->sock, req->acb->qiov,
+                              req->qiov_offset + s->send_done - NBD_REQUEST_SIZE,
+                              total - s->send_done, false);
+            if (ret < 0) {
+                goto fail;
+            }
+            s->send_done += ret;
+            if (s->send_done < total) {
+                break;
+            }
+        }
+
+        QTAILQ_REMOVE(&s->send_queue, req, node);
+        QTAILQ_INSERT_TAIL(&s->reply_queue, req, node);
+        s->send_done = 0;
+    }
+
+    nbd_update_fd_handler(s);
+    return;
+
+fail:
+    nbd_fail_all(s, ret);
+}
+
+static void nbd_receive_replies(void *opaque)
+{
+    BDRVNBDState *s = opaque;
     struct nbd_reply reply;
+    NBDRequest *req;
+    ssize_t ret;
+
+    for (;;) {
+        if (!s->recv_req) {
+            ret = nbd_sock_io(s->sock, s->recv_buf + s->recv_done,
+                              NBD_REPLY_SIZE - s->recv_done, true);
+            if (ret < 0) {
+                goto fail;
+            }
+            s->recv_done += ret;
+            if (s->recv_done < NBD_REPLY_SIZE) {
+                break;
+            }
+            s->recv_done = 0;
+
+            ret = -EIO;
+            if (nbd_decode_reply(s->recv_buf, &reply) == -1) {
+                goto fail;
+            }
+            QTAILQ_FOREACH(req, &s->reply_queue, node) {
+                if (reply.handle == (uint64_t)(intptr_t)req) {
+                    break;
+                }
+            }
+            if (req == NULL) {
+                goto fail;
+            }
+
+            if (reply.error == 0 && req->request.type == NBD_CMD_READ) {
+                /* the data follows the reply */
+                s->recv_req = req;
+                continue;
+            }
+
+            QTAILQ_REMOVE(&s->reply_queue, req, node);
+            nbd_request_done(s, req, -reply.error);
+        } else {
+            req = s->recv_req;
+            ret = nbd_qiov_io(s->sock, req->acb->qiov,
+                              req->qiov_offset + s->recv_done,
+                              req->request.len - s->recv_done, true);
+            if (ret < 0) {
+                goto fail;
+            }
+            s->recv_done += ret;
+            if (s->recv_done < req->request.len) {
+                break;
+            }
+            s->recv_done = 0;
+            s->recv_req = NULL;
+
+            QTAILQ_REMOVE(&s->reply_queue, req, node);
+            nbd_request_done(s, req, 0);
+        }
+    }
 
-    request.type = NBD_CMD_READ;
-    request.handle = (uint64_t)(intptr_t)bs;
-    request.from = sector_num * 512;;
-    request.len = nb_sectors * 512;
+    nbd_check_flushes(s);
+    return;
 
-    if (nbd_send_request(s->sock, &request) == -1)
-        return -errno;
+fail:
+    nbd_fail_all(s, ret);
+}
 
-    if (nbd_receive_reply(s->sock, &reply) == -1)
-        return -errno;
+static int nbd_aio_flush_cb(void *opaque)
+{
+    BDRVNBDState *s = opaque;
 
-    if (reply.error !=0)
-        return -reply.error;
+    return s->in_flight > 0 || !QLIST_EMPTY(&s->flush_reqs) ||
+           !QLIST_EMPTY(&s->completed_reqs);
+}
 
-    if (reply.handle != request.handle)
-        return -EIO;
+static void nbd_update_fd_handler(BDRVNBDState *s)
+{
+    if (s->broken) {
+        return;
+    }
 
-    if (nbd_wr_sync(s->sock, buf, request.len, 1) != request.len)
-        return -EIO;
+    /* Only poll for writing while there is something to send */
+    qemu_aio_set_fd_handler(s->sock, nbd_receive_replies,
+                            QTAILQ_EMPTY(&s->send_queue) ? NULL
+                                                         : nbd_send_pending,
+                            nbd_aio_flush_cb, nbd_process_queue, s);
+}
 
-    return 0;
+static void nbd_aio_cancel(BlockDriverAIOCB *blockacb)
+{
+    NBDAIOCB *acb = (NBDAIOCB *)blockacb;
+    BDRVNBDState *s = acb->common.bs->opaque;
+    NBDRequest *req, *next;
+
+    if (acb->parts == 0) {
+        /* a flush, or a request waiting for its callback */
+        QLIST_REMOVE(acb, node);
+        qemu_aio_release(acb);
+        return;
+    }
+
+    /* Drop the parts the server hasn't seen yet */
+    QTAILQ_FOREACH_SAFE(req, &s->send_queue, node, next) {
+        if (req->acb == acb &&
+            (req != QTAILQ_FIRST(&s->send_queue) || s->send_done == 0)) {
+            QTAILQ_REMOVE(&s->send_queue, req, node);
+            qemu_free(req);
+            s->in_flight--;
+            acb->parts--;
+        }
+    }
+
+    /* The others use the caller's buffers, so wait for them */
+    acb->cancelled = 1;
+    while (acb->parts > 0) {
+        qemu_aio_wait();
+    }
+    qemu_aio_release(acb);
+
+    nbd_check_flushes(s);
+    nbd_update_fd_handler(s);
+}
+
+static AIOPool nbd_aio_pool = {
+    .aiocb_size         = sizeof(NBDAIOCB),
+    .cancel             = nbd_aio_cancel,
+};
+
+static NBDAIOCB *nbd_aio_get(BlockDriverState *bs,
+    BlockDriverCompletionFunc *cb, void *opaque)
+{
+    NBDAIOCB *acb;
+
+    acb = qemu_aio_get(&nbd_aio_pool, bs, cb, opaque);
+    acb->qiov = NULL;
+    acb->ret = 0;
+    acb->parts = 0;
+    acb->cancelled = 0;
+    acb->async_context_id = get_async_context_id();
+
+    return acb;
 }
 
-static int nbd_write(BlockDriverState *bs, int64_t sector_num,
-                     const uint8_t *buf, int nb_sectors)
+static BlockDriverAIOCB *nbd_aio_flush(BlockDriverState *bs,
+        BlockDriverCompletionFunc *cb, void *opaque)
 {
     BDRVNBDState *s = bs->opaque;
-    struct nbd_request request;
-    struct nbd_reply reply;
+    NBDAIOCB *acb;
 
-    request.type = NBD_CMD_WRITE;
-    request.handle = (uint64_t)(intptr_t)bs;
-    request.from = sector_num * 512;;
-    request.len = nb_sectors * 512;
+    if (s->broken) {
+        return NULL;
+    }
 
-    if (nbd_send_request(s->sock, &request) == -1)
-        return -errno;
+    /*
+     * The server writes synchronously before replying, so a flush just
+     * has to wait until all earlier requests have been answered.
+     */
+    acb = nbd_aio_get(bs, cb, opaque);
+    acb->flush_seq = s->next_seq;
+    QLIST_INSERT_HEAD(&s->flush_reqs, acb, node);
+
+    if (!s->bh) {
+        s->bh = qemu_bh_new(nbd_bh_cb, s);
+    }
+    qemu_bh_schedule(s->bh);
 
-    if (nbd_wr_sync(s->sock, (uint8_t*)buf, request.len, 0) != request.len)
-        return -EIO;
+    return &acb->common;
+}
 
-    if (nbd_receive_reply(s->sock, &reply) == -1)
-        return -errno;
+static BlockDriverAIOCB *nbd_aio_rw(BlockDriverState *bs,
+        int64_t sector_num, QEMUIOVector *qiov, int nb_sectors,
+        BlockDriverCompletionFunc *cb, void *opaque, int type)
+{
+    BDRVNBDState *s = bs->opaque;
+    NBDAIOCB *acb;
+    NBDRequest *req;
+    size_t offset = 0;
 
-    if (reply.error !=0)
-        return -reply.error;
+    if (s->broken) {
+        return NULL;
+    }
+    if (nb_sectors == 0) {
+        return nbd_aio_flush(bs, cb, opaque);
+    }
 
-    if (reply.handle != request.handle)
-        return -EIO;
+    acb = nbd_aio_get(bs, cb, opaque);
+    acb->qiov = qiov;
 
-    return 0;
+    while (nb_sectors > 0) {
+        int n = MIN(nb_sectors, NBD_MAX_SECTORS);
+
+        req = qemu_mallocz(sizeof(*req));
+        req->acb = acb;
+        req->seq = s->next_seq++;
+        req->qiov_offset = offset;
+        req->request.type = type;
+        req->request.handle = (uint64_t)(intptr_t)req;
+        req->request.from = sector_num * 512;
+        req->request.len = n * 512;
+        QTAILQ_INSERT_TAIL(&s->send_queue, req, node);
+
+        acb->parts++;
+        s->in_flight++;
+
+        sector_num += n;
+        nb_sectors -= n;
+        offset += n * 512;
+    }
+
+    /* Sending starts as soon as the main loop sees the socket writable */
+    nbd_update_fd_handler(s);
+
+    return &acb->common;
+}
+
+static BlockDriverAIOCB *nbd_aio_readv(BlockDriverState *bs,
+        int64_t sector_num, QEMUIOVector *qiov, int nb_sectors,
+        BlockDriverCompletionFunc *cb, void *opaque)
+{
+    return nbd_aio_rw(bs, sector_num, qiov, nb_sectors, cb, opaque,
+                      NBD_CMD_READ);
+}
+
+static BlockDriverAIOCB *nbd_aio_writev(BlockDriverState *bs,
+        int64_t sector_num, QEMUIOVector *qiov, int nb_sectors,
+        BlockDriverCompletionFunc *cb, void *opaque)
+{
+    return nbd_aio_rw(bs, sector_num, qiov, nb_sectors, cb, opaque,
+                      NBD_CMD_WRITE);
 }
 
 static void nbd_close(BlockDriverState *bs)
@@ -158,6 +596,16 @@ static void nbd_close(BlockDriverState *bs)
     BDRVNBDState *s = bs->opaque;
     struct nbd_request request;
 
+    while (!s->broken && nbd_aio_flush_cb(s)) {
+        qemu_aio_wait();
+    }
+    qemu_aio_set_fd_handler(s->sock, NULL, NULL, NULL, NULL, NULL);
+    if (s->bh) {
+        qemu_bh_delete(s->bh);
+    }
+
+    /* nothing else is sent any more, so wait for the socket synchronously */
+    socket_set_block(s->sock);
     request.type = NBD_CMD_DISC;
     request.handle = (uint64_t)(intptr_t)bs;
     request.from = 0;
@@ -178,9 +626,10 @@ static BlockDriver bdrv_nbd = {
     .format_name	= "nbd",
     .instance_size	= sizeof(BDRVNBDState),
     .bdrv_open		= nbd_open,
-    .bdrv_read		= nbd_read,
-    .bdrv_write		= nbd_write,
     .bdrv_close		= nbd_close,
+    .bdrv_aio_readv	= nbd_aio_readv,
+    .bdrv_aio_writev	= nbd_aio_writev,
+    .bdrv_aio_flush	= nbd_aio_flush,
     .bdrv_getlength	= nbd_getlength,
     .protocol_name	= "nbd",
 };
@@ -399,7 +399,7 @@ static int copy_sectors(BlockDriverState *bs, uint64_t start_sect,
  *
  * on exit, *num is the number of contiguous clusters we can read.
  *
- * Return 1, if the offset is found
+ * Return the cluster offset if the offset is found,
  * Return 0, otherwise.
  *
  */
@@ -522,6 +522,11 @@ static int get_cluster_table(BlockDriverState *bs, uint64_t offset,
             return -EIO;
         }
     } else {
+        /* a snapshot may still have to take its references on the table */
+        ret = qcow2_lazy_refcount_l2(bs, l1_index);
+        if (ret < 0) {
+            return ret;
+        }
         if (l2_offset)
             qcow2_free_clusters(bs, l2_offset, s->l2_size * sizeof(uint64_t));
         l2_table = l2_allocate(bs, l1_index);
@@ -828,6 +833,79 @@ out:
     return 0;
 }
 
+/*
+ * discard_clusters
+ *
+ * Drop the host clusters backing nb_clusters guest clusters starting at the
+ * (cluster aligned) disk offset. The L2 entries become unallocated, so the
+ * clusters read as zeros unless the image has a backing file.
+ *
+ * Host clusters that are no longer referenced are passed down to the image
+ * file as a discard request so that its space can be reclaimed, too.
+ *
+ * Returns 0 on success, -errno in failure case
+ */
+int qcow2_discard_clusters(BlockDriverState *bs, uint64_t offset,
+    int nb_clusters)
+{
+    BDRVQcowState *s = bs->opaque;
+    uint64_t l2_offset, *l2_table, *old_cluster;
+    unsigned int l1_index;
+    int l2_index, n, i, j, ret;
+
+    old_cluster = qemu_malloc(MIN(nb_clusters, s->l2_size) * sizeof(uint64_t));
+    ret = 0;
+
+    while (nb_clusters > 0) {
+        l2_index = (offset >> s->cluster_bits) & (s->l2_size - 1);
+        n = MIN(nb_clusters, s->l2_size - l2_index);
+
+        /* Nothing to drop if there is no L2 table yet */
+        l1_index = offset >> (s->l2_bits + s->cluster_bits);
+        if (l1_index >= s->l1_size || !s->l1_table[l1_index]) {
+            goto next;
+        }
+
+        ret = get_cluster_table(bs, offset, &l2_table, &l2_offset, &l2_index);
+        if (ret < 0) {
+            goto out;
+        }
+
+        j = 0;
+        for (i = 0; i < n; i++) {
+            uint64_t entry = be64_to_cpu(l2_table[l2_index + i]);
+            if (entry != 0) {
+                old_cluster[j++] = entry;
+            }
+            l2_table[l2_index + i] = 0;
+        }
+
+        if (write_l2_entries(s, l2_table, l2_offset, l2_index, n) < 0) {
+            ret = -EIO;
+            goto out;
+        }
+
+        for (i = 0; i < j; i++) {
+            qcow2_free_any_clusters(bs, old_cluster[i] & ~QCOW_OFLAG_COPIED, 1);
+
+            /* The copied flag means that we held the only reference */
+            if (old_cluster[i] & QCOW_OFLAG_COPIED) {
+                bdrv_discard(s->hd,
+                    (old_cluster[i] & ~QCOW_OFLAG_COPIED) >> 9,
+                    s->cluster_sectors);
+            }
+        }
+
+next:
+        nb_clusters -= n;
+        offset += (uint64_t) n << s->cluster_bits;
+    }
+
+out:
+    qemu_free(old_cluster);
+    return ret;
+}
+
 static int decompress_buffer(uint8_t *out_buf, int out_buf_size,
                              const uint8_t *buf, int buf_size)
 {
@@ -678,14 +678,76 @@ void qcow2_create_refcount_update(QCowCreateState *s, int64_t offset,
     }
 }
 
+/*
+ * Updates the refcounts of all clusters referenced by the L2 table at
+ * l2_offset by addend and sets their copied flag accordingly.  The refcount
+ * of the L2 table itself is left alone.  The caller handles the caching of
+ * refcount updates.
+ */
+static int update_l2_refcounts(BlockDriverState *bs, uint64_t *l2_table,
+                               int64_t l2_offset, int addend)
+{
+    BDRVQcowState *s = bs->opaque;
+    uint64_t offset;
+    int64_t old_offset;
+    int l2_size, j, l2_modified, nb_csectors, refcount;
+
+    l2_size = s->l2_size * sizeof(uint64_t);
+    l2_modified = 0;
+    if (bdrv_pread(s->hd, l2_offset, l2_table, l2_size) != l2_size)
+        return -EIO;
+    for(j = 0; j < s->l2_size; j++) {
+        offset = be64_to_cpu(l2_table[j]);
+        if (offset != 0) {
+            old_offset = offset;
+            offset &= ~QCOW_OFLAG_COPIED;
+            if (offset & QCOW_OFLAG_COMPRESSED) {
+                nb_csectors = ((offset >> s->csize_shift) &
+                               s->csize_mask) + 1;
+                if (addend != 0) {
+                    int ret;
+                    ret = update_refcount(bs,
+                        (offset & s->cluster_offset_mask) & ~511,
+                        nb_csectors * 512, addend);
+                    if (ret < 0) {
+                        return ret;
+                    }
+                }
+                /* compressed clusters are never modified */
+                refcount = 2;
+            } else {
+                if (addend != 0) {
+                    refcount = update_cluster_refcount(bs, offset >> s->cluster_bits, addend);
+                } else {
+                    refcount = get_refcount(bs, offset >> s->cluster_bits);
+                }
+            }
+
+            if (refcount == 1) {
+                offset |= QCOW_OFLAG_COPIED;
+            }
+            if (offset != old_offset) {
+                l2_table[j] = cpu_to_be64(offset);
+                l2_modified = 1;
+            }
+        }
+    }
+    if (l2_modified) {
+        if (bdrv_pwrite(s->hd,
+                        l2_offset, l2_table, l2_size) != l2_size)
+            return -EIO;
+    }
+    return 0;
+}
+
 /* update the refcounts of snapshots and the copied flag */
 int qcow2_update_snapshot_refcount(BlockDriverState *bs,
     int64_t l1_table_offset, int l1_size, int addend)
 {
     BDRVQcowState *s = bs->opaque;
-    uint64_t *l1_table, *l2_table, l2_offset, offset, l1_size2, l1_allocated;
-    int64_t old_offset, old_l2_offset;
-    int l2_size, i, j, l1_modified, l2_modified, nb_csectors, refcount;
+    uint64_t *l1_table, *l2_table, l2_offset, l1_size2, l1_allocated;
+    int64_t old_l2_offset;
+    int l2_size, i, l1_modified, refcount;
 
     qcow2_l2_cache_reset(bs);
     cache_refcount_updates = 1;
@@ -719,50 +781,8 @@ int qcow2_update_snapshot_refcount(BlockDriverState *bs,
         if (l2_offset) {
             old_l2_offset = l2_offset;
             l2_offset &= ~QCOW_OFLAG_COPIED;
-            l2_modified = 0;
-            if (bdrv_pread(s->hd, l2_offset, l2_table, l2_size) != l2_size)
+            if (update_l2_refcounts(bs, l2_table, l2_offset, addend) < 0)
                 goto fail;
-            for(j = 0; j < s->l2_size; j++) {
-                offset = be64_to_cpu(l2_table[j]);
-                if (offset != 0) {
-                    old_offset = offset;
-                    offset &= ~QCOW_OFLAG_COPIED;
-                    if (offset & QCOW_OFLAG_COMPRESSED) {
-                        nb_csectors = ((offset >> s->csize_shift) &
-                                       s->csize_mask) + 1;
-                        if (addend != 0) {
-                            int ret;
-                            ret = update_refcount(bs,
-                                (offset & s->cluster_offset_mask) & ~511,
-                                nb_csectors * 512, addend);
-                            if (ret < 0) {
-                                goto fail;
-                            }
-                        }
-                        /* compressed clusters are never modified */
-                        refcount = 2;
-                    } else {
-                        if (addend != 0) {
-                            refcount = update_cluster_refcount(bs, offset >> s->cluster_bits, addend);
-                        } else {
-                            refcount = get_refcount(bs, offset >> s->cluster_bits);
-                        }
-                    }
-
-                    if (refcount == 1) {
-                        offset |= QCOW_OFLAG_COPIED;
-                    }
-                    if (offset != old_offset) {
-                        l2_table[j] = cpu_to_be64(offset);
-                        l2_modified = 1;
-                    }
-                }
-            }
-            if (l2_modified) {
-                if (bdrv_pwrite(s->hd,
-                                l2_offset, l2_table, l2_size) != l2_size)
-                    goto fail;
-            }
 
             if (addend != 0) {
                 refcount = update_cluster_refcount(bs, l2_offset >> s->cluster_bits, addend);
@@ -802,300 +822,585 @@ int qcow2_update_snapshot_refcount(BlockDriverState *bs,
     return -EIO;
 }
 
+/*
+ * Takes an additional reference on all L2 tables of the active L1 table and
+ * clears their copied flag, without touching the clusters they reference.
+ * This is the part of taking a snapshot that is O(L1); the references to
+ * the data clusters are added later by qcow2_update_l2_refcounts().
+ */
+int qcow2_share_l2_tables(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+    uint64_t *l1_table;
+    int64_t l2_offset;
+    int i, ret;
+
+    cache_refcount_updates = 1;
+    for(i = 0; i < s->l1_size; i++) {
+        l2_offset = s->l1_table[i] & ~QCOW_OFLAG_COPIED;
+        if (l2_offset) {
+            ret = update_cluster_refcount(bs, l2_offset >> s->cluster_bits, 1);
+            if (ret < 0) {
+                goto fail;
+            }
+        }
+    }
+    cache_refcount_updates = 0;
+    ret = write_refcount_block(s);
+    if (ret < 0) {
+        return ret;
+    }
+
+    /* Only now that the refcounts are on disk, the copied flags can go */
+    for(i = 0; i < s->l1_size; i++) {
+        s->l1_table[i] &= ~QCOW_OFLAG_COPIED;
+    }
+    l1_table = qemu_malloc(s->l1_size * sizeof(uint64_t));
+    for(i = 0; i < s->l1_size; i++) {
+        l1_table[i] = cpu_to_be64(s->l1_table[i]);
+    }
+    ret = bdrv_pwrite(s->hd, s->l1_table_offset, l1_table,
+                      s->l1_size * sizeof(uint64_t));
+    qemu_free(l1_table);
+    qcow2_l2_cache_reset(bs);
+
+    return ret < 0 ? ret : 0;
+
+fail:
+    cache_refcount_updates = 0;
+    write_refcount_block(s);
+    return ret;
+}
+
+/*
+ * Adds a reference to all clusters referenced by the (shared) L2 table at
+ * l2_offset, and clears their copied flags.  This completes a snapshot
+ * taken with qcow2_share_l2_tables() for this table.
+ */
+int qcow2_update_l2_refcounts(BlockDriverState *bs, int64_t l2_offset)
+{
+    BDRVQcowState *s = bs->opaque;
+    uint64_t *l2_table;
+    int ret;
+
+    l2_table = qemu_malloc(s->l2_size * sizeof(uint64_t));
+    cache_refcount_updates = 1;
+    ret = update_l2_refcounts(bs, l2_table, l2_offset, 1);
+    cache_refcount_updates = 0;
+    if (write_refcount_block(s) < 0 && ret == 0) {
+        ret = -EIO;
+    }
+    qemu_free(l2_table);
+
+    return ret;
+}
+
 
 
 
 /*********************************************************/
 /* refcount checking functions */
 
+/*
+ * The check rebuilds the refcounts from the metadata and compares them to
+ * the refcount blocks.  To keep memory bounded on large images, the
+ * computed refcounts are kept for one window of clusters at a time, and
+ * the metadata is walked once per window.
+ */
+#define QCOW2_CHECK_WINDOW      (64 * 1024 * 1024)
+
+/* Number of L2 tables or refcount blocks that are read ahead */
+#define QCOW2_CHECK_READAHEAD   16
 
+typedef struct QCowCheckState {
+    BdrvCheckResult *res;
+    uint16_t *refcounts;    /* computed refcounts of the window */
+    int64_t start;          /* first cluster of the window */
+    int64_t nb;             /* number of clusters in the window */
+    int64_t nb_clusters;    /* number of clusters in the image file */
+    int first_pass;         /* metadata errors are only reported once */
+} QCowCheckState;
 
 /*
- * Increases the refcount for a range of clusters in a given refcount table.
- * This is used to construct a temporary refcount table out of L1 and L2 tables
- * which can be compared the the refcount table saved in the image.
- *
- * Returns the number of errors in the image that were found
+ * Tables are read through AIO so that the next ones are already on their
+ * way while the current one is processed.
  */
-static int inc_refcounts(BlockDriverState *bs,
-                          uint16_t *refcount_table,
-                          int refcount_table_size,
+#define CHECK_READ_PENDING 1
+
+typedef struct QCowCheckRead {
+    uint64_t *buf;
+    int64_t offset;
+    int ret;
+    struct iovec iov;
+    QEMUIOVector qiov;
+} QCowCheckRead;
+
+static void check_read_cb(void *opaque, int ret)
+{
+    QCowCheckRead *r = opaque;
+
+    r->ret = ret < 0 ? ret : 0;
+}
+
+static void check_read_start(BlockDriverState *bs, QCowCheckRead *r,
+                             int64_t offset, int len)
+{
+    BDRVQcowState *s = bs->opaque;
+
+    r->offset = offset;
+    r->ret = CHECK_READ_PENDING;
+
+    /* A corrupted offset may not even be sector aligned */
+    if (offset & 511) {
+        r->ret = bdrv_pread(s->hd, offset, r->buf, len) == len ? 0 : -EIO;
+        return;
+    }
+
+    r->iov.iov_base = r->buf;
+    r->iov.iov_len = len;
+    qemu_iovec_init_external(&r->qiov, &r->iov, 1);
+    if (!bdrv_aio_readv(s->hd, offset >> 9, &r->qiov, len >> 9,
+                        check_read_cb, r)) {
+        r->ret = -EIO;
+    }
+}
+
+static int check_read_wait(QCowCheckRead *r)
+{
+    while (r->ret == CHECK_READ_PENDING) {
+        qemu_aio_wait();
+    }
+    return r->ret;
+}
+
+static QCowCheckRead *check_reads_new(int len)
+{
+    QCowCheckRead *reads;
+    int i;
+
+    reads = qemu_mallocz(QCOW2_CHECK_READAHEAD * sizeof(*reads));
+    for (i = 0; i < QCOW2_CHECK_READAHEAD; i++) {
+        reads[i].buf = qemu_malloc(len);
+    }
+    return reads;
+}
+
+/* Waits for the reads still in flight and frees the buffers */
+static void check_reads_free(QCowCheckRead *reads, int head, int nr_pending)
+{
+    int i;
+
+    while (nr_pending--) {
+        check_read_wait(&reads[head]);
+        head = (head + 1) % QCOW2_CHECK_READAHEAD;
+    }
+    for (i = 0; i < QCOW2_CHECK_READAHEAD; i++) {
+        qemu_free(reads[i].buf);
+    }
+    qemu_free(reads);
+}
+
+/*
+ * Increases the refcount for a range of clusters in the computed refcounts,
+ * as far as they fall into the current window.  References outside of the
+ * image file are counted as corruptions.
+ */
+static void inc_refcounts(BlockDriverState *bs, QCowCheckState *cs,
                           int64_t offset, int64_t size)
 {
     BDRVQcowState *s = bs->opaque;
-    int64_t start, last, cluster_offset;
-    int k;
-    int errors = 0;
+    int64_t start, last, cluster_offset, k;
 
     if (size <= 0)
-        return 0;
+        return;
 
     start = offset & ~(s->cluster_size - 1);
     last = (offset + size - 1) & ~(s->cluster_size - 1);
     for(cluster_offset = start; cluster_offset <= last;
         cluster_offset += s->cluster_size) {
         k = cluster_offset >> s->cluster_bits;
-        if (k < 0 || k >= refcount_table_size) {
-            fprintf(stderr, "ERROR: invalid cluster offset=0x%" PRIx64 "\n",
-                cluster_offset);
-            errors++;
-        } else {
-            if (++refcount_table[k] == 0) {
+        if (k < 0 || k >= cs->nb_clusters) {
+            if (cs->first_pass) {
+                fprintf(stderr, "ERROR: invalid cluster offset=0x%" PRIx64
+                    "\n", cluster_offset);
+                cs->res->corruptions++;
+            }
+        } else if (k >= cs->start && k < cs->start + cs->nb) {
+            if (++cs->refcounts[k - cs->start] == 0) {
                 fprintf(stderr, "ERROR: overflow cluster offset=0x%" PRIx64
                     "\n", cluster_offset);
-                errors++;
+                cs->res->corruptions++;
             }
         }
     }
-
-    return errors;
 }
 
 /*
- * Increases the refcount in the given refcount table for the all clusters
- * referenced in the L2 table. While doing so, performs some checks on L2
- * entries.
- *
- * Returns the number of errors found by the checks or -errno if an internal
- * error occurred.
+ * Increases the computed refcount for all clusters referenced in the given
+ * L2 table. While doing so, performs some checks on L2 entries.
  */
-static int check_refcounts_l2(BlockDriverState *bs,
-    uint16_t *refcount_table, int refcount_table_size, int64_t l2_offset,
-    int check_copied)
+static void check_refcounts_l2(BlockDriverState *bs, QCowCheckState *cs,
+    uint64_t *l2_table, int check_copied)
 {
     BDRVQcowState *s = bs->opaque;
-    uint64_t *l2_table, offset;
-    int i, l2_size, nb_csectors, refcount;
-    int errors = 0;
-
-    /* Read L2 table from disk */
-    l2_size = s->l2_size * sizeof(uint64_t);
-    l2_table = qemu_malloc(l2_size);
+    uint64_t offset;
+    int i, nb_csectors, refcount;
+    int report = cs->first_pass;
 
-    if (bdrv_pread(s->hd, l2_offset, l2_table, l2_size) != l2_size)
-        goto fail;
-
-    /* Do the actual checks */
     for(i = 0; i < s->l2_size; i++) {
         offset = be64_to_cpu(l2_table[i]);
         if (offset != 0) {
             if (offset & QCOW_OFLAG_COMPRESSED) {
                 /* Compressed clusters don't have QCOW_OFLAG_COPIED */
                 if (offset & QCOW_OFLAG_COPIED) {
-                    fprintf(stderr, "ERROR: cluster %" PRId64 ": "
-                        "copied flag must never be set for compressed "
-                        "clusters\n", offset >> s->cluster_bits);
+                    if (report) {
+                        fprintf(stderr, "ERROR: cluster %" PRId64 ": "
+                            "copied flag must never be set for compressed "
+                            "clusters\n", offset >> s->cluster_bits);
+                        cs->res->corruptions++;
+                    }
                     offset &= ~QCOW_OFLAG_COPIED;
-                    errors++;
                 }
 
                 /* Mark cluster as used */
                 nb_csectors = ((offset >> s->csize_shift) &
                                s->csize_mask) + 1;
                 offset &= s->cluster_offset_mask;
-                errors += inc_refcounts(bs, refcount_table,
-                              refcount_table_size,
-                              offset & ~511, nb_csectors * 512);
+                inc_refcounts(bs, cs, offset & ~511, nb_csectors * 512);
             } else {
                 /* QCOW_OFLAG_COPIED must be set iff refcount == 1 */
-                if (check_copied) {
+                if (check_copied && report) {
                     uint64_t entry = offset;
                     offset &= ~QCOW_OFLAG_COPIED;
                     refcount = get_refcount(bs, offset >> s->cluster_bits);
                     if ((refcount == 1) != ((entry & QCOW_OFLAG_COPIED) != 0)) {
                         fprintf(stderr, "ERROR OFLAG_COPIED: offset=%"
                             PRIx64 " refcount=%d\n", entry, refcount);
-                        errors++;
+                        cs->res->corruptions++;
                     }
                 }
 
                 /* Mark cluster as used */
                 offset &= ~QCOW_OFLAG_COPIED;
-                errors += inc_refcounts(bs, refcount_table,
-                              refcount_table_size,
-                              offset, s->cluster_size);
+                inc_refcounts(bs, cs, offset, s->cluster_size);
 
                 /* Correct offsets are cluster aligned */
-                if (offset & (s->cluster_size - 1)) {
+                if ((offset & (s->cluster_size - 1)) && report) {
                     fprintf(stderr, "ERROR offset=%" PRIx64 ": Cluster is not "
                         "properly aligned; L2 entry corrupted.\n", offset);
-                    errors++;
+                    cs->res->corruptions++;
                 }
             }
         }
     }
-
-    qemu_free(l2_table);
-    return errors;
-
-fail:
-    fprintf(stderr, "ERROR: I/O error in check_refcounts_l1\n");
-    qemu_free(l2_table);
-    return -EIO;
 }
 
 /*
- * Increases the refcount for the L1 table, its L2 tables and all referenced
- * clusters in the given refcount table. While doing so, performs some checks
- * on L1 and L2 entries.
+ * Increases the computed refcount for the L1 table, its L2 tables and all
+ * referenced clusters. While doing so, performs some checks on L1 and L2
+ * entries.  The L2 tables are streamed with read-ahead.
  *
- * Returns the number of errors found by the checks or -errno if an internal
- * error occurred.
+ * The data clusters of L2 tables for which lazy_pending is set are not
+ * referenced yet by this L1 table, so only the tables themselves are counted.
+ *
+ * Returns 0 on success and -errno when an L1 or L2 table can't be read.
  */
-static int check_refcounts_l1(BlockDriverState *bs,
-                              uint16_t *refcount_table,
-                              int refcount_table_size,
+static int check_refcounts_l1(BlockDriverState *bs, QCowCheckState *cs,
                               int64_t l1_table_offset, int l1_size,
-                              int check_copied)
+                              int check_copied, const uint8_t *lazy_pending,
+                              int lazy_size)
 {
     BDRVQcowState *s = bs->opaque;
     uint64_t *l1_table, l2_offset, l1_size2;
+    QCowCheckRead *reads;
     int i, refcount, ret;
-    int errors = 0;
+    int head = 0, nr_pending = 0;
+    int l2_size = s->l2_size * sizeof(uint64_t);
 
     l1_size2 = l1_size * sizeof(uint64_t);
 
     /* Mark L1 table as used */
-    errors += inc_refcounts(bs, refcount_table, refcount_table_size,
-                  l1_table_offset, l1_size2);
+    inc_refcounts(bs, cs, l1_table_offset, l1_size2);
 
     /* Read L1 table entries from disk */
     if (l1_size2 == 0) {
-        l1_table = NULL;
-    } else {
-        l1_table = qemu_malloc(l1_size2);
-        if (bdrv_pread(s->hd, l1_table_offset,
-                       l1_table, l1_size2) != l1_size2)
-            goto fail;
-        for(i = 0;i < l1_size; i++)
-            be64_to_cpus(&l1_table[i]);
+        return 0;
+    }
+    l1_table = qemu_malloc(l1_size2);
+    if (bdrv_pread(s->hd, l1_table_offset, l1_table, l1_size2) != l1_size2) {
+        fprintf(stderr, "ERROR: I/O error in check_refcounts_l1\n");
+        qemu_free(l1_table);
+        return -EIO;
     }
+    for(i = 0;i < l1_size; i++)
+        be64_to_cpus(&l1_table[i]);
+
+    reads = check_reads_new(l2_size);
+    i = 0;
+    for (;;) {
+        /* Check L1 entries and start reading their L2 tables */
+        while (nr_pending < QCOW2_CHECK_READAHEAD && i < l1_size) {
+            l2_offset = l1_table[i++];
+            if (!l2_offset) {
+                continue;
+            }
+            if (lazy_pending && i - 1 < lazy_size && lazy_pending[i - 1]) {
+                inc_refcounts(bs, cs, l2_offset & ~QCOW_OFLAG_COPIED,
+                              s->cluster_size);
+                continue;
+            }
 
-    /* Do the actual checks */
-    for(i = 0; i < l1_size; i++) {
-        l2_offset = l1_table[i];
-        if (l2_offset) {
             /* QCOW_OFLAG_COPIED must be set iff refcount == 1 */
-            if (check_copied) {
+            if (check_copied && cs->first_pass) {
                 refcount = get_refcount(bs, (l2_offset & ~QCOW_OFLAG_COPIED)
                     >> s->cluster_bits);
                 if ((refcount == 1) != ((l2_offset & QCOW_OFLAG_COPIED) != 0)) {
                     fprintf(stderr, "ERROR OFLAG_COPIED: l2_offset=%" PRIx64
                         " refcount=%d\n", l2_offset, refcount);
-                    errors++;
+                    cs->res->corruptions++;
                 }
             }
 
             /* Mark L2 table as used */
             l2_offset &= ~QCOW_OFLAG_COPIED;
-            errors += inc_refcounts(bs, refcount_table,
-                          refcount_table_size,
-                          l2_offset,
-                          s->cluster_size);
+            inc_refcounts(bs, cs, l2_offset, s->cluster_size);
 
             /* L2 tables are cluster aligned */
-            if (l2_offset & (s->cluster_size - 1)) {
+            if ((l2_offset & (s->cluster_size - 1)) && cs->first_pass) {
                 fprintf(stderr, "ERROR l2_offset=%" PRIx64 ": Table is not "
                     "cluster aligned; L1 entry corrupted\n", l2_offset);
-                errors++;
+                cs->res->corruptions++;
             }
 
-            /* Process and check L2 entries */
-            ret = check_refcounts_l2(bs, refcount_table, refcount_table_size,
-                l2_offset, check_copied);
-            if (ret < 0) {
-                goto fail;
-            }
-            errors += ret;
+            check_read_start(bs, &reads[(head + nr_pending) %
+                                        QCOW2_CHECK_READAHEAD],
+                             l2_offset, l2_size);
+            nr_pending++;
         }
+
+        if (!nr_pending) {
+            break;
+        }
+
+        /* Process and check L2 entries in order */
+        ret = check_read_wait(&reads[head]);
+        if (ret < 0) {
+            fprintf(stderr, "ERROR: I/O error in check_refcounts_l1\n");
+            goto fail;
+        }
+        check_refcounts_l2(bs, cs, reads[head].buf, check_copied);
+        head = (head + 1) % QCOW2_CHECK_READAHEAD;
+        nr_pending--;
     }
-    qemu_free(l1_table);
-    return errors;
+    ret = 0;
 
 fail:
-    fprintf(stderr, "ERROR: I/O error in check_refcounts_l1\n");
+    check_reads_free(reads, head, nr_pending);
     qemu_free(l1_table);
-    return -EIO;
+    return ret;
 }
 
 /*
- * Checks an image for refcount consistency.
- *
- * Returns 0 if no errors are found, the number of errors in case the image is
- * detected as corrupted, and -errno when an internal error occured.
+ * Computes the refcounts of all clusters in the current window from the
+ * image metadata.
  */
-int qcow2_check_refcounts(BlockDriverState *bs)
+static int check_compute_refcounts(BlockDriverState *bs, QCowCheckState *cs)
 {
     BDRVQcowState *s = bs->opaque;
-    int64_t size;
-    int nb_clusters, refcount1, refcount2, i;
     QCowSnapshot *sn;
-    uint16_t *refcount_table;
-    int ret, errors = 0;
+    int64_t offset, k;
+    int i, ret;
 
-    size = bdrv_getlength(s->hd);
-    nb_clusters = size_to_clusters(s, size);
-    refcount_table = qemu_mallocz(nb_clusters * sizeof(uint16_t));
+    memset(cs->refcounts, 0, cs->nb * sizeof(uint16_t));
 
     /* header */
-    errors += inc_refcounts(bs, refcount_table, nb_clusters,
-                  0, s->cluster_size);
+    inc_refcounts(bs, cs, 0, s->cluster_size);
 
     /* current L1 table */
-    ret = check_refcounts_l1(bs, refcount_table, nb_clusters,
-                       s->l1_table_offset, s->l1_size, 1);
+    ret = check_refcounts_l1(bs, cs, s->l1_table_offset, s->l1_size, 1,
+                             NULL, 0);
     if (ret < 0) {
         return ret;
     }
-    errors += ret;
 
     /* snapshots */
     for(i = 0; i < s->nb_snapshots; i++) {
         sn = s->snapshots + i;
-        check_refcounts_l1(bs, refcount_table, nb_clusters,
-                           sn->l1_table_offset, sn->l1_size, 0);
+        if (s->lazy_l1_offset && sn->l1_table_offset == s->lazy_l1_offset) {
+            ret = check_refcounts_l1(bs, cs, sn->l1_table_offset, sn->l1_size,
+                                     0, s->lazy_pending, s->lazy_size);
+        } else {
+            ret = check_refcounts_l1(bs, cs, sn->l1_table_offset, sn->l1_size,
+                                     0, NULL, 0);
+        }
+        if (ret < 0) {
+            return ret;
+        }
     }
-    errors += inc_refcounts(bs, refcount_table, nb_clusters,
-                  s->snapshots_offset, s->snapshots_size);
+    inc_refcounts(bs, cs, s->snapshots_offset, s->snapshots_size);
 
     /* refcount data */
-    errors += inc_refcounts(bs, refcount_table, nb_clusters,
-                  s->refcount_table_offset,
+    inc_refcounts(bs, cs, s->refcount_table_offset,
                   s->refcount_table_size * sizeof(uint64_t));
     for(i = 0; i < s->refcount_table_size; i++) {
-        int64_t offset;
         offset = s->refcount_table[i];
 
         /* Refcount blocks are cluster aligned */
-        if (offset & (s->cluster_size - 1)) {
+        if ((offset & (s->cluster_size - 1)) && cs->first_pass) {
             fprintf(stderr, "ERROR refcount block %d is not "
                 "cluster aligned; refcount table entry corrupted\n", i);
-            errors++;
+            cs->res->corruptions++;
         }
 
         if (offset != 0) {
-            errors += inc_refcounts(bs, refcount_table, nb_clusters,
-                          offset, s->cluster_size);
-            if (refcount_table[offset / s->cluster_size] != 1) {
+            inc_refcounts(bs, cs, offset, s->cluster_size);
+            k = offset >> s->cluster_bits;
+            if (k >= cs->start && k < cs->start + cs->nb &&
+                cs->refcounts[k - cs->start] != 1) {
                 fprintf(stderr, "ERROR refcount block %d refcount=%d\n",
-                    i, refcount_table[offset / s->cluster_size]);
+                    i, cs->refcounts[k - cs->start]);
+                cs->res->corruptions++;
             }
         }
     }
 
-    /* compare ref counts */
-    for(i = 0; i < nb_clusters; i++) {
-        refcount1 = get_refcount(bs, i);
-        refcount2 = refcount_table[i];
-        if (refcount1 != refcount2) {
-            fprintf(stderr, "ERROR cluster %d refcount=%d reference=%d\n",
-                   i, refcount1, refcount2);
-            errors++;
+    return 0;
+}
+
+/*
+ * Compares the computed refcounts of the current window with the refcount
+ * blocks, which are streamed with read-ahead.  Clusters that are referenced
+ * less often than their refcount says are leaks, and are repaired if
+ * BDRV_FIX_LEAKS is given.
+ */
+static int check_compare_refcounts(BlockDriverState *bs, QCowCheckState *cs,
+                                   int fix)
+{
+    BDRVQcowState *s = bs->opaque;
+    QCowCheckRead *reads, *r;
+    int64_t rb_index, rb_next, rb_last, k, end;
+    int refcount1, refcount2, shift, ret;
+    int head = 0, nr_pending = 0;
+
+    shift = s->cluster_bits - REFCOUNT_SHIFT;
+    rb_next = cs->start >> shift;
+    rb_last = (cs->start + cs->nb - 1) >> shift;
+    reads = check_reads_new(s->cluster_size);
+
+    for (rb_index = rb_next; rb_index <= rb_last; rb_index++) {
+        /* Keep reading ahead, blocks that don't exist read as zero */
+        while (nr_pending < QCOW2_CHECK_READAHEAD && rb_next <= rb_last) {
+            r = &reads[(head + nr_pending) % QCOW2_CHECK_READAHEAD];
+            if (rb_next < s->refcount_table_size &&
+                s->refcount_table[rb_next]) {
+                check_read_start(bs, r, s->refcount_table[rb_next],
+                                 s->cluster_size);
+            } else {
+                memset(r->buf, 0, s->cluster_size);
+                r->ret = 0;
+            }
+            rb_next++;
+            nr_pending++;
         }
-    }
 
-    qemu_free(refcount_table);
+        r = &reads[head];
+        ret = check_read_wait(r);
+        if (ret < 0) {
+            fprintf(stderr, "ERROR: I/O error reading refcount block %"
+                PRId64 "\n", rb_index);
+            goto fail;
+        }
+
+        k = MAX(rb_index << shift, cs->start);
+        end = MIN((rb_index + 1) << shift, cs->start + cs->nb);
+        for (; k < end; k++) {
+            refcount1 = be16_to_cpu(((uint16_t *)r->buf)[k &
+                                    ((1 << shift) - 1)]);
+            refcount2 = cs->refcounts[k - cs->start];
+            if (refcount1 == refcount2) {
+                continue;
+            }
+
+            if (refcount1 > refcount2 && (fix & BDRV_FIX_LEAKS)) {
+                fprintf(stderr, "Repairing cluster %" PRId64
+                    " refcount=%d reference=%d\n", k, refcount1, refcount2);
+                ret = update_refcount(bs, k << s->cluster_bits,
+                                      s->cluster_size, refcount2 - refcount1);
+                if (ret < 0) {
+                    fprintf(stderr, "ERROR: could not repair cluster %"
+                        PRId64 ": %s\n", k, strerror(-ret));
+                    cs->res->check_errors++;
+                } else {
+                    cs->res->leaks_fixed++;
+                }
+                continue;
+            }
 
-    return errors;
+            fprintf(stderr, "%s cluster %" PRId64 " refcount=%d "
+                "reference=%d\n", refcount1 > refcount2 ? "Leaked" : "ERROR",
+                k, refcount1, refcount2);
+            if (refcount1 > refcount2) {
+                cs->res->leaks++;
+            } else {
+                cs->res->corruptions++;
+            }
+        }
+
+        head = (head + 1) % QCOW2_CHECK_READAHEAD;
+        nr_pending--;
+    }
+    ret = 0;
+
+fail:
+    check_reads_free(reads, head, nr_pending);
+    return ret;
 }
 
+/*
+ * Checks an image for refcount consistency and optionally repairs leaked
+ * clusters.
+ *
+ * Returns 0 if the check could be completed, the problems that were found
+ * are counted in res. Returns -errno when an internal error occured.
+ */
+int qcow2_check_refcounts(BlockDriverState *bs, BdrvCheckResult *res, int fix)
+{
+    BDRVQcowState *s = bs->opaque;
+    QCowCheckState cs;
+    int64_t size;
+    int ret;
+
+    size = bdrv_getlength(s->hd);
+    if (size < 0) {
+        return size;
+    }
+
+    memset(&cs, 0, sizeof(cs));
+    cs.res = res;
+    cs.nb_clusters = size_to_clusters(s, size);
+    cs.refcounts = qemu_malloc(MIN(cs.nb_clusters, QCOW2_CHECK_WINDOW) *
+                               sizeof(uint16_t));
+    cs.first_pass = 1;
+
+    ret = 0;
+    for (cs.start = 0; cs.start < cs.nb_clusters;
+         cs.start += QCOW2_CHECK_WINDOW) {
+        cs.nb = MIN(cs.nb_clusters - cs.start, QCOW2_CHECK_WINDOW);
+
+        ret = check_compute_refcounts(bs, &cs);
+        if (ret < 0) {
+            break;
+        }
+        ret = check_compare_refcounts(bs, &cs, fix);
+        if (ret < 0) {
+            break;
+        }
+        cs.first_pass = 0;
+    }
+
+    qemu_free(cs.refcounts);
+    if (ret < 0) {
+        res->check_errors++;
+    }
+    return ret;
+}
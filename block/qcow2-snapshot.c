@@ -231,6 +231,155 @@ static int find_snapshot_by_id_or_name(BlockDriverState *bs, const char *name)
     return -1;
 }
 
+/*
+ * Lazy snapshot refcounts
+ *
+ * Taking a snapshot only takes a reference on the L2 tables of the active
+ * L1 table (qcow2_share_l2_tables), which is O(L1).  The references that
+ * the snapshot adds to the data clusters are taken per L2 table afterwards:
+ * before the active image copies a shared L2 table on its first write to
+ * it, and for the rest before the next snapshot operation, a check, or when
+ * the image is closed.  Until then the data clusters of the table may still
+ * have the copied flag set, but since the L1 entry has it cleared, any write
+ * copies the L2 table first.
+ *
+ * The L1 table offset of the snapshot is recorded in a header extension
+ * while updates are pending, so that they are completed after a crash: the
+ * next read-write open does them before the image is used.
+ */
+
+static void qcow2_lazy_refcounts_reset(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+
+    qemu_free(s->lazy_pending);
+    s->lazy_pending = NULL;
+    s->lazy_size = 0;
+    s->nb_lazy_pending = 0;
+    s->lazy_l1_offset = 0;
+}
+
+/* Clears the header extension once everything is done */
+static int qcow2_lazy_refcounts_done(BlockDriverState *bs)
+{
+    qcow2_lazy_refcounts_reset(bs);
+    return qcow2_update_header(bs);
+}
+
+/*
+ * Picks up the pending updates of a snapshot that was taken before the image
+ * was last closed: all L2 tables that are still shared between the snapshot
+ * and the active L1 table.  A read-write open completes them right away, so
+ * that the extension never outlives the session that created it.
+ */
+int qcow2_lazy_refcounts_open(BlockDriverState *bs, int flags)
+{
+    BDRVQcowState *s = bs->opaque;
+    uint64_t *l1_table;
+    int i, l1_size;
+
+    if (!s->lazy_l1_offset) {
+        return 0;
+    }
+
+    for(i = 0; i < s->nb_snapshots; i++) {
+        if (s->snapshots[i].l1_table_offset == s->lazy_l1_offset)
+            break;
+    }
+    if (i == s->nb_snapshots) {
+        /* The snapshot was never completed, only some leaks are left */
+        s->lazy_l1_offset = 0;
+        return (flags & BDRV_O_RDWR) ? qcow2_update_header(bs) : 0;
+    }
+
+    l1_size = MIN(s->snapshots[i].l1_size, s->l1_size);
+    l1_table = qemu_malloc(l1_size * sizeof(uint64_t) + 1);
+    if (bdrv_pread(s->hd, s->lazy_l1_offset, l1_table,
+                   l1_size * sizeof(uint64_t)) != l1_size * sizeof(uint64_t)) {
+        qemu_free(l1_table);
+        return -EIO;
+    }
+
+    s->lazy_pending = qemu_mallocz(l1_size + 1);
+    s->lazy_size = l1_size;
+    for(i = 0; i < l1_size; i++) {
+        uint64_t l2_offset = be64_to_cpu(l1_table[i]) & ~QCOW_OFLAG_COPIED;
+        if (l2_offset &&
+            l2_offset == (s->l1_table[i] & ~QCOW_OFLAG_COPIED)) {
+            s->lazy_pending[i] = 1;
+            s->nb_lazy_pending++;
+        }
+    }
+    qemu_free(l1_table);
+
+    if (!(flags & BDRV_O_RDWR)) {
+        return 0;
+    }
+    if (!s->nb_lazy_pending) {
+        return qcow2_lazy_refcounts_done(bs);
+    }
+    return qcow2_lazy_refcounts_finish(bs);
+}
+
+/*
+ * Takes the pending references of the snapshot for the data clusters of the
+ * L2 table at l1_index, if there are any.  Must be called before the L2
+ * table of the active L1 table is replaced.
+ */
+int qcow2_lazy_refcount_l2(BlockDriverState *bs, int l1_index)
+{
+    BDRVQcowState *s = bs->opaque;
+    int ret;
+
+    if (l1_index >= s->lazy_size || !s->lazy_pending[l1_index]) {
+        return 0;
+    }
+
+    ret = qcow2_update_l2_refcounts(bs,
+                                    s->l1_table[l1_index] & ~QCOW_OFLAG_COPIED);
+    if (ret < 0) {
+        return ret;
+    }
+    qcow2_l2_cache_reset(bs);
+
+    s->lazy_pending[l1_index] = 0;
+    if (--s->nb_lazy_pending == 0) {
+        return qcow2_lazy_refcounts_done(bs);
+    }
+    return 0;
+}
+
+/* Completes all pending refcount updates */
+int qcow2_lazy_refcounts_finish(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+    int i, ret;
+
+    for(i = 0; i < s->lazy_size && s->nb_lazy_pending; i++) {
+        ret = qcow2_lazy_refcount_l2(bs, i);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+    return 0;
+}
+
+void qcow2_lazy_refcounts_close(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+    int ret;
+
+    if (s->nb_lazy_pending && !bs->read_only) {
+        ret = qcow2_lazy_refcounts_finish(bs);
+        if (ret < 0) {
+            fprintf(stderr, "qcow2: failed to complete snapshot refcount "
+                    "updates: %s\n", strerror(-ret));
+        }
+    }
+    qemu_free(s->lazy_pending);
+    s->lazy_pending = NULL;
+}
+
 /* if no id is provided, a new one is constructed */
 int qcow2_snapshot_create(BlockDriverState *bs, QEMUSnapshotInfo *sn_info)
 {
@@ -262,7 +411,12 @@ int qcow2_snapshot_create(BlockDriverState *bs, QEMUSnapshotInfo *sn_info)
     sn->date_nsec = sn_info->date_nsec;
     sn->vm_clock_nsec = sn_info->vm_clock_nsec;
 
-    ret = qcow2_update_snapshot_refcount(bs, s->l1_table_offset, s->l1_size, 1);
+    /* Only one snapshot at a time can have pending refcount updates */
+    ret = qcow2_lazy_refcounts_finish(bs);
+    if (ret < 0)
+        goto fail;
+
+    ret = qcow2_share_l2_tables(bs);
     if (ret < 0)
         goto fail;
 
@@ -291,6 +445,28 @@ int qcow2_snapshot_create(BlockDriverState *bs, QEMUSnapshotInfo *sn_info)
     qemu_free(l1_table);
     l1_table = NULL;
 
+    /*
+     * Record the pending updates before the snapshot becomes visible. If
+     * that is not possible, do them right away.
+     */
+    s->lazy_pending = qemu_mallocz(s->l1_size + 1);
+    s->lazy_size = s->l1_size;
+    for(i = 0; i < s->l1_size; i++) {
+        if (s->l1_table[i]) {
+            s->lazy_pending[i] = 1;
+            s->nb_lazy_pending++;
+        }
+    }
+    if (s->nb_lazy_pending) {
+        s->lazy_l1_offset = sn->l1_table_offset;
+        if (qcow2_update_header(bs) < 0) {
+            s->lazy_l1_offset = 0;
+            ret = qcow2_lazy_refcounts_finish(bs);
+            if (ret < 0)
+                goto fail;
+        }
+    }
+
     snapshots1 = qemu_malloc((s->nb_snapshots + 1) * sizeof(QCowSnapshot));
     if (s->snapshots) {
         memcpy(snapshots1, s->snapshots, s->nb_snapshots * sizeof(QCowSnapshot));
@@ -302,7 +478,10 @@ int qcow2_snapshot_create(BlockDriverState *bs, QEMUSnapshotInfo *sn_info)
     if (qcow_write_snapshots(bs) < 0)
         goto fail;
 #ifdef DEBUG_ALLOC
-    qcow2_check_refcounts(bs);
+    {
+        BdrvCheckResult result = {0};
+        qcow2_check_refcounts(bs, &result, 0);
+    }
 #endif
     return 0;
  fail:
@@ -323,6 +502,9 @@ int qcow2_snapshot_goto(BlockDriverState *bs, const char *snapshot_id)
         return -ENOENT;
     sn = &s->snapshots[snapshot_index];
 
+    if (qcow2_lazy_refcounts_finish(bs) < 0)
+        goto fail;
+
     if (qcow2_update_snapshot_refcount(bs, s->l1_table_offset, s->l1_size, -1) < 0)
         goto fail;
 
@@ -346,7 +528,10 @@ int qcow2_snapshot_goto(BlockDriverState *bs, const char *snapshot_id)
         goto fail;
 
 #ifdef DEBUG_ALLOC
-    qcow2_check_refcounts(bs);
+    {
+        BdrvCheckResult result = {0};
+        qcow2_check_refcounts(bs, &result, 0);
+    }
 #endif
     return 0;
  fail:
@@ -364,6 +549,10 @@ int qcow2_snapshot_delete(BlockDriverState *bs, const char *snapshot_id)
         return -ENOENT;
     sn = &s->snapshots[snapshot_index];
 
+    ret = qcow2_lazy_refcounts_finish(bs);
+    if (ret < 0)
+        return ret;
+
     ret = qcow2_update_snapshot_refcount(bs, sn->l1_table_offset, sn->l1_size, -1);
     if (ret < 0)
         return ret;
@@ -383,7 +572,10 @@ int qcow2_snapshot_delete(BlockDriverState *bs, const char *snapshot_id)
         return ret;
     }
 #ifdef DEBUG_ALLOC
-    qcow2_check_refcounts(bs);
+    {
+        BdrvCheckResult result = {0};
+        qcow2_check_refcounts(bs, &result, 0);
+    }
 #endif
     return 0;
 }
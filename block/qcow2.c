@@ -51,6 +51,7 @@ typedef struct {
 } QCowExtension;
 #define  QCOW_EXT_MAGIC_END 0
 #define  QCOW_EXT_MAGIC_BACKING_FORMAT 0xE2792ACA
+#define  QCOW_EXT_MAGIC_LAZY_REFCOUNTS 0x6C617A79
 
 
 
@@ -127,6 +128,17 @@ static int qcow_read_extensions(BlockDriverState *bs, uint64_t start_offset,
             offset = ((offset + ext.len + 7) & ~7);
             break;
 
+        case QCOW_EXT_MAGIC_LAZY_REFCOUNTS:
+            /* L1 table offset of a snapshot with pending refcount updates */
+            if (ext.len >= sizeof(uint64_t)) {
+                if (bdrv_pread(s->hd, offset, &s->lazy_l1_offset,
+                               sizeof(uint64_t)) != sizeof(uint64_t))
+                    return 3;
+                be64_to_cpus(&s->lazy_l1_offset);
+            }
+            offset = ((offset + ext.len + 7) & ~7);
+            break;
+
         default:
             /* unknown magic -- just skip it */
             offset = ((offset + ext.len + 7) & ~7);
@@ -164,7 +176,9 @@ static int qcow_open(BlockDriverState *bs, const char *filename, int flags)
     be64_to_cpus(&header.snapshots_offset);
     be32_to_cpus(&header.nb_snapshots);
 
-    if (header.magic != QCOW_MAGIC || header.version != QCOW_VERSION)
+    if (header.magic != QCOW_MAGIC)
+        goto fail;
+    if (header.version != QCOW_VERSION)
         goto fail;
     if (header.cluster_bits < MIN_CLUSTER_BITS ||
         header.cluster_bits > MAX_CLUSTER_BITS)
@@ -241,9 +255,14 @@ static int qcow_open(BlockDriverState *bs, const char *filename, int flags)
     }
     if (qcow2_read_snapshots(bs) < 0)
         goto fail;
+    if (qcow2_lazy_refcounts_open(bs, flags) < 0)
+        goto fail;
 
 #ifdef DEBUG_ALLOC
-    qcow2_check_refcounts(bs);
+    {
+        BdrvCheckResult result = {0};
+        qcow2_check_refcounts(bs, &result, 0);
+    }
 #endif
     return 0;
 
@@ -653,6 +672,7 @@ static BlockDriverAIOCB *qcow_aio_writev(BlockDriverState *bs,
 static void qcow_close(BlockDriverState *bs)
 {
     BDRVQcowState *s = bs->opaque;
+    qcow2_lazy_refcounts_close(bs);
     qemu_free(s->l1_table);
     qemu_free(s->l2_cache);
     qemu_free(s->cluster_cache);
@@ -674,8 +694,12 @@ static int qcow2_update_ext_header(BlockDriverState *bs,
 {
     size_t backing_file_len = 0;
     size_t backing_fmt_len = 0;
+    size_t lazy_len = 0;
     BDRVQcowState *s = bs->opaque;
     QCowExtension ext_backing_fmt = {0, 0};
+    QCowExtension ext_lazy = {0, 0};
+    QCowExtension ext_end = {0, 0};
+    uint64_t lazy_l1_offset;
     int ret;
 
     /* Backing file format doesn't make sense without a backing file */
@@ -691,13 +715,20 @@ static int qcow2_update_ext_header(BlockDriverState *bs,
             + strlen(backing_fmt) + 7) & ~7);
     }
 
+    /* Pending refcount updates of a snapshot must survive a crash */
+    if (s->lazy_l1_offset) {
+        ext_lazy.magic = cpu_to_be32(QCOW_EXT_MAGIC_LAZY_REFCOUNTS);
+        ext_lazy.len = cpu_to_be32(sizeof(uint64_t));
+        lazy_len = sizeof(ext_lazy) + sizeof(uint64_t);
+    }
+
     /* Check if we can fit the new header into the first cluster */
     if (backing_file) {
         backing_file_len = strlen(backing_file);
     }
 
     size_t header_size = sizeof(QCowHeader) + backing_file_len
-        + backing_fmt_len;
+        + backing_fmt_len + lazy_len + sizeof(ext_end);
 
     if (header_size > s->cluster_size) {
         return -ENOSPC;
@@ -709,21 +740,34 @@ static int qcow2_update_ext_header(BlockDriverState *bs,
     size_t offset = 0;
     size_t backing_file_offset = 0;
 
-    if (backing_file) {
-        if (backing_fmt) {
-            int padding = backing_fmt_len -
-                (sizeof(ext_backing_fmt) + strlen(backing_fmt));
+    if (backing_fmt) {
+        int padding = backing_fmt_len -
+            (sizeof(ext_backing_fmt) + strlen(backing_fmt));
 
-            memcpy(buf + offset, &ext_backing_fmt, sizeof(ext_backing_fmt));
-            offset += sizeof(ext_backing_fmt);
+        memcpy(buf + offset, &ext_backing_fmt, sizeof(ext_backing_fmt));
+        offset += sizeof(ext_backing_fmt);
 
-            memcpy(buf + offset, backing_fmt, strlen(backing_fmt));
-            offset += strlen(backing_fmt);
+        memcpy(buf + offset, backing_fmt, strlen(backing_fmt));
+        offset += strlen(backing_fmt);
 
-            memset(buf + offset, 0, padding);
-            offset += padding;
-        }
+        memset(buf + offset, 0, padding);
+        offset += padding;
+    }
+
+    if (lazy_len) {
+        memcpy(buf + offset, &ext_lazy, sizeof(ext_lazy));
+        offset += sizeof(ext_lazy);
 
+        lazy_l1_offset = cpu_to_be64(s->lazy_l1_offset);
+        memcpy(buf + offset, &lazy_l1_offset, sizeof(lazy_l1_offset));
+        offset += sizeof(lazy_l1_offset);
+    }
+
+    /* Terminate the extensions, there may be old ones behind them */
+    memcpy(buf + offset, &ext_end, sizeof(ext_end));
+    offset += sizeof(ext_end);
+
+    if (backing_file) {
         memcpy(buf + offset, backing_file, backing_file_len);
         backing_file_offset = sizeof(QCowHeader) + offset;
     }
@@ -757,7 +801,27 @@ fail:
 static int qcow2_change_backing_file(BlockDriverState *bs,
     const char *backing_file, const char *backing_fmt)
 {
-    return qcow2_update_ext_header(bs, backing_file, backing_fmt);
+    int ret;
+
+    ret = qcow2_update_ext_header(bs, backing_file, backing_fmt);
+    if (ret < 0) {
+        return ret;
+    }
+
+    /* Later header updates must write the same backing file */
+    pstrcpy(bs->backing_file, sizeof(bs->backing_file),
+            backing_file ? backing_file : "");
+    pstrcpy(bs->backing_format, sizeof(bs->backing_format),
+            backing_fmt ? backing_fmt : "");
+    return 0;
+}
+
+/* Rewrites the header extensions, e.g. after lazy_l1_offset has changed */
+int qcow2_update_header(BlockDriverState *bs)
+{
+    return qcow2_update_ext_header(bs,
+        bs->backing_file[0] ? bs->backing_file : NULL,
+        bs->backing_format[0] ? bs->backing_format : NULL);
 }
 
 static int get_bits_from_size(size_t size)
@@ -1143,6 +1207,70 @@ static int qcow_write_compressed(BlockDriverState *bs, int64_t sector_num,
     return 0;
 }
 
+static int qcow_discard(BlockDriverState *bs, int64_t sector_num,
+                        int nb_sectors)
+{
+    BDRVQcowState *s = bs->opaque;
+    int64_t start, end;
+
+    /* Only whole clusters can be dropped, ignore the rest */
+    start = (sector_num + s->cluster_sectors - 1) & ~(s->cluster_sectors - 1);
+    end = (sector_num + nb_sectors) & ~(s->cluster_sectors - 1);
+    if (start >= end) {
+        return 0;
+    }
+
+    return qcow2_discard_clusters(bs, start << 9,
+        (end - start) >> (s->cluster_bits - 9));
+}
+
+static int qcow_write_zeroes(BlockDriverState *bs, int64_t sector_num,
+                             int nb_sectors)
+{
+    BDRVQcowState *s = bs->opaque;
+    uint8_t *zero_buf;
+    int64_t start, end;
+    int ret;
+
+    /*
+     * Dropped clusters read as zeros only without a backing file. qcow2 v2
+     * has no feature bit that would keep older versions from reading a zero
+     * cluster L2 entry as a host offset, so let the zeros be written.
+     */
+    if (bs->backing_hd) {
+        return -ENOTSUP;
+    }
+
+    start = (sector_num + s->cluster_sectors - 1) & ~(s->cluster_sectors - 1);
+    end = (sector_num + nb_sectors) & ~(s->cluster_sectors - 1);
+    if (start >= end) {
+        start = end = sector_num + nb_sectors;
+    }
+
+    /* Partial clusters at the head and tail are written out explicitly */
+    if (start > sector_num || sector_num + nb_sectors > end) {
+        zero_buf = qemu_mallocz(s->cluster_size);
+        ret = 0;
+        if (start > sector_num) {
+            ret = bdrv_write(bs, sector_num, zero_buf, start - sector_num);
+        }
+        if (ret == 0 && sector_num + nb_sectors > end) {
+            ret = bdrv_write(bs, end, zero_buf, sector_num + nb_sectors - end);
+        }
+        qemu_free(zero_buf);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    if (start >= end) {
+        return 0;
+    }
+
+    return qcow2_discard_clusters(bs, start << 9,
+        (end - start) >> (s->cluster_bits - 9));
+}
+
 static void qcow_flush(BlockDriverState *bs)
 {
     BDRVQcowState *s = bs->opaque;
@@ -1157,6 +1285,20 @@ static BlockDriverAIOCB *qcow_aio_flush(BlockDriverState *bs,
      return bdrv_aio_flush(s->hd, cb, opaque);
 }
 
+static void qcow_io_plug(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+
+    bdrv_io_plug(s->hd);
+}
+
+static void qcow_io_unplug(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+
+    bdrv_io_unplug(s->hd);
+}
+
 static int64_t qcow_vm_state_offset(BDRVQcowState *s)
 {
 	return (int64_t)s->l1_vm_state_index << (s->cluster_bits + s->l2_bits);
@@ -1171,9 +1313,19 @@ static int qcow_get_info(BlockDriverState *bs, BlockDriverInfo *bdi)
 }
 
 
-static int qcow_check(BlockDriverState *bs)
+static int qcow_check(BlockDriverState *bs, BdrvCheckResult *res, int fix)
 {
-    return qcow2_check_refcounts(bs);
+    int ret;
+
+    /* Pending snapshot refcount updates are not an error, complete them */
+    if (!bs->read_only) {
+        ret = qcow2_lazy_refcounts_finish(bs);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    return qcow2_check_refcounts(bs, res, fix);
 }
 
 #if 0
@@ -1273,7 +1425,11 @@ static BlockDriver bdrv_qcow2 = {
     .bdrv_aio_readv	= qcow_aio_readv,
     .bdrv_aio_writev	= qcow_aio_writev,
     .bdrv_aio_flush	= qcow_aio_flush,
+    .bdrv_io_plug	= qcow_io_plug,
+    .bdrv_io_unplug	= qcow_io_unplug,
     .bdrv_write_compressed = qcow_write_compressed,
+    .bdrv_discard       = qcow_discard,
+    .bdrv_write_zeroes  = qcow_write_zeroes,
 
     .bdrv_snapshot_create   = qcow2_snapshot_create,
     .bdrv_snapshot_goto     = qcow2_snapshot_goto,
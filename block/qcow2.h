@@ -116,6 +116,17 @@ typedef struct BDRVQcowState {
     int snapshots_size;
     int nb_snapshots;
     QCowSnapshot *snapshots;
+
+    /*
+     * Snapshot whose L2 tables are shared with the active L1 table, but
+     * whose data clusters haven't got their additional reference yet for
+     * the L1 indices marked in lazy_pending. lazy_l1_offset is 0 if there
+     * is no such snapshot.
+     */
+    uint64_t lazy_l1_offset;
+    uint8_t *lazy_pending;
+    int lazy_size;
+    int nb_lazy_pending;
 } BDRVQcowState;
 
 /* XXX: use std qcow open function ? */
@@ -160,6 +171,7 @@ static inline int64_t align_offset(int64_t offset, int n)
 // FIXME Need qcow2_ prefix to global functions
 
 /* qcow2.c functions */
+int qcow2_update_header(BlockDriverState *bs);
 int qcow2_backing_read1(BlockDriverState *bs,
                   int64_t sector_num, uint8_t *buf, int nb_sectors);
 
@@ -178,8 +190,10 @@ void qcow2_create_refcount_update(QCowCreateState *s, int64_t offset,
     int64_t size);
 int qcow2_update_snapshot_refcount(BlockDriverState *bs,
     int64_t l1_table_offset, int l1_size, int addend);
+int qcow2_share_l2_tables(BlockDriverState *bs);
+int qcow2_update_l2_refcounts(BlockDriverState *bs, int64_t l2_offset);
 
-int qcow2_check_refcounts(BlockDriverState *bs);
+int qcow2_check_refcounts(BlockDriverState *bs, BdrvCheckResult *res, int fix);
 
 /* qcow2-cluster.c functions */
 int qcow2_grow_l1_table(BlockDriverState *bs, int min_size);
@@ -199,6 +213,8 @@ uint64_t qcow2_alloc_compressed_cluster_offset(BlockDriverState *bs,
                                          int compressed_size);
 
 int qcow2_alloc_cluster_link_l2(BlockDriverState *bs, QCowL2Meta *m);
+int qcow2_discard_clusters(BlockDriverState *bs, uint64_t offset,
+    int nb_clusters);
 
 /* qcow2-snapshot.c functions */
 int qcow2_snapshot_create(BlockDriverState *bs, QEMUSnapshotInfo *sn_info);
@@ -209,4 +225,9 @@ int qcow2_snapshot_list(BlockDriverState *bs, QEMUSnapshotInfo **psn_tab);
 void qcow2_free_snapshots(BlockDriverState *bs);
 int qcow2_read_snapshots(BlockDriverState *bs);
 
+int qcow2_lazy_refcounts_open(BlockDriverState *bs, int flags);
+int qcow2_lazy_refcount_l2(BlockDriverState *bs, int l1_index);
+int qcow2_lazy_refcounts_finish(BlockDriverState *bs);
+void qcow2_lazy_refcounts_close(BlockDriverState *bs);
+
 #endif
@@ -29,6 +29,11 @@
 #include "module.h"
 #include "block/raw-posix-aio.h"
 
+#include <sys/mman.h>
+#include <pthread.h>
+#include <signal.h>
+#include <setjmp.h>
+
 #ifdef CONFIG_COCOA
 #include <paths.h>
 #include <sys/param.h>
@@ -50,6 +55,9 @@
 #include <sys/ioctl.h>
 #include <linux/cdrom.h>
 #include <linux/fd.h>
+#ifdef CONFIG_FALLOCATE
+#include <linux/falloc.h>
+#endif
 #endif
 #if defined (__FreeBSD__) || defined(__FreeBSD_kernel__)
 #include <signal.h>
@@ -96,7 +104,9 @@
 #define FTYPE_CD     1
 #define FTYPE_FD     2
 
-#define ALIGNED_BUFFER_SIZE (32 * 512)
+/* Aligned bounce buffers for O_DIRECT, at most RAW_BOUNCE_BUFFERS are kept */
+#define RAW_BOUNCE_BUFFER_SIZE (64 * 1024)
+#define RAW_BOUNCE_BUFFERS 16
 
 /* if the FD is not accessed during that time (in ms), we try to
    reopen it to see if the disk has been changed */
@@ -118,7 +128,18 @@ typedef struct BDRVRawState {
     int use_aio;
     void *aio_ctx;
 #endif
-    uint8_t* aligned_buf;
+
+    /* O_DIRECT is used, misaligned requests need a bounce buffer */
+    int need_bounce;
+    uint8_t *bounce_bufs[RAW_BOUNCE_BUFFERS];
+    int nb_bounce_bufs;
+
+    /* read-only image mapped with BDRV_O_MMAP, or NULL */
+    uint8_t *map;
+    size_t map_len;
+    size_t map_size;        /* part of the mapping still backed by the file */
+    unsigned char *map_vec; /* residency of the pages of a request */
+    size_t map_vec_len;
 } BDRVRawState;
 
 static int fd_open(BlockDriverState *bs);
@@ -161,53 +182,204 @@ static int raw_open_common(BlockDriverState *bs, const char *filename,
         return ret;
     }
     s->fd = fd;
-    s->aligned_buf = NULL;
-
-    if ((bdrv_flags & BDRV_O_NOCACHE)) {
-        s->aligned_buf = qemu_blockalign(bs, ALIGNED_BUFFER_SIZE);
-        if (s->aligned_buf == NULL) {
-            goto out_close;
-        }
-    }
+    s->need_bounce = !!(bdrv_flags & BDRV_O_NOCACHE);
+    s->nb_bounce_bufs = 0;
 
 #ifdef CONFIG_LINUX_AIO
+    s->use_aio = 0;
     if ((bdrv_flags & (BDRV_O_NOCACHE|BDRV_O_NATIVE_AIO)) ==
                       (BDRV_O_NOCACHE|BDRV_O_NATIVE_AIO)) {
-
-        /* We're falling back to POSIX AIO in some cases */
-        paio_init();
-
+        /* Without an AIO context we just use the thread pool */
         s->aio_ctx = laio_init();
-        if (!s->aio_ctx) {
-            goto out_free_buf;
-        }
-        s->use_aio = 1;
-    } else
-#endif
-    {
-        if (paio_init() < 0) {
-            goto out_free_buf;
-        }
-#ifdef CONFIG_LINUX_AIO
-        s->use_aio = 0;
+        s->use_aio = (s->aio_ctx != NULL);
+    }
 #endif
+
+    /* Flushes always go to the thread pool */
+    if (paio_init() < 0) {
+        goto out_close;
     }
 
     return 0;
 
-out_free_buf:
-    qemu_vfree(s->aligned_buf);
 out_close:
     close(fd);
     return -errno;
 }
 
+/*
+ * Bounce buffers come from a small per-device pool, so that misaligned
+ * requests don't need to allocate memory each time.  Requests larger
+ * than a pool buffer get a buffer of their own.
+ */
+static uint8_t *raw_get_bounce(BlockDriverState *bs, size_t size)
+{
+    BDRVRawState *s = bs->opaque;
+
+    if (size > RAW_BOUNCE_BUFFER_SIZE) {
+        return qemu_blockalign(bs, size);
+    }
+    if (s->nb_bounce_bufs) {
+        return s->bounce_bufs[--s->nb_bounce_bufs];
+    }
+    return qemu_blockalign(bs, RAW_BOUNCE_BUFFER_SIZE);
+}
+
+static void raw_put_bounce(BlockDriverState *bs, uint8_t *buf, size_t size)
+{
+    BDRVRawState *s = bs->opaque;
+
+    if (size <= RAW_BOUNCE_BUFFER_SIZE &&
+        s->nb_bounce_bufs < RAW_BOUNCE_BUFFERS) {
+        s->bounce_bufs[s->nb_bounce_bufs++] = buf;
+    } else {
+        qemu_vfree(buf);
+    }
+}
+
+/*
+ * Maps a read-only image so that reads are served by copying out of the
+ * host page cache, which is then shared by all processes mapping the same
+ * file, e.g. many guests using one backing file.  Images that can't be
+ * mapped are just read the normal way.
+ *
+ * Only ranges whose pages are resident are copied out of the mapping, so
+ * that the copy never waits for the disk in the main loop; the rest is read
+ * the normal way and brings the pages into the shared page cache, too.
+ */
+/*
+ * Copying from the mapping raises SIGBUS where the file was truncated after
+ * raw_map_readable() checked the range. Such a copy fails instead and the
+ * request is read the normal way. Copies are only done by one thread at a
+ * time; SIGBUS anywhere else is left to the previous handler.
+ */
+static sigjmp_buf raw_map_jmp;
+static volatile sig_atomic_t raw_map_copying;
+static pthread_t raw_map_thread;
+static struct sigaction raw_map_old_sigbus;
+static int raw_map_sigbus_installed;
+
+static void raw_map_sigbus(int sig)
+{
+    if (raw_map_copying && pthread_equal(pthread_self(), raw_map_thread)) {
+        siglongjmp(raw_map_jmp, 1);
+    }
+    /* the fault repeats and goes to the previous handler */
+    sigaction(SIGBUS, &raw_map_old_sigbus, NULL);
+}
+
+/* Returns 0 if count bytes at offset were copied to buf or qiov, -1 if not */
+static int raw_map_copy(BlockDriverState *bs, int64_t offset, uint8_t *buf,
+                        QEMUIOVector *qiov, size_t count)
+{
+    BDRVRawState *s = bs->opaque;
+    struct stat st;
+
+    if (sigsetjmp(raw_map_jmp, 1)) {
+        raw_map_copying = 0;
+        /* truncated: never use the part that is gone again */
+        if (fstat(s->fd, &st) < 0) {
+            st.st_size = 0;
+        }
+        s->map_size = MIN(s->map_size, MIN(offset, st.st_size));
+        return -1;
+    }
+
+    raw_map_thread = pthread_self();
+    raw_map_copying = 1;
+    if (qiov) {
+        qemu_iovec_from_buffer(qiov, s->map + offset, count);
+    } else {
+        memcpy(buf, s->map + offset, count);
+    }
+    raw_map_copying = 0;
+
+    return 0;
+}
+
+static void raw_map_file(BlockDriverState *bs)
+{
+    BDRVRawState *s = bs->opaque;
+    struct sigaction act;
+    off_t size;
+    void *map;
+
+    size = lseek(s->fd, 0, SEEK_END);
+    if (size <= 0 || size != (size_t)size) {
+        return;
+    }
+
+    map = mmap(NULL, size, PROT_READ, MAP_SHARED, s->fd, 0);
+    if (map == MAP_FAILED) {
+        return;
+    }
+
+    if (!raw_map_sigbus_installed) {
+        memset(&act, 0, sizeof(act));
+        act.sa_handler = raw_map_sigbus;
+        sigemptyset(&act.sa_mask);
+        if (sigaction(SIGBUS, &act, &raw_map_old_sigbus) < 0) {
+            munmap(map, size);
+            return;
+        }
+        raw_map_sigbus_installed = 1;
+    }
+
+    s->map = map;
+    s->map_len = size;
+    s->map_size = size;
+}
+
+/*
+ * Returns 1 if count bytes at offset are within the mapping and their pages
+ * are in the page cache, so that copying them out doesn't wait for the disk.
+ */
+static int raw_map_readable(BlockDriverState *bs, int64_t offset, size_t count)
+{
+    BDRVRawState *s = bs->opaque;
+    uintptr_t page_mask = getpagesize() - 1;
+    uintptr_t start, end;
+    size_t i, nb_pages;
+
+    if (!s->map || offset + count > s->map_size) {
+        return 0;
+    }
+
+    start = (uintptr_t)(s->map + offset) & ~page_mask;
+    end = ((uintptr_t)(s->map + offset + count) + page_mask) & ~page_mask;
+    nb_pages = (end - start) / (page_mask + 1);
+    if (nb_pages > s->map_vec_len) {
+        s->map_vec = qemu_realloc(s->map_vec, nb_pages);
+        s->map_vec_len = nb_pages;
+    }
+
+    if (mincore((void *)start, end - start, (void *)s->map_vec) < 0) {
+        return 0;
+    }
+    for (i = 0; i < nb_pages; i++) {
+        if (!(s->map_vec[i] & 1)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
 static int raw_open(BlockDriverState *bs, const char *filename, int flags)
 {
     BDRVRawState *s = bs->opaque;
+    int ret;
 
     s->type = FTYPE_FILE;
-    return raw_open_common(bs, filename, flags, 0);
+    ret = raw_open_common(bs, filename, flags, 0);
+    if (ret < 0) {
+        return ret;
+    }
+
+    if ((flags & BDRV_O_MMAP) && !(flags & (BDRV_O_RDWR | BDRV_O_NOCACHE))) {
+        raw_map_file(bs);
+    }
+
+    return 0;
 }
 
 /* XXX: use host sector size if necessary with:
@@ -346,75 +518,93 @@ label__raw_write__success:
  * with O_DIRECT, necessary alignments are ensured before calling
  * raw_pread_aligned to do the actual read.
  */
-static int raw_pread(BlockDriverState *bs, int64_t offset,
-                     uint8_t *buf, int count)
+static int raw_pread_bounce(BlockDriverState *bs, int64_t offset,
+                            uint8_t *buf, int count, uint8_t *aligned_buf)
 {
-    BDRVRawState *s = bs->opaque;
     int size, ret, shift, sum;
 
     sum = 0;
 
-    if (s->aligned_buf != NULL)  {
+    if (offset & 0x1ff) {
+        /* align offset on a 512 bytes boundary */
 
-        if (offset & 0x1ff) {
-            /* align offset on a 512 bytes boundary */
+        shift = offset & 0x1ff;
+        size = (shift + count + 0x1ff) & ~0x1ff;
+        if (size > RAW_BOUNCE_BUFFER_SIZE)
+            size = RAW_BOUNCE_BUFFER_SIZE;
+        ret = raw_pread_aligned(bs, offset - shift, aligned_buf, size);
+        if (ret < 0)
+            return ret;
 
-            shift = offset & 0x1ff;
-            size = (shift + count + 0x1ff) & ~0x1ff;
-            if (size > ALIGNED_BUFFER_SIZE)
-                size = ALIGNED_BUFFER_SIZE;
-            ret = raw_pread_aligned(bs, offset - shift, s->aligned_buf, size);
-            if (ret < 0)
+        size = 512 - shift;
+        if (size > count)
+            size = count;
+        memcpy(buf, aligned_buf + shift, size);
+
+        buf += size;
+        offset += size;
+        count -= size;
+        sum += size;
+
+        if (count == 0)
+            return sum;
+    }
+    if (count & 0x1ff || (uintptr_t) buf & 0x1ff) {
+
+        /* read on aligned buffer */
+
+        while (count) {
+
+            size = (count + 0x1ff) & ~0x1ff;
+            if (size > RAW_BOUNCE_BUFFER_SIZE)
+                size = RAW_BOUNCE_BUFFER_SIZE;
+
+            ret = raw_pread_aligned(bs, offset, aligned_buf, size);
+            if (ret < 0) {
                 return ret;
+            } else if (ret == 0) {
+                fprintf(stderr, "raw_pread: read beyond end of file\n");
+                abort();
+            }
 
-            size = 512 - shift;
+            size = ret;
             if (size > count)
                 size = count;
-            memcpy(buf, s->aligned_buf + shift, size);
+
+            memcpy(buf, aligned_buf, size);
 
             buf += size;
             offset += size;
             count -= size;
             sum += size;
-
-            if (count == 0)
-                return sum;
         }
-        if (count & 0x1ff || (uintptr_t) buf & 0x1ff) {
-
-            /* read on aligned buffer */
-
-            while (count) {
-
-                size = (count + 0x1ff) & ~0x1ff;
-                if (size > ALIGNED_BUFFER_SIZE)
-                    size = ALIGNED_BUFFER_SIZE;
 
-                ret = raw_pread_aligned(bs, offset, s->aligned_buf, size);
-                if (ret < 0) {
-                    return ret;
-                } else if (ret == 0) {
-                    fprintf(stderr, "raw_pread: read beyond end of file\n");
-                    abort();
-                }
+        return sum;
+    }
 
-                size = ret;
-                if (size > count)
-                    size = count;
+    return raw_pread_aligned(bs, offset, buf, count) + sum;
+}
 
-                memcpy(buf, s->aligned_buf, size);
+static int raw_pread(BlockDriverState *bs, int64_t offset,
+                     uint8_t *buf, int count)
+{
+    BDRVRawState *s = bs->opaque;
+    uint8_t *aligned_buf;
+    int ret;
 
-                buf += size;
-                offset += size;
-                count -= size;
-                sum += size;
-            }
+    if (raw_map_readable(bs, offset, count) &&
+        raw_map_copy(bs, offset, buf, NULL, count) == 0) {
+        return count;
+    }
 
-            return sum;
-        }
+    if (!s->need_bounce) {
+        return raw_pread_aligned(bs, offset, buf, count);
     }
 
-    return raw_pread_aligned(bs, offset, buf, count) + sum;
+    aligned_buf = raw_get_bounce(bs, RAW_BOUNCE_BUFFER_SIZE);
+    ret = raw_pread_bounce(bs, offset, buf, count, aligned_buf);
+    raw_put_bounce(bs, aligned_buf, RAW_BOUNCE_BUFFER_SIZE);
+    return ret;
 }
 
 static int raw_read(BlockDriverState *bs, int64_t sector_num,
@@ -433,79 +623,93 @@ static int raw_read(BlockDriverState *bs, int64_t sector_num,
  * with O_DIRECT, necessary alignments are ensured before calling
  * raw_pwrite_aligned to do the actual write.
  */
-static int raw_pwrite(BlockDriverState *bs, int64_t offset,
-                      const uint8_t *buf, int count)
+static int raw_pwrite_bounce(BlockDriverState *bs, int64_t offset,
+                             const uint8_t *buf, int count,
+                             uint8_t *aligned_buf)
 {
-    BDRVRawState *s = bs->opaque;
     int size, ret, shift, sum;
 
     sum = 0;
 
-    if (s->aligned_buf != NULL) {
+    if (offset & 0x1ff) {
+        /* align offset on a 512 bytes boundary */
+        shift = offset & 0x1ff;
+        ret = raw_pread_aligned(bs, offset - shift, aligned_buf, 512);
+        if (ret < 0)
+            return ret;
 
-        if (offset & 0x1ff) {
-            /* align offset on a 512 bytes boundary */
-            shift = offset & 0x1ff;
-            ret = raw_pread_aligned(bs, offset - shift, s->aligned_buf, 512);
-            if (ret < 0)
-                return ret;
+        size = 512 - shift;
+        if (size > count)
+            size = count;
+        memcpy(aligned_buf + shift, buf, size);
 
-            size = 512 - shift;
-            if (size > count)
-                size = count;
-            memcpy(s->aligned_buf + shift, buf, size);
+        ret = raw_pwrite_aligned(bs, offset - shift, aligned_buf, 512);
+        if (ret < 0)
+            return ret;
 
-            ret = raw_pwrite_aligned(bs, offset - shift, s->aligned_buf, 512);
-            if (ret < 0)
-                return ret;
+        buf += size;
+        offset += size;
+        count -= size;
+        sum += size;
 
-            buf += size;
-            offset += size;
-            count -= size;
-            sum += size;
+        if (count == 0)
+            return sum;
+    }
+    if (count & 0x1ff || (uintptr_t) buf & 0x1ff) {
 
-            if (count == 0)
-                return sum;
-        }
-        if (count & 0x1ff || (uintptr_t) buf & 0x1ff) {
+        while ((size = (count & ~0x1ff)) != 0) {
 
-            while ((size = (count & ~0x1ff)) != 0) {
+            if (size > RAW_BOUNCE_BUFFER_SIZE)
+                size = RAW_BOUNCE_BUFFER_SIZE;
 
-                if (size > ALIGNED_BUFFER_SIZE)
-                    size = ALIGNED_BUFFER_SIZE;
+            memcpy(aligned_buf, buf, size);
 
-                memcpy(s->aligned_buf, buf, size);
+            ret = raw_pwrite_aligned(bs, offset, aligned_buf, size);
+            if (ret < 0)
+                return ret;
+
+            buf += ret;
+            offset += ret;
+            count -= ret;
+            sum += ret;
+        }
+        /* here, count < 512 because (count & ~0x1ff) == 0 */
+        if (count) {
+            ret = raw_pread_aligned(bs, offset, aligned_buf, 512);
+            if (ret < 0)
+                return ret;
+             memcpy(aligned_buf, buf, count);
 
-                ret = raw_pwrite_aligned(bs, offset, s->aligned_buf, size);
-                if (ret < 0)
-                    return ret;
+             ret = raw_pwrite_aligned(bs, offset, aligned_buf, 512);
+             if (ret < 0)
+                 return ret;
+             if (count < ret)
+                 ret = count;
 
-                buf += ret;
-                offset += ret;
-                count -= ret;
-                sum += ret;
-            }
-            /* here, count < 512 because (count & ~0x1ff) == 0 */
-            if (count) {
-                ret = raw_pread_aligned(bs, offset, s->aligned_buf, 512);
-                if (ret < 0)
-                    return ret;
-                 memcpy(s->aligned_buf, buf, count);
-
-                 ret = raw_pwrite_aligned(bs, offset, s->aligned_buf, 512);
-                 if (ret < 0)
-                     return ret;
-                 if (count < ret)
-                     ret = count;
-
-                 sum += ret;
-            }
-            return sum;
+             sum += ret;
         }
+        return sum;
     }
     return raw_pwrite_aligned(bs, offset, buf, count) + sum;
 }
 
+static int raw_pwrite(BlockDriverState *bs, int64_t offset,
+                      const uint8_t *buf, int count)
+{
+    BDRVRawState *s = bs->opaque;
+    uint8_t *aligned_buf;
+    int ret;
+
+    if (!s->need_bounce) {
+        return raw_pwrite_aligned(bs, offset, buf, count);
+    }
+
+    aligned_buf = raw_get_bounce(bs, RAW_BOUNCE_BUFFER_SIZE);
+    ret = raw_pwrite_bounce(bs, offset, buf, count, aligned_buf);
+    raw_put_bounce(bs, aligned_buf, RAW_BOUNCE_BUFFER_SIZE);
+    return ret;
+}
+
 static int raw_write(BlockDriverState *bs, int64_t sector_num,
                      const uint8_t *buf, int nb_sectors)
 {
@@ -532,6 +736,155 @@ static int qiov_is_aligned(QEMUIOVector *qiov)
     return 1;
 }
 
+typedef struct RawMapAIOCB {
+    BlockDriverAIOCB common;
+    QEMUBH *bh;
+} RawMapAIOCB;
+
+static void raw_map_aio_cancel(BlockDriverAIOCB *blockacb)
+{
+    RawMapAIOCB *acb = (RawMapAIOCB *)blockacb;
+
+    qemu_bh_delete(acb->bh);
+    qemu_aio_release(acb);
+}
+
+static AIOPool raw_map_aio_pool = {
+    .aiocb_size         = sizeof(RawMapAIOCB),
+    .cancel             = raw_map_aio_cancel,
+};
+
+static void raw_map_aio_bh_cb(void *opaque)
+{
+    RawMapAIOCB *acb = opaque;
+
+    qemu_bh_delete(acb->bh);
+    acb->common.cb(acb->common.opaque, 0);
+    qemu_aio_release(acb);
+}
+
+/*
+ * Reads from the mapping. The copy is done right after raw_map_readable()
+ * checked the range, only the completion is deferred to a bottom half.
+ * Returns NULL if the copy failed and the request must be read normally.
+ */
+static BlockDriverAIOCB *raw_map_aio_readv(BlockDriverState *bs,
+        int64_t sector_num, QEMUIOVector *qiov,
+        BlockDriverCompletionFunc *cb, void *opaque)
+{
+    RawMapAIOCB *acb;
+
+    if (raw_map_copy(bs, sector_num * 512, NULL, qiov, qiov->size) < 0) {
+        return NULL;
+    }
+
+    acb = qemu_aio_get(&raw_map_aio_pool, bs, cb, opaque);
+    acb->bh = qemu_bh_new(raw_map_aio_bh_cb, acb);
+    qemu_bh_schedule(acb->bh);
+
+    return &acb->common;
+}
+
+static BlockDriverAIOCB *raw_aio_submit_aligned(BlockDriverState *bs,
+        int64_t sector_num, QEMUIOVector *qiov, int nb_sectors,
+        BlockDriverCompletionFunc *cb, void *opaque, int type)
+{
+    BDRVRawState *s = bs->opaque;
+
+#ifdef CONFIG_LINUX_AIO
+    if (s->use_aio) {
+        return laio_submit(bs, s->aio_ctx, s->fd, sector_num, qiov,
+                           nb_sectors, cb, opaque, type);
+    }
+#endif
+
+    return paio_submit(bs, s->fd, sector_num, qiov, nb_sectors,
+                       cb, opaque, type);
+}
+
+typedef struct RawBounceAIOCB {
+    BlockDriverAIOCB common;
+    BlockDriverAIOCB *aiocb;
+    QEMUIOVector *qiov;
+    uint8_t *buf;
+    struct iovec iov;
+    QEMUIOVector bounce_qiov;
+    int type;
+    int cancelled;
+    int done;
+} RawBounceAIOCB;
+
+static void raw_bounce_aio_cancel(BlockDriverAIOCB *blockacb)
+{
+    RawBounceAIOCB *acb = (RawBounceAIOCB *)blockacb;
+
+    /* Linux AIO completes the request while cancelling it */
+    acb->cancelled = 1;
+    bdrv_aio_cancel(acb->aiocb);
+    if (!acb->done) {
+        raw_put_bounce(acb->common.bs, acb->buf, acb->iov.iov_len);
+    }
+    qemu_aio_release(acb);
+}
+
+static AIOPool raw_bounce_aio_pool = {
+    .aiocb_size         = sizeof(RawBounceAIOCB),
+    .cancel             = raw_bounce_aio_cancel,
+};
+
+static void raw_bounce_aio_cb(void *opaque, int ret)
+{
+    RawBounceAIOCB *acb = opaque;
+
+    acb->done = 1;
+    if (!acb->cancelled && ret >= 0 && acb->type == QEMU_AIO_READ) {
+        qemu_iovec_from_buffer(acb->qiov, acb->buf, acb->qiov->size);
+    }
+    raw_put_bounce(acb->common.bs, acb->buf, acb->iov.iov_len);
+    if (acb->cancelled) {
+        /* raw_bounce_aio_cancel() releases acb */
+        return;
+    }
+
+    acb->common.cb(acb->common.opaque, ret);
+    qemu_aio_release(acb);
+}
+
+/*
+ * Copies a misaligned request through a pooled bounce buffer, so that it
+ * can still be handled asynchronously, by Linux AIO as well.
+ */
+static BlockDriverAIOCB *raw_bounce_aio_submit(BlockDriverState *bs,
+        int64_t sector_num, QEMUIOVector *qiov, int nb_sectors,
+        BlockDriverCompletionFunc *cb, void *opaque, int type)
+{
+    RawBounceAIOCB *acb;
+
+    acb = qemu_aio_get(&raw_bounce_aio_pool, bs, cb, opaque);
+    acb->qiov = qiov;
+    acb->type = type;
+    acb->cancelled = 0;
+    acb->done = 0;
+    acb->iov.iov_len = nb_sectors * 512;
+    acb->buf = raw_get_bounce(bs, acb->iov.iov_len);
+    acb->iov.iov_base = acb->buf;
+    qemu_iovec_init_external(&acb->bounce_qiov, &acb->iov, 1);
+
+    if (type == QEMU_AIO_WRITE) {
+        qemu_iovec_to_buffer(qiov, acb->buf);
+    }
+
+    acb->aiocb = raw_aio_submit_aligned(bs, sector_num, &acb->bounce_qiov,
+                                        nb_sectors, raw_bounce_aio_cb, acb,
+                                        type);
+    if (!acb->aiocb) {
+        raw_put_bounce(bs, acb->buf, acb->iov.iov_len);
+        qemu_aio_release(acb);
+        return NULL;
+    }
+    return &acb->common;
+}
+
 static BlockDriverAIOCB *raw_aio_submit(BlockDriverState *bs,
         int64_t sector_num, QEMUIOVector *qiov, int nb_sectors,
         BlockDriverCompletionFunc *cb, void *opaque, int type)
@@ -541,24 +894,28 @@ static BlockDriverAIOCB *raw_aio_submit(BlockDriverState *bs,
     if (fd_open(bs) < 0)
         return NULL;
 
+    if (type == QEMU_AIO_READ &&
+        raw_map_readable(bs, sector_num * 512, nb_sectors * 512)) {
+        BlockDriverAIOCB *acb;
+
+        acb = raw_map_aio_readv(bs, sector_num, qiov, cb, opaque);
+        if (acb) {
+            return acb;
+        }
+    }
+
     /*
      * If O_DIRECT is used the buffer needs to be aligned on a sector
-     * boundary.  Check if this is the case or telll the low-level
-     * driver that it needs to copy the buffer.
+     * boundary.  Misaligned requests are copied through a bounce buffer
+     * and then take the same path as aligned ones.
      */
-    if (s->aligned_buf) {
-        if (!qiov_is_aligned(qiov)) {
-            type |= QEMU_AIO_MISALIGNED;
-#ifdef CONFIG_LINUX_AIO
-        } else if (s->use_aio) {
-            return laio_submit(bs, s->aio_ctx, s->fd, sector_num, qiov,
-                               nb_sectors, cb, opaque, type);
-#endif
-        }
+    if (s->need_bounce && !qiov_is_aligned(qiov)) {
+        return raw_bounce_aio_submit(bs, sector_num, qiov, nb_sectors,
+                                     cb, opaque, type);
     }
 
-    return paio_submit(bs, s->fd, sector_num, qiov, nb_sectors,
-                       cb, opaque, type);
+    return raw_aio_submit_aligned(bs, sector_num, qiov, nb_sectors,
+                                  cb, opaque, type);
 }
 
 static BlockDriverAIOCB *raw_aio_readv(BlockDriverState *bs,
@@ -588,15 +945,46 @@ static BlockDriverAIOCB *raw_aio_flush(BlockDriverState *bs,
     return paio_submit(bs, s->fd, 0, NULL, 0, cb, opaque, QEMU_AIO_FLUSH);
 }
 
+static void raw_io_plug(BlockDriverState *bs)
+{
+#ifdef CONFIG_LINUX_AIO
+    BDRVRawState *s = bs->opaque;
+
+    if (s->use_aio) {
+        laio_io_plug(s->aio_ctx);
+    }
+#endif
+}
+
+static void raw_io_unplug(BlockDriverState *bs)
+{
+#ifdef CONFIG_LINUX_AIO
+    BDRVRawState *s = bs->opaque;
+
+    if (s->use_aio) {
+        laio_io_unplug(s->aio_ctx);
+    }
+#endif
+}
+
 static void raw_close(BlockDriverState *bs)
 {
     BDRVRawState *s = bs->opaque;
+    if (s->map) {
+        munmap(s->map, s->map_len);
+        s->map = NULL;
+        qemu_free(s->map_vec);
+        s->map_vec = NULL;
+        s->map_vec_len = 0;
+    }
     if (s->fd >= 0) {
         close(s->fd);
         s->fd = -1;
-        if (s->aligned_buf != NULL)
-            qemu_vfree(s->aligned_buf);
     }
+    while (s->nb_bounce_bufs) {
+        qemu_vfree(s->bounce_bufs[--s->nb_bounce_bufs]);
+    }
+    paio_release(bs);
 }
 
 static int raw_truncate(BlockDriverState *bs, int64_t offset)
@@ -609,6 +997,48 @@ static int raw_truncate(BlockDriverState *bs, int64_t offset)
     return 0;
 }
 
+#if defined(CONFIG_FALLOCATE) && defined(FALLOC_FL_PUNCH_HOLE)
+static int raw_punch_hole(BlockDriverState *bs, int64_t sector_num,
+                          int nb_sectors)
+{
+    BDRVRawState *s = bs->opaque;
+
+    if (s->type != FTYPE_FILE)
+        return -ENOTSUP;
+    if (fallocate(s->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                  sector_num * 512, (int64_t)nb_sectors * 512) < 0) {
+        return errno == EOPNOTSUPP ? -ENOTSUP : -errno;
+    }
+    return 0;
+}
+#else
+static int raw_punch_hole(BlockDriverState *bs, int64_t sector_num,
+                          int nb_sectors)
+{
+    return -ENOTSUP;
+}
+#endif
+
+static int raw_discard(BlockDriverState *bs, int64_t sector_num,
+                       int nb_sectors)
+{
+    int ret;
+
+    ret = raw_punch_hole(bs, sector_num, nb_sectors);
+    if (ret == -ENOTSUP) {
+        /* discard is only a hint, keep the data */
+        return 0;
+    }
+    return ret;
+}
+
+/* Holes read back as zeros, so punching one is as good as writing zeros */
+static int raw_write_zeroes(BlockDriverState *bs, int64_t sector_num,
+                            int nb_sectors)
+{
+    return raw_punch_hole(bs, sector_num, nb_sectors);
+}
+
 #ifdef __OpenBSD__
 static int64_t raw_getlength(BlockDriverState *bs)
 {
@@ -764,9 +1194,13 @@ static BlockDriver bdrv_raw = {
     .bdrv_aio_readv = raw_aio_readv,
     .bdrv_aio_writev = raw_aio_writev,
     .bdrv_aio_flush = raw_aio_flush,
+    .bdrv_io_plug = raw_io_plug,
+    .bdrv_io_unplug = raw_io_unplug,
 
     .bdrv_truncate = raw_truncate,
     .bdrv_getlength = raw_getlength,
+    .bdrv_discard = raw_discard,
+    .bdrv_write_zeroes = raw_write_zeroes,
 
     .create_options = raw_create_options,
 };
@@ -1020,6 +1454,8 @@ static BlockDriver bdrv_host_device = {
     .bdrv_aio_readv	= raw_aio_readv,
     .bdrv_aio_writev	= raw_aio_writev,
     .bdrv_aio_flush	= raw_aio_flush,
+    .bdrv_io_plug	= raw_io_plug,
+    .bdrv_io_unplug	= raw_io_unplug,
 
     .bdrv_read          = raw_read,
     .bdrv_write         = raw_write,
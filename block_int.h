@@ -26,6 +26,7 @@
 
 #include "block.h"
 #include "qemu-option.h"
+#include "qemu-queue.h"
 
 #define BLOCK_FLAG_ENCRYPT	1
 #define BLOCK_FLAG_COMPRESS	2
@@ -39,6 +40,17 @@
 #define BLOCK_OPT_CLUSTER_SIZE  "cluster_size"
 #define BLOCK_OPT_PREALLOC      "preallocation"
 
+/* I/O types for latency accounting */
+enum {
+    BDRV_ACCT_READ,
+    BDRV_ACCT_WRITE,
+    BDRV_ACCT_FLUSH,
+    BDRV_ACCT_MAX,
+};
+
+/* Bucket i counts latencies of 2^i to 2^(i+1)-1 us, the last one the rest */
+#define BDRV_LATENCY_BUCKETS 24
+
 typedef struct AIOPool {
     void (*cancel)(BlockDriverAIOCB *acb);
     int aiocb_size;
@@ -76,6 +88,8 @@ struct BlockDriver {
         int num_reqs);
     int (*bdrv_merge_requests)(BlockDriverState *bs, BlockRequest* a,
         BlockRequest *b);
+    void (*bdrv_io_plug)(BlockDriverState *bs);
+    void (*bdrv_io_unplug)(BlockDriverState *bs);
 
 
     const char *protocol_name;
@@ -83,6 +97,10 @@ struct BlockDriver {
     int64_t (*bdrv_getlength)(BlockDriverState *bs);
     int (*bdrv_write_compressed)(BlockDriverState *bs, int64_t sector_num,
                                  const uint8_t *buf, int nb_sectors);
+    int (*bdrv_write_zeroes)(BlockDriverState *bs, int64_t sector_num,
+                             int nb_sectors);
+    int (*bdrv_discard)(BlockDriverState *bs, int64_t sector_num,
+                        int nb_sectors);
 
     int (*bdrv_snapshot_create)(BlockDriverState *bs,
                                 QEMUSnapshotInfo *sn_info);
@@ -117,8 +135,11 @@ struct BlockDriver {
     QEMUOptionParameter *create_options;
 
 
-    /* Returns number of errors in image, -errno for internal errors */
-    int (*bdrv_check)(BlockDriverState* bs);
+    /*
+     * Counts the problems found in the image in res and repairs those
+     * requested by fix. Returns -errno if the check couldn't complete.
+     */
+    int (*bdrv_check)(BlockDriverState* bs, BdrvCheckResult *res, int fix);
 
     /* Set if newly created images are not guaranteed to contain only zeros */
     int no_zero_init;
@@ -161,6 +182,27 @@ struct BlockDriverState {
     uint64_t wr_bytes;
     uint64_t rd_ops;
     uint64_t wr_ops;
+    uint64_t flush_ops;
+    uint64_t wr_merged; /* write requests merged by bdrv_aio_multiwrite */
+    uint64_t throttled_ops;
+    uint64_t throttled_time; /* in ms */
+    uint64_t latency_hist[BDRV_ACCT_MAX][BDRV_LATENCY_BUCKETS];
+    int in_flight;
+    int max_in_flight;
+
+    /* I/O throttling (see bdrv_set_io_limits) */
+    BlockIOLimit io_limits;
+    int io_limits_enabled;
+    double io_tokens_bps[BLOCK_IO_LIMIT_MAX];
+    double io_tokens_iops[BLOCK_IO_LIMIT_MAX];
+    int64_t io_tokens_time;
+    QEMUTimer *io_limits_timer;
+    QTAILQ_HEAD(, BlockThrottleAIOCB) throttled_reqs;
+
+    /* copy-on-read and image streaming (see bdrv_enable_copy_on_read) */
+    int copy_on_read;
+    QTAILQ_HEAD(, BdrvTrackedRequest) tracked_reqs;
+    struct BlockStreamJob *stream_job;
 
     /* Whether the disk can expand beyond total_sectors */
     int growable;
@@ -846,7 +846,6 @@ int cpu_str_to_log_mask(const char *str);
 /* memory API */
 
 extern int phys_ram_fd;
-extern uint8_t *phys_ram_dirty;
 extern ram_addr_t ram_size;
 extern ram_addr_t last_ram_offset;
 
@@ -871,27 +870,84 @@ extern ram_addr_t last_ram_offset;
 int cpu_memory_rw_debug(CPUState *env, target_ulong addr,
                         uint8_t *buf, int len, int is_write);
 
-#define VGA_DIRTY_FLAG       0x01
-#define CODE_DIRTY_FLAG      0x02
-#define MIGRATION_DIRTY_FLAG 0x08
+/* Dirty memory clients; each of them has its own bitmap with one bit per
+   page. Dirty flag (1 << n) stands for client n. */
+#define DIRTY_MEMORY_VGA       0
+#define DIRTY_MEMORY_CODE      1
+#define DIRTY_MEMORY_MIGRATION 2
+#define DIRTY_MEMORY_NUM       3
+
+#define VGA_DIRTY_FLAG       (1 << DIRTY_MEMORY_VGA)
+#define CODE_DIRTY_FLAG      (1 << DIRTY_MEMORY_CODE)
+#define MIGRATION_DIRTY_FLAG (1 << DIRTY_MEMORY_MIGRATION)
+#define ALL_DIRTY_FLAGS      ((1 << DIRTY_MEMORY_NUM) - 1)
+
+extern unsigned long *phys_ram_dirty[DIRTY_MEMORY_NUM];
+/* number of pages with MIGRATION_DIRTY_FLAG set */
+extern ram_addr_t phys_ram_migration_dirty_pages;
+
+#define DIRTY_WORD(addr) \
+    (((addr) >> TARGET_PAGE_BITS) / HOST_LONG_BITS)
+#define DIRTY_MASK(addr) \
+    (1UL << (((addr) >> TARGET_PAGE_BITS) % HOST_LONG_BITS))
+
+static inline int cpu_physical_memory_get_dirty_flags(ram_addr_t addr)
+{
+    unsigned long word = DIRTY_WORD(addr), mask = DIRTY_MASK(addr);
+    int i, dirty_flags = 0;
+
+    for (i = 0; i < DIRTY_MEMORY_NUM; i++) {
+        if (phys_ram_dirty[i][word] & mask) {
+            dirty_flags |= 1 << i;
+        }
+    }
+    return dirty_flags;
+}
 
 /* read dirty bit (return 0 or 1) */
 static inline int cpu_physical_memory_is_dirty(ram_addr_t addr)
 {
-    return phys_ram_dirty[addr >> TARGET_PAGE_BITS] == 0xff;
+    return cpu_physical_memory_get_dirty_flags(addr) == ALL_DIRTY_FLAGS;
 }
 
 static inline int cpu_physical_memory_get_dirty(ram_addr_t addr,
                                                 int dirty_flags)
 {
-    return phys_ram_dirty[addr >> TARGET_PAGE_BITS] & dirty_flags;
+    unsigned long word = DIRTY_WORD(addr), mask = DIRTY_MASK(addr);
+    int i, ret = 0;
+
+    for (i = 0; i < DIRTY_MEMORY_NUM; i++) {
+        if ((dirty_flags & (1 << i)) && (phys_ram_dirty[i][word] & mask)) {
+            ret |= 1 << i;
+        }
+    }
+    return ret;
+}
+
+static inline void cpu_physical_memory_set_dirty_flags(ram_addr_t addr,
+                                                       int dirty_flags)
+{
+    unsigned long word = DIRTY_WORD(addr), mask = DIRTY_MASK(addr);
+    int i;
+
+    if ((dirty_flags & MIGRATION_DIRTY_FLAG) &&
+        !(phys_ram_dirty[DIRTY_MEMORY_MIGRATION][word] & mask)) {
+        phys_ram_migration_dirty_pages++;
+    }
+    for (i = 0; i < DIRTY_MEMORY_NUM; i++) {
+        if (dirty_flags & (1 << i)) {
+            phys_ram_dirty[i][word] |= mask;
+        }
+    }
 }
 
 static inline void cpu_physical_memory_set_dirty(ram_addr_t addr)
 {
-    phys_ram_dirty[addr >> TARGET_PAGE_BITS] = 0xff;
+    cpu_physical_memory_set_dirty_flags(addr, ALL_DIRTY_FLAGS);
 }
 
+void cpu_physical_memory_set_dirty_range(ram_addr_t start, ram_addr_t length,
+                                         int dirty_flags);
 void cpu_physical_memory_reset_dirty(ram_addr_t start, ram_addr_t end,
                                      int dirty_flags);
 void cpu_tlb_update_dirty(CPUState *env);
@@ -45,6 +45,13 @@ typedef int (QEMUFileRateLimit)(void *opaque);
 typedef size_t (QEMUFileSetRateLimit)(void *opaque, size_t new_rate);
 typedef size_t (QEMUFileGetRateLimit)(void *opaque);
 
+/* Write a vector of buffers at the given position, like a put_buffer handler.
+ * The buffers may change as soon as the handler returns, anything it keeps
+ * must be copied. The iovec array itself may be modified.
+ */
+typedef ssize_t (QEMUFileWritevBufferFunc)(void *opaque, struct iovec *iov,
+                                           int iovcnt, int64_t pos);
+
 QEMUFile *qemu_fopen_ops(void *opaque, QEMUFilePutBufferFunc *put_buffer,
                          QEMUFileGetBufferFunc *get_buffer,
                          QEMUFileCloseFunc *close,
@@ -57,9 +64,11 @@ QEMUFile *qemu_fopen_socket(int fd);
 QEMUFile *qemu_popen(FILE *popen_file, const char *mode);
 QEMUFile *qemu_popen_cmd(const char *command, const char *mode);
 int qemu_stdio_fd(QEMUFile *f);
+void qemu_file_set_writev(QEMUFile *f, QEMUFileWritevBufferFunc *writev_buffer);
 void qemu_fflush(QEMUFile *f);
 int qemu_fclose(QEMUFile *f);
 void qemu_put_buffer(QEMUFile *f, const uint8_t *buf, int size);
+void qemu_put_buffer_async(QEMUFile *f, const uint8_t *buf, int size);
 void qemu_put_byte(QEMUFile *f, int v);
 
 static inline void qemu_put_ubyte(QEMUFile *f, unsigned int v)
@@ -247,6 +256,7 @@ typedef void SaveStateHandler(QEMUFile *f, void *opaque);
 typedef int SaveLiveStateHandler(Monitor *mon, QEMUFile *f, int stage,
                                  void *opaque);
 typedef int LoadStateHandler(QEMUFile *f, void *opaque, int version_id);
+typedef int SaveVersionHandler(void *opaque);
 
 int register_savevm(const char *idstr,
                     int instance_id,
@@ -266,6 +276,11 @@ int register_savevm_live(const char *idstr,
 
 void unregister_savevm(const char *idstr, void *opaque);
 
+/* Returns the version a live section is saved with, which may be lower than
+   the one it was registered with if the newer stream features are unused */
+void register_savevm_version(const char *idstr, void *opaque,
+                             SaveVersionHandler *save_version);
+
 typedef void QEMUResetHandler(void *opaque);
 
 void qemu_register_reset(QEMUResetHandler *func, void *opaque);
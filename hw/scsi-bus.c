@@ -300,6 +300,7 @@ static void scsi_req_xfer_mode(SCSIRequest *req)
     case UPDATE_BLOCK:
     case WRITE_LONG:
     case WRITE_SAME:
+    case UNMAP:
     case SEARCH_HIGH_12:
     case SEARCH_EQUAL_12:
     case SEARCH_LOW_12:
@@ -424,6 +425,7 @@ static const char *scsi_command_name(uint8_t cmd)
         [ WRITE_LONG               ] = "WRITE_LONG",
         [ CHANGE_DEFINITION        ] = "CHANGE_DEFINITION",
         [ WRITE_SAME               ] = "WRITE_SAME",
+        [ UNMAP                    ] = "UNMAP",
         [ READ_TOC                 ] = "READ_TOC",
         [ LOG_SELECT               ] = "LOG_SELECT",
         [ LOG_SENSE                ] = "LOG_SENSE",
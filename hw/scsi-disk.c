@@ -40,6 +40,8 @@ do { fprintf(stderr, "scsi-disk: " fmt , ## __VA_ARGS__); } while (0)
 
 #define SCSI_DMA_BUF_SIZE    131072
 #define SCSI_MAX_INQUIRY_LEN 256
+/* UNMAP parameter list: 8 byte header followed by 16 byte descriptors */
+#define SCSI_MAX_UNMAP_DESCRIPTORS ((SCSI_DMA_BUF_SIZE - 8) / 16)
 
 #define SCSI_REQ_STATUS_RETRY 0x01
 
@@ -230,11 +232,66 @@ static void scsi_write_complete(void * opaque, int ret)
     }
 }
 
+static void scsi_unmap_request(SCSIDiskReq *r)
+{
+    SCSIDiskState *s = DO_UPCAST(SCSIDiskState, qdev, r->req.dev);
+    uint8_t *p = r->iov.iov_base;
+    uint64_t lba;
+    uint32_t nb_blocks, nb_sectors;
+    int len, ret;
+
+    if (r->iov.iov_len == 0) {
+        /* Fetch the parameter list from the host.  */
+        r->iov.iov_len = r->req.cmd.xfer;
+        r->req.bus->complete(r->req.bus, SCSI_REASON_DATA, r->req.tag,
+                             r->iov.iov_len);
+        return;
+    }
+
+    len = (p[2] << 8) | p[3];
+    if (len > r->iov.iov_len - 8) {
+        len = r->iov.iov_len - 8;
+    }
+
+    for (p += 8; len >= 16; p += 16, len -= 16) {
+        lba = ((uint64_t) p[0] << 56) | ((uint64_t) p[1] << 48) |
+              ((uint64_t) p[2] << 40) | ((uint64_t) p[3] << 32) |
+              ((uint64_t) p[4] << 24) | ((uint64_t) p[5] << 16) |
+              ((uint64_t) p[6] << 8) | (uint64_t) p[7];
+        nb_blocks = (p[8] << 24) | (p[9] << 16) | (p[10] << 8) | p[11];
+
+        if (lba > s->max_lba || nb_blocks > s->max_lba + 1 - lba) {
+            scsi_command_complete(r, CHECK_CONDITION, ILLEGAL_REQUEST);
+            return;
+        }
+
+        lba *= s->cluster_size;
+        while (nb_blocks > 0) {
+            nb_sectors = MIN(nb_blocks, (INT_MAX >> 9) / s->cluster_size);
+            ret = bdrv_discard(s->bs, lba, nb_sectors * s->cluster_size);
+            if (ret < 0) {
+                if (scsi_handle_write_error(r, -ret))
+                    return;
+                break;
+            }
+            lba += nb_sectors * s->cluster_size;
+            nb_blocks -= nb_sectors;
+        }
+    }
+
+    scsi_command_complete(r, GOOD, NO_SENSE);
+}
+
 static void scsi_write_request(SCSIDiskReq *r)
 {
     SCSIDiskState *s = DO_UPCAST(SCSIDiskState, qdev, r->req.dev);
     uint32_t n;
 
+    if (r->req.cmd.buf[0] == UNMAP) {
+        scsi_unmap_request(r);
+        return;
+    }
+
     n = r->iov.iov_len / 512;
     if (n) {
         qemu_iovec_init_external(&r->qiov, &r->iov, 1);
@@ -349,11 +406,12 @@ static int scsi_disk_emulate_inquiry(SCSIRequest *req, uint8_t *outbuf)
         case 0x00: /* Supported page codes, mandatory */
             DPRINTF("Inquiry EVPD[Supported pages] "
                     "buffer size %zd\n", req->cmd.xfer);
-            outbuf[buflen++] = 4;    // number of pages
+            outbuf[buflen++] = 5;    // number of pages
             outbuf[buflen++] = 0x00; // list of supported pages (this page)
             outbuf[buflen++] = 0x80; // unit serial number
             outbuf[buflen++] = 0x83; // device identification
             outbuf[buflen++] = 0xb0; // block device characteristics
+            outbuf[buflen++] = 0xb2; // logical block provisioning
             break;
 
         case 0x80: /* Device serial number, optional */
@@ -414,8 +472,29 @@ static int scsi_disk_emulate_inquiry(SCSIRequest *req, uint8_t *outbuf)
             outbuf[13] = (opt_io_size >> 16) & 0xff;
             outbuf[14] = (opt_io_size >> 8) & 0xff;
             outbuf[15] = opt_io_size & 0xff;
+
+            if (bdrv_get_type_hint(s->bs) != BDRV_TYPE_CDROM) {
+                /* maximum unmap lba count: no limit */
+                outbuf[20] = outbuf[21] = outbuf[22] = outbuf[23] = 0xff;
+
+                /* maximum unmap block descriptor count */
+                outbuf[24] = (SCSI_MAX_UNMAP_DESCRIPTORS >> 24) & 0xff;
+                outbuf[25] = (SCSI_MAX_UNMAP_DESCRIPTORS >> 16) & 0xff;
+                outbuf[26] = (SCSI_MAX_UNMAP_DESCRIPTORS >> 8) & 0xff;
+                outbuf[27] = SCSI_MAX_UNMAP_DESCRIPTORS & 0xff;
+            }
             break;
         }
+        case 0xb2: /* logical block provisioning */
+            outbuf[3] = 4;
+            buflen = 8;
+            memset(outbuf + 4, 0, buflen - 4);
+
+            if (bdrv_get_type_hint(s->bs) != BDRV_TYPE_CDROM) {
+                outbuf[5] = 0x80; // LBPU: UNMAP supported
+                outbuf[6] = 0x02; // thin provisioned
+            }
+            break;
         default:
             BADF("Error: unsupported Inquiry (EVPD[%02X]) "
                  "buffer size %zd\n", page_code, req->cmd.xfer);
@@ -818,6 +897,10 @@ static int scsi_disk_emulate_command(SCSIRequest *req, uint8_t *outbuf)
             outbuf[11] = 0;
             outbuf[12] = 0;
             outbuf[13] = get_physical_block_exp(&s->qdev.conf);
+            if (bdrv_get_type_hint(s->bs) != BDRV_TYPE_CDROM) {
+                /* LBPME: thin provisioned, UNMAP supported */
+                outbuf[14] = 0x80;
+            }
             /* Protection, exponent and lowest lba field left blank. */
             buflen = req->cmd.xfer;
             break;
@@ -982,6 +1065,24 @@ static int32_t scsi_send_command(SCSIDevice *d, uint32_t tag,
         r->sector_count = len * s->cluster_size;
         is_write = 1;
         break;
+    case UNMAP:
+        DPRINTF("Unmap (len %zd)\n", r->req.cmd.xfer);
+        if (bdrv_get_type_hint(s->bs) == BDRV_TYPE_CDROM)
+            goto fail;
+        if (r->req.cmd.xfer > SCSI_DMA_BUF_SIZE)
+            goto fail;
+        if (bdrv_is_read_only(s->bs)) {
+            /* not an I/O error, so the error policy doesn't apply */
+            scsi_command_complete(r, CHECK_CONDITION, DATA_PROTECT);
+            return 0;
+        }
+        if (r->req.cmd.xfer < 8) {
+            /* An empty parameter list is not an error.  */
+            scsi_command_complete(r, GOOD, NO_SENSE);
+            return 0;
+        }
+        /* The parameter list is fetched by scsi_write_data.  */
+        return -r->req.cmd.xfer;
     default:
 	DPRINTF("Unknown SCSI command (%2.2x)\n", buf[0]);
     fail:
@@ -327,6 +327,9 @@ static void virtio_blk_handle_output(VirtIODevice *vdev, VirtQueue *vq)
         .old_bs = NULL,
     };
 
+    /* Submit everything the guest queued with as few syscalls as possible */
+    bdrv_io_plug(s->bs);
+
     while ((req = virtio_blk_get_request(s))) {
         virtio_blk_handle_request(req, &mrb);
     }
@@ -335,6 +338,8 @@ static void virtio_blk_handle_output(VirtIODevice *vdev, VirtQueue *vq)
         do_multiwrite(mrb.old_bs, mrb.blkreq, mrb.num_writes);
     }
 
+    bdrv_io_unplug(s->bs);
+
     /*
      * FIXME: Want to check for completions before returning to guest mode,
      * so cached reads and writes are reported as quickly as possible. But
@@ -356,6 +361,8 @@ static void virtio_blk_dma_restart_bh(void *opaque)
 
     s->rq = NULL;
 
+    bdrv_io_plug(s->bs);
+
     while (req) {
         virtio_blk_handle_request(req, &mrb);
         req = req->next;
@@ -364,6 +371,8 @@ static void virtio_blk_dma_restart_bh(void *opaque)
     if (mrb.num_writes > 0) {
         do_multiwrite(mrb.old_bs, mrb.blkreq, mrb.num_writes);
     }
+
+    bdrv_io_unplug(s->bs);
 }
 
 static void virtio_blk_dma_restart_cb(void *opaque, int running, int reason)
@@ -25,6 +25,12 @@
  */
 #define MAX_EVENTS 128
 
+/*
+ * Maximum number of requests collected while plugged.  When it is reached
+ * the queue is submitted even though the caller did not unplug yet.
+ */
+#define MAX_QUEUED_IO MAX_EVENTS
+
 struct qemu_laiocb {
     BlockDriverAIOCB common;
     struct qemu_laio_state *ctx;
@@ -40,6 +46,11 @@ struct qemu_laio_state {
     int efd;
     int count;
     QLIST_HEAD(, qemu_laiocb) completed_reqs;
+
+    /* requests held back by laio_io_plug() */
+    int plugged;
+    int num_pending;
+    struct iocb *pending[MAX_QUEUED_IO];
 };
 
 static inline ssize_t io_event_ret(struct io_event *ev)
@@ -144,6 +155,9 @@ static void qemu_laio_completion_cb(void *opaque)
             qemu_laio_enqueue_completed(s, laiocb);
         }
     }
+
+    /* Requests that failed to be submitted from the plug queue */
+    qemu_laio_process_requests(s);
 }
 
 static int qemu_laio_flush_cb(void *opaque)
@@ -156,12 +170,36 @@ static int qemu_laio_flush_cb(void *opaque)
 static void laio_cancel(BlockDriverAIOCB *blockacb)
 {
     struct qemu_laiocb *laiocb = (struct qemu_laiocb *)blockacb;
+    struct qemu_laio_state *s = laiocb->ctx;
     struct io_event event;
-    int ret;
+    int ret, i;
 
-    if (laiocb->ret != -EINPROGRESS)
+    if (laiocb->ret == -ECANCELED)
         return;
 
+    /*
+     * Finished, or refused from the plug queue, but the callback hasn't run
+     * yet: it must not run after the request has been cancelled.
+     */
+    if (laiocb->ret != -EINPROGRESS) {
+        QLIST_REMOVE(laiocb, node);
+        s->count--;
+        qemu_aio_release(laiocb);
+        return;
+    }
+
+    /* Still waiting in the plug queue, so the kernel never saw it */
+    for (i = 0; i < s->num_pending; i++) {
+        if (s->pending[i] == &laiocb->iocb) {
+            s->num_pending--;
+            memmove(&s->pending[i], &s->pending[i + 1],
+                    (s->num_pending - i) * sizeof(s->pending[0]));
+            s->count--;
+            qemu_aio_release(laiocb);
+            return;
+        }
+    }
+
     /*
      * Note that as of Linux 2.6.31 neither the block device code nor any
      * filesystem implements cancellation of AIO request.
@@ -184,6 +222,61 @@ static void laio_cancel(BlockDriverAIOCB *blockacb)
         qemu_laio_completion_cb(laiocb->ctx);
 }
 
+/*
+ * Submits all requests in the plug queue with as few io_submit calls as
+ * possible.  Requests the kernel refuses are completed with an error from
+ * the completion handler, never from within this function, so that callers
+ * of laio_submit() don't see their callback run before they get the ACB.
+ */
+static void laio_submit_pending(struct qemu_laio_state *s)
+{
+    struct qemu_laiocb *laiocb;
+    uint64_t val = 1;
+    int done = 0;
+    int ret = 0;
+
+    while (done < s->num_pending) {
+        ret = io_submit(s->ctx, s->num_pending - done, &s->pending[done]);
+        if (ret == -EINTR) {
+            continue;
+        }
+        if (ret <= 0) {
+            break;
+        }
+        done += ret;
+    }
+
+    if (done < s->num_pending) {
+        for (; done < s->num_pending; done++) {
+            laiocb = container_of(s->pending[done], struct qemu_laiocb, iocb);
+            laiocb->ret = ret < 0 ? ret : -EIO;
+            QLIST_INSERT_HEAD(&s->completed_reqs, laiocb, node);
+        }
+        if (write(s->efd, &val, sizeof(val)) != sizeof(val)) {
+            fprintf(stderr, "%s: failed to signal eventfd\n", __func__);
+        }
+    }
+
+    s->num_pending = 0;
+}
+
+void laio_io_plug(void *aio_ctx)
+{
+    struct qemu_laio_state *s = aio_ctx;
+
+    s->plugged++;
+}
+
+void laio_io_unplug(void *aio_ctx)
+{
+    struct qemu_laio_state *s = aio_ctx;
+
+    assert(s->plugged > 0);
+    if (--s->plugged == 0 && s->num_pending > 0) {
+        laio_submit_pending(s);
+    }
+}
+
 static AIOPool laio_pool = {
     .aiocb_size         = sizeof(struct qemu_laiocb),
     .cancel             = laio_cancel,
@@ -223,6 +316,14 @@ BlockDriverAIOCB *laio_submit(BlockDriverState *bs, void *aio_ctx, int fd,
     io_set_eventfd(&laiocb->iocb, s->efd);
     s->count++;
 
+    if (s->plugged) {
+        s->pending[s->num_pending++] = iocbs;
+        if (s->num_pending == MAX_QUEUED_IO) {
+            laio_submit_pending(s);
+        }
+        return &laiocb->common;
+    }
+
     if (io_submit(s->ctx, 1, &iocbs) < 0)
         goto out_dec_count;
     return &laiocb->common;
@@ -0,0 +1,550 @@
+/*
+ * QEMU live migration: RAM pages over parallel connections
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ *
+ */
+
+#include <signal.h>
+#include <poll.h>
+
+#include "qemu-common.h"
+#include "qemu_socket.h"
+#include "qemu-thread.h"
+#include "migration-channels.h"
+
+/*
+ * Besides the main migration connection, RAM pages can be sent over a number
+ * of additional TCP connections ("channels"), each one served by a thread on
+ * both sides. A page is always sent over the same channel, so the pages on
+ * one channel arrive in the order they were sent; there is no ordering between
+ * channels. Device state and all other sections stay on the main connection.
+ *
+ * A channel starts with a header (be32 magic, be32 version) followed by
+ * records: be64 page address | flags, then the page contents for
+ * MIG_CHANNEL_PAGE or a single byte the page is filled with for
+ * MIG_CHANNEL_FILL. MIG_CHANNEL_END ends the channel.
+ *
+ * The sender double buffers: the main thread fills one buffer per channel
+ * while the channel thread writes out the other one.
+ */
+
+#define MIG_CHANNEL_MAGIC       0x514d4348 /* "QMCH" */
+#define MIG_CHANNEL_VERSION     0
+
+#define MIG_CHANNEL_PAGE        0x01
+#define MIG_CHANNEL_FILL        0x02
+#define MIG_CHANNEL_END         0x04
+#define MIG_CHANNEL_FLAGS       0xff
+
+#define MIG_CHANNEL_BUF_SIZE    (1024 * 1024)
+
+typedef struct MigChannel {
+    MigChannels *mc;
+    QemuThread thread;
+    int fd;
+
+    /* outgoing: filled by the main thread */
+    uint8_t *fill_buf;
+    int fill_len;
+    /* outgoing: owned by the channel thread while send_len is non-zero */
+    uint8_t *send_buf;
+    int send_len;
+
+    /* incoming: the end record has been received */
+    int done;
+} MigChannel;
+
+struct MigChannels {
+    int outgoing;
+    int nb;
+    MigChannel *channels;
+    int started;
+    struct sockaddr_in addr;
+
+    int page_size;
+    MigRAMBlock *blocks;
+    int nb_blocks;
+
+    QemuMutex lock;
+    QemuCond cond;
+    int quit;
+    int error;
+
+    /* outgoing: bytes queued by the main thread */
+    uint64_t bytes;
+};
+
+static int listen_fd = -1;
+static MigChannels *incoming_channels;
+
+static int read_full(int fd, void *buf, size_t size)
+{
+    uint8_t *p = buf;
+    ssize_t ret;
+
+    while (size > 0) {
+        ret = recv(fd, p, size, 0);
+        if (ret < 0 && errno == EINTR) {
+            continue;
+        }
+        if (ret <= 0) {
+            return -1;
+        }
+        p += ret;
+        size -= ret;
+    }
+    return 0;
+}
+
+static int write_full(int fd, const void *buf, size_t size)
+{
+    const uint8_t *p = buf;
+    ssize_t ret;
+
+    while (size > 0) {
+        ret = send(fd, p, size, 0);
+        if (ret < 0 && errno == EINTR) {
+            continue;
+        }
+        if (ret <= 0) {
+            return -1;
+        }
+        p += ret;
+        size -= ret;
+    }
+    return 0;
+}
+
+static MigChannels *channels_new(int outgoing, int nb)
+{
+    MigChannels *mc;
+    int i;
+
+    mc = qemu_mallocz(sizeof(*mc));
+    mc->outgoing = outgoing;
+    mc->nb = nb;
+    mc->channels = qemu_mallocz(nb * sizeof(MigChannel));
+    qemu_mutex_init(&mc->lock);
+    qemu_cond_init(&mc->cond);
+
+    for (i = 0; i < nb; i++) {
+        mc->channels[i].mc = mc;
+        mc->channels[i].fd = -1;
+    }
+    return mc;
+}
+
+static void channels_start(MigChannels *mc, void *(*fn)(void *))
+{
+    sigset_t set, oldset;
+    int i;
+
+    /* signals are handled by the main thread */
+    sigfillset(&set);
+    pthread_sigmask(SIG_SETMASK, &set, &oldset);
+    for (i = 0; i < mc->nb; i++) {
+        qemu_thread_create(&mc->channels[i].thread, fn, &mc->channels[i]);
+    }
+    pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+    mc->started = 1;
+}
+
+/* Outgoing */
+
+static void *channel_send_thread(void *opaque)
+{
+    MigChannel *c = opaque;
+    MigChannels *mc = c->mc;
+    uint32_t hdr[2];
+    int ret, len, err = 0;
+
+    do {
+        ret = connect(c->fd, (struct sockaddr *)&mc->addr, sizeof(mc->addr));
+    } while (ret < 0 && errno == EINTR);
+    if (ret < 0) {
+        err = 1;
+    } else {
+        hdr[0] = cpu_to_be32(MIG_CHANNEL_MAGIC);
+        hdr[1] = cpu_to_be32(MIG_CHANNEL_VERSION);
+        err = write_full(c->fd, hdr, sizeof(hdr)) < 0;
+    }
+
+    qemu_mutex_lock(&mc->lock);
+    for (;;) {
+        if (err) {
+            mc->error = 1;
+        }
+        while (!c->send_len && !mc->quit) {
+            qemu_cond_wait(&mc->cond, &mc->lock);
+        }
+        if (!c->send_len) {
+            break;
+        }
+        len = c->send_len;
+        qemu_mutex_unlock(&mc->lock);
+
+        /* after an error, buffers are dropped so that the sender can't hang */
+        if (!err && write_full(c->fd, c->send_buf, len) < 0) {
+            err = 1;
+        }
+
+        qemu_mutex_lock(&mc->lock);
+        c->send_len = 0;
+        qemu_cond_broadcast(&mc->cond);
+    }
+    qemu_mutex_unlock(&mc->lock);
+
+    return NULL;
+}
+
+/*
+ * Opens nb channels to addr. The connections are made by the channel threads;
+ * connection errors are reported by mig_channels_has_error().
+ */
+MigChannels *mig_channels_connect(const struct sockaddr_in *addr, int nb)
+{
+    MigChannels *mc;
+    int i;
+
+    mc = channels_new(1, nb);
+    mc->addr = *addr;
+    for (i = 0; i < nb; i++) {
+        mc->channels[i].fill_buf = qemu_malloc(MIG_CHANNEL_BUF_SIZE);
+        mc->channels[i].send_buf = qemu_malloc(MIG_CHANNEL_BUF_SIZE);
+        mc->channels[i].fd = qemu_socket(PF_INET, SOCK_STREAM, 0);
+        if (mc->channels[i].fd < 0) {
+            mig_channels_free(mc);
+            return NULL;
+        }
+    }
+    channels_start(mc, channel_send_thread);
+
+    return mc;
+}
+
+int mig_channels_count(MigChannels *mc)
+{
+    return mc->nb;
+}
+
+/* Hands the filled buffer of c to its thread. Called with the lock held. */
+static void channel_flush(MigChannels *mc, MigChannel *c)
+{
+    uint8_t *tmp;
+
+    while (c->send_len) {
+        qemu_cond_wait(&mc->cond, &mc->lock);
+    }
+    if (!c->fill_len) {
+        return;
+    }
+    tmp = c->send_buf;
+    c->send_buf = c->fill_buf;
+    c->send_len = c->fill_len;
+    c->fill_buf = tmp;
+    c->fill_len = 0;
+    qemu_cond_broadcast(&mc->cond);
+}
+
+static void channel_put(MigChannels *mc, MigChannel *c, uint64_t addr,
+                        int flags, const void *data, int len)
+{
+    uint64_t val = cpu_to_be64(addr | flags);
+
+    if (c->fill_len + sizeof(val) + len > MIG_CHANNEL_BUF_SIZE) {
+        qemu_mutex_lock(&mc->lock);
+        channel_flush(mc, c);
+        qemu_mutex_unlock(&mc->lock);
+    }
+    memcpy(c->fill_buf + c->fill_len, &val, sizeof(val));
+    if (len) {
+        memcpy(c->fill_buf + c->fill_len + sizeof(val), data, len);
+    }
+    c->fill_len += sizeof(val) + len;
+    mc->bytes += sizeof(val) + len;
+}
+
+static MigChannel *channel_for_page(MigChannels *mc, uint64_t addr,
+                                    int page_size)
+{
+    return &mc->channels[(addr / page_size) % mc->nb];
+}
+
+/* Queues a copy of the page at addr */
+void mig_channels_put_page(MigChannels *mc, uint64_t addr, const uint8_t *page,
+                           int page_size)
+{
+    channel_put(mc, channel_for_page(mc, addr, page_size), addr,
+                MIG_CHANNEL_PAGE, page, page_size);
+}
+
+/* Queues a page at addr whose bytes are all ch */
+void mig_channels_put_fill(MigChannels *mc, uint64_t addr, uint8_t ch,
+                           int page_size)
+{
+    channel_put(mc, channel_for_page(mc, addr, page_size), addr,
+                MIG_CHANNEL_FILL, &ch, 1);
+}
+
+/* Returns the number of bytes queued on all channels so far */
+uint64_t mig_channels_bytes(MigChannels *mc)
+{
+    return mc->bytes;
+}
+
+int mig_channels_has_error(MigChannels *mc)
+{
+    int error;
+
+    qemu_mutex_lock(&mc->lock);
+    error = mc->error;
+    qemu_mutex_unlock(&mc->lock);
+
+    return error;
+}
+
+/* Incoming */
+
+static int channel_accept(MigChannels *mc)
+{
+    struct sockaddr_in addr;
+    socklen_t addrlen;
+    struct pollfd pfd;
+    int fd, ret;
+
+    pfd.fd = listen_fd;
+    pfd.events = POLLIN;
+
+    for (;;) {
+        qemu_mutex_lock(&mc->lock);
+        ret = mc->quit;
+        qemu_mutex_unlock(&mc->lock);
+        if (ret) {
+            return -1;
+        }
+
+        /* wake up now and then to check whether we are still wanted */
+        ret = poll(&pfd, 1, 100);
+        if (ret < 0 && errno != EINTR) {
+            return -1;
+        }
+        if (ret <= 0) {
+            continue;
+        }
+
+        addrlen = sizeof(addr);
+        fd = qemu_accept(listen_fd, (struct sockaddr *)&addr, &addrlen);
+        if (fd >= 0) {
+            return fd;
+        }
+        if (errno != EINTR && errno != EAGAIN && errno != EWOULDBLOCK) {
+            return -1;
+        }
+    }
+}
+
+static uint8_t *channel_page_ptr(MigChannels *mc, uint64_t addr)
+{
+    MigRAMBlock *b;
+    int i;
+
+    for (i = 0; i < mc->nb_blocks; i++) {
+        b = &mc->blocks[i];
+        if (addr >= b->offset && addr - b->offset + mc->page_size <= b->length) {
+            return b->host + (addr - b->offset);
+        }
+    }
+    return NULL;
+}
+
+static void *channel_recv_thread(void *opaque)
+{
+    MigChannel *c = opaque;
+    MigChannels *mc = c->mc;
+    uint32_t hdr[2];
+    uint64_t val;
+    uint8_t *host, ch;
+    int fd, flags;
+
+    fd = channel_accept(mc);
+    if (fd < 0) {
+        goto fail;
+    }
+
+    qemu_mutex_lock(&mc->lock);
+    c->fd = fd;
+    if (mc->quit) {
+        qemu_mutex_unlock(&mc->lock);
+        goto fail;
+    }
+    qemu_mutex_unlock(&mc->lock);
+
+    if (read_full(fd, hdr, sizeof(hdr)) < 0 ||
+        be32_to_cpu(hdr[0]) != MIG_CHANNEL_MAGIC ||
+        be32_to_cpu(hdr[1]) != MIG_CHANNEL_VERSION) {
+        goto fail;
+    }
+
+    for (;;) {
+        if (read_full(fd, &val, sizeof(val)) < 0) {
+            goto fail;
+        }
+        val = be64_to_cpu(val);
+        flags = val & MIG_CHANNEL_FLAGS;
+        val &= ~(uint64_t)MIG_CHANNEL_FLAGS;
+
+        if (flags == MIG_CHANNEL_END) {
+            break;
+        }
+
+        host = channel_page_ptr(mc, val);
+        if (!host) {
+            goto fail;
+        }
+        if (flags == MIG_CHANNEL_PAGE) {
+            if (read_full(fd, host, mc->page_size) < 0) {
+                goto fail;
+            }
+        } else if (flags == MIG_CHANNEL_FILL) {
+            if (read_full(fd, &ch, 1) < 0) {
+                goto fail;
+            }
+            memset(host, ch, mc->page_size);
+        } else {
+            goto fail;
+        }
+    }
+
+    qemu_mutex_lock(&mc->lock);
+    c->done = 1;
+    qemu_cond_broadcast(&mc->cond);
+    qemu_mutex_unlock(&mc->lock);
+    return NULL;
+
+fail:
+    qemu_mutex_lock(&mc->lock);
+    mc->error = 1;
+    qemu_cond_broadcast(&mc->cond);
+    qemu_mutex_unlock(&mc->lock);
+    return NULL;
+}
+
+/*
+ * Sets the socket that incoming channels are accepted on, -1 if there is
+ * none. Resetting it releases channels left over from a failed migration.
+ */
+void mig_channels_listen(int fd)
+{
+    listen_fd = fd;
+    if (fd < 0 && incoming_channels) {
+        mig_channels_free(incoming_channels);
+    }
+}
+
+/*
+ * Accepts nb channels on the listening socket in the background. Pages are
+ * written to the host addresses of the given RAM blocks.
+ */
+MigChannels *mig_channels_accept(int nb, int page_size,
+                                 const MigRAMBlock *blocks, int nb_blocks)
+{
+    MigChannels *mc;
+
+    if (listen_fd < 0 || incoming_channels || nb < 1 ||
+        nb > MIG_CHANNELS_MAX) {
+        return NULL;
+    }
+
+    mc = channels_new(0, nb);
+    mc->page_size = page_size;
+    mc->blocks = qemu_malloc(nb_blocks * sizeof(MigRAMBlock));
+    memcpy(mc->blocks, blocks, nb_blocks * sizeof(MigRAMBlock));
+    mc->nb_blocks = nb_blocks;
+    channels_start(mc, channel_recv_thread);
+
+    incoming_channels = mc;
+    return mc;
+}
+
+/* Returns the channels being received, if any */
+MigChannels *mig_channels_incoming(void)
+{
+    return incoming_channels;
+}
+
+/*
+ * Outgoing: ends all channels and waits until everything has been written.
+ * Incoming: waits until all channels have ended.
+ * Returns -EIO if a channel has failed.
+ */
+int mig_channels_finish(MigChannels *mc)
+{
+    MigChannel *c;
+    int i, ret;
+
+    if (mc->outgoing) {
+        for (i = 0; i < mc->nb; i++) {
+            channel_put(mc, &mc->channels[i], 0, MIG_CHANNEL_END, NULL, 0);
+        }
+    }
+
+    qemu_mutex_lock(&mc->lock);
+    for (i = 0; i < mc->nb; i++) {
+        c = &mc->channels[i];
+        if (mc->outgoing) {
+            channel_flush(mc, c);
+            while (c->send_len) {
+                qemu_cond_wait(&mc->cond, &mc->lock);
+            }
+        } else {
+            while (!c->done && !mc->error) {
+                qemu_cond_wait(&mc->cond, &mc->lock);
+            }
+        }
+    }
+    ret = mc->error ? -EIO : 0;
+    qemu_mutex_unlock(&mc->lock);
+
+    return ret;
+}
+
+/* Stops the channel threads and closes the connections */
+void mig_channels_free(MigChannels *mc)
+{
+    MigChannel *c;
+    int i;
+
+    /* wake up threads blocked on their socket */
+    qemu_mutex_lock(&mc->lock);
+    mc->quit = 1;
+    for (i = 0; i < mc->nb; i++) {
+        if (mc->channels[i].fd >= 0) {
+            shutdown(mc->channels[i].fd, SHUT_RDWR);
+        }
+    }
+    qemu_cond_broadcast(&mc->cond);
+    qemu_mutex_unlock(&mc->lock);
+
+    for (i = 0; i < mc->nb; i++) {
+        c = &mc->channels[i];
+        if (mc->started) {
+            qemu_thread_join(&c->thread);
+        }
+        if (c->fd >= 0) {
+            closesocket(c->fd);
+        }
+        qemu_free(c->fill_buf);
+        qemu_free(c->send_buf);
+    }
+
+    if (mc == incoming_channels) {
+        incoming_channels = NULL;
+    }
+    qemu_cond_destroy(&mc->cond);
+    qemu_mutex_destroy(&mc->lock);
+    qemu_free(mc->channels);
+    qemu_free(mc->blocks);
+    qemu_free(mc);
+}
@@ -0,0 +1,89 @@
+/*
+ * QEMU live migration: RAM pages over parallel connections
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ *
+ */
+
+#ifndef QEMU_MIGRATION_CHANNELS_H
+#define QEMU_MIGRATION_CHANNELS_H
+
+#include "qemu-common.h"
+
+#define MIG_CHANNELS_MAX 16
+
+typedef struct MigChannels MigChannels;
+
+typedef struct MigRAMBlock {
+    uint8_t *host;
+    uint64_t offset;
+    uint64_t length;
+} MigRAMBlock;
+
+#ifdef CONFIG_POSIX
+struct sockaddr_in;
+
+MigChannels *mig_channels_connect(const struct sockaddr_in *addr, int nb);
+int mig_channels_count(MigChannels *mc);
+void mig_channels_put_page(MigChannels *mc, uint64_t addr, const uint8_t *page,
+                           int page_size);
+void mig_channels_put_fill(MigChannels *mc, uint64_t addr, uint8_t ch,
+                           int page_size);
+uint64_t mig_channels_bytes(MigChannels *mc);
+int mig_channels_has_error(MigChannels *mc);
+
+void mig_channels_listen(int fd);
+MigChannels *mig_channels_accept(int nb, int page_size,
+                                 const MigRAMBlock *blocks, int nb_blocks);
+
+MigChannels *mig_channels_incoming(void);
+
+int mig_channels_finish(MigChannels *mc);
+void mig_channels_free(MigChannels *mc);
+#else
+struct sockaddr_in;
+
+static inline MigChannels *mig_channels_connect(const struct sockaddr_in *addr,
+                                                int nb)
+{
+    return NULL;
+}
+static inline void mig_channels_listen(int fd) {}
+static inline MigChannels *mig_channels_accept(int nb, int page_size,
+                                               const MigRAMBlock *blocks,
+                                               int nb_blocks)
+{
+    return NULL;
+}
+
+/* without threads there are never any channels */
+static inline MigChannels *mig_channels_incoming(void)
+{
+    return NULL;
+}
+static inline int mig_channels_count(MigChannels *mc)
+{
+    return 0;
+}
+static inline void mig_channels_put_page(MigChannels *mc, uint64_t addr,
+                                         const uint8_t *page,
+                                         int page_size) {}
+static inline void mig_channels_put_fill(MigChannels *mc, uint64_t addr,
+                                         uint8_t ch, int page_size) {}
+static inline uint64_t mig_channels_bytes(MigChannels *mc)
+{
+    return 0;
+}
+static inline int mig_channels_has_error(MigChannels *mc)
+{
+    return 0;
+}
+static inline int mig_channels_finish(MigChannels *mc)
+{
+    return 0;
+}
+static inline void mig_channels_free(MigChannels *mc) {}
+#endif
+
+#endif
@@ -0,0 +1,442 @@
+/*
+ * QEMU live migration: multi-threaded page compression
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ *
+ */
+
+#include <signal.h>
+#include <time.h>
+#include <zlib.h>
+
+#include "qemu-common.h"
+#include "qemu-thread.h"
+#include "migration-compress.h"
+
+/*
+ * A pool of worker threads that deflate (or inflate) one page at a time.
+ *
+ * Every worker owns its buffers and its zlib stream. The main thread hands
+ * a page to an IDLE worker and marks it BUSY; the worker marks it DONE when
+ * it has finished. Only the main thread moves a worker from DONE back to
+ * IDLE, after it has passed on the result, so the buffers of a DONE worker
+ * can be used without holding the lock.
+ *
+ * A page is never in flight twice, which keeps the records for a page in
+ * the order in which they were submitted.
+ */
+
+enum {
+    WORKER_IDLE,
+    WORKER_BUSY,
+    WORKER_DONE,
+};
+
+typedef struct PageWorker {
+    CompressPool *pool;
+    QemuThread thread;
+    int state;
+    z_stream stream;
+
+    /* the page being compressed, or the destination of a decompression */
+    uint64_t addr;
+    uint8_t *dst;
+
+    uint8_t *in;
+    int in_len;
+    uint8_t *out;
+    int out_len;
+    int compressed;
+} PageWorker;
+
+struct CompressPool {
+    int decompress;
+    int level;
+    int page_size;
+    int nb_workers;
+    PageWorker *workers;
+    CompressPutFunc *put;
+    void *opaque;
+
+    QemuMutex lock;
+    QemuCond work_cond;
+    QemuCond done_cond;
+    int quit;
+    int error;
+
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+    uint64_t time_ns;
+};
+
+static uint64_t thread_clock_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Called without the lock held; the buffers belong to the worker */
+static void worker_compress(PageWorker *w)
+{
+    CompressPool *pool = w->pool;
+    z_stream *s = &w->stream;
+    int ret;
+
+    deflateReset(s);
+    s->next_in = w->in;
+    s->avail_in = pool->page_size;
+    s->next_out = w->out;
+    s->avail_out = pool->page_size - 1;
+
+    ret = deflate(s, Z_FINISH);
+    if (ret == Z_STREAM_END) {
+        w->out_len = s->total_out;
+        w->compressed = 1;
+    } else {
+        /* incompressible, the page is sent as it is */
+        w->out_len = pool->page_size;
+        w->compressed = 0;
+    }
+}
+
+static int worker_decompress(PageWorker *w)
+{
+    CompressPool *pool = w->pool;
+    z_stream *s = &w->stream;
+    int ret;
+
+    inflateReset(s);
+    s->next_in = w->in;
+    s->avail_in = w->in_len;
+    s->next_out = w->dst;
+    s->avail_out = pool->page_size;
+
+    ret = inflate(s, Z_FINISH);
+    if (ret != Z_STREAM_END || s->total_out != pool->page_size) {
+        return -1;
+    }
+    return 0;
+}
+
+static void *worker_thread(void *opaque)
+{
+    PageWorker *w = opaque;
+    CompressPool *pool = w->pool;
+    uint64_t start;
+    int ret = 0;
+
+    qemu_mutex_lock(&pool->lock);
+    for (;;) {
+        while (w->state != WORKER_BUSY && !pool->quit) {
+            qemu_cond_wait(&pool->work_cond, &pool->lock);
+        }
+        if (pool->quit) {
+            break;
+        }
+        qemu_mutex_unlock(&pool->lock);
+
+        start = thread_clock_ns();
+        if (pool->decompress) {
+            ret = worker_decompress(w);
+        } else {
+            worker_compress(w);
+        }
+
+        qemu_mutex_lock(&pool->lock);
+        pool->time_ns += thread_clock_ns() - start;
+        pool->bytes_in += pool->page_size;
+        pool->bytes_out += pool->decompress ? w->in_len : w->out_len;
+        if (ret < 0) {
+            pool->error = 1;
+        }
+        w->state = WORKER_DONE;
+        qemu_cond_broadcast(&pool->done_cond);
+    }
+    qemu_mutex_unlock(&pool->lock);
+
+    return NULL;
+}
+
+static CompressPool *pool_new(int decompress, int nb_threads, int level,
+                              int page_size)
+{
+    CompressPool *pool;
+    PageWorker *w;
+    sigset_t set, oldset;
+    int i, ret;
+
+    pool = qemu_mallocz(sizeof(*pool));
+    pool->decompress = decompress;
+    pool->level = level;
+    pool->page_size = page_size;
+    pool->nb_workers = nb_threads;
+    pool->workers = qemu_mallocz(nb_threads * sizeof(PageWorker));
+    qemu_mutex_init(&pool->lock);
+    qemu_cond_init(&pool->work_cond);
+    qemu_cond_init(&pool->done_cond);
+
+    for (i = 0; i < nb_threads; i++) {
+        w = &pool->workers[i];
+        w->pool = pool;
+        w->state = WORKER_IDLE;
+        w->in = qemu_malloc(page_size);
+        if (decompress) {
+            ret = inflateInit2(&w->stream, -MAX_WBITS);
+        } else {
+            w->out = qemu_malloc(page_size);
+            ret = deflateInit2(&w->stream, level, Z_DEFLATED, -MAX_WBITS, 8,
+                               Z_DEFAULT_STRATEGY);
+        }
+        if (ret != Z_OK) {
+            fprintf(stderr, "migration: zlib initialisation failed\n");
+            goto fail;
+        }
+    }
+
+    /* signals are handled by the main thread */
+    sigfillset(&set);
+    pthread_sigmask(SIG_SETMASK, &set, &oldset);
+    for (i = 0; i < nb_threads; i++) {
+        qemu_thread_create(&pool->workers[i].thread, worker_thread,
+                           &pool->workers[i]);
+    }
+    pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+
+    return pool;
+
+fail:
+    /* worker i has no stream, the ones before it do */
+    qemu_free(pool->workers[i].in);
+    qemu_free(pool->workers[i].out);
+    while (--i >= 0) {
+        w = &pool->workers[i];
+        if (decompress) {
+            inflateEnd(&w->stream);
+        } else {
+            deflateEnd(&w->stream);
+        }
+        qemu_free(w->in);
+        qemu_free(w->out);
+    }
+    qemu_cond_destroy(&pool->done_cond);
+    qemu_cond_destroy(&pool->work_cond);
+    qemu_mutex_destroy(&pool->lock);
+    qemu_free(pool->workers);
+    qemu_free(pool);
+    return NULL;
+}
+
+CompressPool *compress_pool_new(int nb_threads, int level, int page_size,
+                                CompressPutFunc *put, void *opaque)
+{
+    CompressPool *pool = pool_new(0, nb_threads, level, page_size);
+
+    if (pool) {
+        pool->put = put;
+        pool->opaque = opaque;
+    }
+    return pool;
+}
+
+CompressPool *decompress_pool_new(int nb_threads, int page_size)
+{
+    return pool_new(1, nb_threads, 0, page_size);
+}
+
+/*
+ * Passes on the result of a DONE worker and makes it IDLE. Called with the
+ * lock held, which is dropped while the result is being written.
+ */
+static void pool_complete(CompressPool *pool, PageWorker *w)
+{
+    if (!pool->decompress) {
+        qemu_mutex_unlock(&pool->lock);
+        pool->put(pool->opaque, w->addr,
+                  w->compressed ? w->out : w->in, w->out_len, w->compressed);
+        qemu_mutex_lock(&pool->lock);
+    }
+    w->state = WORKER_IDLE;
+}
+
+/* Returns an IDLE worker, waiting for one to finish if necessary */
+static PageWorker *pool_get_idle(CompressPool *pool)
+{
+    PageWorker *w;
+    int i;
+
+    for (;;) {
+        for (i = 0; i < pool->nb_workers; i++) {
+            w = &pool->workers[i];
+            if (w->state == WORKER_IDLE) {
+                return w;
+            }
+            if (w->state == WORKER_DONE) {
+                pool_complete(pool, w);
+                return w;
+            }
+        }
+        qemu_cond_wait(&pool->done_cond, &pool->lock);
+    }
+}
+
+/* Waits until no worker is busy with the page identified by addr or dst */
+static void pool_wait_page(CompressPool *pool, uint64_t addr, uint8_t *dst)
+{
+    PageWorker *w;
+    int i;
+
+    for (i = 0; i < pool->nb_workers; i++) {
+        w = &pool->workers[i];
+        if (w->state == WORKER_IDLE ||
+            (pool->decompress ? w->dst != dst : w->addr != addr)) {
+            continue;
+        }
+        while (w->state == WORKER_BUSY) {
+            qemu_cond_wait(&pool->done_cond, &pool->lock);
+        }
+        pool_complete(pool, w);
+        return;
+    }
+}
+
+static void pool_flush(CompressPool *pool)
+{
+    PageWorker *w;
+    int i;
+
+    for (i = 0; i < pool->nb_workers; i++) {
+        w = &pool->workers[i];
+        while (w->state == WORKER_BUSY) {
+            qemu_cond_wait(&pool->done_cond, &pool->lock);
+        }
+        if (w->state == WORKER_DONE) {
+            pool_complete(pool, w);
+        }
+    }
+}
+
+void compress_pool_submit(CompressPool *pool, uint64_t addr,
+                          const uint8_t *page)
+{
+    PageWorker *w;
+
+    qemu_mutex_lock(&pool->lock);
+    pool_wait_page(pool, addr, NULL);
+    w = pool_get_idle(pool);
+    w->addr = addr;
+    memcpy(w->in, page, pool->page_size);
+    w->state = WORKER_BUSY;
+    qemu_cond_broadcast(&pool->work_cond);
+    qemu_mutex_unlock(&pool->lock);
+}
+
+/* Writes out the page at addr if it is still being compressed */
+void compress_pool_wait(CompressPool *pool, uint64_t addr)
+{
+    qemu_mutex_lock(&pool->lock);
+    pool_wait_page(pool, addr, NULL);
+    qemu_mutex_unlock(&pool->lock);
+}
+
+/* Writes out all pages that have been submitted */
+void compress_pool_flush(CompressPool *pool)
+{
+    qemu_mutex_lock(&pool->lock);
+    pool_flush(pool);
+    qemu_mutex_unlock(&pool->lock);
+}
+
+/*
+ * Returns the number of bytes fed into and produced by the compression, and
+ * the time the workers have spent on it in total.
+ */
+void compress_pool_stats(CompressPool *pool, uint64_t *bytes_in,
+                         uint64_t *bytes_out, uint64_t *time_ns)
+{
+    qemu_mutex_lock(&pool->lock);
+    *bytes_in = pool->bytes_in;
+    *bytes_out = pool->bytes_out;
+    *time_ns = pool->time_ns;
+    qemu_mutex_unlock(&pool->lock);
+}
+
+/*
+ * Inflates len bytes of data into the page at dst in the background. The
+ * data is copied, dst must stay valid until the page has been waited for.
+ */
+void decompress_pool_submit(CompressPool *pool, uint8_t *dst,
+                            const uint8_t *data, int len)
+{
+    PageWorker *w;
+
+    qemu_mutex_lock(&pool->lock);
+    pool_wait_page(pool, 0, dst);
+    w = pool_get_idle(pool);
+    w->dst = dst;
+    memcpy(w->in, data, len);
+    w->in_len = len;
+    w->state = WORKER_BUSY;
+    qemu_cond_broadcast(&pool->work_cond);
+    qemu_mutex_unlock(&pool->lock);
+}
+
+/*
+ * Waits until the page at dst is decompressed. Returns -EINVAL if any page
+ * so far has failed to decompress.
+ */
+int decompress_pool_wait(CompressPool *pool, uint8_t *dst)
+{
+    int ret;
+
+    qemu_mutex_lock(&pool->lock);
+    pool_wait_page(pool, 0, dst);
+    ret = pool->error ? -EINVAL : 0;
+    qemu_mutex_unlock(&pool->lock);
+
+    return ret;
+}
+
+int decompress_pool_flush(CompressPool *pool)
+{
+    int ret;
+
+    qemu_mutex_lock(&pool->lock);
+    pool_flush(pool);
+    ret = pool->error ? -EINVAL : 0;
+    qemu_mutex_unlock(&pool->lock);
+
+    return ret;
+}
+
+/* Stops the workers; pending compressed pages are not written out */
+void compress_pool_free(CompressPool *pool)
+{
+    PageWorker *w;
+    int i;
+
+    qemu_mutex_lock(&pool->lock);
+    pool->quit = 1;
+    qemu_cond_broadcast(&pool->work_cond);
+    qemu_mutex_unlock(&pool->lock);
+
+    for (i = 0; i < pool->nb_workers; i++) {
+        w = &pool->workers[i];
+        qemu_thread_join(&w->thread);
+        if (pool->decompress) {
+            inflateEnd(&w->stream);
+        } else {
+            deflateEnd(&w->stream);
+        }
+        qemu_free(w->in);
+        qemu_free(w->out);
+    }
+
+    qemu_cond_destroy(&pool->done_cond);
+    qemu_cond_destroy(&pool->work_cond);
+    qemu_mutex_destroy(&pool->lock);
+    qemu_free(pool->workers);
+    qemu_free(pool);
+}
@@ -0,0 +1,75 @@
+/*
+ * QEMU live migration: multi-threaded page compression
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ *
+ */
+
+#ifndef QEMU_MIGRATION_COMPRESS_H
+#define QEMU_MIGRATION_COMPRESS_H
+
+#include "qemu-common.h"
+
+typedef struct CompressPool CompressPool;
+
+/*
+ * Called in the main thread for each compressed page. If the page didn't
+ * compress, data is the original page and len is the page size.
+ */
+typedef void CompressPutFunc(void *opaque, uint64_t addr, const uint8_t *data,
+                             int len, int compressed);
+
+#ifdef CONFIG_POSIX
+CompressPool *compress_pool_new(int nb_threads, int level, int page_size,
+                                CompressPutFunc *put, void *opaque);
+void compress_pool_submit(CompressPool *pool, uint64_t addr,
+                          const uint8_t *page);
+void compress_pool_wait(CompressPool *pool, uint64_t addr);
+void compress_pool_flush(CompressPool *pool);
+void compress_pool_stats(CompressPool *pool, uint64_t *bytes_in,
+                         uint64_t *bytes_out, uint64_t *time_ns);
+
+CompressPool *decompress_pool_new(int nb_threads, int page_size);
+void decompress_pool_submit(CompressPool *pool, uint8_t *dst,
+                            const uint8_t *data, int len);
+int decompress_pool_wait(CompressPool *pool, uint8_t *dst);
+int decompress_pool_flush(CompressPool *pool);
+
+void compress_pool_free(CompressPool *pool);
+#else
+static inline CompressPool *compress_pool_new(int nb_threads, int level,
+                                              int page_size,
+                                              CompressPutFunc *put,
+                                              void *opaque)
+{
+    return NULL;
+}
+
+static inline CompressPool *decompress_pool_new(int nb_threads, int page_size)
+{
+    return NULL;
+}
+
+/* without threads there are never any pools */
+static inline void compress_pool_submit(CompressPool *pool, uint64_t addr,
+                                        const uint8_t *page) {}
+static inline void compress_pool_wait(CompressPool *pool, uint64_t addr) {}
+static inline void compress_pool_flush(CompressPool *pool) {}
+static inline void compress_pool_stats(CompressPool *pool, uint64_t *bytes_in,
+                                       uint64_t *bytes_out,
+                                       uint64_t *time_ns) {}
+static inline void decompress_pool_submit(CompressPool *pool, uint8_t *dst,
+                                          const uint8_t *data, int len) {}
+static inline int decompress_pool_wait(CompressPool *pool, uint8_t *dst)
+{
+    return 0;
+}
+static inline int decompress_pool_flush(CompressPool *pool)
+{
+    return 0;
+}
+static inline void compress_pool_free(CompressPool *pool) {}
+#endif
+
+#endif
@@ -0,0 +1,811 @@
+/*
+ * QEMU live migration: RAM image in a local file
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ *
+ */
+
+#include <signal.h>
+#include <sys/mman.h>
+
+#include "qemu-common.h"
+#include "qemu-thread.h"
+#include "migration.h"
+#include "monitor.h"
+#include "sysemu.h"
+#include "buffered_file.h"
+#include "migration-file.h"
+
+//#define DEBUG_MIGRATION_FILE
+
+#ifdef DEBUG_MIGRATION_FILE
+#define DPRINTF(fmt, ...) \
+    do { printf("migration-file: " fmt, ## __VA_ARGS__); } while (0)
+#else
+#define DPRINTF(fmt, ...) \
+    do { } while (0)
+#endif
+
+/*
+ * Migrating to a file keeps guest RAM out of the migration stream. The file
+ * starts with a header (be32 magic, be32 version, be64 offset and be64 size
+ * of the RAM image, be64 offset of the stream), followed by the RAM image
+ * and then by the usual migration stream, with the RAM section only telling
+ * that the pages are in the image.
+ *
+ * The image holds guest RAM at its RAM address: the page at addr is stored at
+ * offset + addr, so a page written again during a live migration overwrites
+ * its older copy and the image never grows past the size of guest RAM. Pages
+ * are written by a number of threads, each one in charge of a range of
+ * MIG_FILE_CHUNK bytes out of every MIG_FILE_THREADS * MIG_FILE_CHUNK; runs
+ * of contiguous pages are written at once, straight from guest RAM, with
+ * O_DIRECT if the file system supports it. Pages that are never written are
+ * holes and read as zeroes.
+ *
+ * On load, the image is read by as many threads into guest RAM, skipping the
+ * holes. With "lazy", the image is mapped over guest RAM instead, so that
+ * pages are only read when the guest touches them.
+ */
+
+#define MIG_FILE_MAGIC          0x514d4649 /* "QMFI" */
+#define MIG_FILE_VERSION        0
+
+/* alignment for O_DIRECT, of the image in the file */
+#define MIG_FILE_ALIGN          4096
+#define MIG_FILE_RAM_OFFSET     (1024 * 1024)
+
+/* largest write, and range of RAM always written by the same thread */
+#define MIG_FILE_CHUNK          (1024 * 1024)
+#define MIG_FILE_QUEUE          512
+#define MIG_FILE_LOAD_CHUNK     (8 * 1024 * 1024)
+
+typedef struct MigFileHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t ram_offset;
+    uint64_t ram_size;
+    uint64_t stream_offset;
+} MigFileHeader;
+
+typedef struct MigFileWrite {
+    uint64_t addr;
+    const uint8_t *host;
+    int len;
+} MigFileWrite;
+
+typedef struct MigFileWriter {
+    MigFile *mf;
+    QemuThread thread;
+    /* owned by the thread from head up to head + count */
+    MigFileWrite queue[MIG_FILE_QUEUE];
+    int head;
+    int count;
+} MigFileWriter;
+
+struct MigFile {
+    int fd;
+    int direct_fd;
+    uint64_t ram_offset;
+    uint64_t ram_size;
+    int lazy;
+
+    MigFileWriter *writers;
+    int nb;
+    int started;
+
+    /* incoming: next range to read */
+    MigRAMBlock *blocks;
+    int nb_blocks;
+    int load_block;
+    uint64_t load_offset;
+
+    QemuMutex lock;
+    QemuCond cond;
+    int quit;
+    int error;
+
+    /* outgoing: bytes queued by the main thread */
+    uint64_t bytes;
+};
+
+static MigFile *incoming_file;
+
+/*
+ * The image guest RAM is mapped from after a lazy load. Its unmodified pages
+ * are read from the file as long as the guest runs, so the file must not be
+ * changed until then.
+ */
+static int image_mapped;
+static dev_t image_dev;
+static ino_t image_ino;
+
+static int pwrite_full(int fd, const uint8_t *buf, size_t size, uint64_t pos)
+{
+    ssize_t ret;
+
+    while (size > 0) {
+        ret = pwrite(fd, buf, size, pos);
+        if (ret < 0 && errno == EINTR) {
+            continue;
+        }
+        if (ret < 0) {
+            return -errno;
+        }
+        if (ret == 0) {
+            return -EIO;
+        }
+        buf += ret;
+        pos += ret;
+        size -= ret;
+    }
+    return 0;
+}
+
+static int pread_full(int fd, uint8_t *buf, size_t size, uint64_t pos)
+{
+    ssize_t ret;
+
+    while (size > 0) {
+        ret = pread(fd, buf, size, pos);
+        if (ret < 0 && errno == EINTR) {
+            continue;
+        }
+        if (ret < 0) {
+            return -errno;
+        }
+        if (ret == 0) {
+            return -EIO;
+        }
+        buf += ret;
+        pos += ret;
+        size -= ret;
+    }
+    return 0;
+}
+
+static int file_aligned(const uint8_t *buf, size_t size, uint64_t pos)
+{
+    return ((uintptr_t)buf | size | pos) % MIG_FILE_ALIGN == 0;
+}
+
+static int file_open_direct(const char *path, int flags)
+{
+#ifdef O_DIRECT
+    return open(path, flags | O_DIRECT);
+#else
+    return -1;
+#endif
+}
+
+/* Falls back to the page cache if the file system refuses O_DIRECT */
+static int file_write(MigFile *mf, const uint8_t *buf, size_t size,
+                      uint64_t pos)
+{
+    int ret;
+
+    if (mf->direct_fd >= 0 && file_aligned(buf, size, pos)) {
+        ret = pwrite_full(mf->direct_fd, buf, size, pos);
+        if (ret != -EINVAL) {
+            return ret;
+        }
+    }
+    return pwrite_full(mf->fd, buf, size, pos);
+}
+
+static int file_read(MigFile *mf, uint8_t *buf, size_t size, uint64_t pos)
+{
+    int ret;
+
+    if (mf->direct_fd >= 0 && file_aligned(buf, size, pos)) {
+        ret = pread_full(mf->direct_fd, buf, size, pos);
+        if (ret != -EINVAL) {
+            return ret;
+        }
+    }
+    return pread_full(mf->fd, buf, size, pos);
+}
+
+static MigFile *file_new(void)
+{
+    MigFile *mf;
+
+    mf = qemu_mallocz(sizeof(*mf));
+    mf->fd = -1;
+    mf->direct_fd = -1;
+    mf->ram_offset = MIG_FILE_RAM_OFFSET;
+    qemu_mutex_init(&mf->lock);
+    qemu_cond_init(&mf->cond);
+    return mf;
+}
+
+static void file_thread_create(QemuThread *thread, void *(*fn)(void *),
+                               void *opaque)
+{
+    sigset_t set, oldset;
+
+    /* signals are handled by the main thread */
+    sigfillset(&set);
+    pthread_sigmask(SIG_SETMASK, &set, &oldset);
+    qemu_thread_create(thread, fn, opaque);
+    pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+}
+
+/* Outgoing */
+
+static void *file_write_thread(void *opaque)
+{
+    MigFileWriter *w = opaque;
+    MigFile *mf = w->mf;
+    MigFileWrite *first, *next;
+    int n, len, quit, err = 0;
+
+    qemu_mutex_lock(&mf->lock);
+    for (;;) {
+        while (!w->count && !mf->quit) {
+            qemu_cond_wait(&mf->cond, &mf->lock);
+        }
+        if (!w->count) {
+            break;
+        }
+
+        /* write a run of contiguous pages at once */
+        first = &w->queue[w->head];
+        len = first->len;
+        for (n = 1; n < w->count && len < MIG_FILE_CHUNK; n++) {
+            next = &w->queue[(w->head + n) % MIG_FILE_QUEUE];
+            if (next->addr != first->addr + len ||
+                next->host != first->host + len) {
+                break;
+            }
+            len += next->len;
+        }
+        quit = mf->quit;
+        qemu_mutex_unlock(&mf->lock);
+
+        /* after an error, pages are dropped so that the sender can't hang */
+        if (!err && !quit &&
+            file_write(mf, first->host, len, mf->ram_offset + first->addr) < 0) {
+            err = 1;
+        }
+
+        qemu_mutex_lock(&mf->lock);
+        if (err) {
+            mf->error = 1;
+        }
+        w->head = (w->head + n) % MIG_FILE_QUEUE;
+        w->count -= n;
+        qemu_cond_broadcast(&mf->cond);
+    }
+    qemu_mutex_unlock(&mf->lock);
+
+    return NULL;
+}
+
+/*
+ * Writes the header of a RAM image of ram_size bytes to the file at path,
+ * opened as fd, and moves fd to where the migration stream starts.
+ */
+MigFile *mig_file_create(const char *path, int fd, uint64_t ram_size)
+{
+    MigFileHeader hdr;
+    MigFile *mf;
+    int i;
+
+    mf = file_new();
+    mf->ram_size = ram_size;
+
+    hdr.magic = cpu_to_be32(MIG_FILE_MAGIC);
+    hdr.version = cpu_to_be32(MIG_FILE_VERSION);
+    hdr.ram_offset = cpu_to_be64(mf->ram_offset);
+    hdr.ram_size = cpu_to_be64(ram_size);
+    hdr.stream_offset = cpu_to_be64(mf->ram_offset +
+                                    ((ram_size + MIG_FILE_CHUNK - 1) &
+                                     ~(uint64_t)(MIG_FILE_CHUNK - 1)));
+    if (pwrite_full(fd, (uint8_t *)&hdr, sizeof(hdr), 0) < 0 ||
+        lseek(fd, be64_to_cpu(hdr.stream_offset), SEEK_SET) == (off_t)-1) {
+        goto fail;
+    }
+
+    mf->fd = open(path, O_WRONLY | O_BINARY);
+    if (mf->fd < 0) {
+        goto fail;
+    }
+    mf->direct_fd = file_open_direct(path, O_WRONLY | O_BINARY);
+    DPRINTF("writing %" PRIu64 " bytes of RAM%s\n", ram_size,
+            mf->direct_fd >= 0 ? " with O_DIRECT" : "");
+
+    mf->nb = MIG_FILE_THREADS;
+    mf->writers = qemu_mallocz(mf->nb * sizeof(MigFileWriter));
+    for (i = 0; i < mf->nb; i++) {
+        mf->writers[i].mf = mf;
+        file_thread_create(&mf->writers[i].thread, file_write_thread,
+                           &mf->writers[i]);
+    }
+    mf->started = 1;
+
+    return mf;
+
+fail:
+    mig_file_free(mf);
+    return NULL;
+}
+
+int mig_file_threads(MigFile *mf)
+{
+    return mf->nb;
+}
+
+/* Queues the page at addr; it is written from page, which must stay mapped */
+void mig_file_put_page(MigFile *mf, uint64_t addr, const uint8_t *page,
+                       int page_size)
+{
+    MigFileWriter *w = &mf->writers[(addr / MIG_FILE_CHUNK) % mf->nb];
+    MigFileWrite *e;
+
+    qemu_mutex_lock(&mf->lock);
+    while (w->count == MIG_FILE_QUEUE) {
+        qemu_cond_wait(&mf->cond, &mf->lock);
+    }
+    e = &w->queue[(w->head + w->count) % MIG_FILE_QUEUE];
+    e->addr = addr;
+    e->host = page;
+    e->len = page_size;
+    w->count++;
+    qemu_cond_broadcast(&mf->cond);
+    qemu_mutex_unlock(&mf->lock);
+
+    mf->bytes += page_size;
+}
+
+/* Returns the number of bytes queued so far */
+uint64_t mig_file_bytes(MigFile *mf)
+{
+    return mf->bytes;
+}
+
+int mig_file_has_error(MigFile *mf)
+{
+    int error;
+
+    qemu_mutex_lock(&mf->lock);
+    error = mf->error;
+    qemu_mutex_unlock(&mf->lock);
+
+    return error;
+}
+
+/*
+ * Waits until all queued pages have been written and makes sure they are on
+ * disk. Returns -EIO if a write has failed.
+ */
+int mig_file_finish(MigFile *mf)
+{
+    int i, ret;
+
+    qemu_mutex_lock(&mf->lock);
+    for (i = 0; i < mf->nb; i++) {
+        while (mf->writers[i].count) {
+            qemu_cond_wait(&mf->cond, &mf->lock);
+        }
+    }
+    ret = mf->error ? -EIO : 0;
+    qemu_mutex_unlock(&mf->lock);
+
+    if (ret == 0 && qemu_fdatasync(mf->fd) < 0) {
+        ret = -EIO;
+    }
+    return ret;
+}
+
+/* Incoming */
+
+/*
+ * Reads the header of the file at path and keeps it for mig_file_load().
+ * Returns where the migration stream starts in stream_offset.
+ */
+MigFile *mig_file_open(const char *path, int lazy, uint64_t *stream_offset)
+{
+    MigFileHeader hdr;
+    MigFile *mf;
+
+    if (incoming_file) {
+        return NULL;
+    }
+
+    mf = file_new();
+    mf->lazy = lazy;
+    mf->fd = open(path, O_RDONLY | O_BINARY);
+    if (mf->fd < 0 ||
+        pread_full(mf->fd, (uint8_t *)&hdr, sizeof(hdr), 0) < 0 ||
+        be32_to_cpu(hdr.magic) != MIG_FILE_MAGIC ||
+        be32_to_cpu(hdr.version) != MIG_FILE_VERSION) {
+        goto fail;
+    }
+    mf->ram_offset = be64_to_cpu(hdr.ram_offset);
+    mf->ram_size = be64_to_cpu(hdr.ram_size);
+    *stream_offset = be64_to_cpu(hdr.stream_offset);
+    if (mf->ram_offset % MIG_FILE_ALIGN ||
+        *stream_offset < mf->ram_offset + mf->ram_size) {
+        goto fail;
+    }
+    mf->direct_fd = file_open_direct(path, O_RDONLY | O_BINARY);
+
+    incoming_file = mf;
+    return mf;
+
+fail:
+    mig_file_free(mf);
+    return NULL;
+}
+
+/* Returns the RAM image being loaded, if any */
+MigFile *mig_file_incoming(void)
+{
+    return incoming_file;
+}
+
+/* Fills the guest pages that are not already zero with zeroes */
+static void file_clear(uint8_t *host, uint64_t size)
+{
+    const unsigned long *p;
+    uint64_t len;
+    size_t i;
+
+    while (size > 0) {
+        len = MIN(size, MIG_FILE_ALIGN - (uintptr_t)host % MIG_FILE_ALIGN);
+        p = (const unsigned long *)host;
+        for (i = 0; i < len / sizeof(*p); i++) {
+            if (p[i]) {
+                break;
+            }
+        }
+        /* reading a page that was never touched doesn't allocate it */
+        if (i < len / sizeof(*p) || len % sizeof(*p)) {
+            memset(host, 0, len);
+        }
+        host += len;
+        size -= len;
+    }
+}
+
+static int file_load_range(MigFile *mf, uint8_t *host, uint64_t pos,
+                           uint64_t size)
+{
+#ifdef SEEK_DATA
+    off_t data, hole;
+
+    while (size > 0) {
+        data = lseek(mf->fd, pos, SEEK_DATA);
+        if (data == (off_t)-1) {
+            if (errno != ENXIO) {
+                /* no hole detection, read everything */
+                break;
+            }
+            data = pos + size;
+        }
+        if (data > pos + size) {
+            data = pos + size;
+        }
+        file_clear(host, data - pos);
+        host += data - pos;
+        size -= data - pos;
+        pos = data;
+        if (size == 0) {
+            break;
+        }
+
+        hole = lseek(mf->fd, pos, SEEK_HOLE);
+        if (hole == (off_t)-1 || hole > pos + size) {
+            hole = pos + size;
+        }
+        if (file_read(mf, host, hole - pos, pos) < 0) {
+            return -1;
+        }
+        host += hole - pos;
+        size -= hole - pos;
+        pos = hole;
+    }
+#endif
+    if (size > 0) {
+        return file_read(mf, host, size, pos);
+    }
+    return 0;
+}
+
+static void *file_load_thread(void *opaque)
+{
+    MigFile *mf = opaque;
+    MigRAMBlock *b;
+    uint64_t off, len;
+    int err = 0;
+
+    qemu_mutex_lock(&mf->lock);
+    while (!mf->error && mf->load_block < mf->nb_blocks) {
+        b = &mf->blocks[mf->load_block];
+        off = mf->load_offset;
+        if (off >= b->length) {
+            mf->load_block++;
+            mf->load_offset = 0;
+            continue;
+        }
+        len = MIN(b->length - off, MIG_FILE_LOAD_CHUNK);
+        mf->load_offset += len;
+        qemu_mutex_unlock(&mf->lock);
+
+        err = file_load_range(mf, b->host + off,
+                              mf->ram_offset + b->offset + off, len) < 0;
+
+        qemu_mutex_lock(&mf->lock);
+        if (err) {
+            mf->error = 1;
+        }
+    }
+    qemu_mutex_unlock(&mf->lock);
+
+    return NULL;
+}
+
+static void file_set_mapped(MigFile *mf)
+{
+    struct stat st;
+
+    if (!image_mapped && fstat(mf->fd, &st) == 0) {
+        image_dev = st.st_dev;
+        image_ino = st.st_ino;
+        image_mapped = 1;
+    }
+}
+
+/* Returns 1 if guest RAM is mapped from the file at path */
+static int file_is_mapped(const char *path)
+{
+    struct stat st;
+
+    return image_mapped && stat(path, &st) == 0 &&
+           st.st_dev == image_dev && st.st_ino == image_ino;
+}
+
+/* Maps the image of b over guest RAM, copy-on-write */
+static int file_map(MigFile *mf, MigRAMBlock *b)
+{
+    uint64_t pos = mf->ram_offset + b->offset;
+    long page_size = getpagesize();
+    void *p;
+
+    if ((uintptr_t)b->host % page_size || pos % page_size ||
+        b->length % page_size) {
+        return -1;
+    }
+    p = mmap(b->host, b->length, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_FIXED, mf->fd, pos);
+    return p == MAP_FAILED ? -1 : 0;
+}
+
+/*
+ * Loads the image into the given RAM blocks; they are mapped instead if the
+ * image was opened lazily and lazy_ok allows to replace guest RAM mappings.
+ * Returns -EIO if reading fails.
+ */
+int mig_file_load(MigFile *mf, const MigRAMBlock *blocks, int nb_blocks,
+                  int lazy_ok)
+{
+    QemuThread threads[MIG_FILE_THREADS];
+    int i;
+
+    for (i = 0; i < nb_blocks; i++) {
+        if (blocks[i].offset + blocks[i].length > mf->ram_size) {
+            return -EINVAL;
+        }
+    }
+
+    qemu_free(mf->blocks);
+    mf->blocks = qemu_malloc(nb_blocks * sizeof(MigRAMBlock));
+    memcpy(mf->blocks, blocks, nb_blocks * sizeof(MigRAMBlock));
+    mf->nb_blocks = nb_blocks;
+    mf->load_block = 0;
+    mf->load_offset = 0;
+
+    if (mf->lazy && lazy_ok) {
+        for (i = 0; i < nb_blocks; i++) {
+            /* blocks that can't be mapped are read */
+            if (file_map(mf, &mf->blocks[i]) == 0) {
+                mf->blocks[i].length = 0;
+                file_set_mapped(mf);
+            }
+        }
+    }
+
+    for (i = 0; i < MIG_FILE_THREADS; i++) {
+        file_thread_create(&threads[i], file_load_thread, mf);
+    }
+    for (i = 0; i < MIG_FILE_THREADS; i++) {
+        qemu_thread_join(&threads[i]);
+    }
+
+    return mf->error ? -EIO : 0;
+}
+
+/* Stops the writer threads and closes the file */
+void mig_file_free(MigFile *mf)
+{
+    int i;
+
+    qemu_mutex_lock(&mf->lock);
+    mf->quit = 1;
+    qemu_cond_broadcast(&mf->cond);
+    qemu_mutex_unlock(&mf->lock);
+
+    if (mf->started) {
+        for (i = 0; i < mf->nb; i++) {
+            qemu_thread_join(&mf->writers[i].thread);
+        }
+    }
+    if (mf->fd >= 0) {
+        close(mf->fd);
+    }
+    if (mf->direct_fd >= 0) {
+        close(mf->direct_fd);
+    }
+
+    if (mf == incoming_file) {
+        incoming_file = NULL;
+    }
+    qemu_cond_destroy(&mf->cond);
+    qemu_mutex_destroy(&mf->lock);
+    qemu_free(mf->writers);
+    qemu_free(mf->blocks);
+    qemu_free(mf);
+}
+
+/* Migration protocol */
+
+static int file_errno(FdMigrationState *s)
+{
+    return errno;
+}
+
+static int file_write_stream(FdMigrationState *s, const void * buf,
+                             size_t size)
+{
+    return write(s->fd, buf, size);
+}
+
+static int file_close(FdMigrationState *s)
+{
+    DPRINTF("file_close\n");
+    if (s->fd != -1) {
+        close(s->fd);
+        s->fd = -1;
+    }
+    return 0;
+}
+
+MigrationState *file_start_outgoing_migration(Monitor *mon,
+                                              const char *path,
+                                              int64_t bandwidth_limit,
+                                              int detach,
+                                              int blk,
+                                              int inc)
+{
+    FdMigrationState *s;
+
+    /* truncating it would pull guest RAM from under the guest */
+    if (file_is_mapped(path)) {
+        monitor_printf(mon, "%s holds the RAM of the running guest\n", path);
+        return NULL;
+    }
+
+    s = qemu_mallocz(sizeof(*s));
+
+    s->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0600);
+    if (s->fd == -1) {
+        DPRINTF("Unable to open %s\n", path);
+        goto err_after_alloc;
+    }
+
+    s->ram_file = mig_file_create(path, s->fd, ram_bytes_total());
+    if (!s->ram_file) {
+        DPRINTF("Unable to set up the RAM image\n");
+        goto err_after_open;
+    }
+
+    s->get_error = file_errno;
+    s->write = file_write_stream;
+    s->close = file_close;
+    s->mig_state.cancel = migrate_fd_cancel;
+    s->mig_state.get_status = migrate_fd_get_status;
+    s->mig_state.release = migrate_fd_release;
+
+    s->mig_state.blk = blk;
+    s->mig_state.shared = inc;
+
+    s->state = MIG_STATE_ACTIVE;
+    s->mon = NULL;
+    s->bandwidth_limit = bandwidth_limit;
+
+    if (!detach) {
+        migrate_fd_monitor_suspend(s, mon);
+    }
+
+    migrate_fd_connect(s);
+    return &s->mig_state;
+
+err_after_open:
+    close(s->fd);
+err_after_alloc:
+    qemu_free(s);
+    return NULL;
+}
+
+static void file_accept_incoming_migration(void *opaque)
+{
+    QEMUFile *f = opaque;
+    int ret;
+
+    qemu_set_fd_handler2(qemu_stdio_fd(f), NULL, NULL, NULL, NULL);
+
+    ret = qemu_loadvm_state(f);
+    if (incoming_file) {
+        mig_file_free(incoming_file);
+    }
+    if (ret < 0) {
+        fprintf(stderr, "load of migration failed\n");
+        goto err;
+    }
+    qemu_announce_self();
+    DPRINTF("successfully loaded vm state\n");
+    if (autostart)
+        vm_start();
+
+err:
+    qemu_fclose(f);
+}
+
+/* spec is the path of the file, optionally followed by ",lazy" */
+int file_start_incoming_migration(const char *spec)
+{
+    uint64_t stream_offset;
+    char *path, *p;
+    int lazy = 0;
+    QEMUFile *f;
+    MigFile *mf;
+    int fd;
+
+    DPRINTF("Attempting to start an incoming migration from a file\n");
+
+    path = qemu_strdup(spec);
+    p = strrchr(path, ',');
+    if (p && !strcmp(p, ",lazy")) {
+        *p = '\0';
+        lazy = 1;
+    }
+
+    mf = mig_file_open(path, lazy, &stream_offset);
+    if (!mf) {
+        fprintf(stderr, "%s is not a migration file\n", path);
+        goto err;
+    }
+
+    fd = open(path, O_RDONLY | O_BINARY);
+    if (fd < 0) {
+        goto err_after_open;
+    }
+    if (lseek(fd, stream_offset, SEEK_SET) == (off_t)-1 ||
+        (f = qemu_fdopen(fd, "rb")) == NULL) {
+        close(fd);
+        goto err_after_open;
+    }
+    qemu_free(path);
+
+    qemu_set_fd_handler2(fd, NULL, file_accept_incoming_migration, NULL, f);
+
+    return 0;
+
+err_after_open:
+    fprintf(stderr, "could not open %s: %s\n", path, strerror(errno));
+    mig_file_free(mf);
+err:
+    qemu_free(path);
+    return -EINVAL;
+}
@@ -0,0 +1,66 @@
+/*
+ * QEMU live migration: RAM image in a local file
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ *
+ */
+
+#ifndef QEMU_MIGRATION_FILE_H
+#define QEMU_MIGRATION_FILE_H
+
+#include "qemu-common.h"
+#include "migration-channels.h"
+
+#define MIG_FILE_THREADS 4
+
+typedef struct MigFile MigFile;
+
+#ifdef CONFIG_POSIX
+MigFile *mig_file_create(const char *path, int fd, uint64_t ram_size);
+int mig_file_threads(MigFile *mf);
+void mig_file_put_page(MigFile *mf, uint64_t addr, const uint8_t *page,
+                       int page_size);
+uint64_t mig_file_bytes(MigFile *mf);
+int mig_file_has_error(MigFile *mf);
+int mig_file_finish(MigFile *mf);
+
+MigFile *mig_file_open(const char *path, int lazy, uint64_t *stream_offset);
+MigFile *mig_file_incoming(void);
+int mig_file_load(MigFile *mf, const MigRAMBlock *blocks, int nb_blocks,
+                  int lazy_ok);
+
+void mig_file_free(MigFile *mf);
+#else
+/* without threads there is never a RAM image */
+static inline MigFile *mig_file_incoming(void)
+{
+    return NULL;
+}
+static inline int mig_file_threads(MigFile *mf)
+{
+    return 0;
+}
+static inline void mig_file_put_page(MigFile *mf, uint64_t addr,
+                                     const uint8_t *page, int page_size) {}
+static inline uint64_t mig_file_bytes(MigFile *mf)
+{
+    return 0;
+}
+static inline int mig_file_has_error(MigFile *mf)
+{
+    return 0;
+}
+static inline int mig_file_finish(MigFile *mf)
+{
+    return 0;
+}
+static inline int mig_file_load(MigFile *mf, const MigRAMBlock *blocks,
+                                int nb_blocks, int lazy_ok)
+{
+    return -ENOTSUP;
+}
+static inline void mig_file_free(MigFile *mf) {}
+#endif
+
+#endif
@@ -0,0 +1,533 @@
+/*
+ * QEMU live migration: post-copy of RAM on the destination
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ *
+ */
+
+#include <poll.h>
+#include <signal.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <linux/userfaultfd.h>
+
+#include "qemu-common.h"
+#include "qemu-thread.h"
+#include "bitops.h"
+#include "hw/hw.h"
+#include "sysemu.h"
+#include "migration-postcopy.h"
+
+/*
+ * Guest RAM is registered with userfaultfd when the source announces
+ * post-copy, before the devices are loaded. The pages the source hasn't sent
+ * yet (or has to send again) are discarded once everything else has been
+ * loaded, just before the guest starts; touching one of them then blocks the
+ * thread in the kernel until the page has been placed.
+ *
+ * The fault thread asks the source for a missing page the first time it is
+ * touched, and maps a zero page for any other fault (pages the kernel has
+ * never populated, or that were zero on the source). The receive thread reads
+ * the pages from the main connection, whether they were requested or streamed
+ * in the background, and places them atomically, which wakes up whoever is
+ * waiting for them.
+ *
+ * A page is marked as received only after it has been placed, so the fault
+ * thread never maps a zero page where a page from the source is still due.
+ * The exception is a fault while the devices are being loaded: there is no
+ * return path and no receive thread yet, so the page is mapped as zero and
+ * discarded again, with all other missing pages, when post-copy starts.
+ */
+
+typedef struct PostcopyIncoming {
+    int page_size;
+    MigRAMBlock *blocks;
+    int nb_blocks;
+    uint64_t nb_pages;
+
+    int ufd;
+    int fd;
+    int wake[2];
+    QEMUFile *file;
+    uint8_t *fill;
+
+    QemuMutex lock;
+    unsigned long *missing;
+    uint64_t nb_missing;
+    int started;
+    /* only used by the fault thread */
+    unsigned long *requested;
+
+    QemuThread fault_thread;
+    int fault_running;
+    QemuThread recv_thread;
+} PostcopyIncoming;
+
+/* the return path of the incoming migration, -1 if there is none */
+static int incoming_fd = -1;
+static PostcopyIncoming *incoming;
+
+static MigRAMBlock *postcopy_find_block(PostcopyIncoming *pc, uint64_t addr)
+{
+    int i;
+
+    for (i = 0; i < pc->nb_blocks; i++) {
+        if (addr - pc->blocks[i].offset < pc->blocks[i].length) {
+            return &pc->blocks[i];
+        }
+    }
+    return NULL;
+}
+
+static uint8_t *postcopy_host(PostcopyIncoming *pc, uint64_t addr)
+{
+    MigRAMBlock *b = postcopy_find_block(pc, addr);
+
+    return b ? b->host + (addr - b->offset) : NULL;
+}
+
+static void postcopy_received(PostcopyIncoming *pc, uint64_t addr)
+{
+    uint64_t page = addr / pc->page_size;
+
+    qemu_mutex_lock(&pc->lock);
+    if (test_bit(page, pc->missing)) {
+        clear_bit(page, pc->missing);
+        pc->nb_missing--;
+    }
+    qemu_mutex_unlock(&pc->lock);
+}
+
+static int postcopy_zero_page(PostcopyIncoming *pc, uint8_t *host)
+{
+    struct uffdio_zeropage zero;
+
+    do {
+        zero.range.start = (uintptr_t)host;
+        zero.range.len = pc->page_size;
+        zero.mode = 0;
+        if (ioctl(pc->ufd, UFFDIO_ZEROPAGE, &zero) == 0) {
+            return 0;
+        }
+    } while (errno == EAGAIN || errno == EINTR);
+
+    /* somebody else got there first */
+    return errno == EEXIST ? 0 : -errno;
+}
+
+static int postcopy_copy_page(PostcopyIncoming *pc, uint8_t *host,
+                              const uint8_t *data)
+{
+    struct uffdio_copy copy;
+
+    do {
+        copy.dst = (uintptr_t)host;
+        copy.src = (uintptr_t)data;
+        copy.len = pc->page_size;
+        copy.mode = 0;
+        copy.copy = 0;
+        if (ioctl(pc->ufd, UFFDIO_COPY, &copy) == 0) {
+            return 0;
+        }
+    } while (errno == EAGAIN || errno == EINTR);
+
+    return errno == EEXIST ? 0 : -errno;
+}
+
+/*
+ * The guest can't go on without the pages that are still missing, and the
+ * main loop may itself be waiting for one of them, so there is nobody to
+ * report to. Abort instead of calling exit() from one of our threads, which
+ * would run the exit handlers while the main thread is still running.
+ */
+static void QEMU_NORETURN postcopy_lost_source(PostcopyIncoming *pc)
+{
+    uint64_t nb_missing;
+
+    qemu_mutex_lock(&pc->lock);
+    nb_missing = pc->nb_missing;
+    qemu_mutex_unlock(&pc->lock);
+
+    fprintf(stderr, "post-copy: lost the source with %" PRIu64
+            " pages missing\n", nb_missing);
+    abort();
+}
+
+static int postcopy_request(PostcopyIncoming *pc, uint64_t addr)
+{
+    uint64_t buf = cpu_to_be64(addr);
+    size_t done = 0;
+    ssize_t len;
+
+    while (done < sizeof(buf)) {
+        len = send(pc->fd, (uint8_t *)&buf + done, sizeof(buf) - done,
+                   MSG_NOSIGNAL);
+        if (len < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            fprintf(stderr, "post-copy: could not request page: %s\n",
+                    strerror(errno));
+            return -errno;
+        }
+        done += len;
+    }
+    return 0;
+}
+
+static void postcopy_fault(PostcopyIncoming *pc, uint64_t fault_addr)
+{
+    uint8_t *host = (uint8_t *)(uintptr_t)(fault_addr & -pc->page_size);
+    MigRAMBlock *b = NULL;
+    uint64_t addr, page;
+    int i, missing, ret;
+
+    for (i = 0; i < pc->nb_blocks; i++) {
+        if (host >= pc->blocks[i].host &&
+            host < pc->blocks[i].host + pc->blocks[i].length) {
+            b = &pc->blocks[i];
+            break;
+        }
+    }
+    if (!b) {
+        return;
+    }
+    addr = b->offset + (host - b->host);
+    page = addr / pc->page_size;
+
+    qemu_mutex_lock(&pc->lock);
+    missing = pc->started && test_bit(page, pc->missing);
+    qemu_mutex_unlock(&pc->lock);
+
+    if (!missing) {
+        ret = postcopy_zero_page(pc, host);
+        if (ret < 0) {
+            fprintf(stderr, "post-copy: could not map zero page: %s\n",
+                    strerror(-ret));
+        }
+    } else if (!test_bit(page, pc->requested)) {
+        if (postcopy_request(pc, addr) < 0) {
+            postcopy_lost_source(pc);
+        }
+        set_bit(page, pc->requested);
+    }
+}
+
+static void *postcopy_fault_thread(void *opaque)
+{
+    PostcopyIncoming *pc = opaque;
+    struct pollfd pfd[2];
+    struct uffd_msg msg;
+    ssize_t len;
+
+    pfd[0].fd = pc->ufd;
+    pfd[0].events = POLLIN;
+    pfd[1].fd = pc->wake[0];
+    pfd[1].events = POLLIN;
+
+    for (;;) {
+        if (poll(pfd, 2, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        if (pfd[1].revents) {
+            break;
+        }
+
+        len = read(pc->ufd, &msg, sizeof(msg));
+        if (len < 0 && (errno == EAGAIN || errno == EINTR)) {
+            continue;
+        }
+        if (len != sizeof(msg)) {
+            fprintf(stderr, "post-copy: could not read fault\n");
+            break;
+        }
+        if (msg.event == UFFD_EVENT_PAGEFAULT) {
+            postcopy_fault(pc, msg.arg.pagefault.address);
+        }
+    }
+
+    return NULL;
+}
+
+static void postcopy_incoming_free(PostcopyIncoming *pc)
+{
+    struct uffdio_range range;
+    int i;
+
+    if (pc->fault_running) {
+        if (write(pc->wake[1], "", 1) != 1) {
+            fprintf(stderr, "post-copy: could not stop fault thread\n");
+        }
+        qemu_thread_join(&pc->fault_thread);
+    }
+
+    if (pc->ufd != -1) {
+        /* pages still missing are zero from now on */
+        for (i = 0; i < pc->nb_blocks; i++) {
+            range.start = (uintptr_t)pc->blocks[i].host;
+            range.len = pc->blocks[i].length;
+            ioctl(pc->ufd, UFFDIO_UNREGISTER, &range);
+        }
+        close(pc->ufd);
+    }
+    if (pc->wake[0] != -1) {
+        close(pc->wake[0]);
+        close(pc->wake[1]);
+    }
+    if (pc->file) {
+        qemu_fclose(pc->file);
+    }
+    if (pc->fd != -1) {
+        close(pc->fd);
+    }
+
+    qemu_mutex_destroy(&pc->lock);
+    qemu_free(pc->requested);
+    qemu_free(pc->missing);
+    qemu_vfree(pc->fill);
+    qemu_free(pc->blocks);
+    qemu_free(pc);
+}
+
+static void postcopy_create_thread(QemuThread *thread,
+                                   void *(*start)(void *), void *opaque)
+{
+    sigset_t set, oldset;
+
+    /* signals are handled by the main thread */
+    sigfillset(&set);
+    pthread_sigmask(SIG_SETMASK, &set, &oldset);
+    qemu_thread_create(thread, start, opaque);
+    pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+}
+
+/*
+ * Sets the connection that page requests are sent over for the incoming
+ * migration, or -1 if it has none. Post-copy is refused without one.
+ */
+void postcopy_incoming_set_fd(int fd)
+{
+    incoming_fd = fd;
+}
+
+/* Registers guest RAM, which must not have any pages missing yet */
+int postcopy_incoming_init(int page_size, const MigRAMBlock *blocks,
+                           int nb_blocks)
+{
+    PostcopyIncoming *pc;
+    struct uffdio_api api;
+    struct uffdio_register reg;
+    uint64_t end = 0, needed;
+    int i, ret;
+
+    if (incoming_fd == -1 || incoming) {
+        return -ENOTSUP;
+    }
+    /* pages are placed one host page at a time */
+    if (page_size != getpagesize()) {
+        return -ENOTSUP;
+    }
+
+    pc = qemu_mallocz(sizeof(*pc));
+    pc->page_size = page_size;
+    pc->blocks = qemu_malloc(nb_blocks * sizeof(MigRAMBlock));
+    memcpy(pc->blocks, blocks, nb_blocks * sizeof(MigRAMBlock));
+    pc->nb_blocks = nb_blocks;
+    pc->fd = -1;
+    pc->wake[0] = pc->wake[1] = -1;
+    qemu_mutex_init(&pc->lock);
+
+    for (i = 0; i < nb_blocks; i++) {
+        end = MAX(end, blocks[i].offset + blocks[i].length);
+    }
+    pc->nb_pages = end / page_size;
+    pc->missing = qemu_mallocz(BITS_TO_LONGS(pc->nb_pages) *
+                               sizeof(unsigned long));
+    pc->requested = qemu_mallocz(BITS_TO_LONGS(pc->nb_pages) *
+                                 sizeof(unsigned long));
+    pc->fill = qemu_memalign(page_size, page_size);
+
+    pc->ufd = syscall(__NR_userfaultfd, O_CLOEXEC | O_NONBLOCK);
+    if (pc->ufd == -1) {
+        ret = -errno;
+        goto fail;
+    }
+    api.api = UFFD_API;
+    api.features = 0;
+    if (ioctl(pc->ufd, UFFDIO_API, &api) < 0) {
+        ret = -errno;
+        goto fail;
+    }
+
+    needed = (1ULL << _UFFDIO_COPY) | (1ULL << _UFFDIO_ZEROPAGE);
+    for (i = 0; i < nb_blocks; i++) {
+        reg.range.start = (uintptr_t)blocks[i].host;
+        reg.range.len = blocks[i].length;
+        reg.mode = UFFDIO_REGISTER_MODE_MISSING;
+        if (ioctl(pc->ufd, UFFDIO_REGISTER, &reg) < 0) {
+            ret = -errno;
+            goto fail;
+        }
+        /* e.g. huge pages */
+        if ((reg.ioctls & needed) != needed) {
+            ret = -ENOTSUP;
+            goto fail;
+        }
+    }
+
+    if (pipe(pc->wake) < 0) {
+        pc->wake[0] = pc->wake[1] = -1;
+        ret = -errno;
+        goto fail;
+    }
+
+    postcopy_create_thread(&pc->fault_thread, postcopy_fault_thread, pc);
+    pc->fault_running = 1;
+
+    incoming = pc;
+    return 0;
+
+fail:
+    fprintf(stderr, "post-copy: could not register guest RAM: %s\n",
+            strerror(-ret));
+    postcopy_incoming_free(pc);
+    return ret;
+}
+
+/* Marks len bytes of RAM at addr as still to come from the source */
+void postcopy_incoming_discard(uint64_t addr, uint64_t len)
+{
+    PostcopyIncoming *pc = incoming;
+    uint64_t start = addr / pc->page_size;
+    uint64_t nr = len / pc->page_size;
+
+    if (start >= pc->nb_pages) {
+        return;
+    }
+    nr = MIN(nr, pc->nb_pages - start);
+    qemu_mutex_lock(&pc->lock);
+    pc->nb_missing += bitmap_update_range(pc->missing, start, nr, 1);
+    qemu_mutex_unlock(&pc->lock);
+}
+
+static void *postcopy_recv_thread(void *opaque)
+{
+    PostcopyIncoming *pc = opaque;
+
+    pthread_detach(pthread_self());
+
+    if (ram_postcopy_load(pc->file) < 0) {
+        postcopy_lost_source(pc);
+    }
+
+    incoming = NULL;
+    postcopy_incoming_free(pc);
+    return NULL;
+}
+
+/*
+ * Called once the state has been loaded and before the guest starts. Returns
+ * 1 if the remaining pages are received in the background; f and the return
+ * path are closed once they all have arrived. Returns 0 if this isn't a
+ * post-copy migration.
+ */
+int postcopy_incoming_start(QEMUFile *f)
+{
+    PostcopyIncoming *pc = incoming;
+    uint64_t first, page, end;
+    int i;
+
+    if (!pc) {
+        incoming_fd = -1;
+        return 0;
+    }
+    pc->file = f;
+
+    /*
+     * From here on faults on missing pages are requested. This must happen
+     * before they are discarded, so that a zero page mapped after that
+     * can't stand in for one of them.
+     */
+    qemu_mutex_lock(&pc->lock);
+    pc->fd = incoming_fd;
+    pc->started = 1;
+    qemu_mutex_unlock(&pc->lock);
+    incoming_fd = -1;
+
+    for (i = 0; i < pc->nb_blocks; i++) {
+        MigRAMBlock *b = &pc->blocks[i];
+
+        page = b->offset / pc->page_size;
+        end = (b->offset + b->length) / pc->page_size;
+        for (;;) {
+            first = find_next_bit(pc->missing, end, page);
+            if (first >= end) {
+                break;
+            }
+            page = first;
+            while (page < end && test_bit(page, pc->missing)) {
+                page++;
+            }
+            madvise(b->host + (first * pc->page_size - b->offset),
+                    (page - first) * pc->page_size, MADV_DONTNEED);
+        }
+    }
+
+    postcopy_create_thread(&pc->recv_thread, postcopy_recv_thread, pc);
+    return 1;
+}
+
+/* Drops guest RAM registration after a failed load */
+void postcopy_incoming_cancel(void)
+{
+    incoming_fd = -1;
+    if (incoming) {
+        postcopy_incoming_free(incoming);
+        incoming = NULL;
+    }
+}
+
+/* Called by the receive thread with the contents of the page at addr */
+int postcopy_incoming_place_page(uint64_t addr, const uint8_t *data)
+{
+    PostcopyIncoming *pc = incoming;
+    uint8_t *host = postcopy_host(pc, addr);
+    int ret;
+
+    if (!host) {
+        return -EINVAL;
+    }
+    ret = postcopy_copy_page(pc, host, data);
+    if (ret == 0) {
+        postcopy_received(pc, addr);
+    }
+    return ret;
+}
+
+/* Called by the receive thread for a page that is filled with ch */
+int postcopy_incoming_place_fill(uint64_t addr, uint8_t ch)
+{
+    PostcopyIncoming *pc = incoming;
+    uint8_t *host = postcopy_host(pc, addr);
+    int ret;
+
+    if (!host) {
+        return -EINVAL;
+    }
+    if (ch == 0) {
+        ret = postcopy_zero_page(pc, host);
+    } else {
+        memset(pc->fill, ch, pc->page_size);
+        ret = postcopy_copy_page(pc, host, pc->fill);
+    }
+    if (ret == 0) {
+        postcopy_received(pc, addr);
+    }
+    return ret;
+}
@@ -0,0 +1,51 @@
+/*
+ * QEMU live migration: post-copy of RAM on the destination
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ *
+ */
+
+#ifndef QEMU_MIGRATION_POSTCOPY_H
+#define QEMU_MIGRATION_POSTCOPY_H
+
+#include "qemu-common.h"
+#include "migration-channels.h"
+
+#ifdef CONFIG_USERFAULTFD
+void postcopy_incoming_set_fd(int fd);
+int postcopy_incoming_init(int page_size, const MigRAMBlock *blocks,
+                           int nb_blocks);
+void postcopy_incoming_discard(uint64_t addr, uint64_t len);
+int postcopy_incoming_start(QEMUFile *f);
+void postcopy_incoming_cancel(void);
+
+int postcopy_incoming_place_page(uint64_t addr, const uint8_t *data);
+int postcopy_incoming_place_fill(uint64_t addr, uint8_t ch);
+#else
+/* without userfaultfd, the destination refuses post-copy */
+static inline void postcopy_incoming_set_fd(int fd) {}
+static inline int postcopy_incoming_init(int page_size,
+                                         const MigRAMBlock *blocks,
+                                         int nb_blocks)
+{
+    return -ENOTSUP;
+}
+static inline void postcopy_incoming_discard(uint64_t addr, uint64_t len) {}
+static inline int postcopy_incoming_start(QEMUFile *f)
+{
+    return 0;
+}
+static inline void postcopy_incoming_cancel(void) {}
+static inline int postcopy_incoming_place_page(uint64_t addr,
+                                               const uint8_t *data)
+{
+    return -ENOTSUP;
+}
+static inline int postcopy_incoming_place_fill(uint64_t addr, uint8_t ch)
+{
+    return -ENOTSUP;
+}
+#endif
+
+#endif
@@ -18,6 +18,7 @@
 #include "sysemu.h"
 #include "buffered_file.h"
 #include "block.h"
+#include "migration-postcopy.h"
 
 //#define DEBUG_MIGRATION_TCP
 
@@ -50,6 +51,19 @@ static int tcp_close(FdMigrationState *s)
 }
 
 
+/* Opens the page channels once the main connection is established, so that
+   the destination accepts the main connection first */
+static void tcp_connect_channels(FdMigrationState *s)
+{
+    struct sockaddr_in addr;
+    socklen_t addrlen = sizeof(addr);
+
+    if (migrate_channels() &&
+        getpeername(s->fd, (struct sockaddr *)&addr, &addrlen) == 0) {
+        s->channels = mig_channels_connect(&addr, migrate_channels());
+    }
+}
+
 static void tcp_wait_for_connect(void *opaque)
 {
     FdMigrationState *s = opaque;
@@ -68,9 +82,10 @@ static void tcp_wait_for_connect(void *opaque)
 
     qemu_set_fd_handler2(s->fd, NULL, NULL, NULL, NULL);
 
-    if (val == 0)
+    if (val == 0) {
+        tcp_connect_channels(s);
         migrate_fd_connect(s);
-    else {
+    } else {
         DPRINTF("error connecting %d\n", val);
         migrate_fd_error(s);
     }
@@ -131,8 +146,10 @@ MigrationState *tcp_start_outgoing_migration(Monitor *mon,
         close(s->fd);
         qemu_free(s);
         return NULL;
-    } else if (ret >= 0)
+    } else if (ret >= 0) {
+        tcp_connect_channels(s);
         migrate_fd_connect(s);
+    }
 
     return &s->mig_state;
 }
@@ -143,7 +160,7 @@ static void tcp_accept_incoming_migration(void *opaque)
     socklen_t addrlen = sizeof(addr);
     int s = (unsigned long)opaque;
     QEMUFile *f;
-    int c, ret;
+    int c, ret, postcopy;
 
     do {
         c = qemu_accept(s, (struct sockaddr *)&addr, &addrlen);
@@ -162,11 +179,16 @@ static void tcp_accept_incoming_migration(void *opaque)
         goto out;
     }
 
+    mig_channels_listen(s);
+    postcopy_incoming_set_fd(c);
     ret = qemu_loadvm_state(f);
+    mig_channels_listen(-1);
     if (ret < 0) {
+        postcopy_incoming_cancel();
         fprintf(stderr, "load of migration failed\n");
         goto out_fopen;
     }
+    postcopy = postcopy_incoming_start(f);
     qemu_announce_self();
     DPRINTF("successfully loaded vm state\n");
 
@@ -176,6 +198,11 @@ static void tcp_accept_incoming_migration(void *opaque)
     if (autostart)
         vm_start();
 
+    /* the remaining pages arrive over the connection in the background */
+    if (postcopy) {
+        return;
+    }
+
 out_fopen:
     qemu_fclose(f);
 out:
@@ -203,7 +230,8 @@ int tcp_start_incoming_migration(const char *host_port)
     if (bind(s, (struct sockaddr *)&addr, sizeof(addr)) == -1)
         goto err;
 
-    if (listen(s, 1) == -1)
+    /* the main connection and its page channels */
+    if (listen(s, 1 + MIG_CHANNELS_MAX) == -1)
         goto err;
 
     qemu_set_fd_handler2(s, NULL, tcp_accept_incoming_migration, NULL,
@@ -18,6 +18,7 @@
 #include "sysemu.h"
 #include "buffered_file.h"
 #include "block.h"
+#include "migration-postcopy.h"
 
 //#define DEBUG_MIGRATION_UNIX
 
@@ -149,7 +150,7 @@ static void unix_accept_incoming_migration(void *opaque)
     socklen_t addrlen = sizeof(addr);
     int s = (unsigned long)opaque;
     QEMUFile *f;
-    int c, ret;
+    int c, ret, postcopy;
 
     do {
         c = qemu_accept(s, (struct sockaddr *)&addr, &addrlen);
@@ -168,11 +169,14 @@ static void unix_accept_incoming_migration(void *opaque)
         goto out;
     }
 
+    postcopy_incoming_set_fd(c);
     ret = qemu_loadvm_state(f);
     if (ret < 0) {
+        postcopy_incoming_cancel();
         fprintf(stderr, "load of migration failed\n");
         goto out_fopen;
     }
+    postcopy = postcopy_incoming_start(f);
     qemu_announce_self();
     DPRINTF("successfully loaded vm state\n");
 
@@ -180,6 +184,11 @@ static void unix_accept_incoming_migration(void *opaque)
     qemu_set_fd_handler2(s, NULL, NULL, NULL, NULL);
     close(s);
 
+    /* the remaining pages arrive over the connection in the background */
+    if (postcopy) {
+        return;
+    }
+
 out_fopen:
     qemu_fclose(f);
 out:
@@ -16,10 +16,12 @@
 #include "monitor.h"
 #include "buffered_file.h"
 #include "sysemu.h"
+#include "qemu-timer.h"
 #include "block.h"
 #include "qemu_socket.h"
 #include "block-migration.h"
 #include "qemu-objects.h"
+#include "qerror.h"
 
 //#define DEBUG_MIGRATION
 
@@ -49,6 +51,8 @@ void qemu_start_incoming_migration(const char *uri)
         unix_start_incoming_migration(p);
     else if (strstart(uri, "fd:", &p))
         fd_start_incoming_migration(p);
+    else if (strstart(uri, "file:", &p))
+        file_start_incoming_migration(p);
 #endif
     else
         fprintf(stderr, "unknown migration protocol: %s\n", uri);
@@ -84,6 +88,10 @@ int do_migrate(Monitor *mon, const QDict *qdict, QObject **ret_data)
         s = fd_start_outgoing_migration(mon, p, max_throttle, detach, 
                                         (int)qdict_get_int(qdict, "blk"), 
                                         (int)qdict_get_int(qdict, "inc"));
+    } else if (strstart(uri, "file:", &p)) {
+        s = file_start_outgoing_migration(mon, p, max_throttle, detach,
+                                          (int)qdict_get_int(qdict, "blk"),
+                                          (int)qdict_get_int(qdict, "inc"));
 #endif
     } else {
         monitor_printf(mon, "unknown migration protocol: %s\n", uri);
@@ -107,6 +115,12 @@ int do_migrate_cancel(Monitor *mon, const QDict *qdict, QObject **ret_data)
 {
     MigrationState *s = current_migration;
 
+    if (s && ram_postcopy_active()) {
+        monitor_printf(mon, "the guest is running on the destination, "
+                       "post-copy can't be cancelled\n");
+        return -1;
+    }
+
     if (s)
         s->cancel(s);
 
@@ -153,6 +167,267 @@ int do_migrate_set_downtime(Monitor *mon, const QDict *qdict,
     return 0;
 }
 
+/* size of the page delta cache in bytes, 0 if page deltas are disabled */
+static uint64_t max_cache_size;
+
+uint64_t migrate_cache_size(void)
+{
+    return max_cache_size;
+}
+
+int do_migrate_set_cache_size(Monitor *mon, const QDict *qdict,
+                              QObject **ret_data)
+{
+    double d;
+
+    d = qdict_get_double(qdict, "value");
+    /* more than guest RAM would never be used */
+    if (d < 0 || d > ram_bytes_total()) {
+        qemu_error_new(QERR_INVALID_PARAMETER, "value");
+        return -1;
+    }
+    max_cache_size = (uint64_t)d;
+
+    return 0;
+}
+
+/* zlib level for RAM pages, 0 if compression is disabled */
+static int compress_level;
+static int compress_threads = 4;
+
+int migrate_compress_level(void)
+{
+    return compress_level;
+}
+
+int migrate_compress_threads(void)
+{
+    return compress_threads;
+}
+
+int do_migrate_set_compression(Monitor *mon, const QDict *qdict,
+                               QObject **ret_data)
+{
+    int level = qdict_get_int(qdict, "level");
+    int threads = qdict_get_try_int(qdict, "threads", compress_threads);
+
+    if (level < 0 || level > 9) {
+        qemu_error_new(QERR_INVALID_PARAMETER, "level");
+        return -1;
+    }
+    if (threads < 1 || threads > 64) {
+        qemu_error_new(QERR_INVALID_PARAMETER, "threads");
+        return -1;
+    }
+    compress_level = level;
+    compress_threads = threads;
+
+    return 0;
+}
+
+/* throttle the vCPUs if the guest dirties memory faster than it is sent */
+static int auto_converge;
+
+int migrate_auto_converge(void)
+{
+    return auto_converge;
+}
+
+int do_migrate_set_auto_converge(Monitor *mon, const QDict *qdict,
+                                 QObject **ret_data)
+{
+    const char *state = qdict_get_str(qdict, "state");
+
+    if (!strcmp(state, "on")) {
+        auto_converge = 1;
+    } else if (!strcmp(state, "off")) {
+        auto_converge = 0;
+    } else {
+        qemu_error_new(QERR_INVALID_PARAMETER, "state");
+        return -1;
+    }
+
+    return 0;
+}
+
+/* block migration reads in flight at once */
+static int block_inflight = 16;
+
+int migrate_block_inflight(void)
+{
+    return block_inflight;
+}
+
+int do_migrate_set_block_inflight(Monitor *mon, const QDict *qdict,
+                                  QObject **ret_data)
+{
+    int n = qdict_get_int(qdict, "value");
+
+    if (n < 1 || n > 256) {
+        qemu_error_new(QERR_INVALID_PARAMETER, "value");
+        return -1;
+    }
+    block_inflight = n;
+
+    return 0;
+}
+
+/* number of connections for RAM pages besides the main one */
+static int nb_channels;
+static MigChannels *outgoing_channels;
+
+int migrate_channels(void)
+{
+    return nb_channels;
+}
+
+/* Returns the page channels of the active outgoing migration, if any */
+MigChannels *migrate_outgoing_channels(void)
+{
+    return outgoing_channels;
+}
+
+int do_migrate_set_channels(Monitor *mon, const QDict *qdict,
+                            QObject **ret_data)
+{
+    int n = qdict_get_int(qdict, "value");
+
+    if (n < 0 || n > MIG_CHANNELS_MAX) {
+        qemu_error_new(QERR_INVALID_PARAMETER, "value");
+        return -1;
+    }
+    nb_channels = n;
+
+    return 0;
+}
+
+/* RAM image of the active outgoing migration to a file */
+static MigFile *outgoing_file;
+
+MigFile *migrate_outgoing_file(void)
+{
+    return outgoing_file;
+}
+
+/* move the guest after the first pass over RAM if it doesn't converge */
+static int postcopy;
+static int outgoing_postcopy;
+
+/* Returns 1 if the active outgoing migration may switch to post-copy */
+int migrate_outgoing_postcopy(void)
+{
+    return outgoing_postcopy;
+}
+
+int do_migrate_set_postcopy(Monitor *mon, const QDict *qdict,
+                            QObject **ret_data)
+{
+    const char *state = qdict_get_str(qdict, "state");
+
+    if (!strcmp(state, "on")) {
+        postcopy = 1;
+    } else if (!strcmp(state, "off")) {
+        postcopy = 0;
+    } else {
+        qemu_error_new(QERR_INVALID_PARAMETER, "state");
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Telemetry of the last outgoing migration. A pass is complete when the RAM
+ * scan wraps around; its statistics are sent in a MIGRATION_PASS event and
+ * the last ones are kept for "info migrate".
+ */
+static int64_t mig_start_time;
+static int64_t mig_stop_time;
+static int64_t mig_pass_start;
+static uint64_t mig_pass_bytes;
+static uint64_t mig_pass_pages;
+static uint64_t mig_pass_dup;
+static int mig_passes;
+static QObject *mig_last_pass;
+static int64_t mig_total_time;
+static int64_t mig_downtime;
+static QObject *mig_device_sizes;
+
+static void migrate_stats_start(void)
+{
+    mig_start_time = qemu_get_clock(rt_clock);
+    mig_pass_start = mig_start_time;
+    mig_pass_bytes = 0;
+    mig_pass_pages = 0;
+    mig_pass_dup = 0;
+    mig_passes = 0;
+    mig_total_time = 0;
+    mig_downtime = 0;
+    qobject_decref(mig_last_pass);
+    mig_last_pass = NULL;
+    qobject_decref(mig_device_sizes);
+    mig_device_sizes = NULL;
+}
+
+/* Called after each iteration while the guest runs */
+static void migrate_stats_update(void)
+{
+    int64_t now, duration;
+    uint64_t bytes;
+
+    if (ram_pass_count() == mig_passes) {
+        return;
+    }
+    mig_passes = ram_pass_count();
+
+    now = qemu_get_clock(rt_clock);
+    duration = now - mig_pass_start;
+    bytes = ram_bytes_transferred() - mig_pass_bytes;
+
+    qobject_decref(mig_last_pass);
+    mig_last_pass = qobject_from_jsonf("{ 'pass': %d, "
+                                         "'duration': %" PRId64 ", "
+                                         "'pages': %" PRId64 ", "
+                                         "'duplicate-pages': %" PRId64 ", "
+                                         "'transferred': %" PRId64 ", "
+                                         "'bandwidth': %" PRId64 ", "
+                                         "'dirty-rate': %" PRId64 ", "
+                                         "'remaining': %" PRId64 " }",
+                                       mig_passes, duration,
+                                       ram_pages_sent() - mig_pass_pages,
+                                       ram_pages_duplicate() - mig_pass_dup,
+                                       bytes,
+                                       duration ? bytes * 1000 / duration : 0,
+                                       ram_dirty_rate(),
+                                       ram_bytes_remaining());
+    monitor_protocol_event(QEVENT_MIGRATION_PASS, mig_last_pass);
+
+    mig_pass_start = now;
+    mig_pass_bytes = ram_bytes_transferred();
+    mig_pass_pages = ram_pages_sent();
+    mig_pass_dup = ram_pages_duplicate();
+}
+
+static void migrate_stats_complete(void)
+{
+    QObject *data;
+
+    mig_total_time = qemu_get_clock(rt_clock) - mig_start_time;
+    qobject_decref(mig_device_sizes);
+    mig_device_sizes = qemu_savevm_state_sizes();
+
+    data = qobject_from_jsonf("{ 'total-time': %" PRId64 ", "
+                                "'downtime': %" PRId64 ", "
+                                "'passes': %d, "
+                                "'transferred': %" PRId64 " }",
+                              mig_total_time, mig_downtime, mig_passes,
+                              ram_bytes_transferred());
+    qobject_incref(mig_device_sizes);
+    qdict_put_obj(qobject_to_qdict(data), "devices", mig_device_sizes);
+    monitor_protocol_event(QEVENT_MIGRATION_COMPLETED, data);
+    qobject_decref(data);
+}
+
 static void migrate_print_status(Monitor *mon, const char *name,
                                  const QDict *status_dict)
 {
@@ -184,6 +459,118 @@ void do_info_migrate_print(Monitor *mon, const QObject *data)
     if (qdict_haskey(qdict, "disk")) {
         migrate_print_status(mon, "disk", qdict);
     }
+
+    if (qdict_haskey(qdict, "cache")) {
+        QDict *cache = qobject_to_qdict(qdict_get(qdict, "cache"));
+        uint64_t hits = qdict_get_int(cache, "hits");
+        uint64_t misses = qdict_get_int(cache, "misses");
+
+        monitor_printf(mon, "cache size: %" PRIu64 " kbytes\n",
+                       qdict_get_int(cache, "size") >> 10);
+        monitor_printf(mon, "cache hits: %" PRIu64 " (%.1f%%), "
+                       "misses: %" PRIu64 "\n", hits,
+                       hits + misses ? 100.0 * hits / (hits + misses) : 0.0,
+                       misses);
+        monitor_printf(mon, "delta pages: %" PRIu64 ", delta bytes: %" PRIu64
+                       " kbytes\n", qdict_get_int(cache, "delta-pages"),
+                       qdict_get_int(cache, "delta-bytes") >> 10);
+    }
+
+    if (qdict_haskey(qdict, "compression")) {
+        QDict *comp = qobject_to_qdict(qdict_get(qdict, "compression"));
+        uint64_t bytes = qdict_get_int(comp, "bytes");
+        uint64_t cbytes = qdict_get_int(comp, "compressed-bytes");
+        uint64_t busy = qdict_get_int(comp, "busy-time");
+
+        monitor_printf(mon, "compression: level %" PRId64 ", %" PRId64
+                       " threads\n", qdict_get_int(comp, "level"),
+                       qdict_get_int(comp, "threads"));
+        monitor_printf(mon, "compressed: %" PRIu64 " kbytes to %" PRIu64
+                       " kbytes (%.1f%%), %.1f MB/s per thread\n",
+                       bytes >> 10, cbytes >> 10,
+                       bytes ? 100.0 * cbytes / bytes : 0.0,
+                       busy ? bytes * 1e9 / busy / (1024 * 1024) : 0.0);
+    }
+
+    if (qdict_haskey(qdict, "convergence")) {
+        QDict *conv = qobject_to_qdict(qdict_get(qdict, "convergence"));
+
+        monitor_printf(mon, "dirty rate: %" PRIu64 " kbytes/s\n",
+                       qdict_get_int(conv, "dirty-rate") >> 10);
+        if (qdict_get_bool(conv, "auto-converge")) {
+            monitor_printf(mon, "auto-converge throttle: %" PRId64 "%%\n",
+                           qdict_get_int(conv, "throttle"));
+        }
+    }
+
+    if (qdict_haskey(qdict, "channels")) {
+        QDict *channels = qobject_to_qdict(qdict_get(qdict, "channels"));
+
+        monitor_printf(mon, "page channels: %" PRId64 ", transferred: %" PRIu64
+                       " kbytes\n", qdict_get_int(channels, "count"),
+                       qdict_get_int(channels, "transferred") >> 10);
+    }
+
+    if (qdict_haskey(qdict, "file")) {
+        QDict *file = qobject_to_qdict(qdict_get(qdict, "file"));
+
+        monitor_printf(mon, "RAM image threads: %" PRId64 ", written: %" PRIu64
+                       " kbytes\n", qdict_get_int(file, "threads"),
+                       qdict_get_int(file, "transferred") >> 10);
+    }
+
+    if (qdict_haskey(qdict, "postcopy")) {
+        QDict *pc = qobject_to_qdict(qdict_get(qdict, "postcopy"));
+
+        monitor_printf(mon, "post-copy: %s, requested pages: %" PRIu64 "\n",
+                       qdict_get_bool(pc, "active") ? "active" : "pending",
+                       qdict_get_int(pc, "requests"));
+    }
+
+    if (qdict_haskey(qdict, "pages")) {
+        QDict *pages = qobject_to_qdict(qdict_get(qdict, "pages"));
+
+        monitor_printf(mon, "pages: %" PRIu64 ", duplicate: %" PRIu64
+                       ", passes: %" PRId64 "\n",
+                       qdict_get_int(pages, "normal") +
+                       qdict_get_int(pages, "duplicate"),
+                       qdict_get_int(pages, "duplicate"),
+                       qdict_get_int(pages, "passes"));
+    }
+
+    if (qdict_haskey(qdict, "last-pass")) {
+        QDict *pass = qobject_to_qdict(qdict_get(qdict, "last-pass"));
+
+        monitor_printf(mon, "last pass: %" PRId64 " ms, %" PRIu64 " pages, %"
+                       PRIu64 " kbytes/s\n", qdict_get_int(pass, "duration"),
+                       qdict_get_int(pass, "pages"),
+                       qdict_get_int(pass, "bandwidth") >> 10);
+    }
+
+    if (qdict_haskey(qdict, "total-time")) {
+        monitor_printf(mon, "total time: %" PRId64 " ms\n",
+                       qdict_get_int(qdict, "total-time"));
+    }
+
+    if (qdict_haskey(qdict, "downtime")) {
+        monitor_printf(mon, "downtime: %" PRId64 " ms\n",
+                       qdict_get_int(qdict, "downtime"));
+    }
+
+    if (qdict_haskey(qdict, "devices")) {
+        QList *devices = qobject_to_qlist(qdict_get(qdict, "devices"));
+        QListEntry *entry;
+
+        monitor_printf(mon, "device state sizes:\n");
+        QLIST_FOREACH_ENTRY(devices, entry) {
+            QDict *dev = qobject_to_qdict(qlist_entry_obj(entry));
+
+            monitor_printf(mon, "  %s.%" PRId64 ": %" PRIu64 " bytes\n",
+                           qdict_get_str(dev, "name"),
+                           qdict_get_int(dev, "instance"),
+                           qdict_get_int(dev, "size"));
+        }
+    }
 }
 
 static void migrate_put_status(QDict *qdict, const char *name,
@@ -217,12 +604,64 @@ static void migrate_put_status(QDict *qdict, const char *name,
  *          - "transferred": amount transferred
  *          - "remaining": amount remaining
  *          - "total": total
+ * - "cache": only present if "status" is "active" and page deltas are
+ *   enabled, it is a QDict with the following information:
+ *          - "size": size of the page cache (in bytes)
+ *          - "hits": resent pages that were found in the cache
+ *          - "misses": resent pages that were not in the cache
+ *          - "delta-pages": pages sent as a delta
+ *          - "delta-bytes": size of the deltas sent (in bytes)
+ * - "compression": only present if "status" is "active" and RAM pages are
+ *   compressed, it is a QDict with the following information:
+ *          - "level": zlib compression level
+ *          - "threads": number of compression threads
+ *          - "bytes": size of the pages compressed (in bytes)
+ *          - "compressed-bytes": size after compression (in bytes)
+ *          - "busy-time": time spent compressing by all threads (in
+ *            nanoseconds)
+ * - "convergence": only present if "status" is "active", it is a QDict with
+ *   the following information:
+ *          - "auto-converge": true if the vCPUs are throttled when the
+ *            migration doesn't converge
+ *          - "dirty-rate": rate at which the guest dirtied memory in the last
+ *            second (in bytes per second)
+ *          - "throttle": percentage of time the vCPUs are stopped
+ * - "channels": only present if "status" is "active" and RAM pages are sent
+ *   over additional connections, it is a QDict with the following information:
+ *          - "count": number of connections
+ *          - "transferred": amount queued on them (in bytes)
+ * - "file": only present if "status" is "active" and RAM is written to the
+ *   image in a migration file, it is a QDict with the following information:
+ *          - "threads": number of writer threads
+ *          - "transferred": amount queued for them (in bytes)
+ * - "postcopy": only present if "status" is "active" and the migration may
+ *   switch to post-copy, it is a QDict with the following information:
+ *          - "active": true if the guest runs on the destination and the
+ *            remaining pages are being sent
+ *          - "requests": pages the destination asked for
+ * - "total-time": time since the migration started, or the time it took if
+ *   "status" is "completed" (in milliseconds)
+ * - "pages": only present if "status" is "active", it is a QDict with the
+ *   following information:
+ *          - "normal": RAM pages sent with their contents
+ *          - "duplicate": RAM pages filled with a single byte
+ *          - "passes": passes over RAM completed
+ * - "last-pass": only present if "status" is "active" and a pass over RAM
+ *   has completed, it has the data of the last MIGRATION_PASS event
+ * - "downtime": only present if "status" is "completed", time the guest was
+ *   stopped on the source (in milliseconds)
+ * - "devices": only present if "status" is "completed", it is a QList with
+ *   a QDict for each device in the saved state:
+ *          - "name": section name
+ *          - "instance": instance number
+ *          - "size": bytes the device wrote to the stream
  *
  * Examples:
  *
  * 1. Migration is "completed":
  *
- * { "status": "completed" }
+ * { "status": "completed", "total-time": 5320, "downtime": 47,
+ *   "devices": [ { "name": "ram", "instance": 0, "size": 1083412519 } ] }
  *
  * 2. Migration is "active" and it is not a block migration:
  *
@@ -237,6 +676,7 @@ static void migrate_put_status(QDict *qdict, const char *name,
  */
 void do_info_migrate(Monitor *mon, QObject **ret_data)
 {
+    QObject *obj;
     QDict *qdict;
     MigrationState *s = current_migration;
 
@@ -255,10 +695,101 @@ void do_info_migrate(Monitor *mon, QObject **ret_data)
                                    blk_mig_bytes_total());
             }
 
+            if (ram_cache_size()) {
+                QObject *obj;
+
+                obj = qobject_from_jsonf("{ 'size': %" PRId64 ", "
+                                           "'hits': %" PRId64 ", "
+                                           "'misses': %" PRId64 ", "
+                                           "'delta-pages': %" PRId64 ", "
+                                           "'delta-bytes': %" PRId64 " }",
+                                         ram_cache_size(), ram_cache_hits(),
+                                         ram_cache_misses(), ram_delta_pages(),
+                                         ram_delta_bytes());
+                qdict_put_obj(qdict, "cache", obj);
+            }
+
+            if (ram_compress_active()) {
+                QObject *obj;
+
+                obj = qobject_from_jsonf("{ 'level': %d, "
+                                           "'threads': %d, "
+                                           "'bytes': %" PRId64 ", "
+                                           "'compressed-bytes': %" PRId64 ", "
+                                           "'busy-time': %" PRId64 " }",
+                                         compress_level, compress_threads,
+                                         ram_compress_bytes(),
+                                         ram_compressed_bytes(),
+                                         ram_compress_time());
+                qdict_put_obj(qdict, "compression", obj);
+            }
+
+            obj = qobject_from_jsonf("{ 'auto-converge': %i, "
+                                       "'dirty-rate': %" PRId64 ", "
+                                       "'throttle': %d }",
+                                     auto_converge, ram_dirty_rate(),
+                                     cpu_throttle_get());
+            qdict_put_obj(qdict, "convergence", obj);
+
+            if (outgoing_channels) {
+                QObject *obj;
+
+                obj = qobject_from_jsonf("{ 'count': %d, "
+                                           "'transferred': %" PRId64 " }",
+                                         mig_channels_count(outgoing_channels),
+                                         mig_channels_bytes(outgoing_channels));
+                qdict_put_obj(qdict, "channels", obj);
+            }
+
+            if (outgoing_file) {
+                QObject *obj;
+
+                obj = qobject_from_jsonf("{ 'threads': %d, "
+                                           "'transferred': %" PRId64 " }",
+                                         mig_file_threads(outgoing_file),
+                                         mig_file_bytes(outgoing_file));
+                qdict_put_obj(qdict, "file", obj);
+            }
+
+            if (outgoing_postcopy) {
+                QObject *obj;
+
+                obj = qobject_from_jsonf("{ 'active': %i, "
+                                           "'requests': %" PRId64 " }",
+                                         ram_postcopy_active(),
+                                         ram_postcopy_requests());
+                qdict_put_obj(qdict, "postcopy", obj);
+            }
+
+            qdict_put(qdict, "total-time",
+                      qint_from_int(qemu_get_clock(rt_clock) -
+                                    mig_start_time));
+
+            obj = qobject_from_jsonf("{ 'normal': %" PRId64 ", "
+                                       "'duplicate': %" PRId64 ", "
+                                       "'passes': %d }",
+                                     ram_pages_sent() - ram_pages_duplicate(),
+                                     ram_pages_duplicate(), ram_pass_count());
+            qdict_put_obj(qdict, "pages", obj);
+
+            if (mig_last_pass) {
+                qobject_incref(mig_last_pass);
+                qdict_put_obj(qdict, "last-pass", mig_last_pass);
+            }
+
             *ret_data = QOBJECT(qdict);
             break;
         case MIG_STATE_COMPLETED:
-            *ret_data = qobject_from_jsonf("{ 'status': 'completed' }");
+            obj = qobject_from_jsonf("{ 'status': 'completed', "
+                                       "'total-time': %" PRId64 ", "
+                                       "'downtime': %" PRId64 " }",
+                                     mig_total_time, mig_downtime);
+            if (mig_device_sizes) {
+                qobject_incref(mig_device_sizes);
+                qdict_put_obj(qobject_to_qdict(obj), "devices",
+                              mig_device_sizes);
+            }
+            *ret_data = obj;
             break;
         case MIG_STATE_ERROR:
             *ret_data = qobject_from_jsonf("{ 'status': 'failed' }");
@@ -303,6 +834,25 @@ void migrate_fd_cleanup(FdMigrationState *s)
     if (s->fd != -1)
         close(s->fd);
 
+    /* a throttled guest must not stay throttled when migration fails */
+    cpu_throttle_set(0);
+
+    if (s->channels) {
+        if (outgoing_channels == s->channels) {
+            outgoing_channels = NULL;
+        }
+        mig_channels_free(s->channels);
+        s->channels = NULL;
+    }
+    if (s->ram_file) {
+        if (outgoing_file == s->ram_file) {
+            outgoing_file = NULL;
+        }
+        mig_file_free(s->ram_file);
+        s->ram_file = NULL;
+    }
+    outgoing_postcopy = 0;
+
     /* Don't resume monitor until we've flushed all of the buffers */
     if (s->mon) {
         monitor_resume(s->mon);
@@ -311,11 +861,52 @@ void migrate_fd_cleanup(FdMigrationState *s)
     s->fd = -1;
 }
 
+/* Reads the addresses of the pages the destination asks for */
+static void migrate_fd_postcopy_read(void *opaque)
+{
+    FdMigrationState *s = opaque;
+    uint64_t addr;
+    ssize_t len;
+    int i;
+
+    do {
+        len = recv(s->fd, (void *)(s->requests + s->requests_len),
+                   sizeof(s->requests) - s->requests_len, 0);
+    } while (len == -1 && s->get_error(s) == EINTR);
+
+    if (len == -1 && s->get_error(s) == EAGAIN) {
+        return;
+    }
+    if (len <= 0) {
+        DPRINTF("lost the destination during post-copy\n");
+        qemu_savevm_state_cancel(s->mon, s->file);
+        migrate_fd_error(s);
+        return;
+    }
+
+    s->requests_len += len;
+    for (i = 0; i + sizeof(addr) <= s->requests_len; i += sizeof(addr)) {
+        memcpy(&addr, s->requests + i, sizeof(addr));
+        ram_postcopy_request(s->file, be64_to_cpu(addr));
+    }
+    memmove(s->requests, s->requests + i, s->requests_len - i);
+    s->requests_len -= i;
+}
+
+/* Page requests are read during post-copy while the stream may be frozen */
+static void migrate_fd_update_handlers(FdMigrationState *s)
+{
+    qemu_set_fd_handler2(s->fd, NULL,
+                         s->postcopy ? migrate_fd_postcopy_read : NULL,
+                         s->wait_write ? migrate_fd_put_notify : NULL, s);
+}
+
 void migrate_fd_put_notify(void *opaque)
 {
     FdMigrationState *s = opaque;
 
-    qemu_set_fd_handler2(s->fd, NULL, NULL, NULL, NULL);
+    s->wait_write = 0;
+    migrate_fd_update_handlers(s);
     qemu_file_put_notify(s->file);
 }
 
@@ -331,11 +922,50 @@ ssize_t migrate_fd_put_buffer(void *opaque, const void *data, size_t size)
     if (ret == -1)
         ret = -(s->get_error(s));
 
-    if (ret == -EAGAIN)
-        qemu_set_fd_handler2(s->fd, NULL, NULL, migrate_fd_put_notify, s);
+    if (ret == -EAGAIN) {
+        s->wait_write = 1;
+        migrate_fd_update_handlers(s);
+    }
+
+    return ret;
+}
+
+static int migrate_fd_is_socket(FdMigrationState *s)
+{
+    int type;
+    socklen_t len = sizeof(type);
+
+    if (getsockopt(s->fd, SOL_SOCKET, SO_TYPE, (void *)&type, &len) < 0) {
+        return 0;
+    }
+    return type == SOCK_STREAM;
+}
+
+#ifndef _WIN32
+/* Sends guest pages straight from guest memory */
+static ssize_t migrate_fd_writev(void *opaque, const struct iovec *iov,
+                                 int iovcnt)
+{
+    FdMigrationState *s = opaque;
+    ssize_t ret;
+
+    do {
+        ret = writev(s->fd, iov, iovcnt);
+    } while (ret == -1 && ((s->get_error(s)) == EINTR));
+
+    if (ret == -1)
+        ret = -(s->get_error(s));
+
+    if (ret == -EAGAIN) {
+        s->wait_write = 1;
+        migrate_fd_update_handlers(s);
+    }
 
     return ret;
 }
+#else
+#define migrate_fd_writev NULL
+#endif
 
 void migrate_fd_connect(FdMigrationState *s)
 {
@@ -344,9 +974,15 @@ void migrate_fd_connect(FdMigrationState *s)
     s->file = qemu_fopen_ops_buffered(s,
                                       s->bandwidth_limit,
                                       migrate_fd_put_buffer,
+                                      migrate_fd_writev,
                                       migrate_fd_put_ready,
                                       migrate_fd_wait_for_unfreeze,
                                       migrate_fd_close);
+    outgoing_channels = s->channels;
+    outgoing_file = s->ram_file;
+    /* the destination asks for pages over the same connection */
+    outgoing_postcopy = postcopy && !s->channels && migrate_fd_is_socket(s);
+    migrate_stats_start();
 
     DPRINTF("beginning savevm\n");
     ret = qemu_savevm_state_begin(s->mon, s->file, s->mig_state.blk,
@@ -369,12 +1005,26 @@ void migrate_fd_put_ready(void *opaque)
         return;
     }
 
+    if (s->postcopy) {
+        DPRINTF("post-copy\n");
+        if (ram_save_postcopy(s->file) == 1) {
+            migrate_fd_cleanup(s);
+            s->state = MIG_STATE_COMPLETED;
+            migrate_stats_complete();
+        } else if (qemu_file_has_error(s->file)) {
+            qemu_savevm_state_cancel(s->mon, s->file);
+            migrate_fd_error(s);
+        }
+        return;
+    }
+
     DPRINTF("iterate\n");
     if (qemu_savevm_state_iterate(s->mon, s->file) == 1) {
         int state;
         int old_vm_running = vm_running;
 
         DPRINTF("done iterating\n");
+        mig_stop_time = qemu_get_clock(rt_clock);
         vm_stop(0);
 
         qemu_aio_flush();
@@ -384,11 +1034,24 @@ void migrate_fd_put_ready(void *opaque)
                 vm_start();
             }
             state = MIG_STATE_ERROR;
+        } else if (ram_postcopy_active()) {
+            /* the guest stays stopped, the destination takes over */
+            DPRINTF("switching to post-copy\n");
+            mig_downtime = qemu_get_clock(rt_clock) - mig_stop_time;
+            s->postcopy = 1;
+            migrate_fd_update_handlers(s);
+            return;
         } else {
             state = MIG_STATE_COMPLETED;
         }
         migrate_fd_cleanup(s);
         s->state = state;
+        if (state == MIG_STATE_COMPLETED) {
+            mig_downtime = qemu_get_clock(rt_clock) - mig_stop_time;
+            migrate_stats_complete();
+        }
+    } else {
+        migrate_stats_update();
     }
 }
 
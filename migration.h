@@ -16,6 +16,8 @@
 
 #include "qdict.h"
 #include "qemu-common.h"
+#include "migration-channels.h"
+#include "migration-file.h"
 
 #define MIG_STATE_ERROR		-1
 #define MIG_STATE_COMPLETED	0
@@ -48,6 +50,12 @@ struct FdMigrationState
     int (*close)(struct FdMigrationState*);
     int (*write)(struct FdMigrationState*, const void *, size_t);
     void *opaque;
+    MigChannels *channels;
+    MigFile *ram_file;
+    int wait_write;
+    int postcopy;
+    uint8_t requests[64];
+    int requests_len;
 };
 
 void qemu_start_incoming_migration(const char *uri);
@@ -60,6 +68,42 @@ int do_migrate_set_speed(Monitor *mon, const QDict *qdict, QObject **ret_data);
 
 uint64_t migrate_max_downtime(void);
 
+uint64_t migrate_cache_size(void);
+
+int do_migrate_set_cache_size(Monitor *mon, const QDict *qdict,
+                              QObject **ret_data);
+
+int migrate_compress_level(void);
+
+int migrate_compress_threads(void);
+
+int do_migrate_set_compression(Monitor *mon, const QDict *qdict,
+                               QObject **ret_data);
+
+int migrate_auto_converge(void);
+
+int do_migrate_set_auto_converge(Monitor *mon, const QDict *qdict,
+                                 QObject **ret_data);
+
+int migrate_block_inflight(void);
+
+int do_migrate_set_block_inflight(Monitor *mon, const QDict *qdict,
+                                  QObject **ret_data);
+
+int migrate_channels(void);
+
+MigChannels *migrate_outgoing_channels(void);
+
+int do_migrate_set_channels(Monitor *mon, const QDict *qdict,
+                            QObject **ret_data);
+
+MigFile *migrate_outgoing_file(void);
+
+int migrate_outgoing_postcopy(void);
+
+int do_migrate_set_postcopy(Monitor *mon, const QDict *qdict,
+                            QObject **ret_data);
+
 int do_migrate_set_downtime(Monitor *mon, const QDict *qdict,
                             QObject **ret_data);
 
@@ -103,6 +147,15 @@ MigrationState *fd_start_outgoing_migration(Monitor *mon,
 					    int blk,
 					    int inc);
 
+int file_start_incoming_migration(const char *spec);
+
+MigrationState *file_start_outgoing_migration(Monitor *mon,
+                                              const char *path,
+                                              int64_t bandwidth_limit,
+                                              int detach,
+                                              int blk,
+                                              int inc);
+
 void migrate_fd_monitor_suspend(FdMigrationState *s, Monitor *mon);
 
 void migrate_fd_error(FdMigrationState *s);
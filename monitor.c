@@ -426,6 +426,15 @@ void monitor_protocol_event(MonitorEvent event, QObject *data)
         case QEVENT_BLOCK_IO_ERROR:
             event_name = "BLOCK_IO_ERROR";
             break;
+        case QEVENT_BLOCK_STREAM_COMPLETED:
+            event_name = "BLOCK_STREAM_COMPLETED";
+            break;
+        case QEVENT_MIGRATION_PASS:
+            event_name = "MIGRATION_PASS";
+            break;
+        case QEVENT_MIGRATION_COMPLETED:
+            event_name = "MIGRATION_COMPLETED";
+            break;
         default:
             abort();
             break;
@@ -1057,6 +1066,144 @@ static int do_block_set_passwd(Monitor *mon, const QDict *qdict,
     return 0;
 }
 
+static int do_block_set_io_throttle(Monitor *mon, const QDict *qdict,
+                                    QObject **ret_data)
+{
+    static const char *const bps_names[BLOCK_IO_LIMIT_MAX] = {
+        [BLOCK_IO_LIMIT_READ] = "bps_rd",
+        [BLOCK_IO_LIMIT_WRITE] = "bps_wr",
+        [BLOCK_IO_LIMIT_TOTAL] = "bps",
+    };
+    static const char *const iops_names[BLOCK_IO_LIMIT_MAX] = {
+        [BLOCK_IO_LIMIT_READ] = "iops_rd",
+        [BLOCK_IO_LIMIT_WRITE] = "iops_wr",
+        [BLOCK_IO_LIMIT_TOTAL] = "iops",
+    };
+    BlockIOLimit io_limits;
+    BlockDriverState *bs;
+    int i;
+
+    bs = bdrv_find(qdict_get_str(qdict, "device"));
+    if (!bs) {
+        qemu_error_new(QERR_DEVICE_NOT_FOUND, qdict_get_str(qdict, "device"));
+        return -1;
+    }
+
+    memset(&io_limits, 0, sizeof(io_limits));
+    for (i = 0; i < BLOCK_IO_LIMIT_MAX; i++) {
+        io_limits.bps[i] = qdict_get_int(qdict, bps_names[i]);
+        io_limits.iops[i] = qdict_get_int(qdict, iops_names[i]);
+        if (io_limits.bps[i] < 0) {
+            qemu_error_new(QERR_INVALID_PARAMETER, bps_names[i]);
+            return -1;
+        }
+        if (io_limits.iops[i] < 0) {
+            qemu_error_new(QERR_INVALID_PARAMETER, iops_names[i]);
+            return -1;
+        }
+    }
+    if (qdict_haskey(qdict, "bps_max")) {
+        io_limits.bps_max = qdict_get_int(qdict, "bps_max");
+    }
+    if (qdict_haskey(qdict, "iops_max")) {
+        io_limits.iops_max = qdict_get_int(qdict, "iops_max");
+    }
+    if (io_limits.bps_max < 0) {
+        qemu_error_new(QERR_INVALID_PARAMETER, "bps_max");
+        return -1;
+    }
+    if (io_limits.iops_max < 0) {
+        qemu_error_new(QERR_INVALID_PARAMETER, "iops_max");
+        return -1;
+    }
+
+    bdrv_set_io_limits(bs, &io_limits);
+
+    return 0;
+}
+
+static int do_block_stream(Monitor *mon, const QDict *qdict,
+                           QObject **ret_data)
+{
+    const char *device = qdict_get_str(qdict, "device");
+    BlockDriverState *bs;
+    int ret;
+
+    bs = bdrv_find(device);
+    if (!bs) {
+        qemu_error_new(QERR_DEVICE_NOT_FOUND, device);
+        return -1;
+    }
+
+    ret = bdrv_stream_start(bs, qdict_get_try_int(qdict, "speed", 0));
+    switch (ret) {
+    case 0:
+        break;
+    case -ENOMEDIUM:
+        qemu_error_new(QERR_DEVICE_HAS_NO_MEDIUM, device);
+        return -1;
+    case -EBUSY:
+        qemu_error_new(QERR_DEVICE_IN_USE, device);
+        return -1;
+    case -EACCES:
+        qemu_error_new(QERR_DEVICE_IS_READ_ONLY, device);
+        return -1;
+    case -EINVAL:
+        qemu_error_new(QERR_INVALID_PARAMETER, "speed");
+        return -1;
+    default:
+        qemu_error_new(QERR_NOT_SUPPORTED);
+        return -1;
+    }
+
+    return 0;
+}
+
+static int do_block_stream_set_speed(Monitor *mon, const QDict *qdict,
+                                     QObject **ret_data)
+{
+    const char *device = qdict_get_str(qdict, "device");
+    BlockDriverState *bs;
+    int ret;
+
+    bs = bdrv_find(device);
+    if (!bs) {
+        qemu_error_new(QERR_DEVICE_NOT_FOUND, device);
+        return -1;
+    }
+
+    ret = bdrv_stream_set_speed(bs, qdict_get_int(qdict, "speed"));
+    if (ret == -EINVAL) {
+        qemu_error_new(QERR_INVALID_PARAMETER, "speed");
+        return -1;
+    } else if (ret < 0) {
+        qemu_error_new(QERR_NO_ACTIVE_BLOCK_JOB, device);
+        return -1;
+    }
+
+    return 0;
+}
+
+static int do_block_stream_cancel(Monitor *mon, const QDict *qdict,
+                                  QObject **ret_data)
+{
+    const char *device = qdict_get_str(qdict, "device");
+    BlockDriverState *bs;
+
+    bs = bdrv_find(device);
+    if (!bs) {
+        qemu_error_new(QERR_DEVICE_NOT_FOUND, device);
+        return -1;
+    }
+
+    if (bdrv_stream_cancel(bs) < 0) {
+        qemu_error_new(QERR_NO_ACTIVE_BLOCK_JOB, device);
+        return -1;
+    }
+
+    return 0;
+}
+
 static int do_change_block(Monitor *mon, const char *device,
                            const char *filename, const char *fmt)
 {
@@ -2612,6 +2759,24 @@ static const mon_cmd_t info_cmds[] = {
         .user_print = bdrv_stats_print,
         .mhandler.info_new = bdrv_info_stats,
     },
+    {
+        .name       = "block-jobs",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show progress of block jobs",
+        .user_print = bdrv_block_jobs_print,
+        .mhandler.info_new = bdrv_info_block_jobs,
+    },
+#ifdef CONFIG_POSIX
+    {
+        .name       = "aio",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show the state of the AIO thread pool",
+        .user_print = paio_info_print,
+        .mhandler.info_new = paio_info,
+    },
+#endif
     {
         .name       = "registers",
         .args_type  = "",
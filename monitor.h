@@ -24,6 +24,9 @@ typedef enum MonitorEvent {
     QEVENT_VNC_INITIALIZED,
     QEVENT_VNC_DISCONNECTED,
     QEVENT_BLOCK_IO_ERROR,
+    QEVENT_BLOCK_STREAM_COMPLETED,
+    QEVENT_MIGRATION_PASS,
+    QEVENT_MIGRATION_COMPLETED,
     QEVENT_MAX,
 } MonitorEvent;
 
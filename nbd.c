@@ -30,6 +30,7 @@
 #include <inttypes.h>
 
 #include "qemu_socket.h"
+#include "qemu-aio.h"
 
 //#define DEBUG_NBD
 
@@ -268,22 +269,28 @@ int unix_socket_outgoing(const char *path)
                   Request (type == 2)
 */
 
-int nbd_negotiate(int csock, off_t size)
-{
-	char buf[8 + 8 + 8 + 128];
+#define NBD_NEGOTIATE_SIZE      (8 + 8 + 8 + 128)
 
+static void nbd_encode_negotiate(uint8_t *buf, off_t size)
+{
 	/* Negotiate
 	   [ 0 ..   7]   passwd   ("NBDMAGIC")
 	   [ 8 ..  15]   magic    (0x00420281861253)
 	   [16 ..  23]   size
 	   [24 .. 151]   reserved (0)
 	 */
-
-	TRACE("Beginning negotiation.");
 	memcpy(buf, "NBDMAGIC", 8);
 	cpu_to_be64w((uint64_t*)(buf + 8), 0x00420281861253LL);
 	cpu_to_be64w((uint64_t*)(buf + 16), size);
 	memset(buf + 24, 0, 128);
+}
+
+int nbd_negotiate(int csock, off_t size)
+{
+	uint8_t buf[NBD_NEGOTIATE_SIZE];
+
+	TRACE("Beginning negotiation.");
+	nbd_encode_negotiate(buf, size);
 
 	if (write_sync(csock, buf, sizeof(buf)) != sizeof(buf)) {
 		LOG("write failed");
@@ -435,15 +442,20 @@ int nbd_client(int fd, int csock)
 }
 #endif
 
-int nbd_send_request(int csock, struct nbd_request *request)
+void nbd_encode_request(uint8_t *buf, const struct nbd_request *request)
 {
-	uint8_t buf[4 + 4 + 8 + 8 + 4];
-
 	cpu_to_be32w((uint32_t*)buf, NBD_REQUEST_MAGIC);
 	cpu_to_be32w((uint32_t*)(buf + 4), request->type);
 	cpu_to_be64w((uint64_t*)(buf + 8), request->handle);
 	cpu_to_be64w((uint64_t*)(buf + 16), request->from);
 	cpu_to_be32w((uint32_t*)(buf + 24), request->len);
+}
+
+int nbd_send_request(int csock, struct nbd_request *request)
+{
+	uint8_t buf[NBD_REQUEST_SIZE];
+
+	nbd_encode_request(buf, request);
 
 	TRACE("Sending request to client");
 
@@ -456,17 +468,10 @@ int nbd_send_request(int csock, struct nbd_request *request)
 }
 
 
-static int nbd_receive_request(int csock, struct nbd_request *request)
+static int nbd_decode_request(const uint8_t *buf, struct nbd_request *request)
 {
-	uint8_t buf[4 + 4 + 8 + 8 + 4];
 	uint32_t magic;
 
-	if (read_sync(csock, buf, sizeof(buf)) != sizeof(buf)) {
-		LOG("read failed");
-		errno = EINVAL;
-		return -1;
-	}
-
 	/* Request
 	   [ 0 ..  3]   magic   (NBD_REQUEST_MAGIC)
 	   [ 4 ..  7]   type    (0 == READ, 1 == WRITE)
@@ -493,10 +498,22 @@ static int nbd_receive_request(int csock, struct nbd_request *request)
 	return 0;
 }
 
+static int nbd_receive_request(int csock, struct nbd_request *request)
+{
+	uint8_t buf[NBD_REQUEST_SIZE];
+
+	if (read_sync(csock, buf, sizeof(buf)) != sizeof(buf)) {
+		LOG("read failed");
+		errno = EINVAL;
+		return -1;
+	}
+
+	return nbd_decode_request(buf, request);
+}
+
 int nbd_receive_reply(int csock, struct nbd_reply *reply)
 {
-	uint8_t buf[4 + 4 + 8];
-	uint32_t magic;
+	uint8_t buf[NBD_REPLY_SIZE];
 
 	memset(buf, 0xAA, sizeof(buf));
 
@@ -506,6 +523,13 @@ int nbd_receive_reply(int csock, struct nbd_reply *reply)
 		return -1;
 	}
 
+	return nbd_decode_reply(buf, reply);
+}
+
+int nbd_decode_reply(const uint8_t *buf, struct nbd_reply *reply)
+{
+	uint32_t magic;
+
 	/* Reply
 	   [ 0 ..  3]    magic   (NBD_REPLY_MAGIC)
 	   [ 4 ..  7]    error   (0 == no error)
@@ -528,10 +552,8 @@ int nbd_receive_reply(int csock, struct nbd_reply *reply)
 	return 0;
 }
 
-static int nbd_send_reply(int csock, struct nbd_reply *reply)
+static void nbd_encode_reply(uint8_t *buf, const struct nbd_reply *reply)
 {
-	uint8_t buf[4 + 4 + 8];
-
 	/* Reply
 	   [ 0 ..  3]    magic   (NBD_REPLY_MAGIC)
 	   [ 4 ..  7]    error   (0 == no error)
@@ -540,6 +562,13 @@ static int nbd_send_reply(int csock, struct nbd_reply *reply)
 	cpu_to_be32w((uint32_t*)buf, NBD_REPLY_MAGIC);
 	cpu_to_be32w((uint32_t*)(buf + 4), reply->error);
 	cpu_to_be64w((uint64_t*)(buf + 8), reply->handle);
+}
+
+static int nbd_send_reply(int csock, struct nbd_reply *reply)
+{
+	uint8_t buf[NBD_REPLY_SIZE];
+
+	nbd_encode_reply(buf, reply);
 
 	TRACE("Sending response to client");
 
@@ -659,3 +688,424 @@ int nbd_trip(BlockDriverState *bs, int csock, off_t size, uint64_t dev_offset,
 
 	return 0;
 }
+
+#ifndef _WIN32
+
+/*
+ * Asynchronous server
+ *
+ * Each connection reads requests as long as fewer than max_requests of
+ * them are outstanding, and submits them to the block layer as AIO.
+ * Replies are sent in the order the requests complete, which need not be
+ * the order they were received in; the client matches them by handle.
+ */
+
+typedef struct NBDServerRequest {
+    NBDClient *client;
+    struct nbd_request request;
+    struct nbd_reply reply;
+    uint8_t reply_buf[NBD_REPLY_SIZE];
+    uint8_t *data;
+    struct iovec iov;
+    QEMUIOVector qiov;
+    QTAILQ_ENTRY(NBDServerRequest) node;
+} NBDServerRequest;
+
+struct NBDClient {
+    BlockDriverState *bs;
+    int sock;
+    off_t size;
+    uint64_t dev_offset;
+    bool readonly;
+    int max_requests;
+    void (*close)(NBDClient *client);
+
+    int refcount;
+    int closed;
+    int nb_requests;        /* received, reply not sent completely */
+
+    /* sent from nbd_client_send() before any request is read */
+    uint8_t negotiate_buf[NBD_NEGOTIATE_SIZE];
+    size_t negotiate_done;
+
+    uint8_t recv_buf[NBD_REQUEST_SIZE];
+    size_t recv_done;
+    NBDServerRequest *recv_req;     /* write whose data is being received */
+
+    /* completed requests; the reply of the first may be partially sent */
+    QTAILQ_HEAD(, NBDServerRequest) send_queue;
+    size_t send_done;
+};
+
+static void nbd_client_update_handler(NBDClient *client);
+
+/* Returns the number of bytes transferred, 0 if it would block, or -errno */
+static ssize_t nbd_client_recv(NBDClient *client, void *buf, size_t len)
+{
+    ssize_t ret;
+
+    do {
+        ret = recv(client->sock, buf, len, 0);
+    } while (ret == -1 && errno == EINTR);
+
+    if (ret == -1) {
+        return errno == EAGAIN ? 0 : -errno;
+    }
+    return ret == 0 ? -EPIPE : ret;
+}
+
+/* The connection and each of its requests hold a reference */
+static void nbd_client_put(NBDClient *client)
+{
+    if (--client->refcount == 0) {
+        client->close(client);
+        qemu_free(client);
+    }
+}
+
+static void nbd_request_free(NBDServerRequest *req)
+{
+    NBDClient *client = req->client;
+
+    qemu_vfree(req->data);
+    qemu_free(req);
+
+    client->nb_requests--;
+    nbd_client_put(client);
+}
+
+static void nbd_client_disconnect(NBDClient *client)
+{
+    NBDServerRequest *req;
+
+    if (client->closed) {
+        return;
+    }
+
+    qemu_aio_set_fd_handler(client->sock, NULL, NULL, NULL, NULL, NULL);
+    close(client->sock);
+    client->closed = 1;
+
+    if (client->recv_req) {
+        nbd_request_free(client->recv_req);
+        client->recv_req = NULL;
+    }
+    while ((req = QTAILQ_FIRST(&client->send_queue)) != NULL) {
+        QTAILQ_REMOVE(&client->send_queue, req, node);
+        nbd_request_free(req);
+    }
+
+    /* Requests still in the block layer drop their references when done */
+    nbd_client_put(client);
+}
+
+/* Returns 1 once the negotiation has been sent, 0 if it would block, or -1 */
+static int nbd_client_send_negotiate(NBDClient *client)
+{
+    ssize_t ret;
+
+    while (client->negotiate_done < NBD_NEGOTIATE_SIZE) {
+        do {
+            ret = send(client->sock,
+                       client->negotiate_buf + client->negotiate_done,
+                       NBD_NEGOTIATE_SIZE - client->negotiate_done, 0);
+        } while (ret == -1 && socket_error() == EINTR);
+
+        if (ret == -1) {
+            return socket_error() == EAGAIN ? 0 : -1;
+        }
+        client->negotiate_done += ret;
+    }
+    TRACE("Negotation succeeded.");
+    return 1;
+}
+
+static void nbd_client_send(void *opaque)
+{
+    NBDClient *client = opaque;
+    NBDServerRequest *req;
+    int ret;
+
+    if (client->negotiate_done < NBD_NEGOTIATE_SIZE) {
+        ret = nbd_client_send_negotiate(client);
+        if (ret < 0) {
+            LOG("write failed");
+            nbd_client_disconnect(client);
+            return;
+        }
+        if (ret == 0) {
+            nbd_client_update_handler(client);
+            return;
+        }
+    }
+
+    while ((req = QTAILQ_FIRST(&client->send_queue)) != NULL) {
+        struct iovec iov[2];
+        struct msghdr msg;
+        size_t total = NBD_REPLY_SIZE;
+        size_t skip = client->send_done;
+        ssize_t ret;
+        int niov = 0;
+
+        if (skip < NBD_REPLY_SIZE) {
+            iov[niov].iov_base = req->reply_buf + skip;
+            iov[niov].iov_len = NBD_REPLY_SIZE - skip;
+            niov++;
+            skip = 0;
+        } else {
+            skip -= NBD_REPLY_SIZE;
+        }
+
+        /* Read data goes out straight from the buffer it was read into */
+        if (req->request.type == NBD_CMD_READ && req->reply.error == 0) {
+            total += req->request.len;
+            iov[niov].iov_base = req->data + skip;
+            iov[niov].iov_len = req->request.len - skip;
+            niov++;
+        }
+
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = niov;
+
+        /* SIGPIPE is ignored by the programs serving NBD */
+        do {
+            ret = sendmsg(client->sock, &msg, 0);
+        } while (ret == -1 && socket_error() == EINTR);
+
+        if (ret == -1) {
+            if (socket_error() == EAGAIN) {
+                break;
+            }
+            LOG("writing to socket failed");
+            nbd_client_disconnect(client);
+            return;
+        }
+
+        client->send_done += ret;
+        if (client->send_done < total) {
+            break;
+        }
+
+        client->send_done = 0;
+        QTAILQ_REMOVE(&client->send_queue, req, node);
+        nbd_request_free(req);
+    }
+
+    nbd_client_update_handler(client);
+}
+
+static void nbd_request_complete(NBDServerRequest *req, int ret)
+{
+    NBDClient *client = req->client;
+
+    if (client->closed) {
+        nbd_request_free(req);
+        return;
+    }
+
+    req->reply.error = ret < 0 ? -ret : 0;
+    nbd_encode_reply(req->reply_buf, &req->reply);
+    QTAILQ_INSERT_TAIL(&client->send_queue, req, node);
+
+    /* Most of the time the reply fits into the socket buffer right away */
+    if (QTAILQ_FIRST(&client->send_queue) == req) {
+        nbd_client_send(client);
+    }
+}
+
+static void nbd_request_cb(void *opaque, int ret)
+{
+    nbd_request_complete(opaque, ret);
+}
+
+static void nbd_request_submit(NBDServerRequest *req)
+{
+    NBDClient *client = req->client;
+    int64_t sector_num = (req->request.from + client->dev_offset) / 512;
+    int nb_sectors = req->request.len / 512;
+    BlockDriverAIOCB *acb;
+
+    if (req->request.type == NBD_CMD_WRITE) {
+        if (client->readonly) {
+            TRACE("Server is read-only, return error");
+            nbd_request_complete(req, -EPERM);
+            return;
+        }
+        acb = bdrv_aio_writev(client->bs, sector_num, &req->qiov, nb_sectors,
+                              nbd_request_cb, req);
+    } else {
+        acb = bdrv_aio_readv(client->bs, sector_num, &req->qiov, nb_sectors,
+                             nbd_request_cb, req);
+    }
+
+    if (acb == NULL) {
+        nbd_request_complete(req, -EIO);
+    }
+}
+
+/* Returns 1 if the request was accepted, 0 if it was a disconnect, or -1 */
+static int nbd_request_new(NBDClient *client)
+{
+    NBDServerRequest *req;
+    struct nbd_request request;
+
+    if (nbd_decode_request(client->recv_buf, &request) == -1) {
+        return -1;
+    }
+
+    switch (request.type) {
+    case NBD_CMD_READ:
+    case NBD_CMD_WRITE:
+        break;
+    case NBD_CMD_DISC:
+        TRACE("Request type is DISCONNECT");
+        return 0;
+    default:
+        LOG("invalid request type (%u) received", request.type);
+        return -1;
+    }
+
+    if (request.len > NBD_BUFFER_SIZE || request.len % 512) {
+        LOG("invalid len (%u)", request.len);
+        return -1;
+    }
+    if ((request.from + request.len) < request.from ||
+        (request.from + request.len) > client->size) {
+        LOG("requested operation past EOF--bad client?");
+        return -1;
+    }
+
+    req = qemu_mallocz(sizeof(*req));
+    req->client = client;
+    req->request = request;
+    req->reply.handle = request.handle;
+    req->data = qemu_blockalign(client->bs, request.len ? request.len : 512);
+    req->iov.iov_base = req->data;
+    req->iov.iov_len = request.len;
+    qemu_iovec_init_external(&req->qiov, &req->iov, 1);
+    client->nb_requests++;
+    client->refcount++;
+
+    if (request.type == NBD_CMD_WRITE && request.len) {
+        /* submitted once the data has arrived */
+        client->recv_req = req;
+    } else {
+        nbd_request_submit(req);
+    }
+
+    return 1;
+}
+
+static void nbd_client_receive(void *opaque)
+{
+    NBDClient *client = opaque;
+    ssize_t ret;
+
+    /* Requests may complete right away and end the connection */
+    client->refcount++;
+
+    while (!client->closed) {
+        NBDServerRequest *req = client->recv_req;
+
+        if (req == NULL) {
+            if (client->nb_requests >= client->max_requests) {
+                break;
+            }
+
+            ret = nbd_client_recv(client, client->recv_buf + client->recv_done,
+                                  NBD_REQUEST_SIZE - client->recv_done);
+            if (ret < 0) {
+                goto fail;
+            }
+            client->recv_done += ret;
+            if (client->recv_done < NBD_REQUEST_SIZE) {
+                break;
+            }
+            client->recv_done = 0;
+
+            if (nbd_request_new(client) <= 0) {
+                goto fail;
+            }
+        } else {
+            ret = nbd_client_recv(client, req->data + client->recv_done,
+                                  req->request.len - client->recv_done);
+            if (ret < 0) {
+                goto fail;
+            }
+            client->recv_done += ret;
+            if (client->recv_done < req->request.len) {
+                break;
+            }
+            client->recv_done = 0;
+            client->recv_req = NULL;
+
+            nbd_request_submit(req);
+        }
+    }
+
+    nbd_client_update_handler(client);
+    nbd_client_put(client);
+    return;
+
+fail:
+    nbd_client_disconnect(client);
+    nbd_client_put(client);
+}
+
+static void nbd_client_update_handler(NBDClient *client)
+{
+    IOHandler *fd_read = NULL;
+    IOHandler *fd_write = NULL;
+
+    if (client->closed) {
+        return;
+    }
+
+    if (client->negotiate_done < NBD_NEGOTIATE_SIZE) {
+        /* nothing is read before the client has got the negotiation */
+        fd_write = nbd_client_send;
+    } else {
+        /* Stop reading while the queue is full */
+        if (client->recv_req || client->nb_requests < client->max_requests) {
+            fd_read = nbd_client_receive;
+        }
+        if (!QTAILQ_EMPTY(&client->send_queue)) {
+            fd_write = nbd_client_send;
+        }
+    }
+
+    qemu_aio_set_fd_handler(client->sock, fd_read, fd_write, NULL, NULL,
+                            client);
+}
+
+/*
+ * Starts serving bs on the connection csock, beginning with the negotiation,
+ * which is sent without blocking.  close is called once the connection is
+ * gone and all its requests are done.
+ */
+NBDClient *nbd_client_new(BlockDriverState *bs, int csock, off_t size,
+                          uint64_t dev_offset, bool readonly,
+                          int max_requests, void (*close)(NBDClient *))
+{
+    NBDClient *client;
+
+    client = qemu_mallocz(sizeof(*client));
+    client->refcount = 1;
+    client->bs = bs;
+    client->sock = csock;
+    client->size = size;
+    client->dev_offset = dev_offset;
+    client->readonly = readonly;
+    client->max_requests = max_requests;
+    client->close = close;
+    QTAILQ_INIT(&client->send_queue);
+    nbd_encode_negotiate(client->negotiate_buf, size);
+
+    socket_set_nonblock(csock);
+    nbd_client_update_handler(client);
+
+    return client;
+}
+
+#endif /* _WIN32 */
@@ -37,6 +37,12 @@ struct nbd_reply {
     uint64_t handle;
 };
 
+#define NBD_REQUEST_SIZE        (4 + 4 + 8 + 8 + 4)
+#define NBD_REPLY_SIZE          (4 + 4 + 8)
+
+/* Largest request qemu-nbd accepts */
+#define NBD_BUFFER_SIZE         (1024 * 1024)
+
 enum {
     NBD_CMD_READ = 0,
     NBD_CMD_WRITE = 1,
@@ -52,10 +58,18 @@ int unix_socket_incoming(const char *path);
 int nbd_negotiate(int csock, off_t size);
 int nbd_receive_negotiate(int csock, off_t *size, size_t *blocksize);
 int nbd_init(int fd, int csock, off_t size, size_t blocksize);
+void nbd_encode_request(uint8_t *buf, const struct nbd_request *request);
+int nbd_decode_reply(const uint8_t *buf, struct nbd_reply *reply);
 int nbd_send_request(int csock, struct nbd_request *request);
 int nbd_receive_reply(int csock, struct nbd_reply *reply);
 int nbd_trip(BlockDriverState *bs, int csock, off_t size, uint64_t dev_offset,
              off_t *offset, bool readonly, uint8_t *data, int data_size);
+
+typedef struct NBDClient NBDClient;
+
+NBDClient *nbd_client_new(BlockDriverState *bs, int csock, off_t size,
+                          uint64_t dev_offset, bool readonly,
+                          int max_requests, void (*close)(NBDClient *));
 int nbd_client(int fd, int csock);
 int nbd_disconnect(int fd);
 
@@ -191,6 +191,12 @@ int qemu_gettimeofday(qemu_timeval *tp)
 
 
 #ifdef _WIN32
+void socket_set_block(int fd)
+{
+    unsigned long opt = 0;
+    ioctlsocket(fd, FIONBIO, &opt);
+}
+
 void socket_set_nonblock(int fd)
 {
     unsigned long opt = 1;
@@ -212,6 +218,13 @@ void qemu_set_cloexec(int fd)
 
 #else
 
+void socket_set_block(int fd)
+{
+    int f;
+    f = fcntl(fd, F_GETFL);
+    fcntl(fd, F_SETFL, f & ~O_NONBLOCK);
+}
+
 void socket_set_nonblock(int fd)
 {
     int f;
@@ -0,0 +1,259 @@
+/*
+ * Page delta compression for live migration
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ *
+ */
+
+#include "qemu-common.h"
+#include "qemu-queue.h"
+#include "page_delta.h"
+
+/*
+ * The cache keeps a copy of the pages as they were last sent, indexed by
+ * their RAM address, and evicts the least recently sent page when it is full.
+ * All memory is allocated up front.
+ */
+
+typedef struct PageDeltaEntry {
+    uint64_t addr;
+    uint8_t *data;
+    struct PageDeltaEntry *hash_next;
+    QTAILQ_ENTRY(PageDeltaEntry) lru;
+} PageDeltaEntry;
+
+struct PageDeltaCache {
+    int page_size;
+    int64_t nb_pages;
+    int64_t nb_used;
+    PageDeltaEntry *entries;
+    uint8_t *data;
+    PageDeltaEntry **hash;
+    uint64_t hash_mask;
+    /* most recently used first */
+    QTAILQ_HEAD(PageDeltaLRU, PageDeltaEntry) lru;
+};
+
+static uint64_t page_delta_hash(PageDeltaCache *cache, uint64_t addr)
+{
+    uint64_t h = addr / cache->page_size;
+
+    h *= 0x9e3779b97f4a7c15ULL;
+    return (h >> 32) & cache->hash_mask;
+}
+
+PageDeltaCache *page_delta_cache_new(int64_t nb_pages, int page_size)
+{
+    PageDeltaCache *cache;
+    uint64_t nb_buckets = 1;
+
+    if (nb_pages < 1) {
+        nb_pages = 1;
+    }
+    while (nb_buckets < nb_pages) {
+        nb_buckets <<= 1;
+    }
+
+    cache = qemu_mallocz(sizeof(*cache));
+    cache->page_size = page_size;
+    cache->nb_pages = nb_pages;
+    cache->entries = qemu_mallocz(nb_pages * sizeof(PageDeltaEntry));
+    cache->data = qemu_vmalloc(nb_pages * page_size);
+    cache->hash = qemu_mallocz(nb_buckets * sizeof(PageDeltaEntry *));
+    cache->hash_mask = nb_buckets - 1;
+    QTAILQ_INIT(&cache->lru);
+
+    return cache;
+}
+
+void page_delta_cache_free(PageDeltaCache *cache)
+{
+    qemu_free(cache->hash);
+    qemu_vfree(cache->data);
+    qemu_free(cache->entries);
+    qemu_free(cache);
+}
+
+static PageDeltaEntry *page_delta_cache_find(PageDeltaCache *cache,
+                                             uint64_t addr,
+                                             PageDeltaEntry ***pprev)
+{
+    PageDeltaEntry **p = &cache->hash[page_delta_hash(cache, addr)];
+
+    while (*p && (*p)->addr != addr) {
+        p = &(*p)->hash_next;
+    }
+    if (pprev) {
+        *pprev = p;
+    }
+    return *p;
+}
+
+/*
+ * Returns the cached copy of the page at addr, or NULL if it isn't cached.
+ * The page becomes the most recently used one.
+ */
+uint8_t *page_delta_cache_get(PageDeltaCache *cache, uint64_t addr)
+{
+    PageDeltaEntry *e = page_delta_cache_find(cache, addr, NULL);
+
+    if (!e) {
+        return NULL;
+    }
+    QTAILQ_REMOVE(&cache->lru, e, lru);
+    QTAILQ_INSERT_HEAD(&cache->lru, e, lru);
+    return e->data;
+}
+
+/* Adds a copy of a page that isn't cached yet */
+void page_delta_cache_insert(PageDeltaCache *cache, uint64_t addr,
+                             const uint8_t *data)
+{
+    PageDeltaEntry *e, **p;
+
+    if (cache->nb_used < cache->nb_pages) {
+        e = &cache->entries[cache->nb_used];
+        e->data = cache->data + cache->nb_used * cache->page_size;
+        cache->nb_used++;
+    } else {
+        /* evict the least recently used page */
+        e = QTAILQ_LAST(&cache->lru, PageDeltaLRU);
+        page_delta_cache_find(cache, e->addr, &p);
+        *p = e->hash_next;
+        QTAILQ_REMOVE(&cache->lru, e, lru);
+    }
+
+    e->addr = addr;
+    memcpy(e->data, data, cache->page_size);
+    p = &cache->hash[page_delta_hash(cache, addr)];
+    e->hash_next = *p;
+    *p = e;
+    QTAILQ_INSERT_HEAD(&cache->lru, e, lru);
+}
+
+int64_t page_delta_cache_pages(PageDeltaCache *cache)
+{
+    return cache->nb_pages;
+}
+
+/*
+ * Encoding
+ *
+ * A delta is a sequence of (unchanged, changed) run length pairs, both
+ * encoded as ULEB128, each followed by the new contents of the changed run.
+ * Unchanged bytes at the end of the page are not encoded.
+ */
+
+static int uleb128_encode(uint8_t *dst, uint32_t val)
+{
+    int n = 0;
+
+    do {
+        dst[n] = val & 0x7f;
+        val >>= 7;
+        if (val) {
+            dst[n] |= 0x80;
+        }
+        n++;
+    } while (val);
+    return n;
+}
+
+static int uleb128_decode(const uint8_t *src, int len, uint32_t *val)
+{
+    int n = 0, shift = 0;
+
+    *val = 0;
+    do {
+        if (n >= len || shift > 28) {
+            return -1;
+        }
+        *val |= (uint32_t)(src[n] & 0x7f) << shift;
+        shift += 7;
+    } while (src[n++] & 0x80);
+    return n;
+}
+
+/*
+ * Encodes the changes from old_buf to new_buf (len bytes each) into dst.
+ * Returns the length of the delta, or -1 if it would be longer than dlen.
+ */
+int page_delta_encode(const uint8_t *old_buf, const uint8_t *new_buf, int len,
+                      uint8_t *dst, int dlen)
+{
+    int i = 0, d = 0, start, unchanged, changed;
+    uint8_t hdr[10];
+    int hdr_len;
+
+    while (i < len) {
+        /* unchanged run, compared a word at a time where possible */
+        start = i;
+        while (i < len && old_buf[i] == new_buf[i]) {
+            i++;
+            if ((i % sizeof(long)) == 0) {
+                while (i + sizeof(long) <= len &&
+                       *(const long *)(old_buf + i) ==
+                       *(const long *)(new_buf + i)) {
+                    i += sizeof(long);
+                }
+            }
+        }
+        if (i == len) {
+            break;
+        }
+        unchanged = i - start;
+
+        /* changed run */
+        start = i;
+        while (i < len && old_buf[i] != new_buf[i]) {
+            i++;
+        }
+        changed = i - start;
+
+        hdr_len = uleb128_encode(hdr, unchanged);
+        hdr_len += uleb128_encode(hdr + hdr_len, changed);
+        if (d + hdr_len + changed > dlen) {
+            return -1;
+        }
+        memcpy(dst + d, hdr, hdr_len);
+        memcpy(dst + d + hdr_len, new_buf + start, changed);
+        d += hdr_len + changed;
+    }
+
+    return d;
+}
+
+/*
+ * Applies a delta of slen bytes to the dlen bytes at dst.
+ * Returns 0 on success and -1 if the delta is malformed.
+ */
+int page_delta_decode(const uint8_t *src, int slen, uint8_t *dst, int dlen)
+{
+    uint32_t unchanged, changed;
+    int i = 0, d = 0, n;
+
+    while (i < slen) {
+        n = uleb128_decode(src + i, slen - i, &unchanged);
+        if (n < 0) {
+            return -1;
+        }
+        i += n;
+        n = uleb128_decode(src + i, slen - i, &changed);
+        if (n < 0) {
+            return -1;
+        }
+        i += n;
+
+        if (unchanged > dlen - d || changed > dlen - d - unchanged ||
+            changed > slen - i) {
+            return -1;
+        }
+        d += unchanged;
+        memcpy(dst + d, src + i, changed);
+        d += changed;
+        i += changed;
+    }
+
+    return 0;
+}
@@ -0,0 +1,27 @@
+/*
+ * Page delta compression for live migration
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ *
+ */
+
+#ifndef QEMU_PAGE_DELTA_H
+#define QEMU_PAGE_DELTA_H
+
+#include "qemu-common.h"
+
+typedef struct PageDeltaCache PageDeltaCache;
+
+PageDeltaCache *page_delta_cache_new(int64_t nb_pages, int page_size);
+void page_delta_cache_free(PageDeltaCache *cache);
+uint8_t *page_delta_cache_get(PageDeltaCache *cache, uint64_t addr);
+void page_delta_cache_insert(PageDeltaCache *cache, uint64_t addr,
+                             const uint8_t *data);
+int64_t page_delta_cache_pages(PageDeltaCache *cache);
+
+int page_delta_encode(const uint8_t *old_buf, const uint8_t *new_buf, int len,
+                      uint8_t *dst, int dlen);
+int page_delta_decode(const uint8_t *src, int slen, uint8_t *dst, int dlen);
+
+#endif
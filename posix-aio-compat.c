@@ -25,6 +25,8 @@
 #include "qemu-queue.h"
 #include "osdep.h"
 #include "qemu-common.h"
+#include "qemu-objects.h"
+#include "monitor.h"
 #include "block_int.h"
 
 #include "block/raw-posix-aio.h"
@@ -44,6 +46,7 @@ struct qemu_paiocb {
     off_t aio_offset;
 
     QTAILQ_ENTRY(qemu_paiocb) node;
+    struct PaioQueue *queue;
     int aio_type;
     ssize_t ret;
     int active;
@@ -58,14 +61,40 @@ typedef struct PosixAioState {
 } PosixAioState;
 
 
+/*
+ * Requests are queued per BlockDriverState. Queues with pending requests
+ * sit on a ready list that workers serve round-robin, and no queue may
+ * occupy more than its share of max_threads, so that a slow image can't
+ * starve all others of worker threads.
+ */
+typedef struct PaioQueue {
+    BlockDriverState *bs;       /* NULL once the image has been closed */
+    char filename[1024];
+    QTAILQ_HEAD(, qemu_paiocb) requests;
+    int queued;
+    int active;
+    int ready;
+    QTAILQ_ENTRY(PaioQueue) ready_node;
+    QLIST_ENTRY(PaioQueue) node;
+} PaioQueue;
+
 static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
 static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
 static pthread_t thread_id;
 static pthread_attr_t attr;
+static int min_threads = 0;
 static int max_threads = 64;
+static int idle_timeout = 10;
 static int cur_threads = 0;
 static int idle_threads = 0;
-static QTAILQ_HEAD(, qemu_paiocb) request_list;
+static QLIST_HEAD(, PaioQueue) queue_list = QLIST_HEAD_INITIALIZER(queue_list);
+static QTAILQ_HEAD(, PaioQueue) ready_list =
+    QTAILQ_HEAD_INITIALIZER(ready_list);
+static int nr_queues;
+
+/* statistics, protected by lock */
+static uint64_t completed_reqs;
+static int64_t busy_time_us;
 
 #ifdef CONFIG_PREADV
 static int preadv_present = 1;
@@ -235,36 +264,35 @@ static ssize_t handle_aiocb_rw(struct qemu_paiocb *aiocb)
     ssize_t nbytes;
     char *buf;
 
-    if (!(aiocb->aio_type & QEMU_AIO_MISALIGNED)) {
-        /*
-         * If there is just a single buffer, and it is properly aligned
-         * we can just use plain pread/pwrite without any problems.
-         */
-        if (aiocb->aio_niov == 1)
-             return handle_aiocb_rw_linear(aiocb, aiocb->aio_iov->iov_base);
-
-        /*
-         * We have more than one iovec, and all are properly aligned.
-         *
-         * Try preadv/pwritev first and fall back to linearizing the
-         * buffer if it's not supported.
-         */
-	if (preadv_present) {
-            nbytes = handle_aiocb_rw_vector(aiocb);
-            if (nbytes == aiocb->aio_nbytes)
-	        return nbytes;
-            if (nbytes < 0 && nbytes != -ENOSYS)
-                return nbytes;
-            preadv_present = 0;
-        }
+    /*
+     * Misaligned requests are copied through a bounce buffer before they
+     * get here. If there is just a single buffer we can just use plain
+     * pread/pwrite without any problems.
+     */
+    if (aiocb->aio_niov == 1)
+         return handle_aiocb_rw_linear(aiocb, aiocb->aio_iov->iov_base);
 
-        /*
-         * XXX(hch): short read/write.  no easy way to handle the reminder
-         * using these interfaces.  For now retry using plain
-         * pread/pwrite?
-         */
+    /*
+     * We have more than one iovec, and all are properly aligned.
+     *
+     * Try preadv/pwritev first and fall back to linearizing the
+     * buffer if it's not supported.
+     */
+    if (preadv_present) {
+        nbytes = handle_aiocb_rw_vector(aiocb);
+        if (nbytes == aiocb->aio_nbytes)
+            return nbytes;
+        if (nbytes < 0 && nbytes != -ENOSYS)
+            return nbytes;
+        preadv_present = 0;
     }
 
+    /*
+     * XXX(hch): short read/write.  no easy way to handle the reminder
+     * using these interfaces.  For now retry using plain
+     * pread/pwrite?
+     */
+
     /*
      * Ok, we have to do it the hard way, copy all segments into
      * a single aligned buffer.
@@ -300,6 +328,61 @@ static ssize_t handle_aiocb_rw(struct qemu_paiocb *aiocb)
     return nbytes;
 }
 
+/* Called with lock held */
+static void paio_put_queue(PaioQueue *q)
+{
+    if (!q->bs && !q->queued && !q->active) {
+        QLIST_REMOVE(q, node);
+        nr_queues--;
+        qemu_free(q);
+    }
+}
+
+static int64_t get_time_us(void)
+{
+    qemu_timeval tv;
+
+    qemu_gettimeofday(&tv);
+    return tv.tv_sec * 1000000LL + tv.tv_usec;
+}
+
+/* Takes the next request to process, or returns NULL. Called with lock held */
+static struct qemu_paiocb *paio_next_request(void)
+{
+    struct qemu_paiocb *aiocb;
+    PaioQueue *q;
+    int share;
+
+    share = nr_queues ? max_threads / nr_queues : max_threads;
+    if (share < 1) {
+        share = 1;
+    }
+
+    QTAILQ_FOREACH(q, &ready_list, ready_node) {
+        if (q->active >= share) {
+            continue;
+        }
+
+        aiocb = QTAILQ_FIRST(&q->requests);
+        QTAILQ_REMOVE(&q->requests, aiocb, node);
+        q->queued--;
+        q->active++;
+
+        /* go to the back of the line */
+        QTAILQ_REMOVE(&ready_list, q, ready_node);
+        if (q->queued) {
+            QTAILQ_INSERT_TAIL(&ready_list, q, ready_node);
+        } else {
+            q->ready = 0;
+        }
+
+        aiocb->active = 1;
+        return aiocb;
+    }
+
+    return NULL;
+}
+
 static void *aio_thread(void *unused)
 {
     pid_t pid;
@@ -308,30 +391,38 @@ static void *aio_thread(void *unused)
 
     while (1) {
         struct qemu_paiocb *aiocb;
+        PaioQueue *q;
         ssize_t ret = 0;
+        int64_t start;
         qemu_timeval tv;
         struct timespec ts;
 
+        mutex_lock(&lock);
+
+        /* idle_timeout is set under the lock */
         qemu_gettimeofday(&tv);
-        ts.tv_sec = tv.tv_sec + 10;
+        ts.tv_sec = tv.tv_sec + idle_timeout;
         ts.tv_nsec = 0;
 
-        mutex_lock(&lock);
-
-        while (QTAILQ_EMPTY(&request_list) &&
+        while (!(aiocb = paio_next_request()) &&
                !(ret == ETIMEDOUT)) {
             ret = cond_timedwait(&cond, &lock, &ts);
         }
 
-        if (QTAILQ_EMPTY(&request_list))
-            break;
+        if (!aiocb) {
+            /* idle for too long, but keep min_threads around */
+            if (cur_threads > min_threads)
+                break;
+            mutex_unlock(&lock);
+            continue;
+        }
 
-        aiocb = QTAILQ_FIRST(&request_list);
-        QTAILQ_REMOVE(&request_list, aiocb, node);
-        aiocb->active = 1;
+        q = aiocb->queue;
         idle_threads--;
         mutex_unlock(&lock);
 
+        start = get_time_us();
+
         switch (aiocb->aio_type & QEMU_AIO_TYPE_MASK) {
         case QEMU_AIO_READ:
         case QEMU_AIO_WRITE:
@@ -351,6 +442,10 @@ static void *aio_thread(void *unused)
 
         mutex_lock(&lock);
         aiocb->ret = ret;
+        q->active--;
+        paio_put_queue(q);
+        completed_reqs++;
+        busy_time_us += get_time_us() - start;
         idle_threads++;
         mutex_unlock(&lock);
 
@@ -380,14 +475,44 @@ static void spawn_thread(void)
     if (sigprocmask(SIG_SETMASK, &oldset, NULL)) die("sigprocmask restore");
 }
 
+/* Called with lock held */
+static PaioQueue *paio_get_queue(BlockDriverState *bs)
+{
+    PaioQueue *q;
+
+    QLIST_FOREACH(q, &queue_list, node) {
+        if (q->bs == bs) {
+            return q;
+        }
+    }
+
+    q = qemu_mallocz(sizeof(*q));
+    q->bs = bs;
+    pstrcpy(q->filename, sizeof(q->filename), bs->filename);
+    QTAILQ_INIT(&q->requests);
+    QLIST_INSERT_HEAD(&queue_list, q, node);
+    nr_queues++;
+
+    return q;
+}
+
 static void qemu_paio_submit(struct qemu_paiocb *aiocb)
 {
+    PaioQueue *q;
+
     aiocb->ret = -EINPROGRESS;
     aiocb->active = 0;
     mutex_lock(&lock);
     if (idle_threads == 0 && cur_threads < max_threads)
         spawn_thread();
-    QTAILQ_INSERT_TAIL(&request_list, aiocb, node);
+    q = paio_get_queue(aiocb->common.bs);
+    aiocb->queue = q;
+    QTAILQ_INSERT_TAIL(&q->requests, aiocb, node);
+    q->queued++;
+    if (!q->ready) {
+        QTAILQ_INSERT_TAIL(&ready_list, q, ready_node);
+        q->ready = 1;
+    }
     mutex_unlock(&lock);
     cond_signal(&cond);
 }
@@ -537,7 +662,14 @@ static void paio_cancel(BlockDriverAIOCB *blockacb)
 
     mutex_lock(&lock);
     if (!acb->active) {
-        QTAILQ_REMOVE(&request_list, acb, node);
+        PaioQueue *q = acb->queue;
+
+        QTAILQ_REMOVE(&q->requests, acb, node);
+        if (--q->queued == 0) {
+            QTAILQ_REMOVE(&ready_list, q, ready_node);
+            q->ready = 0;
+        }
+        paio_put_queue(q);
         acb->ret = -ECANCELED;
     } else if (acb->ret == -EINPROGRESS) {
         active = 1;
@@ -650,8 +782,135 @@ int paio_init(void)
     if (ret)
         die2(ret, "pthread_attr_setdetachstate");
 
-    QTAILQ_INIT(&request_list);
-
     posix_aio_state = s;
+
+    mutex_lock(&lock);
+    while (cur_threads < min_threads) {
+        spawn_thread();
+    }
+    mutex_unlock(&lock);
+
+    return 0;
+}
+
+/*
+ * Drops the request queue of a BlockDriverState that is being closed. If
+ * requests are still outstanding, the queue goes away when they are done.
+ */
+void paio_release(BlockDriverState *bs)
+{
+    PaioQueue *q;
+
+    mutex_lock(&lock);
+    QLIST_FOREACH(q, &queue_list, node) {
+        if (q->bs == bs) {
+            q->bs = NULL;
+            paio_put_queue(q);
+            break;
+        }
+    }
+    mutex_unlock(&lock);
+}
+
+/*
+ * Sets the number of worker threads that are kept around even when idle,
+ * the maximum number of worker threads, and how many seconds a worker
+ * above the minimum may stay idle before it exits.
+ */
+int paio_set_threads(int min, int max, int idle)
+{
+    if (min < 0 || max < 1 || min > max || idle < 1) {
+        return -EINVAL;
+    }
+
+    mutex_lock(&lock);
+    min_threads = min;
+    max_threads = max;
+    idle_timeout = idle;
+    if (posix_aio_state) {
+        while (cur_threads < min_threads) {
+            spawn_thread();
+        }
+    }
+    mutex_unlock(&lock);
+
     return 0;
 }
+
+static void paio_queue_iter(QObject *obj, void *opaque)
+{
+    QDict *queue = qobject_to_qdict(obj);
+    Monitor *mon = opaque;
+
+    monitor_printf(mon, "    %s: queued=%" PRId64 " active=%" PRId64 "\n",
+                   qdict_get_str(queue, "file"),
+                   qdict_get_int(queue, "queued"),
+                   qdict_get_int(queue, "active"));
+}
+
+void paio_info_print(Monitor *mon, const QObject *data)
+{
+    QDict *qdict = qobject_to_qdict(data);
+
+    monitor_printf(mon, "threads=%" PRId64 " idle_threads=%" PRId64
+                        " min_threads=%" PRId64 " max_threads=%" PRId64
+                        " completed=%" PRId64 " busy_time_ms=%" PRId64 "\n",
+                   qdict_get_int(qdict, "threads"),
+                   qdict_get_int(qdict, "idle_threads"),
+                   qdict_get_int(qdict, "min_threads"),
+                   qdict_get_int(qdict, "max_threads"),
+                   qdict_get_int(qdict, "completed"),
+                   qdict_get_int(qdict, "busy_time_ms"));
+    qlist_iter(qdict_get_qlist(qdict, "queues"), paio_queue_iter, mon);
+}
+
+/**
+ * paio_info(): show the state of the AIO thread pool
+ *
+ * Return a QDict with the following information:
+ *
+ * - "threads": number of worker threads
+ * - "idle_threads": number of worker threads waiting for requests
+ * - "min_threads": number of worker threads kept even when idle
+ * - "max_threads": maximum number of worker threads
+ * - "completed": number of requests completed by the workers
+ * - "busy_time_ms": total time the workers spent processing requests,
+ *   summed up over all workers
+ * - "queues": a QList of QDicts, one per image, containing:
+ *     - "file": the image file name
+ *     - "queued": requests waiting for a worker
+ *     - "active": requests being processed by a worker
+ *
+ * Example:
+ *
+ * { "threads": 4, "idle_threads": 3, "min_threads": 0, "max_threads": 64,
+ *   "completed": 1732, "busy_time_ms": 2310,
+ *   "queues": [ { "file": "/images/disk0.img", "queued": 0, "active": 1 } ] }
+ */
+void paio_info(Monitor *mon, QObject **ret_data)
+{
+    QList *queues;
+    PaioQueue *q;
+
+    queues = qlist_new();
+
+    mutex_lock(&lock);
+    QLIST_FOREACH(q, &queue_list, node) {
+        qlist_append_obj(queues,
+                         qobject_from_jsonf("{ 'file': %s, 'queued': %d, "
+                                            "'active': %d }",
+                                            q->filename, q->queued,
+                                            q->active));
+    }
+
+    *ret_data = qobject_from_jsonf("{ 'threads': %d, 'idle_threads': %d, "
+                                   "'min_threads': %d, 'max_threads': %d, "
+                                   "'completed': %" PRId64 ", "
+                                   "'busy_time_ms': %" PRId64 ", "
+                                   "'queues': %p }",
+                                   cur_threads, idle_threads,
+                                   min_threads, max_threads,
+                                   completed_reqs, busy_time_us / 1000,
+                                   QOBJECT(queues));
+    mutex_unlock(&lock);
+}
@@ -58,6 +58,14 @@ QemuOptsList qemu_drive_opts = {
             .name = "aio",
             .type = QEMU_OPT_STRING,
             .help = "host AIO implementation (threads, native)",
+        },{
+            .name = "mmap",
+            .type = QEMU_OPT_BOOL,
+            .help = "read read-only image files through a shared mapping",
+        },{
+            .name = "copy-on-read",
+            .type = QEMU_OPT_BOOL,
+            .help = "copy data read from the backing file into the image",
         },{
             .name = "format",
             .type = QEMU_OPT_STRING,
@@ -78,6 +86,38 @@ QemuOptsList qemu_drive_opts = {
         },{
             .name = "readonly",
             .type = QEMU_OPT_BOOL,
+        },{
+            .name = "bps",
+            .type = QEMU_OPT_NUMBER,
+            .help = "limit total bytes per second",
+        },{
+            .name = "bps_rd",
+            .type = QEMU_OPT_NUMBER,
+            .help = "limit read bytes per second",
+        },{
+            .name = "bps_wr",
+            .type = QEMU_OPT_NUMBER,
+            .help = "limit write bytes per second",
+        },{
+            .name = "iops",
+            .type = QEMU_OPT_NUMBER,
+            .help = "limit total I/O operations per second",
+        },{
+            .name = "iops_rd",
+            .type = QEMU_OPT_NUMBER,
+            .help = "limit read operations per second",
+        },{
+            .name = "iops_wr",
+            .type = QEMU_OPT_NUMBER,
+            .help = "limit write operations per second",
+        },{
+            .name = "bps_max",
+            .type = QEMU_OPT_NUMBER,
+            .help = "burst size in bytes for the bps limits",
+        },{
+            .name = "iops_max",
+            .type = QEMU_OPT_NUMBER,
+            .help = "burst size in operations for the iops limits",
         },
         { /* end if list */ }
     },
@@ -206,6 +246,24 @@ QemuOptsList qemu_rtc_opts = {
     },
 };
 
+QemuOptsList qemu_aio_threads_opts = {
+    .name = "aio-threads",
+    .head = QTAILQ_HEAD_INITIALIZER(qemu_aio_threads_opts.head),
+    .desc = {
+        {
+            .name = "min",
+            .type = QEMU_OPT_NUMBER,
+        },{
+            .name = "max",
+            .type = QEMU_OPT_NUMBER,
+        },{
+            .name = "idle",
+            .type = QEMU_OPT_NUMBER,
+        },
+        { /* end if list */ }
+    },
+};
+
 QemuOptsList qemu_global_opts = {
     .name = "global",
     .head = QTAILQ_HEAD_INITIALIZER(qemu_global_opts.head),
@@ -297,6 +355,7 @@ static QemuOptsList *lists[] = {
     &qemu_netdev_opts,
     &qemu_net_opts,
     &qemu_rtc_opts,
+    &qemu_aio_threads_opts,
     &qemu_global_opts,
     &qemu_mon_opts,
     &qemu_cpudef_opts,
@@ -386,10 +386,13 @@ static int img_check(int argc, char **argv)
     const char *filename, *fmt;
     BlockDriver *drv;
     BlockDriverState *bs;
+    BdrvCheckResult result;
+    int fix = 0;
+    int flags = BRDV_O_FLAGS;
 
     fmt = NULL;
     for(;;) {
-        c = getopt(argc, argv, "f:h");
+        c = getopt(argc, argv, "f:hr:");
         if (c == -1)
             break;
         switch(c) {
@@ -399,6 +402,14 @@ static int img_check(int argc, char **argv)
         case 'f':
             fmt = optarg;
             break;
+        case 'r':
+            if (!strcmp(optarg, "leaks")) {
+                fix = BDRV_FIX_LEAKS;
+                flags |= BDRV_O_RDWR;
+            } else {
+                error("Unknown option for -r: '%s'", optarg);
+            }
+            break;
         }
     }
     if (optind >= argc)
@@ -415,27 +426,46 @@ static int img_check(int argc, char **argv)
     } else {
         drv = NULL;
     }
-    if (bdrv_open2(bs, filename, BRDV_O_FLAGS, drv) < 0) {
+    if (bdrv_open2(bs, filename, flags, drv) < 0) {
         error("Could not open '%s'", filename);
     }
-    ret = bdrv_check(bs);
-    switch(ret) {
-    case 0:
-        printf("No errors were found on the image.\n");
-        break;
-    case -ENOTSUP:
+    ret = bdrv_check(bs, &result, fix);
+    if (ret == -ENOTSUP) {
         error("This image format does not support checks");
-        break;
-    default:
-        if (ret < 0) {
-            error("An error occurred during the check");
-        } else {
-            printf("%d errors were found on the image.\n", ret);
+    }
+
+    if (result.leaks_fixed) {
+        printf("%d leaked clusters were repaired.\n", result.leaks_fixed);
+    }
+    if (!result.corruptions && !result.leaks && !result.check_errors) {
+        printf("No errors were found on the image.\n");
+    } else {
+        if (result.corruptions) {
+            printf("\n%d errors were found on the image.\n"
+                "Data may be corrupted, or further writes to the image "
+                "may corrupt it.\n", result.corruptions);
+        }
+        if (result.leaks) {
+            printf("\n%d leaked clusters were found on the image.\n"
+                "This means waste of disk space, but no harm to data.\n",
+                result.leaks);
+        }
+        if (result.check_errors) {
+            printf("\n%d internal errors have occurred during the check.\n",
+                result.check_errors);
         }
-        break;
     }
 
     bdrv_delete(bs);
+
+    /* Distinguish the outcomes for scripts running periodic checks */
+    if (ret < 0 || result.check_errors) {
+        return 1;
+    } else if (result.corruptions) {
+        return 2;
+    } else if (result.leaks) {
+        return 3;
+    }
     return 0;
 }
 
@@ -789,8 +819,12 @@ static int img_convert(int argc, char **argv)
                 /* If the output image is being created as a copy on write image,
                    assume that sectors which are unallocated in the input image
                    are present in both the output's and input's base images (no
-                   need to copy them). */
-                if (out_baseimg) {
+                   need to copy them).
+
+                   Without a backing file, unallocated sectors of the input
+                   image read as zeros, which the output already contains, so
+                   they need not even be read. */
+                if (out_baseimg || !bs[bs_i]->backing_hd) {
                     if (!bdrv_is_allocated(bs[bs_i], sector_num - bs_offset,
                                            n, &n1)) {
                         sector_num += n1;
@@ -800,28 +834,29 @@ static int img_convert(int argc, char **argv)
                        only those as they may be followed by unallocated sectors. */
                     n = n1;
                 }
-            } else {
-                n1 = n;
             }
 
             if (bdrv_read(bs[bs_i], sector_num - bs_offset, buf, n) < 0) 
                 error("error while reading");
             /* NOTE: at the same time we convert, we do not write zero
-               sectors to have a chance to compress the image. Ideally, we
-               should add a specific call to have the info to go faster */
+               sectors to have a chance to compress the image. */
             buf1 = buf;
             while (n > 0) {
-                /* If the output image is being created as a copy on write image,
-                   copy all sectors even the ones containing only NUL bytes,
-                   because they may differ from the sectors in the base image.
-
-                   If the output is to a host device, we also write out
-                   sectors that are entirely 0, since whatever data was
-                   already there is garbage, not 0s. */
-                if (drv->no_zero_init || out_baseimg ||
-                    is_allocated_sectors(buf1, n, &n1)) {
+                if (is_allocated_sectors(buf1, n, &n1)) {
                     if (bdrv_write(out_bs, sector_num, buf1, n1) < 0)
                         error("error while writing");
+                } else if (drv->no_zero_init || out_baseimg) {
+                    /* If the output image is being created as a copy on write
+                       image, zero sectors may differ from the sectors in the
+                       base image.
+
+                       If the output is to a host device, whatever data was
+                       already there is garbage, not 0s.
+
+                       Either way the zeros must be stored, but the driver
+                       may be able to do so without writing them out. */
+                    if (bdrv_write_zeroes(out_bs, sector_num, n1) < 0)
+                        error("error while writing");
                 }
                 sector_num += n1;
                 n -= n1;
@@ -1143,6 +1143,450 @@ static const cmdinfo_t truncate_cmd = {
 	.oneline	= "truncates the current file at the given offset",
 };
 
+static void
+discard_help(void)
+{
+	printf(
+"\n"
+" discards a range of sectors, allowing the space to be reclaimed\n"
+"\n"
+" Example:\n"
+" 'discard 512 1k' - discards 1 kilobyte from 512 bytes into the file\n"
+"\n"
+" -z, -- make the range read back as zeros instead\n"
+"\n");
+}
+
+static int discard_f(int argc, char **argv);
+
+static const cmdinfo_t discard_cmd = {
+	.name		= "discard",
+	.altname	= "d",
+	.cfunc		= discard_f,
+	.argmin		= 2,
+	.argmax		= 3,
+	.args		= "[-z] off len",
+	.oneline	= "discards a number of bytes at a specified offset",
+	.help		= discard_help,
+};
+
+static int
+discard_f(int argc, char **argv)
+{
+	int zflag = 0;
+	int c, ret;
+	int64_t offset, count;
+
+	while ((c = getopt(argc, argv, "z")) != EOF) {
+		switch (c) {
+		case 'z':
+			zflag = 1;
+			break;
+		default:
+			return command_usage(&discard_cmd);
+		}
+	}
+
+	if (optind != argc - 2)
+		return command_usage(&discard_cmd);
+
+	offset = cvtnum(argv[optind]);
+	if (offset < 0) {
+		printf("non-numeric offset argument -- %s\n", argv[optind]);
+		return 0;
+	}
+
+	optind++;
+	count = cvtnum(argv[optind]);
+	if (count < 0) {
+		printf("non-numeric length argument -- %s\n", argv[optind]);
+		return 0;
+	}
+
+	if ((offset & 0x1ff) || (count & 0x1ff)) {
+		printf("offset and count must be sector aligned\n");
+		return 0;
+	}
+
+	if (zflag)
+		ret = bdrv_write_zeroes(bs, offset >> 9, count >> 9);
+	else
+		ret = bdrv_discard(bs, offset >> 9, count >> 9);
+	if (ret < 0) {
+		printf("discard failed: %s\n", strerror(-ret));
+		return 0;
+	}
+
+	return 0;
+}
+
+/*
+ * Benchmark: keeps a fixed number of AIO requests in flight against the
+ * open image and reports throughput and latency percentiles.
+ */
+struct bench_ctx {
+	int64_t offset;		/* region to run against */
+	int64_t length;
+	int64_t next;		/* next sequential offset */
+	int bsize;
+	int wpercent;
+	int random;
+	uint64_t seed;
+	int inflight;
+	int stop;
+	int64_t reads;
+	int64_t writes;
+	int64_t failed;		/* not part of the latency statistics */
+	int64_t *lat;		/* completion latencies in usec */
+	int64_t nr_lat;
+	int64_t max_lat;
+};
+
+struct bench_req {
+	struct bench_ctx *ctx;
+	QEMUIOVector qiov;
+	void *buf;
+	int64_t start;
+	int is_write;
+	int busy;
+};
+
+static int64_t bench_now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec * 1000000LL + tv.tv_usec;
+}
+
+/* xorshift64*, so that a given seed always produces the same run */
+static uint64_t bench_rand(struct bench_ctx *ctx)
+{
+	ctx->seed ^= ctx->seed >> 12;
+	ctx->seed ^= ctx->seed << 25;
+	ctx->seed ^= ctx->seed >> 27;
+	return ctx->seed * 2685821657736338717ULL;
+}
+
+static void bench_done(void *opaque, int ret)
+{
+	struct bench_req *req = opaque;
+	struct bench_ctx *ctx = req->ctx;
+
+	req->busy = 0;
+	ctx->inflight--;
+
+	if (ret < 0) {
+		if (!ctx->stop)
+			printf("bench: %s failed: %s\n",
+				req->is_write ? "write" : "read",
+				strerror(-ret));
+		ctx->failed++;
+		ctx->stop = 1;
+		return;
+	}
+
+	if (ctx->nr_lat == ctx->max_lat) {
+		ctx->max_lat = ctx->max_lat ? ctx->max_lat * 2 : 4096;
+		ctx->lat = qemu_realloc(ctx->lat,
+					ctx->max_lat * sizeof(*ctx->lat));
+	}
+	ctx->lat[ctx->nr_lat++] = bench_now() - req->start;
+
+	if (req->is_write)
+		ctx->writes++;
+	else
+		ctx->reads++;
+}
+
+static void bench_submit(struct bench_req *req)
+{
+	struct bench_ctx *ctx = req->ctx;
+	BlockDriverAIOCB *acb;
+	int64_t offset;
+	int nb_sectors = ctx->bsize >> 9;
+
+	if (ctx->random) {
+		offset = ctx->offset + (bench_rand(ctx) %
+			(ctx->length / ctx->bsize)) * ctx->bsize;
+	} else {
+		offset = ctx->next;
+		ctx->next += ctx->bsize;
+		if (ctx->next + ctx->bsize > ctx->offset + ctx->length)
+			ctx->next = ctx->offset;
+	}
+	req->is_write = ctx->wpercent &&
+		(int)(bench_rand(ctx) % 100) < ctx->wpercent;
+
+	req->busy = 1;
+	ctx->inflight++;
+	req->start = bench_now();
+	if (req->is_write)
+		acb = bdrv_aio_writev(bs, offset >> 9, &req->qiov, nb_sectors,
+				      bench_done, req);
+	else
+		acb = bdrv_aio_readv(bs, offset >> 9, &req->qiov, nb_sectors,
+				     bench_done, req);
+	if (!acb) {
+		printf("bench: %s failed at offset %lld\n",
+			req->is_write ? "write" : "read", (long long)offset);
+		req->busy = 0;
+		ctx->inflight--;
+		ctx->failed++;
+		ctx->stop = 1;
+	}
+}
+
+static int bench_cmp_lat(const void *a, const void *b)
+{
+	int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* Nearest-rank percentile, p given in tenths of a percent */
+static long long bench_percentile(struct bench_ctx *ctx, int p)
+{
+	int64_t rank = (ctx->nr_lat * p + 999) / 1000;
+
+	return ctx->lat[rank ? rank - 1 : 0];
+}
+
+static void
+bench_help(void)
+{
+	printf(
+"\n"
+" runs a synthetic I/O workload against the open file\n"
+"\n"
+" Example:\n"
+" 'bench -r -w 30 -b 4k -d 32 -t 10' - 10 seconds of random 4k requests,\n"
+" 30%% of them writes, keeping 32 requests in flight\n"
+"\n"
+" Requests are submitted through the asynchronous block layer interface, so\n"
+" the same workload can be run against any image format to compare them.\n"
+" Without -r the requests walk the region sequentially, wrapping around at\n"
+" its end. The run ends after the given time or number of requests,\n"
+" whichever comes first; random offsets are reproducible for a given seed.\n"
+" -b, -- block size (default 4k)\n"
+" -C, -- report statistics in a machine parsable format\n"
+" -d, -- queue depth, number of requests kept in flight (default 1)\n"
+" -l, -- length of the region to access (default up to the end of the file)\n"
+" -n, -- stop after this many requests\n"
+" -o, -- start offset of the region to access (default 0)\n"
+" -P, -- use a pattern to fill written data\n"
+" -r, -- use random instead of sequential offsets\n"
+" -s, -- seed for random offsets and the read/write mix (default 1)\n"
+" -t, -- stop after this many seconds (default 5 unless -n is given)\n"
+" -w, -- percentage of requests that are writes (default 0)\n"
+"\n");
+}
+
+static int bench_f(int argc, char **argv);
+
+static const cmdinfo_t bench_cmd = {
+	.name		= "bench",
+	.cfunc		= bench_f,
+	.argmin		= 0,
+	.argmax		= -1,
+	.args		= "[-Cr] [-b bsize] [-d depth] [-t secs] [-n count] "
+			  "[-o off] [-l len] [-w pct] [-s seed] [-P pattern]",
+	.oneline	= "runs a benchmark workload and reports IOPS and latency",
+	.help		= bench_help,
+};
+
+static int
+bench_f(int argc, char **argv)
+{
+	struct bench_ctx ctx;
+	struct bench_req *reqs;
+	struct timeval t;
+	int64_t size, t1, t2, deadline, max_ops = 0, issued = 0, ops;
+	long long lat_sum = 0;
+	int depth = 1, secs = -1, pattern = 0xcd, Cflag = 0;
+	char s1[64], s2[64], s3[64], ts[64];
+	int c, i;
+
+	memset(&ctx, 0, sizeof(ctx));
+	ctx.bsize = 4096;
+	ctx.length = -1;
+	ctx.seed = 1;
+
+	while ((c = getopt(argc, argv, "b:Cd:l:n:o:P:rs:t:w:")) != EOF) {
+		switch (c) {
+		case 'b':
+			ctx.bsize = cvtnum(optarg);
+			break;
+		case 'C':
+			Cflag = 1;
+			break;
+		case 'd':
+			depth = atoi(optarg);
+			break;
+		case 'l':
+			ctx.length = cvtnum(optarg);
+			break;
+		case 'n':
+			max_ops = cvtnum(optarg);
+			break;
+		case 'o':
+			ctx.offset = cvtnum(optarg);
+			break;
+		case 'P':
+			pattern = parse_pattern(optarg);
+			if (pattern < 0)
+				return 0;
+			break;
+		case 'r':
+			ctx.random = 1;
+			break;
+		case 's':
+			ctx.seed = strtoull(optarg, NULL, 0);
+			break;
+		case 't':
+			secs = atoi(optarg);
+			break;
+		case 'w':
+			ctx.wpercent = atoi(optarg);
+			break;
+		default:
+			return command_usage(&bench_cmd);
+		}
+	}
+
+	if (optind != argc)
+		return command_usage(&bench_cmd);
+
+	if (ctx.bsize <= 0 || (ctx.bsize & 0x1ff)) {
+		printf("block size must be a positive multiple of 512\n");
+		return 0;
+	}
+	if (ctx.offset < 0 || (ctx.offset & 0x1ff)) {
+		printf("offset %lld is not sector aligned\n",
+			(long long)ctx.offset);
+		return 0;
+	}
+	if (depth <= 0 || ctx.wpercent < 0 || ctx.wpercent > 100 ||
+	    max_ops < 0) {
+		printf("invalid queue depth, count or write percentage\n");
+		return 0;
+	}
+	if (secs == 0 && !max_ops) {
+		printf("-t 0 needs a request count (-n) to end the run\n");
+		return 0;
+	}
+	if (ctx.wpercent && bdrv_is_read_only(bs)) {
+		printf("cannot write to a read-only file\n");
+		return 0;
+	}
+	if (!ctx.seed)
+		ctx.seed = 1;
+
+	size = bdrv_getlength(bs);
+	if (size < 0) {
+		printf("getlength: %s\n", strerror(-size));
+		return 0;
+	}
+	if (ctx.length < 0)
+		ctx.length = size - ctx.offset;
+	if (ctx.length < ctx.bsize || ctx.offset + ctx.length > size) {
+		printf("region does not fit a %d byte request into the file\n",
+			ctx.bsize);
+		return 0;
+	}
+	ctx.next = ctx.offset;
+	if (secs < 0)
+		secs = max_ops ? 0 : 5;
+
+	reqs = qemu_mallocz(depth * sizeof(*reqs));
+	for (i = 0; i < depth; i++) {
+		reqs[i].ctx = &ctx;
+		reqs[i].buf = qemu_io_alloc(ctx.bsize, pattern);
+		qemu_iovec_init(&reqs[i].qiov, 1);
+		qemu_iovec_add(&reqs[i].qiov, reqs[i].buf, ctx.bsize);
+	}
+
+	t1 = bench_now();
+	deadline = secs ? t1 + secs * 1000000LL : 0;
+	for (;;) {
+		if (!ctx.stop && ((max_ops && issued >= max_ops) ||
+				  (deadline && bench_now() >= deadline)))
+			ctx.stop = 1;
+
+		/* Completions only mark their slot, refill them from here */
+		for (i = 0; i < depth && !ctx.stop; i++) {
+			if (!reqs[i].busy &&
+			    (!max_ops || issued < max_ops)) {
+				bench_submit(&reqs[i]);
+				issued++;
+			}
+		}
+
+		/* Emulated AIO may already have completed everything */
+		if (ctx.inflight)
+			qemu_aio_wait();
+		else if (ctx.stop)
+			break;
+	}
+	t2 = bench_now();
+
+	for (i = 0; i < depth; i++) {
+		qemu_iovec_destroy(&reqs[i].qiov);
+		qemu_io_free(reqs[i].buf);
+	}
+	qemu_free(reqs);
+
+	ops = ctx.reads + ctx.writes;
+	if (!ctx.nr_lat) {
+		printf("bench: no requests completed\n");
+		return 0;
+	}
+	qsort(ctx.lat, ctx.nr_lat, sizeof(*ctx.lat), bench_cmp_lat);
+	for (i = 0; i < ctx.nr_lat; i++)
+		lat_sum += ctx.lat[i];
+
+	t.tv_sec = (t2 - t1) / 1000000;
+	t.tv_usec = (t2 - t1) % 1000000;
+	timestr(&t, ts, sizeof(ts), Cflag ? VERBOSE_FIXED_TIME : 0);
+
+	if (!Cflag) {
+		cvtstr((double)ops * ctx.bsize, s1, sizeof(s1));
+		cvtstr(tdiv((double)ops * ctx.bsize, t), s2, sizeof(s2));
+		cvtstr(ctx.bsize, s3, sizeof(s3));
+		printf("%s %s, %d%% writes, %s blocks, queue depth %d\n",
+			ctx.random ? "random" : "sequential",
+			ctx.wpercent ? (ctx.wpercent == 100 ? "write" : "mixed")
+				     : "read",
+			ctx.wpercent, s3, depth);
+		printf("%s, %lld ops (%lld reads, %lld writes); %s "
+			"(%s/sec and %.4f ops/sec)\n",
+			s1, (long long)ops, (long long)ctx.reads,
+			(long long)ctx.writes, ts, s2, tdiv((double)ops, t));
+		if (ctx.failed)
+			printf("%lld failed requests not included below\n",
+				(long long)ctx.failed);
+		printf("latency (usec): min %lld, avg %lld, max %lld, "
+			"p50 %lld, p99 %lld, p99.9 %lld\n",
+			(long long)ctx.lat[0], lat_sum / ctx.nr_lat,
+			(long long)ctx.lat[ctx.nr_lat - 1],
+			bench_percentile(&ctx, 500),
+			bench_percentile(&ctx, 990),
+			bench_percentile(&ctx, 999));
+	} else {/* bytes,ops,time,bytes/sec,ops/sec,p50,p99,p99.9 (usec),failed */
+		printf("%lld,%lld,%s,%.3f,%.3f,%lld,%lld,%lld,%lld\n",
+			(long long)ops * ctx.bsize, (long long)ops, ts,
+			tdiv((double)ops * ctx.bsize, t),
+			tdiv((double)ops, t),
+			bench_percentile(&ctx, 500),
+			bench_percentile(&ctx, 990),
+			bench_percentile(&ctx, 999),
+			(long long)ctx.failed);
+	}
+
+	qemu_free(ctx.lat);
+	return 0;
+}
+
 static int
 length_f(int argc, char **argv)
 {
@@ -1488,9 +1932,11 @@ int main(int argc, char **argv)
 	add_command(&aio_flush_cmd);
 	add_command(&flush_cmd);
 	add_command(&truncate_cmd);
+	add_command(&discard_cmd);
 	add_command(&length_cmd);
 	add_command(&info_cmd);
 	add_command(&alloc_cmd);
+	add_command(&bench_cmd);
 
 	add_args_command(init_args_command);
 	add_check_command(init_check_command);
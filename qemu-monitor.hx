@@ -62,6 +62,10 @@ show the character devices
 show the block devices
 @item info block
 show block device statistics
+@item info aio
+show the worker threads and per-image request queues of the AIO thread pool
+@item info block-jobs
+show the progress of image streaming
 @item info registers
 show the cpu registers
 @item info cpus
@@ -783,6 +787,13 @@ STEXI
 Migrate to @var{uri} (using -d to not wait for completion).
 	-b for migration with full copy of disk
 	-i for migration with incremental copy of disk (base image is shared)
+
+With @code{file:@var{path}}, guest RAM is written to an image in @var{path}
+by several threads, in place of the pages in the stream. Such a file is loaded
+with @code{-incoming file:@var{path}}, or @code{-incoming file:@var{path},lazy}
+to map the image over guest RAM and read pages as the guest touches them.
+The file must not be changed while a guest loaded that way runs; migrating
+such a guest to the file it was loaded from is refused.
 ETEXI
 
     {
@@ -828,6 +839,124 @@ STEXI
 @item migrate_set_downtime @var{second}
 @findex migrate_set_downtime
 Set maximum tolerated downtime (in seconds) for migration.
+ETEXI
+
+    {
+        .name       = "migrate_set_cache_size",
+        .args_type  = "value:b",
+        .params     = "value",
+        .help       = "set cache size (in bytes) for page deltas, 0 disables them",
+        .user_print = monitor_user_noop,
+        .mhandler.cmd_new = do_migrate_set_cache_size,
+    },
+
+STEXI
+@item migrate_set_cache_size @var{value}
+@findex migrate_set_cache_size
+Set the size of the cache of sent pages to @var{value} (in bytes) for the
+next migration. Pages that are sent again and are found in the cache are
+sent as a delta to their previous contents. The size can't exceed the size
+of guest RAM. 0 (the default) disables page deltas; the destination must
+support them when they are enabled.
+ETEXI
+
+    {
+        .name       = "migrate_set_compression",
+        .args_type  = "level:i,threads:i?",
+        .params     = "level [threads]",
+        .help       = "set zlib level (0 disables compression) and number of "
+                      "threads for RAM page compression",
+        .user_print = monitor_user_noop,
+        .mhandler.cmd_new = do_migrate_set_compression,
+    },
+
+STEXI
+@item migrate_set_compression @var{level} [@var{threads}]
+@findex migrate_set_compression
+Compress RAM pages with zlib at @var{level} (1 to 9) for the next migration,
+using @var{threads} threads (4 by default). The destination decompresses them
+with as many threads as it has been configured with. 0 (the default) disables
+compression; the destination must support it when it is enabled.
+ETEXI
+
+    {
+        .name       = "migrate_set_auto_converge",
+        .args_type  = "state:s",
+        .params     = "on|off",
+        .help       = "throttle the vCPUs when migration doesn't converge",
+        .user_print = monitor_user_noop,
+        .mhandler.cmd_new = do_migrate_set_auto_converge,
+    },
+
+STEXI
+@item migrate_set_auto_converge [on|off]
+@findex migrate_set_auto_converge
+Throttle the vCPUs of a guest that dirties its memory faster than migration
+can send it. When the guest dirties more than half as much memory as is sent
+for two seconds in a row, the vCPUs are stopped for 20% of the time, and for
+10% more each further time, up to 90%, until the migration converges. Off by
+default.
+ETEXI
+
+    {
+        .name       = "migrate_set_block_inflight",
+        .args_type  = "value:i",
+        .params     = "value",
+        .help       = "set number of disk reads in flight for block migration",
+        .user_print = monitor_user_noop,
+        .mhandler.cmd_new = do_migrate_set_block_inflight,
+    },
+
+STEXI
+@item migrate_set_block_inflight @var{value}
+@findex migrate_set_block_inflight
+Keep up to @var{value} (1 to 256, default 16) disk reads in flight during block
+migration, in the bulk phase as well as for dirty blocks. Chunks being read or
+waiting to be sent count against the migration speed limit, which is shared
+with RAM.
+ETEXI
+
+    {
+        .name       = "migrate_set_channels",
+        .args_type  = "value:i",
+        .params     = "value",
+        .help       = "set number of additional connections for RAM pages "
+                      "(tcp only, 0 disables them)",
+        .user_print = monitor_user_noop,
+        .mhandler.cmd_new = do_migrate_set_channels,
+    },
+
+STEXI
+@item migrate_set_channels @var{value}
+@findex migrate_set_channels
+Send RAM pages over @var{value} additional TCP connections (up to 16) in
+parallel for the next migration, each one served by its own thread on both
+sides. Device state stays on the main connection. Page deltas and compression
+are not used with channels. 0 (the default) sends everything over the main
+connection; the destination must support channels when they are enabled.
+ETEXI
+
+    {
+        .name       = "migrate_set_postcopy",
+        .args_type  = "state:s",
+        .params     = "on|off",
+        .help       = "start the guest on the destination after the first "
+                      "pass over RAM",
+        .user_print = monitor_user_noop,
+        .mhandler.cmd_new = do_migrate_set_postcopy,
+    },
+
+STEXI
+@item migrate_set_postcopy [on|off]
+@findex migrate_set_postcopy
+Move the guest to the destination once all of its RAM has been sent once, if
+the migration hasn't converged by then. The pages dirtied since are sent
+afterwards, in the background and whenever the guest on the destination
+touches one of them. Only over tcp and unix sockets, without page channels,
+and the destination needs userfaultfd. The migration can't be cancelled once
+the guest runs on the destination, and the guest is lost if the connection
+breaks before all pages have arrived: the destination then aborts. Off by
+default.
 ETEXI
 
 #if defined(TARGET_I386)
@@ -1124,6 +1253,78 @@ STEXI
 @item block_passwd @var{device} @var{password}
 @findex block_passwd
 Set the encrypted device @var{device} password to @var{password}
+ETEXI
+
+    {
+        .name       = "block_set_io_throttle",
+        .args_type  = "device:B,bps:l,bps_rd:l,bps_wr:l,iops:l,iops_rd:l,iops_wr:l,bps_max:l?,iops_max:l?",
+        .params     = "device bps bps_rd bps_wr iops iops_rd iops_wr [bps_max] [iops_max]",
+        .help       = "change I/O throttle limits for a block drive",
+        .user_print = monitor_user_noop,
+        .mhandler.cmd_new = do_block_set_io_throttle,
+    },
+
+STEXI
+@item block_set_io_throttle @var{device} @var{bps} @var{bps_rd} @var{bps_wr} @var{iops} @var{iops_rd} @var{iops_wr} [@var{bps_max}] [@var{iops_max}]
+@findex block_set_io_throttle
+Limit the I/O of block device @var{device} to @var{bps} bytes and @var{iops}
+operations per second in total, and to @var{bps_rd}/@var{iops_rd} for reads
+and @var{bps_wr}/@var{iops_wr} for writes. A limit of 0 means unlimited.
+@var{bps_max} and @var{iops_max} set the burst sizes, which default to a
+tenth of a second worth of I/O. Requests exceeding the limits are delayed.
+ETEXI
+
+    {
+        .name       = "block_stream",
+        .args_type  = "device:B,speed:l?",
+        .params     = "device [speed]",
+        .help       = "copy the backing file of a block drive into its image",
+        .user_print = monitor_user_noop,
+        .mhandler.cmd_new = do_block_stream,
+    },
+
+STEXI
+@item block_stream @var{device} [@var{speed}]
+@findex block_stream
+Copy everything the image of block device @var{device} still reads from its
+backing file into the image, in the background and at most @var{speed} bytes
+per second (0, the default, means unlimited). While the data is being
+copied, guest reads of data that is not in the image yet store it there,
+too. Once all data has been copied, the image no longer refers to its
+backing file, the backing file is closed and the BLOCK_STREAM_COMPLETED event
+is emitted. Use @code{info block-jobs} to watch the progress.
+ETEXI
+
+    {
+        .name       = "block_stream_set_speed",
+        .args_type  = "device:B,speed:l",
+        .params     = "device speed",
+        .help       = "change the speed limit of image streaming",
+        .user_print = monitor_user_noop,
+        .mhandler.cmd_new = do_block_stream_set_speed,
+    },
+
+STEXI
+@item block_stream_set_speed @var{device} @var{speed}
+@findex block_stream_set_speed
+Limit the streaming of block device @var{device} to @var{speed} bytes per
+second, 0 means unlimited.
+ETEXI
+
+    {
+        .name       = "block_stream_cancel",
+        .args_type  = "device:B",
+        .params     = "device",
+        .help       = "stop image streaming",
+        .user_print = monitor_user_noop,
+        .mhandler.cmd_new = do_block_stream_cancel,
+    },
+
+STEXI
+@item block_stream_cancel @var{device}
+@findex block_stream_cancel
+Stop streaming block device @var{device}. The data copied so far stays in
+the image, which keeps using its backing file.
 ETEXI
 
     {
@@ -34,7 +34,6 @@
 
 #define SOCKET_PATH    "/var/lock/qemu-nbd-%s"
 
-#define NBD_BUFFER_SIZE (1024*1024)
 
 static int verbose;
 
@@ -57,6 +56,10 @@ static void usage(const char *name)
 "  -d, --disconnect     disconnect the specified device\n"
 "  -e, --shared=NUM     device can be shared by NUM clients (default '1')\n"
 "  -t, --persistent     don't exit on the last connection\n"
+"  -T, --threads=NUM    use up to NUM threads for disk I/O (default '64')\n"
+"  -q, --queue-depth=NUM\n"
+"                       process up to NUM requests per client at a time\n"
+"                       (default '16')\n"
 "  -v, --verbose        display extra debugging information\n"
 "  -h, --help           display this help and exit\n"
 "  -V, --version        output version information and exit\n"
@@ -175,22 +178,57 @@ static void show_parts(const char *device)
     }
 }
 
+static BlockDriverState *bs;
+static off_t fd_size;
+static off_t dev_offset;
+static bool readonly;
+static int shared = 1;
+static int queue_depth = 16;
+static int server_fd;
+static int nb_fds;
+static int nb_connections;
+
+static void nbd_accept(void *opaque);
+
+static void nbd_client_closed(NBDClient *client)
+{
+    /* room for another client again */
+    if (nb_fds-- == shared) {
+        qemu_aio_set_fd_handler(server_fd, nbd_accept, NULL, NULL, NULL, NULL);
+    }
+}
+
+static void nbd_accept(void *opaque)
+{
+    struct sockaddr_in addr;
+    socklen_t addr_len = sizeof(addr);
+    int fd;
+
+    fd = accept(server_fd, (struct sockaddr *)&addr, &addr_len);
+    if (fd == -1) {
+        return;
+    }
+    nb_connections++;
+
+    /* negotiates from the client's fd handler, so a slow client can't block */
+    nbd_client_new(bs, fd, fd_size, dev_offset, readonly, queue_depth,
+                   nbd_client_closed);
+
+    /* leave further connections in the backlog until a client goes away */
+    if (++nb_fds == shared) {
+        qemu_aio_set_fd_handler(server_fd, NULL, NULL, NULL, NULL, NULL);
+    }
+}
+
 int main(int argc, char **argv)
 {
-    BlockDriverState *bs;
-    off_t dev_offset = 0;
-    off_t offset = 0;
-    bool readonly = false;
     bool disconnect = false;
     const char *bindto = "0.0.0.0";
     int port = 1024;
-    struct sockaddr_in addr;
-    socklen_t addr_len = sizeof(addr);
-    off_t fd_size;
     char *device = NULL;
     char *socket = NULL;
     char sockpath[128];
-    const char *sopt = "hVb:o:p:rsnP:c:dvk:e:t";
+    const char *sopt = "hVb:o:p:rsnP:c:dvk:e:tT:q:";
     struct option lopt[] = {
         { "help", 0, NULL, 'h' },
         { "version", 0, NULL, 'V' },
@@ -206,6 +244,8 @@ int main(int argc, char **argv)
         { "nocache", 0, NULL, 'n' },
         { "shared", 1, NULL, 'e' },
         { "persistent", 0, NULL, 't' },
+        { "threads", 1, NULL, 'T' },
+        { "queue-depth", 1, NULL, 'q' },
         { "verbose", 0, NULL, 'v' },
         { NULL, 0, NULL, 0 }
     };
@@ -216,14 +256,7 @@ int main(int argc, char **argv)
     int flags = BDRV_O_RDWR;
     int partition = -1;
     int ret;
-    int shared = 1;
-    uint8_t *data;
-    fd_set fds;
-    int *sharing_fds;
     int fd;
-    int i;
-    int nb_fds = 0;
-    int max_fd;
     int persistent = 0;
 
     while ((ch = getopt_long(argc, argv, sopt, lopt, &opt_ind)) != -1) {
@@ -289,6 +322,18 @@ int main(int argc, char **argv)
 	case 't':
 	    persistent = 1;
 	    break;
+        case 'T':
+            li = strtol(optarg, &end, 0);
+            if (*end || paio_set_threads(0, li, 10) < 0) {
+                errx(EINVAL, "Invalid number of threads `%s'", optarg);
+            }
+            break;
+        case 'q':
+            queue_depth = strtol(optarg, &end, 0);
+            if (*end || queue_depth < 1) {
+                errx(EINVAL, "Invalid queue depth `%s'", optarg);
+            }
+            break;
         case 'v':
             verbose = 1;
             break;
@@ -413,67 +458,33 @@ int main(int argc, char **argv)
         /* children */
     }
 
-    sharing_fds = qemu_malloc((shared + 1) * sizeof(int));
-
     if (socket) {
-        sharing_fds[0] = unix_socket_incoming(socket);
+        server_fd = unix_socket_incoming(socket);
     } else {
-        sharing_fds[0] = tcp_socket_incoming(bindto, port);
+        server_fd = tcp_socket_incoming(bindto, port);
     }
 
-    if (sharing_fds[0] == -1)
+    if (server_fd == -1)
         return 1;
-    max_fd = sharing_fds[0];
-    nb_fds++;
-
-    data = qemu_memalign(512, NBD_BUFFER_SIZE);
-    if (data == NULL)
-        errx(ENOMEM, "Cannot allocate data buffer");
-
-    do {
 
-        FD_ZERO(&fds);
-        for (i = 0; i < nb_fds; i++)
-            FD_SET(sharing_fds[i], &fds);
+    /* a client that goes away must not take the server with it */
+    {
+        struct sigaction act;
+        sigfillset(&act.sa_mask);
+        act.sa_flags = 0;
+        act.sa_handler = SIG_IGN;
+        sigaction(SIGPIPE, &act, NULL);
+    }
 
-        ret = select(max_fd + 1, &fds, NULL, NULL, NULL);
-        if (ret == -1)
-            break;
+    qemu_aio_set_fd_handler(server_fd, nbd_accept, NULL, NULL, NULL, NULL);
 
-        if (FD_ISSET(sharing_fds[0], &fds))
-            ret--;
-        for (i = 1; i < nb_fds && ret; i++) {
-            if (FD_ISSET(sharing_fds[i], &fds)) {
-                if (nbd_trip(bs, sharing_fds[i], fd_size, dev_offset,
-                    &offset, readonly, data, NBD_BUFFER_SIZE) != 0) {
-                    close(sharing_fds[i]);
-                    nb_fds--;
-                    sharing_fds[i] = sharing_fds[nb_fds];
-                    i--;
-                }
-                ret--;
-            }
-        }
-        /* new connection ? */
-        if (FD_ISSET(sharing_fds[0], &fds)) {
-            if (nb_fds < shared + 1) {
-                sharing_fds[nb_fds] = accept(sharing_fds[0],
-                                             (struct sockaddr *)&addr,
-                                             &addr_len);
-                if (sharing_fds[nb_fds] != -1 &&
-                    nbd_negotiate(sharing_fds[nb_fds], fd_size) != -1) {
-                        if (sharing_fds[nb_fds] > max_fd)
-                            max_fd = sharing_fds[nb_fds];
-                        nb_fds++;
-                }
-            }
-        }
-    } while (persistent || nb_fds > 1);
-    qemu_vfree(data);
+    /* Requests of all clients are served by the block layer's AIO */
+    do {
+        qemu_aio_wait();
+    } while (persistent || !nb_connections || nb_fds > 0);
 
-    close(sharing_fds[0]);
+    close(server_fd);
     bdrv_close(bs);
-    qemu_free(sharing_fds);
     if (socket)
         unlink(socket);
 
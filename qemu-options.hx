@@ -117,6 +117,9 @@ DEF("drive", HAS_ARG, QEMU_OPTION_drive,
     "       [,cyls=c,heads=h,secs=s[,trans=t]][,snapshot=on|off]\n"
     "       [,cache=writethrough|writeback|none][,format=f][,serial=s]\n"
     "       [,addr=A][,id=name][,aio=threads|native][,readonly=on|off]\n"
+    "       [,mmap=on|off][,copy-on-read=on|off]\n"
+    "       [[,bps=b]|[[,bps_rd=r][,bps_wr=w]]][,bps_max=bm]\n"
+    "       [[,iops=i]|[[,iops_rd=r][,iops_wr=w]]][,iops_max=im]\n"
     "                use 'file' as a drive image\n")
 STEXI
 @item -drive @var{option}[,@var{option}[,@var{option}[,...]]]
@@ -148,6 +151,21 @@ These options have the same definition as they have in @option{-hdachs}.
 @var{cache} is "none", "writeback", or "writethrough" and controls how the host cache is used to access block data.
 @item aio=@var{aio}
 @var{aio} is "threads", or "native" and selects between pthread based disk I/O and native Linux AIO.
+Native AIO is the default where it is available.  It is only used together
+with @option{cache=none}; other cache modes, and hosts where the AIO context
+cannot be set up, use the thread pool.
+@item mmap=@var{mmap}
+@var{mmap} is "on" or "off" (the default).  With "on", image files that are
+opened read-only, such as the backing files of qcow2 images, are mapped into
+memory and read by copying out of the mapping.  The host page cache holding
+them is then shared with every other process that maps the same file, which
+saves memory and I/O when many guests boot off one base image.  It has no
+effect with @option{cache=none}.
+@item copy-on-read=@var{copy-on-read}
+@var{copy-on-read} is "on" or "off" (the default).  With "on", data the guest
+reads from the backing file of an image, e.g. from a slow remote base image,
+is also written into the image, so that it is read locally from then on.
+The image must not be read-only.
 @item format=@var{format}
 Specify which disk @var{format} will be used rather than detecting
 the format.  Can be used to specifiy format=raw to avoid interpreting
@@ -156,6 +174,12 @@ an untrusted format header.
 This option specifies the serial number to assign to the device.
 @item addr=@var{addr}
 Specify the controller's PCI address (if=virtio only).
+@item bps=@var{b},bps_rd=@var{r},bps_wr=@var{w}
+Limit the total, read and write throughput of the drive to the given number
+of bytes per second. @option{bps_max} sets the burst size in bytes.
+@item iops=@var{i},iops_rd=@var{r},iops_wr=@var{w}
+Limit the total, read and write operations of the drive to the given number
+per second. @option{iops_max} sets the burst size in operations.
 @end table
 
 By default, writethrough caching is used for all block device.  This means that
@@ -1905,6 +1929,20 @@ many timer interrupts were not processed by the Windows guest and will
 re-inject them.
 ETEXI
 
+DEF("aio-threads", HAS_ARG, QEMU_OPTION_aio_threads, \
+    "-aio-threads [min=n][,max=n][,idle=secs]\n" \
+    "                size the thread pool used for asynchronous disk I/O\n")
+STEXI
+@item -aio-threads [min=@var{n}][,max=@var{n}][,idle=@var{secs}]
+@findex -aio-threads
+Control the thread pool that performs disk I/O for images that don't use
+native Linux AIO.  At most @option{max} worker threads (default 64) are
+started; @option{min} of them (default 0) are kept even when there is no
+work, the others exit after being idle for @option{idle} seconds (default
+10).  Requests are queued per image and served round-robin, and no image
+may occupy more than its share of the workers.
+ETEXI
+
 DEF("icount", HAS_ARG, QEMU_OPTION_icount, \
     "-icount [N|auto]\n" \
     "                enable virtual instruction counter with 2^N clock ticks per\n" \
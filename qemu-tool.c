@@ -106,6 +106,31 @@ int64_t qemu_get_clock(QEMUClock *clock)
     return (tv.tv_sec * 1000000000LL + (tv.tv_usec * 1000)) / 1000000;
 }
 
+int64_t qemu_get_clock_ns(QEMUClock *clock)
+{
+    qemu_timeval tv;
+    qemu_gettimeofday(&tv);
+    return tv.tv_sec * 1000000000LL + (tv.tv_usec * 1000);
+}
+
+/* There is no main loop to run timers, so they never fire */
+QEMUTimer *qemu_new_timer(QEMUClock *clock, QEMUTimerCB *cb, void *opaque)
+{
+    return NULL;
+}
+
+void qemu_free_timer(QEMUTimer *ts)
+{
+}
+
+void qemu_del_timer(QEMUTimer *ts)
+{
+}
+
+void qemu_mod_timer(QEMUTimer *ts, int64_t expire_time)
+{
+}
+
 void qemu_error(const char *fmt, ...)
 {
     va_list args;
@@ -48,6 +48,18 @@ static const QErrorStringTable qerror_table[] = {
         .error_fmt = QERR_DEVICE_ENCRYPTED,
         .desc      = "The %(device) is encrypted",
     },
+    {
+        .error_fmt = QERR_DEVICE_HAS_NO_MEDIUM,
+        .desc      = "Device %(device) has no medium",
+    },
+    {
+        .error_fmt = QERR_DEVICE_IN_USE,
+        .desc      = "Device %(device) is in use",
+    },
+    {
+        .error_fmt = QERR_DEVICE_IS_READ_ONLY,
+        .desc      = "Device %(device) is read-only",
+    },
     {
         .error_fmt = QERR_DEVICE_LOCKED,
         .desc      = "Device %(device) is locked",
@@ -72,6 +84,14 @@ static const QErrorStringTable qerror_table[] = {
         .error_fmt = QERR_FD_NOT_SUPPLIED,
         .desc      = "No file descriptor supplied via SCM_RIGHTS",
     },
+    {
+        .error_fmt = QERR_NO_ACTIVE_BLOCK_JOB,
+        .desc      = "No block job is running on device %(device)",
+    },
+    {
+        .error_fmt = QERR_NOT_SUPPORTED,
+        .desc      = "Operation is not supported",
+    },
     {
         .error_fmt = QERR_OPEN_FILE_FAILED,
         .desc      = "Could not open '%(filename)'",
@@ -82,6 +82,7 @@
 #include "migration.h"
 #include "qemu_socket.h"
 #include "qemu-queue.h"
+#include "qemu-objects.h"
 
 /* point to the block driver where the snapshots are managed */
 static BlockDriverState *bs_snapshots;
@@ -159,9 +160,11 @@ void qemu_announce_self(void)
 /* savevm/loadvm support */
 
 #define IO_BUF_SIZE 32768
+#define MAX_IOV_SIZE MIN(IOV_MAX, 64)
 
 struct QEMUFile {
     QEMUFilePutBufferFunc *put_buffer;
+    QEMUFileWritevBufferFunc *writev_buffer;
     QEMUFileGetBufferFunc *get_buffer;
     QEMUFileCloseFunc *close;
     QEMUFileRateLimit *rate_limit;
@@ -176,6 +179,11 @@ struct QEMUFile {
     int buf_size; /* 0 when writing */
     uint8_t buf[IO_BUF_SIZE];
 
+    /* with writev_buffer, what is to be written: small writes are copied to
+       buf, large ones may be referenced where they are */
+    struct iovec iov[MAX_IOV_SIZE];
+    int iovcnt;
+
     int has_error;
 };
 
@@ -427,6 +435,15 @@ QEMUFile *qemu_fopen_ops(void *opaque, QEMUFilePutBufferFunc *put_buffer,
     return f;
 }
 
+/*
+ * Makes f collect its output in an iovec and write it with writev_buffer,
+ * which allows data written with qemu_put_buffer_async() not to be copied.
+ */
+void qemu_file_set_writev(QEMUFile *f, QEMUFileWritevBufferFunc *writev_buffer)
+{
+    f->writev_buffer = writev_buffer;
+}
+
 int qemu_file_has_error(QEMUFile *f)
 {
     return f->has_error;
@@ -439,6 +456,26 @@ void qemu_file_set_error(QEMUFile *f)
 
 void qemu_fflush(QEMUFile *f)
 {
+    if (f->writev_buffer) {
+        if (f->is_write && f->iovcnt > 0) {
+            ssize_t len, size = 0;
+            int i;
+
+            for (i = 0; i < f->iovcnt; i++) {
+                size += f->iov[i].iov_len;
+            }
+            len = f->writev_buffer(f->opaque, f->iov, f->iovcnt,
+                                   f->buf_offset);
+            if (len == size)
+                f->buf_offset += size;
+            else
+                f->has_error = 1;
+            f->buf_index = 0;
+            f->iovcnt = 0;
+        }
+        return;
+    }
+
     if (!f->put_buffer)
         return;
 
@@ -488,6 +525,24 @@ void qemu_file_put_notify(QEMUFile *f)
     f->put_buffer(f->opaque, NULL, 0, 0);
 }
 
+static void add_to_iovec(QEMUFile *f, const uint8_t *buf, int size)
+{
+    struct iovec *last = f->iovcnt > 0 ? &f->iov[f->iovcnt - 1] : NULL;
+
+    /* consecutive bytes become one element */
+    if (last && (uint8_t *)last->iov_base + last->iov_len == buf) {
+        last->iov_len += size;
+    } else {
+        f->iov[f->iovcnt].iov_base = (uint8_t *)buf;
+        f->iov[f->iovcnt].iov_len = size;
+        f->iovcnt++;
+    }
+    f->is_write = 1;
+
+    if (f->iovcnt >= MAX_IOV_SIZE)
+        qemu_fflush(f);
+}
+
 void qemu_put_buffer(QEMUFile *f, const uint8_t *buf, int size)
 {
     int l;
@@ -505,6 +560,8 @@ void qemu_put_buffer(QEMUFile *f, const uint8_t *buf, int size)
         memcpy(f->buf + f->buf_index, buf, l);
         f->is_write = 1;
         f->buf_index += l;
+        if (f->writev_buffer)
+            add_to_iovec(f, f->buf + f->buf_index - l, l);
         buf += l;
         size -= l;
         if (f->buf_index >= IO_BUF_SIZE)
@@ -512,6 +569,29 @@ void qemu_put_buffer(QEMUFile *f, const uint8_t *buf, int size)
     }
 }
 
+/*
+ * Writes size bytes at buf without copying them if the file supports it. The
+ * data is read at the latest by the next qemu_fflush() or qemu_fclose(), and
+ * buf must stay valid until then. Meant for large buffers such as guest
+ * pages.
+ */
+void qemu_put_buffer_async(QEMUFile *f, const uint8_t *buf, int size)
+{
+    if (!f->writev_buffer) {
+        qemu_put_buffer(f, buf, size);
+        return;
+    }
+
+    if (!f->has_error && f->is_write == 0 && f->buf_index > 0) {
+        fprintf(stderr,
+                "Attempted to write to buffer while read buffer is not empty\n");
+        abort();
+    }
+
+    if (!f->has_error && size > 0)
+        add_to_iovec(f, buf, size);
+}
+
 void qemu_put_byte(QEMUFile *f, int v)
 {
     if (!f->has_error && f->is_write == 0 && f->buf_index > 0) {
@@ -522,6 +602,8 @@ void qemu_put_byte(QEMUFile *f, int v)
 
     f->buf[f->buf_index++] = v;
     f->is_write = 1;
+    if (f->writev_buffer)
+        add_to_iovec(f, f->buf + f->buf_index - 1, 1);
     if (f->buf_index >= IO_BUF_SIZE)
         qemu_fflush(f);
 }
@@ -567,6 +649,15 @@ int qemu_get_byte(QEMUFile *f)
 
 int64_t qemu_ftell(QEMUFile *f)
 {
+    int64_t pending = 0;
+    int i;
+
+    if (f->writev_buffer) {
+        for (i = 0; i < f->iovcnt; i++) {
+            pending += f->iov[i].iov_len;
+        }
+        return f->buf_offset + pending;
+    }
     return f->buf_offset - f->buf_size + f->buf_index;
 }
 
@@ -580,7 +671,7 @@ int64_t qemu_fseek(QEMUFile *f, int64_t pos, int whence)
         /* SEEK_END not supported */
         return -1;
     }
-    if (f->put_buffer) {
+    if (f->put_buffer || f->writev_buffer) {
         qemu_fflush(f);
         f->buf_offset = pos;
     } else {
@@ -997,8 +1088,11 @@ typedef struct SaveStateEntry {
     SaveLiveStateHandler *save_live_state;
     SaveStateHandler *save_state;
     LoadStateHandler *load_state;
+    SaveVersionHandler *save_version;
     const VMStateDescription *vmsd;
     void *opaque;
+    /* bytes written by the sections of the last save */
+    uint64_t size;
 } SaveStateEntry;
 
 
@@ -1079,6 +1173,18 @@ void unregister_savevm(const char *idstr, void *opaque)
     }
 }
 
+void register_savevm_version(const char *idstr, void *opaque,
+                             SaveVersionHandler *save_version)
+{
+    SaveStateEntry *se;
+
+    QTAILQ_FOREACH(se, &savevm_handlers, entry) {
+        if (strcmp(se->idstr, idstr) == 0 && se->opaque == opaque) {
+            se->save_version = save_version;
+        }
+    }
+}
+
 int vmstate_register(int instance_id, const VMStateDescription *vmsd,
                      void *opaque)
 {
@@ -1279,11 +1385,18 @@ int qemu_savevm_state_begin(Monitor *mon, QEMUFile *f, int blk_enable,
     qemu_put_be32(f, QEMU_VM_FILE_VERSION);
 
     QTAILQ_FOREACH(se, &savevm_handlers, entry) {
+        se->size = 0;
+    }
+
+    QTAILQ_FOREACH(se, &savevm_handlers, entry) {
+        int64_t pos;
         int len;
 
         if (se->save_live_state == NULL)
             continue;
 
+        pos = qemu_ftell(f);
+
         /* Section type */
         qemu_put_byte(f, QEMU_VM_SECTION_START);
         qemu_put_be32(f, se->section_id);
@@ -1294,9 +1407,14 @@ int qemu_savevm_state_begin(Monitor *mon, QEMUFile *f, int blk_enable,
         qemu_put_buffer(f, (uint8_t *)se->idstr, len);
 
         qemu_put_be32(f, se->instance_id);
-        qemu_put_be32(f, se->version_id);
+        if (se->save_version) {
+            qemu_put_be32(f, se->save_version(se->opaque));
+        } else {
+            qemu_put_be32(f, se->version_id);
+        }
 
         se->save_live_state(mon, f, QEMU_VM_SECTION_START, se->opaque);
+        se->size += qemu_ftell(f) - pos;
     }
 
     if (qemu_file_has_error(f)) {
@@ -1313,14 +1431,19 @@ int qemu_savevm_state_iterate(Monitor *mon, QEMUFile *f)
     int ret = 1;
 
     QTAILQ_FOREACH(se, &savevm_handlers, entry) {
+        int64_t pos;
+
         if (se->save_live_state == NULL)
             continue;
 
+        pos = qemu_ftell(f);
+
         /* Section type */
         qemu_put_byte(f, QEMU_VM_SECTION_PART);
         qemu_put_be32(f, se->section_id);
 
         ret = se->save_live_state(mon, f, QEMU_VM_SECTION_PART, se->opaque);
+        se->size += qemu_ftell(f) - pos;
         if (!ret) {
             /* Do not proceed to the next vmstate before this one reported
                completion of the current stage. This serializes the migration
@@ -1346,22 +1469,30 @@ int qemu_savevm_state_complete(Monitor *mon, QEMUFile *f)
     SaveStateEntry *se;
 
     QTAILQ_FOREACH(se, &savevm_handlers, entry) {
+        int64_t pos;
+
         if (se->save_live_state == NULL)
             continue;
 
+        pos = qemu_ftell(f);
+
         /* Section type */
         qemu_put_byte(f, QEMU_VM_SECTION_END);
         qemu_put_be32(f, se->section_id);
 
         se->save_live_state(mon, f, QEMU_VM_SECTION_END, se->opaque);
+        se->size += qemu_ftell(f) - pos;
     }
 
     QTAILQ_FOREACH(se, &savevm_handlers, entry) {
+        int64_t pos;
         int len;
 
 	if (se->save_state == NULL && se->vmsd == NULL)
 	    continue;
 
+        pos = qemu_ftell(f);
+
         /* Section type */
         qemu_put_byte(f, QEMU_VM_SECTION_FULL);
         qemu_put_be32(f, se->section_id);
@@ -1375,6 +1506,7 @@ int qemu_savevm_state_complete(Monitor *mon, QEMUFile *f)
         qemu_put_be32(f, se->version_id);
 
         vmstate_save(f, se);
+        se->size = qemu_ftell(f) - pos;
     }
 
     qemu_put_byte(f, QEMU_VM_EOF);
@@ -1385,6 +1517,30 @@ int qemu_savevm_state_complete(Monitor *mon, QEMUFile *f)
     return 0;
 }
 
+/*
+ * Returns the bytes each device wrote in the last save, as a QList of QDicts
+ * with "name", "instance" and "size" keys. For live sections, this is the
+ * sum over all stages.
+ */
+QObject *qemu_savevm_state_sizes(void)
+{
+    SaveStateEntry *se;
+    QList *list;
+
+    list = qlist_new();
+    QTAILQ_FOREACH(se, &savevm_handlers, entry) {
+        if (se->size == 0) {
+            continue;
+        }
+        qlist_append_obj(list, qobject_from_jsonf("{ 'name': %s, "
+                                                    "'instance': %d, "
+                                                    "'size': %" PRId64 " }",
+                                                  se->idstr, se->instance_id,
+                                                  se->size));
+    }
+    return QOBJECT(list);
+}
+
 void qemu_savevm_state_cancel(Monitor *mon, QEMUFile *f)
 {
     SaveStateEntry *se;
@@ -1552,6 +1708,7 @@ out:
         QLIST_REMOVE(le, entry);
         qemu_free(le);
     }
+    ram_load_finish();
 
     if (qemu_file_has_error(f))
         ret = -EIO;
@@ -39,10 +39,31 @@ void vm_stop(int reason);
 uint64_t ram_bytes_remaining(void);
 uint64_t ram_bytes_transferred(void);
 uint64_t ram_bytes_total(void);
+uint64_t ram_cache_size(void);
+uint64_t ram_cache_hits(void);
+uint64_t ram_cache_misses(void);
+uint64_t ram_delta_pages(void);
+uint64_t ram_delta_bytes(void);
+int ram_compress_active(void);
+uint64_t ram_compress_bytes(void);
+uint64_t ram_compressed_bytes(void);
+uint64_t ram_compress_time(void);
+uint64_t ram_dirty_rate(void);
+uint64_t ram_pages_sent(void);
+uint64_t ram_pages_duplicate(void);
+int ram_pass_count(void);
+int ram_postcopy_active(void);
+uint64_t ram_postcopy_requests(void);
+void ram_postcopy_request(QEMUFile *f, uint64_t addr);
+int ram_save_postcopy(QEMUFile *f);
+int ram_postcopy_load(QEMUFile *f);
+void ram_load_finish(void);
 
 int64_t cpu_get_ticks(void);
 void cpu_enable_ticks(void);
 void cpu_disable_ticks(void);
+void cpu_throttle_set(int pct);
+int cpu_throttle_get(void);
 
 void qemu_system_reset_request(void);
 void qemu_system_shutdown_request(void);
@@ -67,6 +88,7 @@ int qemu_savevm_state_begin(Monitor *mon, QEMUFile *f, int blk_enable,
 int qemu_savevm_state_iterate(Monitor *mon, QEMUFile *f);
 int qemu_savevm_state_complete(Monitor *mon, QEMUFile *f);
 void qemu_savevm_state_cancel(Monitor *mon, QEMUFile *f);
+QObject *qemu_savevm_state_sizes(void);
 int qemu_loadvm_state(QEMUFile *f);
 
 void qemu_errors_to_file(FILE *fp);
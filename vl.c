@@ -167,6 +167,10 @@ int main(int argc, char **argv)
 #include "slirp/libslirp.h"
 
 #include "qemu-queue.h"
+#include "bitops.h"
+#include "page_delta.h"
+#include "migration-compress.h"
+#include "migration-postcopy.h"
 
 //#define DEBUG_NET
 //#define DEBUG_SLIRP
@@ -1925,10 +1929,15 @@ DriveInfo *drive_init(QemuOpts *opts, void *opaque,
     int max_devs;
     int index;
     int cache;
+#ifdef CONFIG_LINUX_AIO
+    int aio = 1; /* only takes effect with cache=none */
+#else
     int aio = 0;
+#endif
     int ro = 0;
     int bdrv_flags;
     int on_read_error, on_write_error;
+    BlockIOLimit io_limits;
     const char *devaddr;
     DriveInfo *dinfo;
     int snapshot = 0;
@@ -2115,6 +2124,16 @@ DriveInfo *drive_init(QemuOpts *opts, void *opaque,
         }
     }
 
+    memset(&io_limits, 0, sizeof(io_limits));
+    io_limits.bps[BLOCK_IO_LIMIT_TOTAL] = qemu_opt_get_number(opts, "bps", 0);
+    io_limits.bps[BLOCK_IO_LIMIT_READ]  = qemu_opt_get_number(opts, "bps_rd", 0);
+    io_limits.bps[BLOCK_IO_LIMIT_WRITE] = qemu_opt_get_number(opts, "bps_wr", 0);
+    io_limits.iops[BLOCK_IO_LIMIT_TOTAL] = qemu_opt_get_number(opts, "iops", 0);
+    io_limits.iops[BLOCK_IO_LIMIT_READ]  = qemu_opt_get_number(opts, "iops_rd", 0);
+    io_limits.iops[BLOCK_IO_LIMIT_WRITE] = qemu_opt_get_number(opts, "iops_wr", 0);
+    io_limits.bps_max  = qemu_opt_get_number(opts, "bps_max", 0);
+    io_limits.iops_max = qemu_opt_get_number(opts, "iops_max", 0);
+
     if ((devaddr = qemu_opt_get(opts, "addr")) != NULL) {
         if (type != IF_VIRTIO) {
             fprintf(stderr, "addr is not supported\n");
@@ -2190,6 +2209,7 @@ DriveInfo *drive_init(QemuOpts *opts, void *opaque,
                      devname, mediastr, unit_id);
     }
     dinfo->bdrv = bdrv_new(dinfo->id);
+    bdrv_set_io_limits(dinfo->bdrv, &io_limits);
     dinfo->devaddr = devaddr;
     dinfo->type = type;
     dinfo->bus = bus_id;
@@ -2258,6 +2278,10 @@ DriveInfo *drive_init(QemuOpts *opts, void *opaque,
         bdrv_flags &= ~BDRV_O_NATIVE_AIO;
     }
 
+    if (qemu_opt_get_bool(opts, "mmap", 0)) {
+        bdrv_flags |= BDRV_O_MMAP;
+    }
+
     if (ro == 1) {
         if (type != IF_SCSI && type != IF_VIRTIO && type != IF_FLOPPY) {
             fprintf(stderr, "qemu: readonly flag not supported for drive with this interface\n");
@@ -2273,6 +2297,14 @@ DriveInfo *drive_init(QemuOpts *opts, void *opaque,
     }
     bdrv_flags |= ro ? 0 : BDRV_O_RDWR;
 
+    if (qemu_opt_get_bool(opts, "copy-on-read", 0)) {
+        if (ro) {
+            fprintf(stderr, "qemu: copy-on-read is not supported for read-only drives\n");
+            return NULL;
+        }
+        bdrv_enable_copy_on_read(dinfo->bdrv);
+    }
+
     if (bdrv_open2(dinfo->bdrv, file, bdrv_flags, drv) < 0) {
         fprintf(stderr, "qemu: could not open disk image %s: %s\n",
                         file, strerror(errno));
@@ -2735,6 +2767,22 @@ void qemu_del_wait_object(HANDLE handle, WaitObjectFunc *func, void *opaque)
 #define RAM_SAVE_FLAG_MEM_SIZE	0x04
 #define RAM_SAVE_FLAG_PAGE	0x08
 #define RAM_SAVE_FLAG_EOS	0x10
+#define RAM_SAVE_FLAG_DELTA	0x20
+#define RAM_SAVE_FLAG_ZPAGE	0x40
+#define RAM_SAVE_FLAG_CHANNELS	0x80
+#define RAM_SAVE_FLAG_POSTCOPY	0x100
+#define RAM_SAVE_FLAG_FILE	0x200
+
+/*
+ * Version 4 of the "ram" section adds flags that version 3 loaders don't
+ * know and would silently skip. Streams that use none of them are still
+ * saved as version 3, so that older versions can load them.
+ */
+#define RAM_SAVE_VERSION	4
+#define RAM_SAVE_FLAGS_V4	(RAM_SAVE_FLAG_DELTA | RAM_SAVE_FLAG_ZPAGE | \
+                                 RAM_SAVE_FLAG_CHANNELS | \
+                                 RAM_SAVE_FLAG_POSTCOPY | \
+                                 RAM_SAVE_FLAG_FILE)
 
 static int is_dup_page(uint8_t *page, uint8_t ch)
 {
@@ -2750,54 +2798,279 @@ static int is_dup_page(uint8_t *page, uint8_t ch)
     return 1;
 }
 
-static int ram_save_block(QEMUFile *f)
+/* Returns the first page at or after current_addr (wrapping around) that is
+   dirty for migration, or -1 if there is none */
+static ram_addr_t ram_find_dirty(ram_addr_t current_addr)
 {
-    static ram_addr_t current_addr = 0;
-    ram_addr_t saved_addr = current_addr;
-    ram_addr_t addr = 0;
-    int found = 0;
+    unsigned long *bitmap = phys_ram_dirty[DIRTY_MEMORY_MIGRATION];
+    unsigned long nb_pages = last_ram_offset >> TARGET_PAGE_BITS;
+    unsigned long page = current_addr >> TARGET_PAGE_BITS;
+    unsigned long next;
 
-    while (addr < last_ram_offset) {
-        if (cpu_physical_memory_get_dirty(current_addr, MIGRATION_DIRTY_FLAG)) {
-            uint8_t *p;
+    if (!phys_ram_migration_dirty_pages) {
+        return -1;
+    }
 
-            cpu_physical_memory_reset_dirty(current_addr,
-                                            current_addr + TARGET_PAGE_SIZE,
-                                            MIGRATION_DIRTY_FLAG);
+    next = find_next_bit(bitmap, nb_pages, page);
+    if (next == nb_pages) {
+        next = find_next_bit(bitmap, page, 0);
+        if (next == page) {
+            return -1;
+        }
+    }
+    return (ram_addr_t)next << TARGET_PAGE_BITS;
+}
 
-            p = qemu_get_ram_ptr(current_addr);
+/*
+ * Page delta compression: pages that are sent again are encoded as the
+ * difference to the contents they were last sent with, which the source keeps
+ * in an LRU cache. Pages sent during the first pass over RAM aren't cached.
+ */
+static PageDeltaCache *ram_delta_cache;
+static uint8_t *ram_delta_page;
+static uint8_t *ram_delta_buf;
+static int ram_bulk_stage;
+static uint64_t ram_cache_hits_count;
+static uint64_t ram_cache_misses_count;
+static uint64_t ram_delta_pages_count;
+static uint64_t ram_delta_bytes_count;
 
-            if (is_dup_page(p, *p)) {
-                qemu_put_be64(f, current_addr | RAM_SAVE_FLAG_COMPRESS);
-                qemu_put_byte(f, *p);
-            } else {
-                qemu_put_be64(f, current_addr | RAM_SAVE_FLAG_PAGE);
-                qemu_put_buffer(f, p, TARGET_PAGE_SIZE);
-            }
+/* Pages whose delta isn't shorter are sent in full */
+#define RAM_DELTA_MAX   MIN(TARGET_PAGE_SIZE - 1, 0xffff)
 
-            found = 1;
-            break;
-        }
-        addr += TARGET_PAGE_SIZE;
-        current_addr = (saved_addr + addr) % last_ram_offset;
+static void ram_delta_start(void)
+{
+    uint64_t cache_size = migrate_cache_size();
+
+    ram_cache_hits_count = 0;
+    ram_cache_misses_count = 0;
+    ram_delta_pages_count = 0;
+    ram_delta_bytes_count = 0;
+
+    cache_size = MIN(cache_size, last_ram_offset);
+    if (cache_size) {
+        ram_delta_cache = page_delta_cache_new(cache_size / TARGET_PAGE_SIZE,
+                                               TARGET_PAGE_SIZE);
+        ram_delta_page = qemu_malloc(TARGET_PAGE_SIZE);
+        ram_delta_buf = qemu_malloc(RAM_DELTA_MAX);
     }
+}
 
-    return found;
+static void ram_delta_stop(void)
+{
+    if (ram_delta_cache) {
+        page_delta_cache_free(ram_delta_cache);
+        qemu_free(ram_delta_page);
+        qemu_free(ram_delta_buf);
+        ram_delta_cache = NULL;
+        ram_delta_page = NULL;
+        ram_delta_buf = NULL;
+    }
 }
 
-static uint64_t bytes_transferred;
+/*
+ * Compression: full pages are deflated by a pool of threads and written out
+ * as they are finished, in no particular order. The stream is flushed before
+ * the end of each section.
+ */
+static CompressPool *ram_compress_pool;
+static uint64_t ram_compress_bytes_in;
+static uint64_t ram_compress_bytes_out;
+static uint64_t ram_compress_time_ns;
 
-static ram_addr_t ram_save_remaining(void)
+static void ram_compress_put(void *opaque, uint64_t addr, const uint8_t *data,
+                             int len, int compressed)
 {
+    QEMUFile *f = opaque;
+
+    if (compressed) {
+        qemu_put_be64(f, addr | RAM_SAVE_FLAG_ZPAGE);
+        qemu_put_be16(f, len);
+        qemu_put_buffer(f, data, len);
+    } else {
+        qemu_put_be64(f, addr | RAM_SAVE_FLAG_PAGE);
+        qemu_put_buffer(f, data, TARGET_PAGE_SIZE);
+    }
+}
+
+static void ram_compress_start(QEMUFile *f)
+{
+    ram_compress_bytes_in = 0;
+    ram_compress_bytes_out = 0;
+    ram_compress_time_ns = 0;
+
+    if (migrate_compress_level() > 0) {
+        ram_compress_pool = compress_pool_new(migrate_compress_threads(),
+                                              migrate_compress_level(),
+                                              TARGET_PAGE_SIZE,
+                                              ram_compress_put, f);
+    }
+}
+
+/* Pages that haven't been written out yet are dropped */
+static void ram_compress_stop(void)
+{
+    if (ram_compress_pool) {
+        compress_pool_stats(ram_compress_pool, &ram_compress_bytes_in,
+                            &ram_compress_bytes_out, &ram_compress_time_ns);
+        compress_pool_free(ram_compress_pool);
+        ram_compress_pool = NULL;
+    }
+}
+
+/* Sends a page in full; p may be changed as soon as this returns */
+static void ram_save_page(QEMUFile *f, ram_addr_t addr, const uint8_t *p)
+{
+    if (ram_compress_pool) {
+        compress_pool_submit(ram_compress_pool, addr, p);
+    } else {
+        qemu_put_be64(f, addr | RAM_SAVE_FLAG_PAGE);
+        qemu_put_buffer(f, p, TARGET_PAGE_SIZE);
+    }
+}
+
+static void ram_save_page_delta(QEMUFile *f, ram_addr_t addr, uint8_t *p)
+{
+    uint8_t *cached;
+    int len = -1;
+
+    /* the page that is sent and the cached copy must be the same */
+    memcpy(ram_delta_page, p, TARGET_PAGE_SIZE);
+
+    cached = page_delta_cache_get(ram_delta_cache, addr);
+    if (cached) {
+        ram_cache_hits_count++;
+        len = page_delta_encode(cached, ram_delta_page, TARGET_PAGE_SIZE,
+                                ram_delta_buf, RAM_DELTA_MAX);
+        memcpy(cached, ram_delta_page, TARGET_PAGE_SIZE);
+    } else {
+        ram_cache_misses_count++;
+        page_delta_cache_insert(ram_delta_cache, addr, ram_delta_page);
+    }
+
+    if (len >= 0) {
+        qemu_put_be64(f, addr | RAM_SAVE_FLAG_DELTA);
+        qemu_put_be16(f, len);
+        qemu_put_buffer(f, ram_delta_buf, len);
+        ram_delta_pages_count++;
+        ram_delta_bytes_count += len;
+    } else {
+        ram_save_page(f, addr, ram_delta_page);
+    }
+}
+
+/*
+ * With page channels, all pages are sent over them and the main stream only
+ * announces the number of channels at the start and their end (as 0
+ * channels) before the last section. Page deltas and compression are not
+ * used then.
+ */
+static MigChannels *ram_channels;
+
+/*
+ * When migrating to a file, pages are written to the RAM image in the file
+ * and the last section ends with a record telling so. Zero pages are left
+ * out of the first pass: they are holes in the image.
+ */
+static MigFile *ram_file;
+
+/*
+ * Pages sent so far, split by whether they were filled with a single byte,
+ * and the number of complete passes over dirty RAM.
+ */
+static uint64_t ram_pages_normal;
+static uint64_t ram_pages_dup;
+static uint64_t ram_pass_pages;
+static int ram_passes;
+
+/* Sends the dirty page at addr and marks it clean */
+static void ram_save_dirty_page(QEMUFile *f, ram_addr_t addr)
+{
+    uint8_t *p, *cached;
+    int dup;
+
+    cpu_physical_memory_reset_dirty(addr, addr + TARGET_PAGE_SIZE,
+                                    MIGRATION_DIRTY_FLAG);
+
+    p = qemu_get_ram_ptr(addr);
+
+    /* an older copy of the page must not be written out after this one */
+    if (ram_compress_pool) {
+        compress_pool_wait(ram_compress_pool, addr);
+    }
+
+    dup = is_dup_page(p, *p);
+    if (dup) {
+        ram_pages_dup++;
+    } else {
+        ram_pages_normal++;
+    }
+
+    if (ram_file) {
+        if (!ram_bulk_stage || !dup || *p != 0) {
+            mig_file_put_page(ram_file, addr, p, TARGET_PAGE_SIZE);
+        }
+    } else if (ram_channels) {
+        if (dup) {
+            mig_channels_put_fill(ram_channels, addr, *p, TARGET_PAGE_SIZE);
+        } else {
+            mig_channels_put_page(ram_channels, addr, p, TARGET_PAGE_SIZE);
+        }
+    } else if (dup) {
+        qemu_put_be64(f, addr | RAM_SAVE_FLAG_COMPRESS);
+        qemu_put_byte(f, *p);
+        if (ram_delta_cache) {
+            cached = page_delta_cache_get(ram_delta_cache, addr);
+            if (cached) {
+                memset(cached, *p, TARGET_PAGE_SIZE);
+            }
+        }
+    } else if (ram_delta_cache && !ram_bulk_stage) {
+        ram_save_page_delta(f, addr, p);
+    } else if (ram_compress_pool) {
+        ram_save_page(f, addr, p);
+    } else {
+        /* sent from guest RAM; if the page changes before the stream is
+           flushed, it is dirty again and sent once more */
+        qemu_put_be64(f, addr | RAM_SAVE_FLAG_PAGE);
+        qemu_put_buffer_async(f, p, TARGET_PAGE_SIZE);
+    }
+}
+
+static int ram_save_block(QEMUFile *f)
+{
+    static ram_addr_t current_addr = 0;
     ram_addr_t addr;
-    ram_addr_t count = 0;
 
-    for (addr = 0; addr < last_ram_offset; addr += TARGET_PAGE_SIZE) {
-        if (cpu_physical_memory_get_dirty(addr, MIGRATION_DIRTY_FLAG))
-            count++;
+    if (current_addr >= last_ram_offset) {
+        current_addr = 0;
+    }
+    addr = ram_find_dirty(current_addr);
+    if (addr == (ram_addr_t)-1 || addr < current_addr) {
+        ram_bulk_stage = 0;
+        if (ram_pass_pages) {
+            ram_passes++;
+            ram_pass_pages = 0;
+        }
+    }
+    current_addr = addr;
+    if (current_addr == (ram_addr_t)-1) {
+        current_addr = 0;
+        return 0;
     }
 
-    return count;
+    ram_save_dirty_page(f, current_addr);
+    current_addr += TARGET_PAGE_SIZE;
+    ram_pass_pages++;
+
+    return 1;
+}
+
+static uint64_t bytes_transferred;
+
+static ram_addr_t ram_save_remaining(void)
+{
+    return phys_ram_migration_dirty_pages;
 }
 
 uint64_t ram_bytes_remaining(void)
@@ -2815,15 +3088,252 @@ uint64_t ram_bytes_total(void)
     return last_ram_offset;
 }
 
+uint64_t ram_pages_sent(void)
+{
+    return ram_pages_normal + ram_pages_dup;
+}
+
+uint64_t ram_pages_duplicate(void)
+{
+    return ram_pages_dup;
+}
+
+int ram_pass_count(void)
+{
+    return ram_passes;
+}
+
+/*
+ * Auto-converge: once per period, the memory the guest has dirtied is
+ * compared with the memory that has been sent. If the guest dirtied more
+ * than half of it in two periods in a row, the vCPUs are throttled (more).
+ */
+#define RAM_CONVERGE_PERIOD     1000 /* ms */
+#define RAM_THROTTLE_INITIAL    20
+#define RAM_THROTTLE_INCREMENT  10
+
+static ram_addr_t ram_remaining_last;
+static int64_t ram_period_start;
+static uint64_t ram_period_bytes;
+static uint64_t ram_period_dirtied;
+static uint64_t ram_dirty_rate_bps;
+static int ram_period_strikes;
+
+static void ram_converge_start(void)
+{
+    ram_period_start = qemu_get_clock(rt_clock);
+    ram_period_bytes = bytes_transferred;
+    ram_period_dirtied = 0;
+    ram_dirty_rate_bps = 0;
+    ram_period_strikes = 0;
+}
+
+/* Called after the dirty bitmap has been synced */
+static void ram_converge_update(void)
+{
+    ram_addr_t remaining = ram_save_remaining();
+    int64_t now = qemu_get_clock(rt_clock);
+    int64_t elapsed = now - ram_period_start;
+    uint64_t dirtied, sent;
+    int pct;
+
+    if (remaining > ram_remaining_last) {
+        ram_period_dirtied += remaining - ram_remaining_last;
+    }
+    if (elapsed < RAM_CONVERGE_PERIOD) {
+        return;
+    }
+
+    dirtied = ram_period_dirtied * TARGET_PAGE_SIZE;
+    sent = bytes_transferred - ram_period_bytes;
+    ram_dirty_rate_bps = dirtied * 1000 / elapsed;
+
+    if (migrate_auto_converge() && dirtied > sent / 2) {
+        if (++ram_period_strikes >= 2) {
+            pct = cpu_throttle_get();
+            cpu_throttle_set(pct ? pct + RAM_THROTTLE_INCREMENT
+                                 : RAM_THROTTLE_INITIAL);
+            ram_period_strikes = 0;
+        }
+    } else {
+        ram_period_strikes = 0;
+    }
+
+    ram_period_start = now;
+    ram_period_bytes = bytes_transferred;
+    ram_period_dirtied = 0;
+}
+
+/* Returns the rate at which the guest dirtied memory in the last period, in
+   bytes per second */
+uint64_t ram_dirty_rate(void)
+{
+    return ram_dirty_rate_bps;
+}
+
+uint64_t ram_cache_size(void)
+{
+    if (!ram_delta_cache) {
+        return 0;
+    }
+    return page_delta_cache_pages(ram_delta_cache) * TARGET_PAGE_SIZE;
+}
+
+uint64_t ram_cache_hits(void)
+{
+    return ram_cache_hits_count;
+}
+
+uint64_t ram_cache_misses(void)
+{
+    return ram_cache_misses_count;
+}
+
+uint64_t ram_delta_pages(void)
+{
+    return ram_delta_pages_count;
+}
+
+uint64_t ram_delta_bytes(void)
+{
+    return ram_delta_bytes_count;
+}
+
+int ram_compress_active(void)
+{
+    return ram_compress_pool != NULL;
+}
+
+static void ram_compress_update_stats(void)
+{
+    if (ram_compress_pool) {
+        compress_pool_stats(ram_compress_pool, &ram_compress_bytes_in,
+                            &ram_compress_bytes_out, &ram_compress_time_ns);
+    }
+}
+
+uint64_t ram_compress_bytes(void)
+{
+    ram_compress_update_stats();
+    return ram_compress_bytes_in;
+}
+
+uint64_t ram_compressed_bytes(void)
+{
+    ram_compress_update_stats();
+    return ram_compress_bytes_out;
+}
+
+uint64_t ram_compress_time(void)
+{
+    ram_compress_update_stats();
+    return ram_compress_time_ns;
+}
+
+/*
+ * Post-copy: once the first pass over RAM is done, the guest moves to the
+ * destination instead of waiting for the migration to converge. The last
+ * section only lists the pages that are still dirty; they follow the state
+ * of the devices, streamed in the background and sent ahead of the others
+ * when the destination asks for them. Page deltas and compression are not
+ * used then.
+ */
+static int ram_postcopy;
+static int ram_postcopy_running;
+static uint64_t ram_postcopy_requests_count;
+
+static void ram_save_postcopy_list(QEMUFile *f)
+{
+    unsigned long *bitmap = phys_ram_dirty[DIRTY_MEMORY_MIGRATION];
+    unsigned long nb_pages = last_ram_offset >> TARGET_PAGE_BITS;
+    unsigned long page = 0, first;
+
+    qemu_put_be64(f, RAM_SAVE_FLAG_POSTCOPY);
+    for (;;) {
+        first = find_next_bit(bitmap, nb_pages, page);
+        if (first == nb_pages) {
+            break;
+        }
+        page = first + 1;
+        while (page < nb_pages && test_bit(page, bitmap)) {
+            page++;
+        }
+        qemu_put_be64(f, (uint64_t)first << TARGET_PAGE_BITS);
+        qemu_put_be64(f, (uint64_t)(page - first) << TARGET_PAGE_BITS);
+    }
+    qemu_put_be64(f, 0);
+    qemu_put_be64(f, 0);
+}
+
+/* Returns 1 if the last section switched the migration to post-copy */
+int ram_postcopy_active(void)
+{
+    return ram_postcopy_running;
+}
+
+uint64_t ram_postcopy_requests(void)
+{
+    return ram_postcopy_requests_count;
+}
+
+/* Sends the page at addr for the destination unless it has been sent */
+void ram_postcopy_request(QEMUFile *f, uint64_t addr)
+{
+    addr &= TARGET_PAGE_MASK;
+    if (!ram_postcopy_running || addr >= last_ram_offset ||
+        !cpu_physical_memory_get_dirty(addr, MIGRATION_DIRTY_FLAG)) {
+        return;
+    }
+
+    ram_postcopy_requests_count++;
+    ram_save_dirty_page(f, addr);
+    bytes_transferred += TARGET_PAGE_SIZE;
+    qemu_fflush(f);
+}
+
+/*
+ * Sends the pages nobody asked for within the bandwidth limit. Returns 1 once
+ * all pages have been sent.
+ */
+int ram_save_postcopy(QEMUFile *f)
+{
+    while (!qemu_file_rate_limit(f)) {
+        if (ram_save_block(f) == 0) {
+            qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
+            ram_postcopy_running = 0;
+            return 1;
+        }
+        bytes_transferred += TARGET_PAGE_SIZE;
+    }
+    return 0;
+}
+
+static int ram_save_version(void *opaque)
+{
+    /* must match the features that ram_save_live() enables in stage 1 */
+    if (migrate_cache_size() || migrate_compress_level() > 0 ||
+        migrate_outgoing_channels() || migrate_outgoing_postcopy() ||
+        migrate_outgoing_file()) {
+        return RAM_SAVE_VERSION;
+    }
+    return 3;
+}
+
 static int ram_save_live(Monitor *mon, QEMUFile *f, int stage, void *opaque)
 {
-    ram_addr_t addr;
     uint64_t bytes_transferred_last;
+    uint64_t channel_bytes = 0;
     double bwidth = 0;
     uint64_t expected_time = 0;
 
     if (stage < 0) {
         cpu_physical_memory_set_dirty_tracking(0);
+        ram_delta_stop();
+        ram_compress_stop();
+        ram_channels = NULL;
+        ram_file = NULL;
+        ram_postcopy_running = 0;
+        cpu_throttle_set(0);
         return 0;
     }
 
@@ -2834,17 +3344,56 @@ static int ram_save_live(Monitor *mon, QEMUFile *f, int stage, void *opaque)
 
     if (stage == 1) {
         bytes_transferred = 0;
+        ram_bulk_stage = 1;
+        ram_pages_normal = 0;
+        ram_pages_dup = 0;
+        ram_pass_pages = 0;
+        ram_passes = 0;
+        ram_delta_stop();
+        ram_compress_stop();
+        ram_channels = migrate_outgoing_channels();
+        ram_file = migrate_outgoing_file();
+        ram_postcopy = migrate_outgoing_postcopy() &&
+                       TARGET_PAGE_SIZE == getpagesize();
+        ram_postcopy_running = 0;
+        ram_postcopy_requests_count = 0;
+        if (!ram_channels && !ram_file && !ram_postcopy) {
+            ram_delta_start();
+            ram_compress_start(f);
+        }
 
         /* Make sure all dirty bits are set */
-        for (addr = 0; addr < last_ram_offset; addr += TARGET_PAGE_SIZE) {
-            if (!cpu_physical_memory_get_dirty(addr, MIGRATION_DIRTY_FLAG))
-                cpu_physical_memory_set_dirty(addr);
-        }
+        cpu_physical_memory_set_dirty_range(0, last_ram_offset,
+                                            MIGRATION_DIRTY_FLAG);
 
         /* Enable dirty memory tracking */
         cpu_physical_memory_set_dirty_tracking(1);
+        ram_converge_start();
 
         qemu_put_be64(f, last_ram_offset | RAM_SAVE_FLAG_MEM_SIZE);
+        if (ram_channels) {
+            qemu_put_be64(f, RAM_SAVE_FLAG_CHANNELS);
+            qemu_put_be32(f, mig_channels_count(ram_channels));
+        }
+    }
+
+    if (ram_channels) {
+        if (mig_channels_has_error(ram_channels)) {
+            qemu_file_set_error(f);
+            return 0;
+        }
+        channel_bytes = mig_channels_bytes(ram_channels);
+    }
+    if (ram_file) {
+        if (mig_file_has_error(ram_file)) {
+            qemu_file_set_error(f);
+            return 0;
+        }
+        channel_bytes = mig_file_bytes(ram_file);
+    }
+
+    if (stage == 2) {
+        ram_converge_update();
     }
 
     bytes_transferred_last = bytes_transferred;
@@ -2857,6 +3406,15 @@ static int ram_save_live(Monitor *mon, QEMUFile *f, int stage, void *opaque)
         bytes_transferred += ret * TARGET_PAGE_SIZE;
         if (ret == 0) /* no more blocks */
             break;
+        /* the channels share the bandwidth limit of the main stream */
+        if (ram_channels && mig_channels_bytes(ram_channels) - channel_bytes >=
+            qemu_file_get_rate_limit(f)) {
+            break;
+        }
+        if (ram_file && mig_file_bytes(ram_file) - channel_bytes >=
+            qemu_file_get_rate_limit(f)) {
+            break;
+        }
     }
 
     bwidth = qemu_get_clock_ns(rt_clock) - bwidth;
@@ -2869,26 +3427,203 @@ static int ram_save_live(Monitor *mon, QEMUFile *f, int stage, void *opaque)
 
     /* try transferring iterative blocks of memory */
     if (stage == 3) {
-        /* flush all remaining blocks regardless of rate limiting */
-        while (ram_save_block(f) != 0) {
-            bytes_transferred += TARGET_PAGE_SIZE;
+        if (ram_postcopy_running) {
+            /* the guest is stopped, the dirty pages won't change anymore */
+            ram_save_postcopy_list(f);
+        } else {
+            /* flush all remaining blocks regardless of rate limiting */
+            while (ram_save_block(f) != 0) {
+                bytes_transferred += TARGET_PAGE_SIZE;
+            }
         }
         cpu_physical_memory_set_dirty_tracking(0);
+        ram_delta_stop();
+        cpu_throttle_set(0);
+
+        if (ram_channels) {
+            if (mig_channels_finish(ram_channels) < 0) {
+                qemu_file_set_error(f);
+            }
+            qemu_put_be64(f, RAM_SAVE_FLAG_CHANNELS);
+            qemu_put_be32(f, 0);
+            ram_channels = NULL;
+        }
+        if (ram_file) {
+            if (mig_file_finish(ram_file) < 0) {
+                qemu_file_set_error(f);
+            }
+            qemu_put_be64(f, RAM_SAVE_FLAG_FILE);
+            ram_file = NULL;
+        }
     }
 
+    if (ram_compress_pool) {
+        compress_pool_flush(ram_compress_pool);
+        if (stage == 3) {
+            ram_compress_stop();
+        }
+    }
     qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
 
+    ram_remaining_last = ram_save_remaining();
     expected_time = ram_save_remaining() * TARGET_PAGE_SIZE / bwidth;
 
-    return (stage == 2) && (expected_time <= migrate_max_downtime());
+    if (stage != 2) {
+        return 0;
+    }
+    if (expected_time <= migrate_max_downtime()) {
+        return 1;
+    }
+    if (ram_postcopy && !ram_bulk_stage) {
+        ram_postcopy_running = 1;
+        return 1;
+    }
+    return 0;
 }
 
-static int ram_load(QEMUFile *f, void *opaque, int version_id)
+/*
+ * Compressed pages are inflated in the background, straight into guest RAM.
+ * The pool is created by the first compressed page of an incoming migration,
+ * drained at the end of each section and freed by ram_load_finish().
+ */
+static CompressPool *ram_decompress_pool;
+
+typedef struct RAMBlockList {
+    MigRAMBlock *blocks;
+    int nb_blocks;
+} RAMBlockList;
+
+static void ram_add_block(void *host_addr, ram_addr_t offset,
+                          ram_addr_t length, void *opaque)
+{
+    RAMBlockList *list = opaque;
+    MigRAMBlock *b;
+
+    list->blocks = qemu_realloc(list->blocks,
+                                (list->nb_blocks + 1) * sizeof(MigRAMBlock));
+    b = &list->blocks[list->nb_blocks++];
+    b->host = host_addr;
+    b->offset = offset;
+    b->length = length;
+}
+
+/* Starts receiving pages over nb channels, or waits for them to end if nb
+   is 0 */
+static int ram_load_channels(int nb)
+{
+    RAMBlockList list = { NULL, 0 };
+    MigChannels *mc;
+    int ret;
+
+    if (nb == 0) {
+        mc = mig_channels_incoming();
+        if (!mc) {
+            return -EINVAL;
+        }
+        ret = mig_channels_finish(mc);
+        mig_channels_free(mc);
+        return ret;
+    }
+
+    qemu_ram_foreach_block(ram_add_block, &list);
+    mc = mig_channels_accept(nb, TARGET_PAGE_SIZE, list.blocks,
+                             list.nb_blocks);
+    qemu_free(list.blocks);
+
+    return mc ? 0 : -ENOTSUP;
+}
+
+/* Reads guest RAM from the image of the migration file being loaded */
+static int ram_load_file(void)
+{
+    RAMBlockList list = { NULL, 0 };
+    MigFile *mf = mig_file_incoming();
+    int ret;
+
+    if (!mf) {
+        return -EINVAL;
+    }
+
+    qemu_ram_foreach_block(ram_add_block, &list);
+    /* the image can only replace guest RAM if KVM follows the mappings */
+    ret = mig_file_load(mf, list.blocks, list.nb_blocks,
+                        !kvm_enabled() || kvm_has_sync_mmu());
+    qemu_free(list.blocks);
+
+    return ret;
+}
+
+/* Registers guest RAM for post-copy and reads the pages that are to come */
+static int ram_load_postcopy(QEMUFile *f)
+{
+    RAMBlockList list = { NULL, 0 };
+    uint64_t addr, len;
+    int ret;
+
+    qemu_ram_foreach_block(ram_add_block, &list);
+    ret = postcopy_incoming_init(TARGET_PAGE_SIZE, list.blocks,
+                                 list.nb_blocks);
+    qemu_free(list.blocks);
+    if (ret < 0) {
+        return ret;
+    }
+
+    for (;;) {
+        addr = qemu_get_be64(f);
+        len = qemu_get_be64(f);
+        if (qemu_file_has_error(f)) {
+            return -EIO;
+        }
+        if (len == 0) {
+            break;
+        }
+        postcopy_incoming_discard(addr, len);
+    }
+
+    return 0;
+}
+
+/*
+ * Called in the post-copy receive thread once the state has been loaded,
+ * until the source has sent all pages.
+ */
+int ram_postcopy_load(QEMUFile *f)
+{
+    uint8_t buf[TARGET_PAGE_SIZE];
+    ram_addr_t addr;
+    int flags, ret = 0;
+
+    do {
+        addr = qemu_get_be64(f);
+
+        flags = addr & ~TARGET_PAGE_MASK;
+        addr &= TARGET_PAGE_MASK;
+
+        if (flags & RAM_SAVE_FLAG_COMPRESS) {
+            ret = postcopy_incoming_place_fill(addr, qemu_get_byte(f));
+        } else if (flags & RAM_SAVE_FLAG_PAGE) {
+            qemu_get_buffer(f, buf, TARGET_PAGE_SIZE);
+            ret = postcopy_incoming_place_page(addr, buf);
+        } else if (!(flags & RAM_SAVE_FLAG_EOS)) {
+            ret = -EINVAL;
+        }
+        if (qemu_file_has_error(f)) {
+            return -EIO;
+        }
+        if (ret < 0) {
+            return ret;
+        }
+    } while (!(flags & RAM_SAVE_FLAG_EOS));
+
+    return 0;
+}
+
+static int ram_load_section(QEMUFile *f, int version_id)
 {
     ram_addr_t addr;
     int flags;
 
-    if (version_id != 3)
+    if (version_id < 3 || version_id > RAM_SAVE_VERSION)
         return -EINVAL;
 
     do {
@@ -2897,11 +3632,48 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
         flags = addr & ~TARGET_PAGE_MASK;
         addr &= TARGET_PAGE_MASK;
 
+        if (version_id < 4 && (flags & RAM_SAVE_FLAGS_V4)) {
+            return -EINVAL;
+        }
+
         if (flags & RAM_SAVE_FLAG_MEM_SIZE) {
             if (addr != last_ram_offset)
                 return -EINVAL;
         }
 
+        if (flags & RAM_SAVE_FLAG_CHANNELS) {
+            int ret = ram_load_channels(qemu_get_be32(f));
+
+            if (ret < 0) {
+                return ret;
+            }
+        }
+
+        if (flags & RAM_SAVE_FLAG_POSTCOPY) {
+            int ret = ram_load_postcopy(f);
+
+            if (ret < 0) {
+                return ret;
+            }
+        }
+
+        if (flags & RAM_SAVE_FLAG_FILE) {
+            int ret = ram_load_file();
+
+            if (ret < 0) {
+                return ret;
+            }
+        }
+
+        if (ram_decompress_pool &&
+            (flags & (RAM_SAVE_FLAG_COMPRESS | RAM_SAVE_FLAG_PAGE |
+                      RAM_SAVE_FLAG_DELTA))) {
+            if (decompress_pool_wait(ram_decompress_pool,
+                                     qemu_get_ram_ptr(addr)) < 0) {
+                return -EINVAL;
+            }
+        }
+
         if (flags & RAM_SAVE_FLAG_COMPRESS) {
             uint8_t ch = qemu_get_byte(f);
             memset(qemu_get_ram_ptr(addr), ch, TARGET_PAGE_SIZE);
@@ -2913,6 +3685,36 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
 #endif
         } else if (flags & RAM_SAVE_FLAG_PAGE) {
             qemu_get_buffer(f, qemu_get_ram_ptr(addr), TARGET_PAGE_SIZE);
+        } else if (flags & RAM_SAVE_FLAG_DELTA) {
+            uint8_t buf[RAM_DELTA_MAX];
+            int len = qemu_get_be16(f);
+
+            if (len > RAM_DELTA_MAX) {
+                return -EINVAL;
+            }
+            qemu_get_buffer(f, buf, len);
+            if (page_delta_decode(buf, len, qemu_get_ram_ptr(addr),
+                                  TARGET_PAGE_SIZE) < 0) {
+                return -EINVAL;
+            }
+        } else if (flags & RAM_SAVE_FLAG_ZPAGE) {
+            uint8_t buf[TARGET_PAGE_SIZE];
+            int len = qemu_get_be16(f);
+
+            if (len >= TARGET_PAGE_SIZE) {
+                return -EINVAL;
+            }
+            qemu_get_buffer(f, buf, len);
+            if (!ram_decompress_pool) {
+                ram_decompress_pool =
+                    decompress_pool_new(migrate_compress_threads(),
+                                        TARGET_PAGE_SIZE);
+                if (!ram_decompress_pool) {
+                    return -ENOTSUP;
+                }
+            }
+            decompress_pool_submit(ram_decompress_pool, qemu_get_ram_ptr(addr),
+                                   buf, len);
         }
         if (qemu_file_has_error(f)) {
             return -EIO;
@@ -2922,6 +3724,29 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
     return 0;
 }
 
+static int ram_load(QEMUFile *f, void *opaque, int version_id)
+{
+    int ret;
+
+    ret = ram_load_section(f, version_id);
+
+    if (ram_decompress_pool &&
+        decompress_pool_flush(ram_decompress_pool) < 0 && ret == 0) {
+        ret = -EINVAL;
+    }
+
+    return ret;
+}
+
+/* Called once the whole incoming state has been loaded, or failed to */
+void ram_load_finish(void)
+{
+    if (ram_decompress_pool) {
+        compress_pool_free(ram_decompress_pool);
+        ram_decompress_pool = NULL;
+    }
+}
+
 void qemu_service_io(void)
 {
     qemu_notify_event();
@@ -3263,6 +4088,68 @@ static void qemu_event_increment(void)
 }
 #endif
 
+/*
+ * CPU throttling: the vCPUs are kept from running for cpu_throttle_pct
+ * percent of every time slice, while the rest of the emulator carries on.
+ */
+#define CPU_THROTTLE_SLICE      50 /* ms */
+#define CPU_THROTTLE_MAX        90 /* leaves the vCPUs 5 ms per slice */
+
+static int cpu_throttle_pct;
+static int cpu_throttle_active;
+static QEMUTimer *cpu_throttle_timer;
+
+static void cpu_throttle_kick(void)
+{
+    CPUState *env;
+
+    for (env = first_cpu; env != NULL; env = env->next_cpu) {
+        qemu_cpu_kick(env);
+    }
+    qemu_notify_event();
+}
+
+static void cpu_throttle_tick(void *opaque)
+{
+    int64_t run = CPU_THROTTLE_SLICE * (100 - cpu_throttle_pct) / 100;
+
+    if (!cpu_throttle_pct) {
+        cpu_throttle_active = 0;
+    } else if (cpu_throttle_active) {
+        cpu_throttle_active = 0;
+        qemu_mod_timer(cpu_throttle_timer, qemu_get_clock(rt_clock) + run);
+    } else {
+        cpu_throttle_active = 1;
+        qemu_mod_timer(cpu_throttle_timer, qemu_get_clock(rt_clock) +
+                       CPU_THROTTLE_SLICE - run);
+    }
+    cpu_throttle_kick();
+}
+
+/* Sets the percentage of time the vCPUs are stopped, 0 to stop throttling */
+void cpu_throttle_set(int pct)
+{
+    int old_pct = cpu_throttle_pct;
+
+    cpu_throttle_pct = MAX(0, MIN(CPU_THROTTLE_MAX, pct));
+    if (!old_pct && cpu_throttle_pct) {
+        if (!cpu_throttle_timer) {
+            cpu_throttle_timer = qemu_new_timer(rt_clock, cpu_throttle_tick,
+                                                NULL);
+        }
+        cpu_throttle_active = 0;
+        cpu_throttle_tick(NULL);
+    } else if (old_pct && !cpu_throttle_pct) {
+        qemu_del_timer(cpu_throttle_timer);
+        cpu_throttle_tick(NULL);
+    }
+}
+
+int cpu_throttle_get(void)
+{
+    return cpu_throttle_pct;
+}
+
 static int cpu_can_run(CPUState *env)
 {
     if (env->stop)
@@ -3271,6 +4158,8 @@ static int cpu_can_run(CPUState *env)
         return 0;
     if (!vm_running)
         return 0;
+    if (cpu_throttle_active)
+        return 0;
     return 1;
 }
 
@@ -3939,6 +4828,8 @@ static int cpu_has_work(CPUState *env)
         return 1;
     if (env->stopped)
         return 0;
+    if (cpu_throttle_active)
+        return 0;
     if (!env->halted)
         return 1;
     if (qemu_cpu_has_work(env))
@@ -5530,6 +6421,21 @@ int main(int argc, char **argv, char **envp)
                 }
                 configure_rtc(opts);
                 break;
+#ifdef CONFIG_POSIX
+            case QEMU_OPTION_aio_threads:
+                opts = qemu_opts_parse(&qemu_aio_threads_opts, optarg, NULL);
+                if (!opts) {
+                    fprintf(stderr, "parse error: %s\n", optarg);
+                    exit(1);
+                }
+                if (paio_set_threads(qemu_opt_get_number(opts, "min", 0),
+                                     qemu_opt_get_number(opts, "max", 64),
+                                     qemu_opt_get_number(opts, "idle", 10))) {
+                    fprintf(stderr, "qemu: invalid aio-threads option\n");
+                    exit(1);
+                }
+                break;
+#endif
             case QEMU_OPTION_tb_size:
                 tb_size = strtol(optarg, NULL, 0);
                 if (tb_size < 0)
@@ -5843,8 +6749,9 @@ int main(int argc, char **argv, char **envp)
         exit(1);
 
     vmstate_register(0, &vmstate_timers ,&timers_state);
-    register_savevm_live("ram", 0, 3, NULL, ram_save_live, NULL, 
+    register_savevm_live("ram", 0, RAM_SAVE_VERSION, NULL, ram_save_live, NULL,
                          ram_load, NULL);
+    register_savevm_version("ram", NULL, ram_save_version);
 
     if (nb_numa_nodes > 0) {
         int i;